@@ -0,0 +1,246 @@
+/**
+    Image difference between the god rays of lightscatter.frag and those of every RadialBlur
+    preset, on a synthetic occlusion mask (the light grey box, a black sun and soft white
+    cloud blobs, as the occlusion pass draws them) with the sun at several screen positions.
+
+    Errors are measured on the rays clamped to [0, 1], which is all the additive composite can
+    show. Exits with status 1 when a preset's mean error exceeds the bound.
+
+    usage: godraydiff [width height] [--max-error 0.05]
+    Run from this directory so ../shaders resolves.
+**/
+
+#include "radialblur.h"
+#include <QApplication>
+#include <QGLFramebufferObject>
+#include <QGLPixelBuffer>
+#include <QGLShaderProgram>
+#include <QStringList>
+#include <GL/glext.h>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#define EXPOSURE 0.8f //same parameters as View::renderLightScatter
+#define DECAY 0.95f
+#define DENSITY 0.9f
+#define WEIGHT 1.0f
+
+struct Blob
+{
+    float x, y, radius;
+};
+
+static std::vector<float> occlusionMask(int width, int height, float sunX, float sunY)
+{
+    std::vector<Blob> blobs;
+    srand(3);
+    for (int b = 0; b < 40; b++)
+    {
+        Blob blob = { rand() / (float) RAND_MAX, rand() / (float) RAND_MAX * 0.6f,
+                      0.02f + 0.08f * rand() / (float) RAND_MAX };
+        blobs.push_back(blob);
+    }
+
+    float aspect = width / (float) height;
+    std::vector<float> mask((size_t) width * height * 3);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            float u = (x + 0.5f) / width, v = (y + 0.5f) / height;
+            float dx = (u - sunX) * aspect, dy = v - sunY;
+            float value = dx * dx + dy * dy < 0.05f * 0.05f ? 0.0f : 0.99f;
+
+            for (size_t b = 0; b < blobs.size(); b++)
+            {
+                float ex = (u - blobs[b].x) * aspect, ey = v - blobs[b].y;
+                float distance = sqrtf(ex * ex + ey * ey);
+                if (distance < blobs[b].radius)
+                {
+                    value = qMin(1.0f, value + 0.3f * (1 - distance / blobs[b].radius));
+                }
+            }
+
+            for (int c = 0; c < 3; c++)
+            {
+                mask[((size_t) y * width + x) * 3 + c] = value;
+            }
+        }
+    }
+    return mask;
+}
+
+static void drawQuad()
+{
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0, 1, 0, 1, -1, 1);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    glBegin(GL_QUADS);
+    glTexCoord2f(0.0f, 0.0f);
+    glVertex2f(0.0f, 0.0f);
+    glTexCoord2f(1.0f, 0.0f);
+    glVertex2f(1.0f, 0.0f);
+    glTexCoord2f(1.0f, 1.0f);
+    glVertex2f(1.0f, 1.0f);
+    glTexCoord2f(0.0f, 1.0f);
+    glVertex2f(0.0f, 1.0f);
+    glEnd();
+}
+
+static QGLFramebufferObject *newTarget(int width, int height)
+{
+    QGLFramebufferObject *target = new QGLFramebufferObject(width, height, QGLFramebufferObject::NoAttachment,
+                                                            GL_TEXTURE_2D, GL_RGB16F_ARB);
+    glBindTexture(GL_TEXTURE_2D, target->texture());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return target;
+}
+
+static std::vector<float> readTexture(GLuint texture, int width, int height)
+{
+    std::vector<float> pixels((size_t) width * height * 3);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_FLOAT, &pixels[0]);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return pixels;
+}
+
+int main(int argc, char *argv[])
+{
+    QApplication app(argc, argv);
+    QStringList arguments = app.arguments();
+
+    int width = 480, height = 270;
+    if (arguments.size() > 2 && arguments[1].toInt() > 0)
+    {
+        width = arguments[1].toInt();
+        height = arguments[2].toInt();
+    }
+    double maxError = 0.05;
+    int bound = arguments.indexOf("--max-error");
+    if (bound >= 0 && bound + 1 < arguments.size())
+    {
+        maxError = arguments[bound + 1].toDouble();
+    }
+
+    QGLPixelBuffer context(QSize(width, height));
+    if (!context.isValid() || !context.makeCurrent())
+    {
+        fprintf(stderr, "no offscreen OpenGL context\n");
+        return 2;
+    }
+    glViewport(0, 0, width, height);
+    glEnable(GL_TEXTURE_2D);
+
+    QGLShaderProgram reference, blur;
+    if (!reference.addShaderFromSourceFile(QGLShader::Fragment, "../shaders/lightscatter.frag") || !reference.link()
+            || !blur.addShaderFromSourceFile(QGLShader::Fragment, "../shaders/radialblur.frag") || !blur.link())
+    {
+        fprintf(stderr, "could not build the shaders, run from the bench directory\n");
+        return 2;
+    }
+
+    QGLFramebufferObject *mask = newTarget(width, height);
+    QGLFramebufferObject *expected = newTarget(width, height);
+    QGLFramebufferObject *ping = newTarget(width, height);
+    QGLFramebufferObject *pong = newTarget(width, height);
+
+    const float suns[][2] = { { 0.5f, 0.5f }, { 0.3f, 0.7f }, { 0.9f, 0.9f }, { 1.2f, 0.6f } };
+
+    printf("%-10s %-12s %6s %10s %10s %8s %10s\n", "preset", "sun", "reads", "mean err", "max err", "psnr", "ms");
+
+    bool withinBound = true;
+    for (size_t s = 0; s < sizeof(suns) / sizeof(suns[0]); s++)
+    {
+        GLfloat light[2] = { suns[s][0], suns[s][1] };
+        std::vector<float> pixels = occlusionMask(width, height, light[0], light[1]);
+        glBindTexture(GL_TEXTURE_2D, mask->texture());
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F_ARB, width, height, 0, GL_RGB, GL_FLOAT, &pixels[0]);
+
+        std::vector<float> truth;
+        for (int q = RadialBlur::REFERENCE; q < RadialBlur::QUALITIES; q++)
+        {
+            RadialBlur radialBlur;
+            radialBlur.setParameters(EXPOSURE, DECAY, DENSITY, WEIGHT);
+            radialBlur.setQuality((RadialBlur::Quality) q);
+
+            glFinish();
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+            GLuint rays;
+            int reads = 0;
+            if (q == RadialBlur::REFERENCE)
+            {
+                expected->bind();
+                reference.bind();
+                reference.setUniformValue("exposure", EXPOSURE);
+                reference.setUniformValue("decay", DECAY);
+                reference.setUniformValue("density", DENSITY);
+                reference.setUniformValue("weight", WEIGHT);
+                reference.setUniformValue("dotLightLook", -1.0f);
+                reference.setUniformValueArray("lightPositionOnScreen", light, 1, 2);
+                reference.setUniformValue("extent", 1.0f, 1.0f);
+                glBindTexture(GL_TEXTURE_2D, mask->texture());
+                drawQuad();
+                reference.release();
+                expected->release();
+                rays = expected->texture();
+                reads = RadialBlur::REFERENCE_SAMPLES;
+            }
+            else
+            {
+                rays = radialBlur.render(&blur, mask->texture(), ping, pong, light);
+                for (size_t p = 0; p < radialBlur.passes().size(); p++)
+                {
+                    reads += radialBlur.passes()[p].taps;
+                }
+            }
+
+            glFinish();
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+            std::vector<float> result = readTexture(rays, width, height);
+            if (q == RadialBlur::REFERENCE)
+            {
+                truth = result;
+            }
+
+            double sum = 0, squares = 0, worst = 0;
+            for (size_t i = 0; i < result.size(); i++)
+            {
+                double error = fabs(qBound(0.0f, result[i], 1.0f) - qBound(0.0f, truth[i], 1.0f));
+                sum += error;
+                squares += error * error;
+                worst = qMax(worst, error);
+            }
+            double mean = sum / result.size();
+            double psnr = squares > 0 ? 10 * log10(result.size() / squares) : INFINITY;
+            withinBound = withinBound && mean <= maxError;
+
+            char sun[32];
+            snprintf(sun, sizeof(sun), "(%.1f, %.1f)", light[0], light[1]);
+            printf("%-10s %-12s %6d %10.4f %10.4f %8.1f %10.2f\n", RadialBlur::qualityName((RadialBlur::Quality) q),
+                   sun, reads, mean, worst, psnr, ms);
+        }
+    }
+
+    delete mask;
+    delete expected;
+    delete ping;
+    delete pong;
+
+    if (!withinBound)
+    {
+        printf("mean error above %.4f\n", maxError);
+        return 1;
+    }
+    return 0;
+}
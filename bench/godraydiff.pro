@@ -0,0 +1,21 @@
+#
+# Image difference between the reference god ray shader and the multi pass presets
+#
+
+QT += core gui opengl
+
+QMAKE_CXXFLAGS += -std=c++0x
+QMAKE_CXXFLAGS_RELEASE += -O2
+
+TARGET = godraydiff
+TEMPLATE = app
+CONFIG += console release
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../final
+DEPENDPATH += ../final
+
+SOURCES += godraydiff.cpp \
+    ../final/radialblur.cpp
+
+HEADERS += ../final/radialblur.h
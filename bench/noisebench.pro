@@ -0,0 +1,25 @@
+#
+# Benchmarks for the cloud generator kernels
+#
+
+QT -= core gui
+
+QMAKE_CXXFLAGS += -std=c++0x
+QMAKE_CXXFLAGS_RELEASE += -O2
+
+TARGET = noisebench
+TEMPLATE = app
+CONFIG += console release
+CONFIG -= app_bundle qt
+
+INCLUDEPATH += ../final
+DEPENDPATH += ../final
+
+LIBS += -lpthread
+
+SOURCES += noisebench.cpp \
+    ../final/noisekernel.cpp \
+    ../final/cloudvolume.cpp
+
+HEADERS += ../final/noisekernel.h \
+    ../final/cloudvolume.h
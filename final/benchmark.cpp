@@ -0,0 +1,545 @@
+#include "benchmark.h"
+#include "layeredvolume.h"
+#include "streamedvolume.h"
+#include "view.h"
+#include "volumecache.h"
+
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+#include <QTimer>
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <stdio.h>
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+#define PAN_FRACTION 16 //of the window width moved per step, as the view's arrow keys do
+#define READ_AHEAD_TICKS 4 //between two steps
+#define READ_AHEAD_BRICKS 256 //per tick, as the view reads ahead
+
+BenchmarkSettings::BenchmarkSettings()
+    : width(1280), height(720), frames(300), warmup(10), idleSeconds(0), startupRuns(5)
+{
+    features << "rays" << "none" << "god" << "modeler" << "rays+raymarch" << "raymarch";
+}
+
+BenchmarkSettings BenchmarkSettings::fromArguments(const QStringList &arguments)
+{
+    BenchmarkSettings settings;
+
+    for (int i = 1; i + 1 < arguments.size(); i++)
+    {
+        const QString &flag = arguments[i];
+        const QString &value = arguments[i + 1];
+
+        if (flag == "--bench-frames")
+        {
+            settings.frames = qMax(0, value.toInt());
+        }
+        else if (flag == "--bench-warmup")
+        {
+            settings.warmup = qMax(0, value.toInt());
+        }
+        else if (flag == "--bench-size")
+        {
+            QStringList size = value.split('x');
+            if (size.size() == 2 && size[0].toInt() > 0 && size[1].toInt() > 0)
+            {
+                settings.width = size[0].toInt();
+                settings.height = size[1].toInt();
+            }
+            else
+            {
+                qWarning("--bench-size expects WxH, got '%s'", qPrintable(value));
+            }
+        }
+        else if (flag == "--bench-path")
+        {
+            settings.path = value;
+        }
+        else if (flag == "--bench-out")
+        {
+            settings.output = value;
+        }
+        else if (flag == "--bench-features")
+        {
+            settings.features = value.split(',', QString::SkipEmptyParts);
+        }
+        else if (flag == "--bench-idle")
+        {
+            settings.idleSeconds = qMax(0, value.toInt());
+        }
+        else if (flag == "--bench-runs")
+        {
+            settings.startupRuns = qMax(1, value.toInt());
+        }
+    }
+
+    return settings;
+}
+
+Benchmark::Benchmark(View *view, const BenchmarkSettings &settings)
+    : m_view(view), m_settings(settings)
+{
+}
+
+/**
+  Sets the view's toggles from a + joined list of features. Returns false for unknown ones.
+  */
+bool Benchmark::applyFeatures(const QString &features)
+{
+    bool godRays = false, godMode = false, modelerMode = false, rayMarching = false;
+
+    QStringList toggles = features.split('+', QString::SkipEmptyParts);
+    for (int t = 0; t < toggles.size(); t++)
+    {
+        if (toggles[t] == "rays")
+        {
+            godRays = true;
+        }
+        else if (toggles[t] == "god")
+        {
+            godMode = true;
+        }
+        else if (toggles[t] == "modeler")
+        {
+            modelerMode = true;
+        }
+        else if (toggles[t] == "raymarch")
+        {
+            rayMarching = true;
+        }
+        else if (toggles[t] != "none")
+        {
+            qWarning("Unknown benchmark feature '%s'", qPrintable(toggles[t]));
+            return false;
+        }
+    }
+
+    m_view->setFeatures(godRays, godMode, modelerMode);
+    m_view->setRayMarching(rayMarching);
+    if (rayMarching && !m_view->isRayMarching())
+    {
+        qWarning("Ray marching unavailable, skipping '%s'", qPrintable(features));
+        return false;
+    }
+    return true;
+}
+
+/**
+  Renders one frame of the path; measures it unless run is null
+  */
+void Benchmark::renderFrame(Run *run)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    m_view->makeCurrent();
+    if (run)
+    {
+        m_gpuTimer.begin();
+    }
+
+    //every frame goes through the whole pipeline, even when the path stands still
+    m_view->invalidate();
+    Clock::time_point start = Clock::now();
+    m_view->updateGL();
+    Clock::time_point submitted = Clock::now();
+
+    if (run)
+    {
+        m_gpuTimer.end();
+    }
+    glFinish();
+    Clock::time_point finished = Clock::now();
+
+    if (!run)
+    {
+        return;
+    }
+
+    run->cpu.push_back(std::chrono::duration<double, std::milli>(submitted - start).count());
+    run->frame.push_back(std::chrono::duration<double, std::milli>(finished - start).count());
+
+    double gpu;
+    if (m_gpuTimer.wait(gpu))
+    {
+        run->gpu.push_back(gpu);
+    }
+}
+
+/**
+  Renders every feature combination along the path and writes the report. Returns false if the
+  view has no usable context or the report can't be written.
+  */
+bool Benchmark::run()
+{
+    m_view->makeCurrent();
+    if (!m_view->isValid())
+    {
+        fprintf(stderr, "no OpenGL context for the benchmark\n");
+        return false;
+    }
+
+    if (!m_settings.path.isEmpty() && !m_path.load(m_settings.path))
+    {
+        return false;
+    }
+    if (!m_gpuTimer.initialize(m_view->context()))
+    {
+        qWarning("Timer queries unavailable, GPU times are not reported");
+    }
+    //the view's own per pass queries can't run inside the frame's
+    m_view->profiler().setGpuTiming(false);
+    //the first frame initializes the view's GL resources, e.g. whether ray marching works
+    this->renderFrame(0);
+
+    OrbitCamera start = m_view->camera();
+    for (int f = 0; f < m_settings.features.size() && m_settings.frames > 0; f++)
+    {
+        Run run;
+        run.features = m_settings.features[f];
+        if (!this->applyFeatures(run.features))
+        {
+            continue;
+        }
+        run.engine = m_view->isRayMarching() ? "raymarch" : "billboards";
+
+        //the warmup follows the end of the path, so the measured frames start on a warm sort
+        for (int w = m_settings.warmup; w > 0; w--)
+        {
+            m_view->setCamera(m_path.at(start, m_settings.frames - w, m_settings.frames));
+            this->renderFrame(0);
+        }
+        for (int frame = 0; frame < m_settings.frames; frame++)
+        {
+            m_view->setCamera(m_path.at(start, frame, m_settings.frames));
+            this->renderFrame(&run);
+        }
+
+        m_runs.push_back(run);
+        fprintf(stderr, "%s: %d frames\n", qPrintable(run.features), m_settings.frames);
+    }
+    m_view->setCamera(start);
+
+    if (m_settings.idleSeconds > 0)
+    {
+        m_idle.push_back(this->measureIdle(false));
+        m_idle.push_back(this->measureIdle(true));
+    }
+
+    QString json = this->toJson();
+    if (m_settings.output.isEmpty())
+    {
+        printf("%s", qPrintable(json));
+        return true;
+    }
+
+    QFile file(m_settings.output);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Truncate))
+    {
+        fprintf(stderr, "could not write '%s'\n", qPrintable(m_settings.output));
+        return false;
+    }
+    QTextStream(&file) << json;
+    return true;
+}
+
+/**
+  Runs the event loop without any input for idleSeconds and measures how many frames the view
+  renders and re-presents and how busy the process is meanwhile
+  */
+Benchmark::Idle Benchmark::measureIdle(bool onDemand)
+{
+    m_view->setRedrawOnDemand(onDemand);
+    int rendered = m_view->framesRendered();
+    int presented = m_view->framesPresented();
+
+    std::clock_t cpu = std::clock();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    QEventLoop loop;
+    QTimer::singleShot(m_settings.idleSeconds * 1000, &loop, SLOT(quit()));
+    loop.exec();
+
+    Idle idle;
+    idle.onDemand = onDemand;
+    idle.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    idle.framesRendered = m_view->framesRendered() - rendered;
+    idle.framesPresented = m_view->framesPresented() - presented;
+    idle.cpuLoad = 100.0 * (std::clock() - cpu) / CLOCKS_PER_SEC / idle.seconds;
+
+    fprintf(stderr, "idle, redraw %s: %d frames rendered, %.1f%% CPU\n", onDemand ? "on demand" : "every tick",
+            idle.framesRendered, idle.cpuLoad);
+    return idle;
+}
+
+/**
+  value as a JSON string literal
+  */
+QString Benchmark::quoted(QString value)
+{
+    return "\"" + value.replace('\\', "\\\\").replace('"', "\\\"") + "\"";
+}
+
+/**
+  Mean, nearest rank percentiles and maximum of the samples as a JSON object, or null
+  */
+QString Benchmark::statistics(std::vector<double> samples)
+{
+    if (samples.empty())
+    {
+        return "null";
+    }
+
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (size_t s = 0; s < samples.size(); s++)
+    {
+        sum += samples[s];
+    }
+
+    const int percentiles[] = { 50, 95, 99 };
+    QString json = QString("{ \"mean\": %1").arg(sum / samples.size(), 0, 'f', 3);
+    for (int p = 0; p < 3; p++)
+    {
+        size_t rank = (percentiles[p] * samples.size() + 99) / 100;
+        json += QString(", \"p%1\": %2").arg(percentiles[p]).arg(samples[qMax((size_t)1, rank) - 1], 0, 'f', 3);
+    }
+    json += QString(", \"max\": %1 }").arg(samples.back(), 0, 'f', 3);
+    return json;
+}
+
+QString Benchmark::toJson() const
+{
+    const CloudSettings &volume = m_view->settings();
+    const char *renderer = (const char *) glGetString(GL_RENDERER);
+
+    QString json = "{\n";
+    json += QString("  \"renderer\": %1,\n").arg(quoted(renderer ? renderer : ""));
+    json += QString("  \"width\": %1,\n  \"height\": %2,\n").arg(m_settings.width).arg(m_settings.height);
+    json += QString("  \"frames\": %1,\n  \"warmup\": %2,\n").arg(m_settings.frames).arg(m_settings.warmup);
+    json += QString("  \"path\": %1,\n").arg(quoted(m_path.isRecorded() ? m_settings.path : QString("orbit")));
+    json += QString("  \"volume\": { \"dims\": [%1, %2, %3], \"octaves\": %4, \"cells\": %5 },\n")
+            .arg(volume.dimX).arg(volume.dimY).arg(volume.dimZ).arg(volume.octaves).arg(volume.cells);
+    json += "  \"runs\": [\n";
+    for (size_t r = 0; r < m_runs.size(); r++)
+    {
+        const Run &run = m_runs[r];
+        json += QString("    { \"features\": %1, \"engine\": %2,\n").arg(quoted(run.features)).arg(quoted(run.engine));
+        json += QString("      \"cpu_ms\": %1,\n").arg(statistics(run.cpu));
+        json += QString("      \"gpu_ms\": %1,\n").arg(statistics(run.gpu));
+        json += QString("      \"frame_ms\": %1 }%2\n").arg(statistics(run.frame)).arg(r + 1 < m_runs.size() ? "," : "");
+    }
+    json += "  ]";
+
+    if (!m_idle.empty())
+    {
+        json += ",\n  \"idle\": [\n";
+        for (size_t i = 0; i < m_idle.size(); i++)
+        {
+            const Idle &idle = m_idle[i];
+            json += QString("    { \"redraw\": \"%1\", \"seconds\": %2, \"frames_rendered\": %3, \"frames_presented\": %4, "
+                            "\"cpu_percent\": %5 }%6\n").arg(idle.onDemand ? "on-demand" : "always")
+                    .arg(idle.seconds, 0, 'f', 2).arg(idle.framesRendered).arg(idle.framesPresented)
+                    .arg(idle.cpuLoad, 0, 'f', 2).arg(i + 1 < m_idle.size() ? "," : "");
+        }
+        json += "  ]";
+    }
+    json += "\n}\n";
+    return json;
+}
+
+StartupBenchmark::StartupBenchmark(const CloudSettings &volume, const BenchmarkSettings &settings)
+    : m_volume(volume), m_settings(settings)
+{
+}
+
+static double millisecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+  Most memory the process had resident so far, -1 where that isn't known
+  */
+static double peakMegabytes()
+{
+#ifdef Q_OS_UNIX
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        return usage.ru_maxrss / 1024.; //kilobytes on Linux
+    }
+#endif
+    return -1;
+}
+
+/**
+  Prints json, or writes it to output when that is set
+  */
+static bool writeReport(const QString &json, const QString &output)
+{
+    if (output.isEmpty())
+    {
+        printf("%s", qPrintable(json));
+        return true;
+    }
+
+    QFile file(output);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Truncate))
+    {
+        fprintf(stderr, "could not write '%s'\n", qPrintable(output));
+        return false;
+    }
+    QTextStream(&file) << json;
+    return true;
+}
+
+/**
+  Runs the cold starts, then the warm ones, and writes the JSON report
+  */
+bool StartupBenchmark::run()
+{
+    if (m_volume.volumeCache.isEmpty())
+    {
+        fprintf(stderr, "--bench-startup needs a volume cache\n");
+        return false;
+    }
+
+    CloudGenerator generator;
+    VolumeCache cache;
+    cache.setPath(m_volume.volumeCache);
+    cache.setVerify(m_volume.verifyCache);
+    cache.setCompression(m_volume.cacheBits, PARTICLE_THRESHOLD);
+    VolumeCache::Key key = VolumeCache::keyFor(m_volume, generator);
+
+    std::vector<double> cold, warm, touched;
+    for (int r = 0; r < m_settings.startupRuns; r++)
+    {
+        QFile::remove(m_volume.volumeCache);
+        CloudVolume volume;
+        LayeredVolume layers(generator);
+        layers.setReduced(m_volume.reducedLayers);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        cache.fetch(key, volume, [&](CloudVolume &generated) {
+            layers.update(m_volume.dimX, m_volume.dimY, m_volume.dimZ, m_volume.octaves, m_volume.cells);
+            layers.compose(generated);
+        });
+        cold.push_back(millisecondsSince(start));
+    }
+    fprintf(stderr, "cold: %d starts\n", m_settings.startupRuns);
+
+    float sum = 0;
+    for (int r = 0; r < m_settings.startupRuns; r++)
+    {
+        CloudVolume volume;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (!cache.open(key, volume))
+        {
+            fprintf(stderr, "could not map '%s'\n", qPrintable(m_volume.volumeCache));
+            return false;
+        }
+        warm.push_back(millisecondsSince(start));
+
+        for (int x = 0; x < volume.sizeX(); x++)
+        {
+            for (int y = 0; y < volume.sizeY(); y++)
+            {
+                const float *row = volume.row(x, y);
+                for (int z = 0; z < volume.sizeZ(); z++)
+                {
+                    sum += row[z];
+                }
+            }
+        }
+        touched.push_back(millisecondsSince(start));
+    }
+    fprintf(stderr, "warm: %d starts\n", m_settings.startupRuns);
+
+    QString json = "{\n";
+    json += QString("  \"volume\": { \"dims\": [%1, %2, %3], \"octaves\": %4, \"cells\": %5 },\n")
+            .arg(m_volume.dimX).arg(m_volume.dimY).arg(m_volume.dimZ).arg(m_volume.octaves).arg(m_volume.cells);
+    json += QString("  \"cache\": %1,\n  \"bits\": %2,\n  \"bytes\": %3,\n  \"runs\": %4,\n")
+            .arg(Benchmark::quoted(m_volume.volumeCache)).arg(m_volume.cacheBits)
+            .arg(QFileInfo(m_volume.volumeCache).size()).arg(m_settings.startupRuns);
+    json += QString("  \"cold_ms\": %1,\n").arg(Benchmark::statistics(cold));
+    json += QString("  \"warm_ms\": %1,\n").arg(Benchmark::statistics(warm));
+    json += QString("  \"warm_read_ms\": %1,\n").arg(Benchmark::statistics(touched));
+    json += QString("  \"density_sum\": %1\n}\n").arg(sum);
+    return writeReport(json, m_settings.output);
+}
+
+StreamBenchmark::StreamBenchmark(const CloudSettings &volume, const BenchmarkSettings &settings)
+    : m_volume(volume), m_settings(settings)
+{
+}
+
+/**
+  Generates the volume, pans the window across it and writes the JSON report
+  */
+bool StreamBenchmark::run()
+{
+    CloudGenerator generator;
+    StreamedVolume stream;
+    stream.setPath(m_volume.streamFile);
+    stream.setCompression(m_volume.cacheBits > 0 ? m_volume.cacheBits : 8, PARTICLE_THRESHOLD);
+    stream.setBudget((qint64)m_volume.streamBudget * 1024 * 1024);
+    VolumeCache::Key key = VolumeCache::keyFor(m_volume, generator);
+
+    fprintf(stderr, "generating %dx%dx%d into '%s'\n", m_volume.dimX, m_volume.dimY, m_volume.dimZ,
+            qPrintable(m_volume.streamFile));
+    if (!stream.build(key, generator))
+    {
+        fprintf(stderr, "could not write '%s'\n", qPrintable(m_volume.streamFile));
+        return false;
+    }
+    double buildPeak = peakMegabytes();
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (!stream.open(key))
+    {
+        fprintf(stderr, "could not open '%s'\n", qPrintable(m_volume.streamFile));
+        return false;
+    }
+    double openTime = millisecondsSince(start);
+
+    CloudVolume window(m_volume.windowX, m_volume.windowY, m_volume.windowZ);
+    int low[3] = { 0, (m_volume.dimY - m_volume.windowY) / 2, (m_volume.dimZ - m_volume.windowZ) / 2 };
+    int step = std::max(1, m_volume.windowX / PAN_FRACTION);
+    std::vector<double> reads;
+    for (; low[0] + m_volume.windowX <= m_volume.dimX; low[0] += step)
+    {
+        start = std::chrono::steady_clock::now();
+        stream.read(window, low[0], low[1], low[2]);
+        reads.push_back(millisecondsSince(start));
+
+        int high[3] = { low[0] + m_volume.windowX, low[1] + m_volume.windowY, low[2] + m_volume.windowZ };
+        for (int t = 0; t < READ_AHEAD_TICKS; t++)
+        {
+            stream.readAhead(low, high, Vector3(1, 0, 0), m_volume.windowX / 4, READ_AHEAD_BRICKS);
+        }
+    }
+    fprintf(stderr, "panned: %d windows\n", (int)reads.size());
+
+    QString json = "{\n";
+    json += QString("  \"volume\": { \"dims\": [%1, %2, %3], \"octaves\": %4, \"cells\": %5 },\n")
+            .arg(m_volume.dimX).arg(m_volume.dimY).arg(m_volume.dimZ).arg(m_volume.octaves).arg(m_volume.cells);
+    json += QString("  \"window\": [%1, %2, %3],\n  \"budget_mb\": %4,\n")
+            .arg(m_volume.windowX).arg(m_volume.windowY).arg(m_volume.windowZ).arg(m_volume.streamBudget);
+    json += QString("  \"file\": %1,\n  \"file_bytes\": %2,\n  \"build_ms\": %3,\n  \"build_peak_rss_mb\": %4,\n")
+            .arg(Benchmark::quoted(m_volume.streamFile)).arg(stream.fileBytes())
+            .arg(stream.lastBuildTime(), 0, 'f', 1).arg(buildPeak, 0, 'f', 1);
+    json += QString("  \"open_ms\": %1,\n  \"read_ms\": %2,\n").arg(openTime, 0, 'f', 2)
+            .arg(Benchmark::statistics(reads));
+    json += QString("  \"hits\": %1,\n  \"misses\": %2,\n  \"read_ahead\": %3,\n  \"evictions\": %4,\n")
+            .arg(stream.hits()).arg(stream.misses()).arg(stream.prefetched()).arg(stream.evictions());
+    json += QString("  \"resident_bricks\": %1,\n  \"stream_bytes\": %2,\n  \"peak_rss_mb\": %3\n}\n")
+            .arg(stream.residentBricks()).arg(stream.bytes()).arg(peakMegabytes(), 0, 'f', 1);
+    return writeReport(json, m_settings.output);
+}
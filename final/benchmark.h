@@ -0,0 +1,152 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <QString>
+#include <QStringList>
+#include <vector>
+#include "camerapath.h"
+#include "cloudsettings.h"
+#include "gputimer.h"
+
+class View;
+
+/**
+    What a --bench run renders and where the results go:
+
+        final --bench
+        final --bench --bench-frames 600 --bench-size 1920x1080 --bench-out frames.json
+        final --bench --bench-path flight.txt --bench-features rays,rays+modeler --quality high
+        final --bench --bench-frames 0 --bench-idle 10
+
+    Feature combinations are comma separated, each a + joined list of toggles: rays (god rays
+    over the scene), god (the god ray pass alone), modeler (untextured particles), raymarch (the
+    volume engine instead of the billboards) or none. The defaults run each engine with and
+    without god rays; both draw the same voxels above the same threshold with the same colours,
+    the ray-marched ones sampled twice per voxel.
+
+    With --bench-idle the view is afterwards left alone for that many seconds, once redrawing
+    every tick and once on demand, to measure what an unchanging frame costs.
+**/
+struct BenchmarkSettings
+{
+    int width;
+    int height;
+    int frames; // measured frames per feature combination
+    int warmup; // frames rendered before measuring, e.g. to build and sort the particles
+    QString path; // camera path file, empty for the parametric orbit
+    QString output; // JSON file, empty for stdout
+    QStringList features;
+    int idleSeconds; // 0 to skip the idle measurement
+    int startupRuns; // cold and warm starts each, for --bench-startup
+
+    BenchmarkSettings();
+
+    static BenchmarkSettings fromArguments(const QStringList &arguments);
+};
+
+/**
+    Renders the view along a camera path for every feature combination and reports CPU, GPU and
+    total frame time percentiles as JSON.
+
+    Frames are driven synchronously through updateGL() on a widget that is never mapped, and each
+    one is finished with glFinish() so the measurements don't bleed into the next frame. CPU time
+    covers paintGL and the buffer swap up to the point the commands are submitted, GPU time is
+    a GL_TIME_ELAPSED query around the same span (null when the driver has no timer queries),
+    and frame time runs until the GPU is done.
+
+    Qt 4 still needs an X display for its GL context; on machines without a GPU, run under Xvfb
+    with LIBGL_ALWAYS_SOFTWARE=1 so Mesa's llvmpipe does the rendering.
+**/
+class Benchmark
+{
+
+public:
+    Benchmark(View *view, const BenchmarkSettings &settings);
+
+    bool run();
+
+    static QString quoted(QString value);
+    static QString statistics(std::vector<double> samples);
+
+private:
+    struct Idle
+    {
+        bool onDemand;
+        double seconds;
+        int framesRendered;
+        int framesPresented;
+        double cpuLoad; // percent of one core
+    };
+
+    struct Run
+    {
+        QString features;
+        QString engine;
+        std::vector<double> cpu; // milliseconds per frame
+        std::vector<double> gpu;
+        std::vector<double> frame;
+    };
+
+    bool applyFeatures(const QString &features);
+    void renderFrame(Run *run);
+    Idle measureIdle(bool onDemand);
+    QString toJson() const;
+
+    View *m_view;
+    BenchmarkSettings m_settings;
+    CameraPath m_path;
+    GpuTimer m_gpuTimer;
+    std::vector<Run> m_runs;
+    std::vector<Idle> m_idle;
+};
+
+/**
+    Times how long the cloud volume takes to be ready at startup, without a window:
+
+        final --bench-startup
+        final --bench-startup --bench-runs 10 --bench-out startup.json --quality ultra
+
+    A cold start removes the volume cache, generates the volume and writes the cache; a warm
+    start maps it. Warm starts are timed again up to having read every voxel once, which is
+    when the mapped pages actually come in. The file stays in the OS page cache, so warm starts
+    measure a recently used cache rather than a disk read.
+**/
+class StartupBenchmark
+{
+
+public:
+    StartupBenchmark(const CloudSettings &volume, const BenchmarkSettings &settings);
+
+    bool run();
+
+private:
+    CloudSettings m_volume;
+    BenchmarkSettings m_settings;
+};
+
+/**
+    Generates an out of core volume and pans a window across it, without a window on screen:
+
+        final --bench-stream --dims 2048x512x2048
+        final --bench-stream --dims 1024x256x1024 --stream-budget 128 --bench-out stream.json
+
+    The volume file is generated from scratch. The window then moves along x a sixteenth of its
+    width at a time, like the arrow keys, reading ahead that way for a few ticks in between.
+    The report has the generation time and file size, the time per window read, the brick
+    cache counters and the peak resident memory of the process, which should stay near the
+    brick budget plus the window however large the volume.
+**/
+class StreamBenchmark
+{
+
+public:
+    StreamBenchmark(const CloudSettings &volume, const BenchmarkSettings &settings);
+
+    bool run();
+
+private:
+    CloudSettings m_volume;
+    BenchmarkSettings m_settings;
+};
+
+#endif // BENCHMARK_H
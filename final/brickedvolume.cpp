@@ -0,0 +1,287 @@
+#include "brickedvolume.h"
+#include "cloudvolume.h"
+#include "threadpool.h"
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+BrickedVolume::BrickedVolume()
+    : m_bits(8), m_constantBricks(0)
+{
+    m_dims[0] = m_dims[1] = m_dims[2] = 0;
+    m_bricks[0] = m_bricks[1] = m_bricks[2] = 0;
+}
+
+void BrickedVolume::clear()
+{
+    m_table.clear();
+    m_codes.clear();
+    m_dims[0] = m_dims[1] = m_dims[2] = 0;
+    m_bricks[0] = m_bricks[1] = m_bricks[2] = 0;
+    m_constantBricks = 0;
+}
+
+double BrickedVolume::ratio() const
+{
+    return this->bytes() > 0 ? (double)m_dims[0] * m_dims[1] * m_dims[2] * sizeof(float) / this->bytes() : 0;
+}
+
+/**
+  Compresses volume with bits (8 or 16) per quantized voxel. threshold is the faded density a
+  voxel needs to be drawn; no voxel ends up on the other side of it.
+  */
+void BrickedVolume::encode(const CloudVolume &volume, float threshold, int bits)
+{
+    m_bits = bits == 16 ? 16 : 8;
+    m_dims[0] = volume.sizeX();
+    m_dims[1] = volume.sizeY();
+    m_dims[2] = volume.sizeZ();
+    for (int a = 0; a < 3; a++)
+    {
+        m_bricks[a] = (m_dims[a] + BRICK_SIZE - 1) / BRICK_SIZE;
+    }
+    int count = m_bricks[0] * m_bricks[1] * m_bricks[2];
+    m_table.assign(count, Brick());
+
+    int levels = (1 << m_bits) - 1;
+    float flat = 0.5f / levels; // spread of a brick that reads as constant
+    ThreadPool &pool = ThreadPool::global();
+    int grain = max(1, count / (8 * (pool.threadCount() + 1)));
+
+    //classify each brick by its range
+    pool.parallelFor(count, grain, [&](int begin, int end) {
+        for (int b = begin; b < end; b++)
+        {
+            int bx = b / (m_bricks[1] * m_bricks[2]), by = b / m_bricks[2] % m_bricks[1], bz = b % m_bricks[2];
+            int x1 = min((bx + 1) * BRICK_SIZE, m_dims[0]), y1 = min((by + 1) * BRICK_SIZE, m_dims[1]);
+            int z0 = bz * BRICK_SIZE, z1 = min(z0 + BRICK_SIZE, m_dims[2]);
+            int voxels = (x1 - bx * BRICK_SIZE) * (y1 - by * BRICK_SIZE) * (z1 - z0);
+            float low = 1e30f, high = -1e30f;
+            double sum = 0;
+            int drawn = 0;
+            for (int x = bx * BRICK_SIZE; x < x1; x++)
+            {
+                for (int y = by * BRICK_SIZE; y < y1; y++)
+                {
+                    const float *row = volume.row(x, y);
+                    float falloff = 1.0 - (y / ((float) m_dims[1]));
+                    for (int z = z0; z < z1; z++)
+                    {
+                        low = min(low, row[z]);
+                        high = max(high, row[z]);
+                        sum += row[z];
+                        drawn += row[z] * falloff > threshold;
+                    }
+                }
+            }
+
+            //the mean must be drawn exactly where the voxels are, row by row
+            float mean = (float)(sum / voxels);
+            bool constant = drawn == 0 || (drawn == voxels && high - low <= flat);
+            for (int x = bx * BRICK_SIZE; constant && x < x1; x++)
+            {
+                for (int y = by * BRICK_SIZE; constant && y < y1; y++)
+                {
+                    const float *row = volume.row(x, y);
+                    float falloff = 1.0 - (y / ((float) m_dims[1]));
+                    for (int z = z0; constant && z < z1; z++)
+                    {
+                        constant = (mean * falloff > threshold) == (row[z] * falloff > threshold);
+                    }
+                }
+            }
+
+            Brick &brick = m_table[b];
+            if (constant)
+            {
+                brick.kind = CONSTANT;
+                brick.base = mean;
+                brick.step = 0;
+            }
+            else
+            {
+                brick.kind = QUANTIZED;
+                brick.base = low;
+                brick.step = (high - low) / levels;
+            }
+        }
+    });
+
+    //quantized bricks get whole, equally sized slots in the codes
+    size_t brickBytes = BRICK_VOXELS * (m_bits / 8);
+    size_t offset = 0;
+    m_constantBricks = 0;
+    for (int b = 0; b < count; b++)
+    {
+        m_table[b].offset = (unsigned)offset;
+        if (m_table[b].kind == QUANTIZED)
+        {
+            offset += brickBytes;
+        }
+        else
+        {
+            m_constantBricks++;
+        }
+    }
+    m_codes.assign(offset, 0);
+
+    pool.parallelFor(count, grain, [&](int begin, int end) {
+        for (int b = begin; b < end; b++)
+        {
+            const Brick &brick = m_table[b];
+            if (brick.kind != QUANTIZED)
+            {
+                continue;
+            }
+            int bx = b / (m_bricks[1] * m_bricks[2]), by = b / m_bricks[2] % m_bricks[1], bz = b % m_bricks[2];
+            int x1 = min((bx + 1) * BRICK_SIZE, m_dims[0]), y1 = min((by + 1) * BRICK_SIZE, m_dims[1]);
+            int z0 = bz * BRICK_SIZE, z1 = min(z0 + BRICK_SIZE, m_dims[2]);
+            unsigned char *codes8 = &m_codes[brick.offset];
+            unsigned short *codes16 = (unsigned short *)codes8;
+            for (int x = bx * BRICK_SIZE; x < x1; x++)
+            {
+                for (int y = by * BRICK_SIZE; y < y1; y++)
+                {
+                    const float *row = volume.row(x, y);
+                    float falloff = 1.0 - (y / ((float) m_dims[1]));
+                    int local = ((x - bx * BRICK_SIZE) * BRICK_SIZE + (y - by * BRICK_SIZE)) * BRICK_SIZE - z0;
+                    for (int z = z0; z < z1; z++)
+                    {
+                        int code = min(max((int)lrintf((row[z] - brick.base) / brick.step), 0), levels);
+                        //stay on the voxel's side of the faded threshold, decoded exactly as sample() does
+                        bool drawn = row[z] * falloff > threshold;
+                        bool decodedDrawn = (brick.base + code * brick.step) * falloff > threshold;
+                        if (drawn && !decodedDrawn && code < levels)
+                        {
+                            code++;
+                        }
+                        else if (!drawn && decodedDrawn && code > 0)
+                        {
+                            code--;
+                        }
+                        if (m_bits == 8)
+                        {
+                            codes8[local + z] = (unsigned char)code;
+                        }
+                        else
+                        {
+                            codes16[local + z] = (unsigned short)code;
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+
+/**
+  Expands every brick into volume, which is resized to the grid
+  */
+void BrickedVolume::decode(CloudVolume &volume) const
+{
+    volume.resize(m_dims[0], m_dims[1], m_dims[2]);
+    int count = (int)m_table.size();
+    ThreadPool &pool = ThreadPool::global();
+    int grain = max(1, count / (8 * (pool.threadCount() + 1)));
+
+    pool.parallelFor(count, grain, [&](int begin, int end) {
+        for (int b = begin; b < end; b++)
+        {
+            const Brick &brick = m_table[b];
+            int bx = b / (m_bricks[1] * m_bricks[2]), by = b / m_bricks[2] % m_bricks[1], bz = b % m_bricks[2];
+            int x1 = min((bx + 1) * BRICK_SIZE, m_dims[0]), y1 = min((by + 1) * BRICK_SIZE, m_dims[1]);
+            int z0 = bz * BRICK_SIZE, z1 = min(z0 + BRICK_SIZE, m_dims[2]);
+            const unsigned char *codes8 = m_codes.empty() ? 0 : &m_codes[0] + brick.offset;
+            const unsigned short *codes16 = (const unsigned short *)codes8;
+            for (int x = bx * BRICK_SIZE; x < x1; x++)
+            {
+                for (int y = by * BRICK_SIZE; y < y1; y++)
+                {
+                    float *row = volume.row(x, y);
+                    if (brick.kind == CONSTANT)
+                    {
+                        fill(row + z0, row + z1, brick.base);
+                        continue;
+                    }
+                    int local = ((x - bx * BRICK_SIZE) * BRICK_SIZE + (y - by * BRICK_SIZE)) * BRICK_SIZE - z0;
+                    for (int z = z0; z < z1; z++)
+                    {
+                        unsigned code = m_bits == 8 ? codes8[local + z] : codes16[local + z];
+                        row[z] = brick.base + code * brick.step;
+                    }
+                }
+            }
+        }
+    });
+}
+
+/**
+  Decodes one brick into BRICK_VOXELS floats laid out like its codes, the padding included.
+  codes points at the brick's own codes and is not read for constant bricks.
+  */
+void BrickedVolume::expand(const Brick &brick, const unsigned char *codes, int bits, float *voxels)
+{
+    if (brick.kind == CONSTANT)
+    {
+        fill(voxels, voxels + BRICK_VOXELS, brick.base);
+    }
+    else if (bits == 8)
+    {
+        for (int v = 0; v < BRICK_VOXELS; v++)
+        {
+            voxels[v] = brick.base + codes[v] * brick.step;
+        }
+    }
+    else
+    {
+        const unsigned short *codes16 = (const unsigned short *)codes;
+        for (int v = 0; v < BRICK_VOXELS; v++)
+        {
+            voxels[v] = brick.base + codes16[v] * brick.step;
+        }
+    }
+}
+
+/**
+  Takes over a brick table and codes written out earlier, e.g. read from the volume cache.
+  Returns false, leaving the volume empty, if they don't fit the grid.
+  */
+bool BrickedVolume::assign(int sizeX, int sizeY, int sizeZ, int bits, std::vector<Brick> &table,
+                           std::vector<unsigned char> &codes)
+{
+    this->clear();
+    int bricks[3] = { (sizeX + BRICK_SIZE - 1) / BRICK_SIZE, (sizeY + BRICK_SIZE - 1) / BRICK_SIZE,
+                      (sizeZ + BRICK_SIZE - 1) / BRICK_SIZE };
+    size_t brickBytes = BRICK_VOXELS * (bits / 8);
+    if ((bits != 8 && bits != 16) || table.size() != (size_t)bricks[0] * bricks[1] * bricks[2])
+    {
+        return false;
+    }
+    int constant = 0;
+    for (size_t b = 0; b < table.size(); b++)
+    {
+        if (table[b].kind == CONSTANT)
+        {
+            constant++;
+        }
+        else if (table[b].kind != QUANTIZED || table[b].offset % brickBytes != 0
+                 || table[b].offset + brickBytes > codes.size())
+        {
+            return false;
+        }
+    }
+
+    m_dims[0] = sizeX;
+    m_dims[1] = sizeY;
+    m_dims[2] = sizeZ;
+    for (int a = 0; a < 3; a++)
+    {
+        m_bricks[a] = bricks[a];
+    }
+    m_bits = bits;
+    m_constantBricks = constant;
+    m_table.swap(table);
+    m_codes.swap(codes);
+    return true;
+}
@@ -0,0 +1,88 @@
+#ifndef BRICKEDVOLUME_H
+#define BRICKEDVOLUME_H
+
+#include <stddef.h>
+#include <vector>
+
+class CloudVolume;
+
+/**
+    A cloud volume compressed into BRICK_SIZE^3 bricks of 8 or 16 bit quantized densities.
+
+    Each brick is quantized over its own range, density = base + code * step, with codes
+    laid out like the voxels of the volume, x-major with z contiguous; bricks at the far edges
+    are padded. A voxel is drawn when its faded density, density * (1 - y / sizeY), is above
+    the threshold, as the renderers test it. A brick none of whose voxels are drawn, or all of
+    them and all the same to within half a step, is CONSTANT and stores only base, the mean of
+    its voxels, as long as that mean is drawn exactly where they are. Quantizing never moves a
+    voxel across the faded threshold either, so the same voxels are drawn as from the dense
+    volume.
+
+    The brick table and the codes are plain arrays that can be written out and read back as
+    they are, which the volume cache does. sample() decodes a single voxel; decode() expands
+    the whole volume on the thread pool.
+**/
+class BrickedVolume
+{
+
+public:
+    static const int BRICK_SIZE = 8;
+    static const int BRICK_SHIFT = 3;
+    static const int BRICK_VOXELS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+
+    enum Kind { CONSTANT, QUANTIZED };
+
+    struct Brick
+    {
+        float base;
+        float step; // 0 for constant bricks
+        unsigned offset; // bytes into the codes
+        unsigned kind;
+    };
+
+    BrickedVolume();
+
+    void encode(const CloudVolume &volume, float threshold, int bits);
+    void decode(CloudVolume &volume) const;
+    bool assign(int sizeX, int sizeY, int sizeZ, int bits, std::vector<Brick> &table, std::vector<unsigned char> &codes);
+    void clear();
+
+    static void expand(const Brick &brick, const unsigned char *codes, int bits, float *voxels);
+
+    float sample(int x, int y, int z) const
+    {
+        const Brick &brick = m_table[this->brickIndex(x >> BRICK_SHIFT, y >> BRICK_SHIFT, z >> BRICK_SHIFT)];
+        if (brick.kind == CONSTANT)
+        {
+            return brick.base;
+        }
+        int local = (((x & (BRICK_SIZE - 1)) << BRICK_SHIFT) + (y & (BRICK_SIZE - 1))) * BRICK_SIZE + (z & (BRICK_SIZE - 1));
+        unsigned code = m_bits == 8 ? m_codes[brick.offset + local]
+                : ((const unsigned short *)&m_codes[brick.offset])[local];
+        return brick.base + code * brick.step;
+    }
+
+    int sizeX() const { return m_dims[0]; }
+    int sizeY() const { return m_dims[1]; }
+    int sizeZ() const { return m_dims[2]; }
+    int bits() const { return m_bits; }
+    bool isEmpty() const { return m_table.empty(); }
+    int brickCount() const { return (int)m_table.size(); }
+    int constantBricks() const { return m_constantBricks; }
+    const std::vector<Brick> &table() const { return m_table; }
+    const std::vector<unsigned char> &codes() const { return m_codes; }
+    size_t bytes() const { return m_table.size() * sizeof(Brick) + m_codes.size(); }
+    double ratio() const; // dense float bytes per byte of this
+
+private:
+    size_t brickIndex(int bx, int by, int bz) const { return ((size_t)bx * m_bricks[1] + by) * m_bricks[2] + bz; }
+
+    int m_dims[3];
+    int m_bricks[3];
+    int m_bits;
+    int m_constantBricks;
+    std::vector<Brick> m_table; // x-major like the voxels
+    std::vector<unsigned char> m_codes;
+};
+
+#endif // BRICKEDVOLUME_H
@@ -0,0 +1,100 @@
+#include "camerapath.h"
+
+#include <QFile>
+#include <QStringList>
+#include <QTextStream>
+#include <math.h>
+
+CameraPath::CameraPath()
+{
+}
+
+/**
+  Reads keyframes written by save(). Returns false, keeping the current keyframes, if the file
+  can't be read or holds none.
+  */
+bool CameraPath::load(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+    {
+        qWarning("Camera path '%s' not found", qPrintable(path));
+        return false;
+    }
+
+    std::vector<Keyframe> keyframes;
+    QTextStream in(&file);
+    while (!in.atEnd())
+    {
+        QString line = in.readLine().trimmed();
+        if (line.isEmpty() || line.startsWith('#'))
+        {
+            continue;
+        }
+
+        QStringList values = line.split(' ', QString::SkipEmptyParts);
+        if (values.size() < 3)
+        {
+            qWarning("Skipping malformed camera path line '%s'", qPrintable(line));
+            continue;
+        }
+        Keyframe keyframe = { values[0].toFloat(), values[1].toFloat(), values[2].toFloat() };
+        keyframes.push_back(keyframe);
+    }
+
+    if (keyframes.empty())
+    {
+        qWarning("Camera path '%s' holds no keyframes", qPrintable(path));
+        return false;
+    }
+    m_keyframes.swap(keyframes);
+    return true;
+}
+
+bool CameraPath::save(const QString &path) const
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Truncate))
+    {
+        qWarning("Could not write camera path '%s'", qPrintable(path));
+        return false;
+    }
+
+    QTextStream out(&file);
+    out << "# theta phi zoom, one line per frame\n";
+    for (size_t k = 0; k < m_keyframes.size(); k++)
+    {
+        out << m_keyframes[k].theta << ' ' << m_keyframes[k].phi << ' ' << m_keyframes[k].zoom << '\n';
+    }
+    return true;
+}
+
+void CameraPath::record(const OrbitCamera &camera)
+{
+    Keyframe keyframe = { camera.theta, camera.phi, camera.zoom };
+    m_keyframes.push_back(keyframe);
+}
+
+/**
+  The camera for the given frame of a run of frames, starting from start (which also provides
+  the center, up vector and field of view)
+  */
+OrbitCamera CameraPath::at(const OrbitCamera &start, int frame, int frames) const
+{
+    OrbitCamera camera = start;
+    if (!m_keyframes.empty())
+    {
+        int size = (int)m_keyframes.size();
+        const Keyframe &keyframe = m_keyframes[(frame % size + size) % size];
+        camera.theta = keyframe.theta;
+        camera.phi = keyframe.phi;
+        camera.zoom = keyframe.zoom;
+        return camera;
+    }
+
+    float t = frames > 0 ? frame / (float)frames : 0;
+    camera.theta = fmodf(start.theta + t * M_2PI, M_2PI);
+    camera.phi = start.phi + 0.15f * sinf(2 * t * M_2PI);
+    camera.zoom = start.zoom * (1 + 0.25f * sinf(t * M_2PI));
+    return camera;
+}
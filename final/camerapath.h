@@ -0,0 +1,42 @@
+#ifndef CAMERAPATH_H
+#define CAMERAPATH_H
+
+#include <QString>
+#include <vector>
+#include "camera.h"
+
+/**
+    A reproducible sequence of orbit camera poses for benchmarking.
+
+    Without keyframes the path is parametric: one full turn around the start camera's center
+    over the given number of frames, bobbing up and down twice and zooming in and out once, so
+    every run looks towards and away from the sun. Keyframes recorded from an interactive
+    session (final --record-path flight.txt) replace it and are played one per frame, looping.
+
+    Path files hold one "theta phi zoom" line per frame; lines starting with # are ignored.
+**/
+class CameraPath
+{
+
+public:
+    CameraPath();
+
+    bool load(const QString &path);
+    bool save(const QString &path) const;
+
+    void record(const OrbitCamera &camera);
+    bool isRecorded() const { return !m_keyframes.empty(); }
+    int size() const { return (int)m_keyframes.size(); }
+
+    OrbitCamera at(const OrbitCamera &start, int frame, int frames) const;
+
+private:
+    struct Keyframe
+    {
+        float theta, phi, zoom;
+    };
+
+    std::vector<Keyframe> m_keyframes;
+};
+
+#endif // CAMERAPATH_H
@@ -0,0 +1,109 @@
+#include "cloudanimator.h"
+#include "cloudgenerator.h"
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+CloudAnimator::CloudAnimator(const CloudGenerator &generator)
+    : m_generator(generator), m_numPasses(1), m_numCubes(1), m_wind(0), m_voxelBudget(32768), m_phase(0),
+      m_frontPhase(0), m_backPhase(0), m_nextRow(0), m_steps(0), m_refreshes(0), m_lastRefreshFrames(0),
+      m_lastStepTime(0)
+{
+    m_dims[0] = m_dims[1] = m_dims[2] = 0;
+}
+
+/**
+  The grid and noise of the front volume, as it was generated at phase(); the refresh under way
+  starts over
+  */
+void CloudAnimator::setVolume(int dimX, int dimY, int dimZ, int numPasses, double numCubes)
+{
+    m_dims[0] = dimX;
+    m_dims[1] = dimY;
+    m_dims[2] = dimZ;
+    m_numPasses = numPasses;
+    m_numCubes = numCubes;
+    m_frontPhase = m_phase;
+    this->restart();
+}
+
+/**
+  How fast the first octave drifts, in its lattice cells per second
+  */
+void CloudAnimator::setWind(double cellsPerSecond)
+{
+    m_wind = cellsPerSecond;
+}
+
+/**
+  Most voxels a step() generates; at least one z row is always generated
+  */
+void CloudAnimator::setVoxelBudget(int voxels)
+{
+    m_voxelBudget = voxels;
+}
+
+void CloudAnimator::advance(double seconds)
+{
+    m_phase += m_wind * seconds;
+}
+
+int CloudAnimator::rowsPerStep() const
+{
+    return max(1, m_voxelBudget / max(1, m_dims[2]));
+}
+
+int CloudAnimator::framesPerRefresh() const
+{
+    int rows = m_dims[0] * m_dims[1];
+    return (rows + this->rowsPerStep() - 1) / this->rowsPerStep();
+}
+
+float CloudAnimator::progress() const
+{
+    int rows = m_dims[0] * m_dims[1];
+    return rows > 0 ? (float)m_nextRow / rows : 0.0f;
+}
+
+void CloudAnimator::restart()
+{
+    m_backPhase = m_phase;
+    m_nextRow = 0;
+    m_steps = 0;
+}
+
+/**
+  Generates the next rows of the back buffer. Returns true when that completed a refresh and
+  front now holds it; front's previous storage becomes the next back buffer.
+  */
+bool CloudAnimator::step(CloudVolume &front)
+{
+    int rows = m_dims[0] * m_dims[1];
+    if (!this->isRunning() || rows == 0)
+    {
+        return false;
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if (m_nextRow == 0)
+    {
+        m_back.resize(m_dims[0], m_dims[1], m_dims[2]);
+    }
+    int end = min(rows, m_nextRow + this->rowsPerStep());
+    m_generator.calcRows(m_back, m_nextRow, end, m_numPasses, m_numCubes, m_backPhase);
+    m_nextRow = end;
+    m_steps++;
+
+    bool swapped = m_nextRow == rows;
+    if (swapped)
+    {
+        front.swap(m_back);
+        m_frontPhase = m_backPhase;
+        m_lastRefreshFrames = m_steps;
+        m_refreshes++;
+        this->restart();
+    }
+    m_lastStepTime = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    return swapped;
+}
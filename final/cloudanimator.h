@@ -0,0 +1,64 @@
+#ifndef CLOUDANIMATOR_H
+#define CLOUDANIMATOR_H
+
+#include "cloudvolume.h"
+
+class CloudGenerator;
+
+/**
+    Keeps a cloud volume evolving: the noise drifts with the wind (see
+    CloudGenerator::setupOctaves) and the volume is regenerated a slice of rows at a time.
+
+    Each step() fills at most the voxel budget's worth of z rows of a back buffer, on the thread
+    pool, all for the phase the refresh started at. When the last row is written the back buffer
+    is swapped with the front volume and the next refresh starts at the current phase, so the
+    volume on screen is always a whole one and a frame never pays for more than its budget.
+    A refresh takes framesPerRefresh() steps.
+
+    A wind of 0 stops the animation; the front volume then stays as it is.
+**/
+class CloudAnimator
+{
+
+public:
+    CloudAnimator(const CloudGenerator &generator);
+
+    void setVolume(int dimX, int dimY, int dimZ, int numPasses, double numCubes);
+    void setWind(double cellsPerSecond);
+    void setVoxelBudget(int voxels);
+    bool isRunning() const { return m_wind > 0; }
+
+    void advance(double seconds);
+    bool step(CloudVolume &front);
+
+    double phase() const { return m_phase; } // lattice cells of the first octave travelled
+    double frontPhase() const { return m_frontPhase; } // of the front volume
+    int framesPerRefresh() const;
+    int refreshes() const { return m_refreshes; }
+    int lastRefreshFrames() const { return m_lastRefreshFrames; } // steps the last swap took
+    double lastStepTime() const { return m_lastStepTime; } // milliseconds
+    float progress() const; // of the refresh under way, 0 to 1
+
+private:
+    int rowsPerStep() const;
+    void restart();
+
+    const CloudGenerator &m_generator;
+    CloudVolume m_back;
+    int m_dims[3];
+    int m_numPasses;
+    double m_numCubes;
+    double m_wind;
+    int m_voxelBudget;
+
+    double m_phase;
+    double m_frontPhase;
+    double m_backPhase; // the refresh under way generates this phase
+    int m_nextRow; // of the back buffer
+    int m_steps; // taken by the refresh under way
+    int m_refreshes;
+    int m_lastRefreshFrames;
+    double m_lastStepTime;
+};
+
+#endif // CLOUDANIMATOR_H
@@ -1,4 +1,5 @@
 #include "cloudgenerator.h"
+#include "threadpool.h"
 #include <qgl.h>
 #include <math.h>
 #include <iostream>
@@ -9,134 +10,139 @@ using namespace std;
 
 CloudGenerator::CloudGenerator()
 {
+    //weigh each pass depending on the number of cubes it used for its grid
+    for (int q=0; q<NoiseKernel::MAX_OCTAVES; q++)
+    {
+        m_weights[q] = (float)(1./pow(2, q));
+    }
+#ifndef QT_NO_DEBUG
+    // the simd paths must agree with the scalar float reference
+    Q_ASSERT(NoiseKernel::verify(m_kernel.isa()) <= NoiseKernel::TOLERANCE);
+#endif
 }
 
 CloudGenerator::~CloudGenerator()
 {
-    for (int x=0; x<m_dimX; x++)
-    {
-        for (int y=0; y<m_dimY; y++)
-        {
-            delete[] m_intensity[x][y];
-        }
+}
 
-        delete[] m_intensity[x];
-    }
-    delete m_intensity;
+/**
+  Fills volume with numPasses octaves of accumulated perlin noise, the first spanning numCubes
+  lattice cells. The volume's storage is reused when it is already large enough for the
+  requested grid. phase moves the clouds along, see setupOctaves().
+
+  The grid is cut into slabs of consecutive (x, y) rows which are spread over the thread pool;
+  each row is written by exactly one task and all octaves are summed per voxel in one pass,
+  so the result does not depend on the number of threads.
+  */
+void CloudGenerator::calcIntensity(CloudVolume &volume, int dimX, int dimY, int dimZ, int numPasses, double numCubes,
+                                   double phase)
+{
+    volume.resize(dimX, dimY, dimZ);
+    calcRows(volume, 0, dimX*dimY, numPasses, numCubes, phase);
 }
 
-double*** CloudGenerator::calcIntensity(int dimX, int dimY, int dimZ)
+/**
+  Fills rows [begin, end) of a volume already sized, row r being the z row at x = r / dimY,
+  y = r % dimY, exactly as calcIntensity would
+  */
+void CloudGenerator::calcRows(CloudVolume &volume, int begin, int end, int numPasses, double numCubes, double phase) const
 {
-    m_dimX = dimX;
-    m_dimY = dimY;
-    m_dimZ = dimZ;
+    NoiseOctave octaves[NoiseKernel::MAX_OCTAVES];
+    numPasses = setupOctaves(octaves, volume.sizeX(), volume.sizeY(), volume.sizeZ(), numPasses, numCubes, phase);
 
-    //makes the 3d array structure
-    m_intensity = new double**[dimX];
-    for (int x=0; x<dimX; x++)
-    {
-        m_intensity[x] = new double*[dimY];
+    //aim for several slabs per thread so stealing can even out the load
+    ThreadPool &pool = ThreadPool::global();
+    int dimY = volume.sizeY();
+    int dimZ = volume.sizeZ();
+    int slab = max(1, (end - begin)/(8*(pool.threadCount()+1)));
 
-        for (int y=0; y<dimY; y++)
+    pool.parallelFor(end - begin, slab, [&](int first, int last) {
+        for (int r=begin+first; r<begin+last; r++)
         {
-            m_intensity[x][y] = new double[dimZ];
+            int i = r/dimY;
+            int j = r%dimY;
+            m_kernel.fillRow(volume.row(i, j), dimZ, i, j, octaves, numPasses);
         }
-    }
+    });
+}
 
-    double numCubes = 4; //affects the size of the cube
-    int numPasses = 4; //number of passes we make (how many perlin functions we accumulate)
-
-    //our psuedo-random number array used for perlin generation
-    int randomNums[512] = {151,160,137,91,90,15,
-                    131,13,201,95,96,53,194,233,7,225,140,36,103,30,69,142,8,99,37,240,21,10,23,
-                    190, 6,148,247,120,234,75,0,26,197,62,94,252,219,203,117,35,11,32,57,177,33,
-                    88,237,149,56,87,174,20,125,136,171,168, 68,175,74,165,71,134,139,48,27,166,
-                    77,146,158,231,83,111,229,122,60,211,133,230,220,105,92,41,55,46,245,40,244,
-                    102,143,54, 65,25,63,161, 1,216,80,73,209,76,132,187,208, 89,18,169,200,196,
-                    135,130,116,188,159,86,164,100,109,198,173,186, 3,64,52,217,226,250,124,123,
-                    5,202,38,147,118,126,255,82,85,212,207,206,59,227,47,16,58,17,182,189,28,42,
-                    223,183,170,213,119,248,152, 2,44,154,163, 70,221,153,101,155,167, 43,172,9,
-                    129,22,39,253, 19,98,108,110,79,113,224,232,178,185, 112,104,218,246,97,228,
-                    251,34,242,193,238,210,144,12,191,179,162,241, 81,51,145,235,249,14,239,107,
-                    49,192,214, 31,181,199,106,157,184, 84,204,176,115,121,50,45,127, 4,150,254,
-                    138,236,205,93,222,114,67,29,24,72,243,141,128,195,78,66,215,61,156,180};
+/**
+  Fills slab, already sized, with the planes x0 to x0 + slab.sizeX() of a grid dimX wide and as
+  high and deep as the slab, exactly as calcIntensity would fill them. A grid too large to
+  hold can be generated one slab at a time.
+  */
+void CloudGenerator::calcSlab(CloudVolume &slab, int x0, int dimX, int numPasses, double numCubes, double phase) const
+{
+    NoiseOctave octaves[NoiseKernel::MAX_OCTAVES];
+    numPasses = setupOctaves(octaves, dimX, slab.sizeY(), slab.sizeZ(), numPasses, numCubes, phase);
 
-    for (int q=0; q<numPasses; q++)
-    {
-        for (int i=0; i<dimX; i++)
+    ThreadPool &pool = ThreadPool::global();
+    int rows = slab.sizeX()*slab.sizeY();
+    int dimY = slab.sizeY();
+    int dimZ = slab.sizeZ();
+    int grain = max(1, rows/(8*(pool.threadCount()+1)));
+
+    pool.parallelFor(rows, grain, [&](int begin, int end) {
+        for (int r=begin; r<end; r++)
         {
-            for (int j=0; j<dimY; j++)
-            {
-                for (int k=0; k<dimZ; k++)
-                {
-
-                    //gets unit cube coordinates for the cube our pixel is in
-                    int X = (int)(floor(j/(dimX/(numCubes*(pow(2, q))))))&255;
-                    int Y = (int)(floor(i/(dimY/(numCubes*(pow(2, q))))))&255;
-                    int Z = (int)(floor(k/(dimZ/(numCubes*(pow(2, q))))))&255;;
-
-                    //offset of the pixel we're looking at within its unit cube
-                    double x = (j/(dimX/(numCubes*(pow(2, q)))))-floor(j/(dimX/(numCubes*(pow(2, q)))));
-                    double y = (i/(dimY/(numCubes*(pow(2, q)))))-floor(i/(dimY/(numCubes*(pow(2, q)))));
-                    double z = (k/(dimZ/(numCubes*(pow(2, q)))))-floor(k/(dimZ/(numCubes*(pow(2, q)))));
-
-                    double u = ((x)*(x)*(x)*((x)*((x)*6.-15.)+10.));
-                    double v = ((y)*(y)*(y)*((y)*((y)*6.-15.)+10.));
-                    double w = ((z)*(z)*(z)*((z)*((z)*6.-15.)+10.));
-
-                    //makes "random" vectors for each of the corners
-                    int A = randomNums[X]+Y;
-                    int B = randomNums[X+1]+Y;
-                    int AA = randomNums[A]+Z;
-                    int AB = randomNums[A+1]+Z;
-                    int BA = randomNums[B]+Z;
-                    int BB = randomNums[B+1]+Z;
-
-                    double color = lerp(w, lerp(v, lerp(u, grad(randomNums[AA], x  , y  , z   ),
-                                                        grad(randomNums[BA], x-1, y  , z   )),
-                                                lerp(u, grad(randomNums[AB], x  , y-1, z   ),
-                                                        grad(randomNums[BB], x-1, y-1, z   ))),
-                                        lerp(v, lerp(u, grad(randomNums[AA+1], x  , y  , z-1 ),
-                                                        grad(randomNums[BA+1], x-1, y  , z-1 )),
-                                                lerp(u, grad(randomNums[AB+1], x  , y-1, z-1 ),
-                                                        grad(randomNums[BB+1], x-1, y-1, z-1 ))));
-
-                    if (q == 0) {
-                        //first pass
-                        m_intensity[i][j][k] = (double)(min(1., max(0., color)));
-                    }
-                    else {
-                        //weigh each pass depending on the number of cubes it used for its grid
-                        m_intensity[i][j][k] += (double)((min(1., max(0., color)))/(pow(2, q)));
-                    }
-                    if (q==numPasses-1) {
-                        //cap intensities at 1
-                        m_intensity[i][j][k] = (min(1., max(0., m_intensity[i][j][k])));
-                    }
-                }
-            }
+            m_kernel.fillRow(slab.row(r/dimY, r%dimY), dimZ, x0 + r/dimY, r%dimY, octaves, numPasses);
         }
-    }
-
-    return m_intensity;
+    });
 }
 
 /**
-  Linear interpolation
+  Fills the whole layer with the clamped noise of a single octave, ignoring its weight, as one
+  term of the sum calcIntensity would write for a layer-sized grid
   */
-double CloudGenerator::lerp(double t, double a, double b)
+void CloudGenerator::calcOctave(CloudVolume &layer, const NoiseOctave &octave) const
 {
-    return max(0., a+(t*(b-a)));
+    NoiseOctave single = octave;
+    single.weight = 1;
+
+    ThreadPool &pool = ThreadPool::global();
+    int rows = layer.sizeX()*layer.sizeY();
+    int dimY = layer.sizeY();
+    int dimZ = layer.sizeZ();
+    int slab = max(1, rows/(8*(pool.threadCount()+1)));
+
+    pool.parallelFor(rows, slab, [&](int begin, int end) {
+        for (int r=begin; r<end; r++)
+        {
+            m_kernel.fillRow(layer.row(r/dimY, r%dimY), dimZ, r/dimY, r%dimY, &single, 1);
+        }
+    });
 }
 
 /**
-  Gradient
+  Changes how much a pass adds to the sum, 1/2^octave unless set
   */
-double CloudGenerator::grad(int hash, double x, double y, double z)
+void CloudGenerator::setWeight(int octave, float weight)
 {
-    int h = hash & 15;
-    double u = (h < 8) ? x : y;
-    double v = (h < 4) ? y : (h == 12||h == 14) ? x : z;
+    m_weights[octave] = weight;
+}
 
-    return (((h & 1) == 0 ? u : -u) + (((h & 2) == 0 ? v: -v)));
+/**
+  Frequencies and weights of the octaves for a dimX x dimY x dimZ grid. phase, in lattice cells of the
+  first octave, drifts the octaves at different speeds: octave q moves (1 + q/4) times as fast
+  as the first along x and rises or sinks a quarter as fast, so the clouds change shape as
+  they go instead of only sliding. Returns the number of octaves used.
+  */
+int CloudGenerator::setupOctaves(NoiseOctave *octaves, int dimX, int dimY, int dimZ, int numPasses, double numCubes,
+                                 double phase) const
+{
+    numPasses = min(numPasses, (int)NoiseKernel::MAX_OCTAVES);
+    for (int q=0; q<numPasses; q++)
+    {
+        //number of lattice cells crossed per voxel; pass q uses a grid 2^q times finer
+        octaves[q].freqX = (float)(numCubes*pow(2, q)/dimX);
+        octaves[q].freqY = (float)(numCubes*pow(2, q)/dimY);
+        octaves[q].freqZ = (float)(numCubes*pow(2, q)/dimZ);
+        octaves[q].weight = m_weights[q];
+
+        //the lattice repeats every 256 cells, which keeps the offsets small
+        double cells = phase*pow(2, q);
+        octaves[q].offsetY = (float)fmod(cells*(1 + 0.25*q), 256.);
+        octaves[q].offsetX = (float)fmod(cells*0.25*(q % 2 ? -1 : 1), 256.);
+    }
+    return numPasses;
 }
@@ -1,23 +1,32 @@
 #ifndef CLOUDGENERATOR_H
 #define CLOUDGENERATOR_H
 
+#include "cloudvolume.h"
+#include "noisekernel.h"
+
 class CloudGenerator
 {
 
 public:
+    static const int VERSION = 2; // raised whenever the same parameters come to give different clouds
+
     CloudGenerator();
     ~CloudGenerator();
-    double*** calcIntensity(int dimX, int dimY, int dimZ);
-    double lerp(double t, double a, double b);
-    double grad(int hash, double x, double y, double z);
+    void calcIntensity(CloudVolume &volume, int dimX, int dimY, int dimZ, int numPasses = 4, double numCubes = 4,
+                       double phase = 0);
+    void calcRows(CloudVolume &volume, int begin, int end, int numPasses, double numCubes, double phase) const;
+    void calcSlab(CloudVolume &slab, int x0, int dimX, int numPasses, double numCubes, double phase = 0) const;
+    void calcOctave(CloudVolume &layer, const NoiseOctave &octave) const;
+    int setupOctaves(NoiseOctave *octaves, int dimX, int dimY, int dimZ, int numPasses, double numCubes,
+                     double phase) const;
+
+    void setWeight(int octave, float weight);
+    float weight(int octave) const { return m_weights[octave]; }
+    const NoiseKernel &kernel() const { return m_kernel; }
 private:
-    double*** m_intensity;
-    int m_dimX;
-    int m_dimY;
-    int m_dimZ;
+    NoiseKernel m_kernel;
+    float m_weights[NoiseKernel::MAX_OCTAVES]; // of each pass in the sum
 
 };
 
 #endif // CLOUDGENERATOR_H
-
-
@@ -0,0 +1,568 @@
+#include "cloudparticles.h"
+#include "cloudvolume.h"
+#include "lightvolume.h"
+#include "noisekernel.h"
+#include "threadpool.h"
+#include <math.h>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PARTICLES_X86
+#include <immintrin.h>
+#endif
+
+#define RELIGHT_CHUNK 4096 //particles per thread pool task
+
+/**
+  Arrays and sun setup shared by the relight kernels
+  */
+struct RelightParams
+{
+    const float *x;
+    const float *y;
+    const float *z;
+    const float *density;
+    float *light;
+    Vector3 sun;
+    Vector3 lightVector;
+};
+
+/**
+  Lighting factor of one particle: the cosine between the sun's direction and the ray from the
+  sun to the particle, mapped to [0, 1], subtracted from 1.8 and scaled by the density. The
+  vector kernels below perform the same float operations in the same order.
+  */
+static inline float lightFactor(const RelightParams &params, int p)
+{
+    float dx = params.x[p] - params.sun.x;
+    float dy = params.y[p] - params.sun.y;
+    float dz = params.z[p] - params.sun.z;
+    float length = sqrtf(dx * dx + dy * dy + dz * dz);
+    float cosine = params.lightVector.x * (dx / length) + params.lightVector.y * (dy / length)
+            + params.lightVector.z * (dz / length);
+    float particleSunAngle = cosine * 0.5f + 0.5f;
+    return (1.8f - particleSunAngle) * params.density[p];
+}
+
+#ifdef PARTICLES_X86
+static inline int relightSse(const RelightParams &params, int begin, int end)
+{
+    __m128 sunX = _mm_set1_ps(params.sun.x), sunY = _mm_set1_ps(params.sun.y), sunZ = _mm_set1_ps(params.sun.z);
+    __m128 lightX = _mm_set1_ps(params.lightVector.x), lightY = _mm_set1_ps(params.lightVector.y);
+    __m128 lightZ = _mm_set1_ps(params.lightVector.z);
+    __m128 half = _mm_set1_ps(0.5f), brightest = _mm_set1_ps(1.8f);
+
+    int p = begin;
+    for (; p + 4 <= end; p += 4)
+    {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(params.x + p), sunX);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(params.y + p), sunY);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(params.z + p), sunZ);
+        __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+        __m128 cosine = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lightX, _mm_div_ps(dx, length)),
+                                              _mm_mul_ps(lightY, _mm_div_ps(dy, length))),
+                                   _mm_mul_ps(lightZ, _mm_div_ps(dz, length)));
+        __m128 angle = _mm_add_ps(_mm_mul_ps(cosine, half), half);
+        _mm_storeu_ps(params.light + p, _mm_mul_ps(_mm_sub_ps(brightest, angle), _mm_loadu_ps(params.density + p)));
+    }
+    return p;
+}
+
+__attribute__((target("avx2")))
+static int relightAvx2(const RelightParams &params, int begin, int end)
+{
+    __m256 sunX = _mm256_set1_ps(params.sun.x), sunY = _mm256_set1_ps(params.sun.y), sunZ = _mm256_set1_ps(params.sun.z);
+    __m256 lightX = _mm256_set1_ps(params.lightVector.x), lightY = _mm256_set1_ps(params.lightVector.y);
+    __m256 lightZ = _mm256_set1_ps(params.lightVector.z);
+    __m256 half = _mm256_set1_ps(0.5f), brightest = _mm256_set1_ps(1.8f);
+
+    int p = begin;
+    for (; p + 8 <= end; p += 8)
+    {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(params.x + p), sunX);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(params.y + p), sunY);
+        __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(params.z + p), sunZ);
+        __m256 length = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
+                                                     _mm256_mul_ps(dz, dz)));
+        __m256 cosine = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lightX, _mm256_div_ps(dx, length)),
+                                                    _mm256_mul_ps(lightY, _mm256_div_ps(dy, length))),
+                                      _mm256_mul_ps(lightZ, _mm256_div_ps(dz, length)));
+        __m256 angle = _mm256_add_ps(_mm256_mul_ps(cosine, half), half);
+        _mm256_storeu_ps(params.light + p, _mm256_mul_ps(_mm256_sub_ps(brightest, angle), _mm256_loadu_ps(params.density + p)));
+    }
+    return p;
+}
+#endif
+
+/**
+  Fills params.light for particles [begin, end), widest kernel first and scalar for the tail
+  */
+static void relightRange(const RelightParams &params, int begin, int end, bool wide)
+{
+    int p = begin;
+#ifdef PARTICLES_X86
+    if (wide)
+    {
+        p = relightAvx2(params, p, end);
+    }
+    p = relightSse(params, p, end);
+#else
+    (void) wide;
+#endif
+    for (; p < end; p++)
+    {
+        params.light[p] = lightFactor(params, p);
+    }
+}
+
+CloudParticles::CloudParticles()
+    : m_spacing(0), m_threshold(0), m_nextBrick(0), m_complete(false)
+{
+    m_dims[0] = m_dims[1] = m_dims[2] = 0;
+}
+
+/**
+  Collects every voxel whose density, faded out towards the top of the volume, exceeds
+  threshold. Voxel (i, j, k) sits at origin + spacing * (i, j, k).
+  */
+void CloudParticles::build(const CloudVolume &volume, const Vector3 &origin, float spacing, float threshold)
+{
+    this->start(volume, origin, spacing, threshold);
+    this->extract(volume, 0);
+}
+
+/**
+  Drops the particles and lays out the bricks of volume for extract(), which must then be
+  given the same, unchanged volume until it completes
+  */
+void CloudParticles::start(const CloudVolume &volume, const Vector3 &origin, float spacing, float threshold)
+{
+    clear();
+    m_threshold = threshold;
+    m_dims[0] = volume.sizeX();
+    m_dims[1] = volume.sizeY();
+    m_dims[2] = volume.sizeZ();
+
+    //the grid positions bound every particle
+    m_spacing = spacing;
+    m_boundsMin = origin;
+    m_boundsMax = origin + Vector3(m_dims[0] - 1, m_dims[1] - 1, m_dims[2] - 1) * spacing;
+
+    int low[3] = { 0, 0, 0 };
+    if (m_dims[0] > 0 && m_dims[1] > 0 && m_dims[2] > 0)
+    {
+        this->planNode(low, m_dims);
+    }
+}
+
+/**
+  Extracts the next bricks, at most maxVoxels voxels of them if that is above 0 but at least
+  one brick, on the thread pool. Returns true once every brick is done and the tree is built.
+  */
+bool CloudParticles::extract(const CloudVolume &volume, int maxVoxels)
+{
+    int bricks = (int)m_plan.size();
+    if (m_complete)
+    {
+        return true;
+    }
+
+    if (m_nextBrick < bricks)
+    {
+        int begin = m_nextBrick, end = begin;
+        long long voxels = 0;
+        while (end < bricks)
+        {
+            const Brick &brick = m_plan[end];
+            voxels += (long long)(brick.high[0] - brick.low[0]) * (brick.high[1] - brick.low[1]) * (brick.high[2] - brick.low[2]);
+            if (end > begin && maxVoxels > 0 && voxels > maxVoxels)
+            {
+                break;
+            }
+            end++;
+        }
+
+        //count each brick's particles, place the bricks one after the other, then fill them in
+        ThreadPool &pool = ThreadPool::global();
+        int grain = std::max(1, (end - begin) / (8 * (pool.threadCount() + 1)));
+        pool.parallelFor(end - begin, grain, [&](int first, int last)
+        {
+            for (int b = begin + first; b < begin + last; b++)
+            {
+                m_plan[b].count = this->scanBrick(volume, m_plan[b], false);
+            }
+        });
+        int count = size();
+        for (int b = begin; b < end; b++)
+        {
+            m_plan[b].first = count;
+            count += m_plan[b].count;
+        }
+        m_x.resize(count);
+        m_y.resize(count);
+        m_z.resize(count);
+        m_density.resize(count);
+        pool.parallelFor(end - begin, grain, [&](int first, int last)
+        {
+            for (int b = begin + first; b < begin + last; b++)
+            {
+                this->scanBrick(volume, m_plan[b], true);
+            }
+        });
+
+        m_nextBrick = end;
+        if (end < bricks)
+        {
+            return false;
+        }
+    }
+
+    //every brick is in, so the tree over them can be put together
+    if (bricks > 0)
+    {
+        int low[3] = { 0, 0, 0 };
+        int brick = 0;
+        this->assembleNode(low, m_dims, brick);
+    }
+    m_light.assign(size(), 0.0f);
+    m_shade.assign(size(), UNSHADED);
+    m_complete = true;
+    return true;
+}
+
+/**
+  Splits each axis of voxels [low, high) longer than a brick about halfway, rounded up to a
+  brick boundary. Returns whether the block is a single brick.
+  */
+bool CloudParticles::split(const int *low, const int *high, int *middle)
+{
+    bool leaf = true;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        int half = ((high[axis] - low[axis] + 1) / 2 + BRICK_SIZE - 1) / BRICK_SIZE * BRICK_SIZE;
+        middle[axis] = std::min(low[axis] + half, high[axis]);
+        leaf = leaf && middle[axis] == high[axis];
+    }
+    return leaf;
+}
+
+/**
+  Appends the bricks of voxels [low, high) to the plan, in the order the octree visits them
+  */
+void CloudParticles::planNode(const int *low, const int *high)
+{
+    int middle[3];
+    if (split(low, high, middle))
+    {
+        Brick brick;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            brick.low[axis] = low[axis];
+            brick.high[axis] = high[axis];
+        }
+        brick.first = brick.count = 0;
+        m_plan.push_back(brick);
+        return;
+    }
+
+    for (int octant = 0; octant < 8; octant++)
+    {
+        int childLow[3], childHigh[3];
+        bool empty = false;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            bool upper = (octant >> axis) & 1;
+            childLow[axis] = upper ? middle[axis] : low[axis];
+            childHigh[axis] = upper ? high[axis] : middle[axis];
+            empty = empty || childLow[axis] == childHigh[axis];
+        }
+        if (!empty)
+        {
+            this->planNode(childLow, childHigh);
+        }
+    }
+}
+
+/**
+  Counts the voxels of brick above the threshold, and stores them as particles from index
+  brick.first on when store is set
+  */
+int CloudParticles::scanBrick(const CloudVolume &volume, const Brick &brick, bool store)
+{
+    int count = 0;
+    for (int i = brick.low[0]; i < brick.high[0]; i++)
+    {
+        for (int j = brick.low[1]; j < brick.high[1]; j++)
+        {
+            const float *row = volume.row(i, j);
+            float falloff = 1.0 - (j / ((float) m_dims[1]));
+
+            for (int k = brick.low[2]; k < brick.high[2]; k++)
+            {
+                //threshold on the intensity with vertical fall-off
+                if (row[k] * falloff <= m_threshold)
+                {
+                    continue;
+                }
+
+                if (store)
+                {
+                    int p = brick.first + count;
+                    m_x[p] = m_boundsMin.x + m_spacing * i;
+                    m_y[p] = m_boundsMin.y + m_spacing * j;
+                    m_z[p] = m_boundsMin.z + m_spacing * k;
+                    m_density[p] = row[k];
+                }
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+/**
+  Appends the node covering voxels [low, high) after its non-empty children, from the
+  extracted bricks starting at m_plan[brick]. Returns the node's index, or -1 when the block
+  holds no particles.
+  */
+int CloudParticles::assembleNode(const int *low, const int *high, int &brick)
+{
+    int index = (int)m_nodes.size();
+    m_nodes.push_back(Node());
+
+    int middle[3];
+    bool leaf = split(low, high, middle);
+    int childCount = 0;
+    int children[8];
+    int first = 0, count = 0;
+    if (leaf)
+    {
+        first = m_plan[brick].first;
+        count = m_plan[brick].count;
+        brick++;
+    }
+    else
+    {
+        for (int octant = 0; octant < 8; octant++)
+        {
+            int childLow[3], childHigh[3];
+            bool empty = false;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                bool upper = (octant >> axis) & 1;
+                childLow[axis] = upper ? middle[axis] : low[axis];
+                childHigh[axis] = upper ? high[axis] : middle[axis];
+                empty = empty || childLow[axis] == childHigh[axis];
+            }
+
+            int child = empty ? -1 : this->assembleNode(childLow, childHigh, brick);
+            if (child >= 0)
+            {
+                first = childCount ? first : m_nodes[child].first;
+                count += m_nodes[child].count;
+                children[childCount++] = child;
+            }
+        }
+    }
+
+    //empty children removed themselves, so this node is still the last one
+    if (count == 0)
+    {
+        m_nodes.pop_back();
+        return -1;
+    }
+
+    Node &node = m_nodes[index];
+    node.first = first;
+    node.count = count;
+    node.childCount = childCount;
+    node.bricks = leaf ? 1 : 0;
+    if (leaf)
+    {
+        node.min = m_boundsMin + Vector3(low[0], low[1], low[2]) * m_spacing;
+        node.max = m_boundsMin + Vector3(high[0] - 1, high[1] - 1, high[2] - 1) * m_spacing;
+    }
+    for (int c = 0; c < childCount; c++)
+    {
+        const Node &child = m_nodes[children[c]];
+        node.children[c] = children[c];
+        node.bricks += child.bricks;
+        node.min = c ? Vector3::min(node.min, child.min) : child.min;
+        node.max = c ? Vector3::max(node.max, child.max) : child.max;
+    }
+    return index;
+}
+
+/**
+  Recomputes the lighting factor and shade of every particle for a sun at the given position,
+  in parallel chunks on the global thread pool. Nothing else about the particles changes.
+  */
+void CloudParticles::relight(const Vector3 &sun)
+{
+    //light vector indicates direction in which the suns rays are going
+    Vector3 lightVector = -sun;
+    lightVector.normalize();
+
+    RelightParams params;
+    params.x = m_x.data();
+    params.y = m_y.data();
+    params.z = m_z.data();
+    params.density = m_density.data();
+    params.light = m_light.data();
+    params.sun = sun;
+    params.lightVector = lightVector;
+
+    static const bool wide = NoiseKernel::detectIsa() == NoiseKernel::ISA_AVX2;
+
+    ThreadPool::global().parallelFor(size(), RELIGHT_CHUNK, [&](int begin, int end)
+    {
+        relightRange(params, begin, end, wide);
+        for (int p = begin; p < end; p++)
+        {
+            m_shade[p] = shadeLayer(m_light[p]);
+        }
+    });
+}
+
+/**
+  Takes the lighting factor of every particle from the transmittance of its voxel in light,
+  which must have been updated for the volume the particles were built from
+  */
+void CloudParticles::relight(const LightVolume &light)
+{
+    if (light.isEmpty())
+    {
+        return;
+    }
+
+    Vector3 origin = m_boundsMin;
+    float inverse = 1.0f / m_spacing;
+    ThreadPool::global().parallelFor(size(), RELIGHT_CHUNK, [&](int begin, int end)
+    {
+        for (int p = begin; p < end; p++)
+        {
+            int i = (int)floorf((m_x[p] - origin.x) * inverse + 0.5f);
+            int j = (int)floorf((m_y[p] - origin.y) * inverse + 0.5f);
+            int k = (int)floorf((m_z[p] - origin.z) * inverse + 0.5f);
+            m_light[p] = light.transmittance(i, j, k);
+            m_shade[p] = shadeLayer(m_light[p]);
+        }
+    });
+}
+
+void CloudParticles::clear()
+{
+    m_boundsMin = Vector3();
+    m_boundsMax = Vector3();
+    m_x.clear();
+    m_y.clear();
+    m_z.clear();
+    m_density.clear();
+    m_light.clear();
+    m_shade.clear();
+    m_nodes.clear();
+    m_plan.clear();
+    m_nextBrick = 0;
+    m_complete = false;
+    m_dims[0] = m_dims[1] = m_dims[2] = 0;
+}
+
+/**
+  Trades every particle, the tree and any extraction under way with other
+  */
+void CloudParticles::swap(CloudParticles &other)
+{
+    m_x.swap(other.m_x);
+    m_y.swap(other.m_y);
+    m_z.swap(other.m_z);
+    m_density.swap(other.m_density);
+    m_light.swap(other.m_light);
+    m_shade.swap(other.m_shade);
+    std::swap(m_spacing, other.m_spacing);
+    std::swap(m_boundsMin, other.m_boundsMin);
+    std::swap(m_boundsMax, other.m_boundsMax);
+    m_nodes.swap(other.m_nodes);
+    std::swap(m_threshold, other.m_threshold);
+    for (int a = 0; a < 3; a++)
+    {
+        std::swap(m_dims[a], other.m_dims[a]);
+    }
+    m_plan.swap(other.m_plan);
+    std::swap(m_nextBrick, other.m_nextBrick);
+    std::swap(m_complete, other.m_complete);
+}
+
+/**
+  Counting sort of count particle indices from sequence (e.g. back to front) by shade, so each
+  shade texture is bound once. Batch l covers order[batchStart[l]] up to order[batchStart[l + 1]],
+  with the unshaded particles in the last batch; batchStart needs SHADE_LAYERS + 2 entries. The
+  sort is stable.
+  */
+void CloudParticles::groupByShade(const int *sequence, int count, std::vector<int> &order, int *batchStart) const
+{
+    int counts[SHADE_LAYERS + 1] = { 0 };
+    for (int i = 0; i < count; i++)
+    {
+        int p = sequence[i];
+        counts[m_shade[p] == UNSHADED ? SHADE_LAYERS : m_shade[p]]++;
+    }
+
+    batchStart[0] = 0;
+    for (int l = 0; l <= SHADE_LAYERS; l++)
+    {
+        batchStart[l + 1] = batchStart[l] + counts[l];
+    }
+
+    int next[SHADE_LAYERS + 1];
+    for (int l = 0; l <= SHADE_LAYERS; l++)
+    {
+        next[l] = batchStart[l];
+    }
+    order.resize(count);
+    for (int i = 0; i < count; i++)
+    {
+        int p = sequence[i];
+        order[next[m_shade[p] == UNSHADED ? SHADE_LAYERS : m_shade[p]]++] = p;
+    }
+}
+
+/**
+  The shade texture for a lighting factor; a greater factor means a particle in more direct view
+  of the sun and a brighter texture.
+  */
+int CloudParticles::shadeLayer(double factor)
+{
+    if (factor >= 0.0 && factor <= 0.125)
+    {
+        return 7;
+    }
+    else if (factor > 0.125 && factor <= 0.18)
+    {
+        return 6;
+    }
+    else if (factor > 0.18 && factor <= 0.25)
+    {
+        return 5;
+    }
+    else if (factor > 0.25 && factor <= 0.31)
+    {
+        return 4;
+    }
+    else if (factor > 0.31 && factor <= 0.4)
+    {
+        return 3;
+    }
+    else if (factor > 0.4 && factor <= 0.5)
+    {
+        return 2;
+    }
+    else if (factor > 0.5 && factor <= 0.6)
+    {
+        return 1;
+    }
+    else if (factor > 0.6 && factor <= 1.0)
+    {
+        return 0;
+    }
+    return UNSHADED;
+}
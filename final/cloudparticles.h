@@ -0,0 +1,108 @@
+#ifndef CLOUDPARTICLES_H
+#define CLOUDPARTICLES_H
+
+#include <vector>
+#include "vector.h"
+
+#define PARTICLE_THRESHOLD 0.1f //minimum faded intensity for a voxel to be drawn
+
+class CloudVolume;
+class LightVolume;
+
+/**
+    The voxels of a cloud volume that are dense enough to be drawn, stored as parallel arrays
+    (structure of arrays) so render passes only walk the particles that survive the threshold.
+
+    Each particle keeps its world position, its raw density, the sun lighting factor and the
+    shade texture that factor picks (0 for particle_cloud1, the brightest, through
+    SHADE_LAYERS - 1, or UNSHADED when the factor falls outside every band). The factor is
+    either the original heuristic, from the angle to the sun and the density, or the fraction
+    of sunlight a LightVolume says reaches the particle's voxel through the cloud.
+
+    Extraction walks the volume as an octree over bricks of BRICK_SIZE^3 voxels and stores the
+    particles in that order, so every node of the tree covers one contiguous index range.
+    Empty bricks and subtrees get no node. The bricks are scanned on the thread pool, all at
+    once by build(), or a voxel budget's worth per extract() call after start(), so a volume
+    can be extracted over several frames into a second set that is swap()ped in once complete.
+    Either way the particles come out unlit; relight() them before drawing.
+**/
+class CloudParticles
+{
+
+public:
+    static const int SHADE_LAYERS = 8;
+    static const int UNSHADED = -1;
+    static const int BRICK_SIZE = 8; // voxels per brick edge
+
+    /** A node of the brick octree; bricks are the leaves **/
+    struct Node
+    {
+        Vector3 min, max; // bounds of the voxel positions below the node
+        int first, count; // range of particle indices
+        int bricks; // non-empty bricks below the node, 1 for a brick
+        int childCount; // 0 for a brick
+        int children[8];
+    };
+
+    CloudParticles();
+
+    void build(const CloudVolume &volume, const Vector3 &origin, float spacing, float threshold);
+    void start(const CloudVolume &volume, const Vector3 &origin, float spacing, float threshold);
+    bool extract(const CloudVolume &volume, int maxVoxels);
+    void swap(CloudParticles &other);
+    void relight(const Vector3 &sun);
+    void relight(const LightVolume &light);
+    void clear();
+    void groupByShade(const int *sequence, int count, std::vector<int> &order, int *batchStart) const;
+
+    static int shadeLayer(double factor);
+
+    int size() const { return (int)m_density.size(); }
+    bool isEmpty() const { return m_density.empty(); }
+    bool isComplete() const { return m_complete; } // every brick since start() is extracted
+
+    const float *x() const { return m_x.data(); }
+    const float *y() const { return m_y.data(); }
+    const float *z() const { return m_z.data(); }
+    const float *density() const { return m_density.data(); }
+    const float *light() const { return m_light.data(); }
+    const signed char *shade() const { return m_shade.data(); }
+
+    float spacing() const { return m_spacing; }
+    Vector3 boundsMin() const { return m_boundsMin; }
+    Vector3 boundsMax() const { return m_boundsMax; }
+
+    const std::vector<Node> &nodes() const { return m_nodes; } // root first, empty without particles
+
+private:
+    // a leaf of the octree and where its particles went
+    struct Brick
+    {
+        int low[3], high[3];
+        int first, count;
+    };
+
+    static bool split(const int *low, const int *high, int *middle);
+    void planNode(const int *low, const int *high);
+    int scanBrick(const CloudVolume &volume, const Brick &brick, bool store);
+    int assembleNode(const int *low, const int *high, int &brick);
+
+    std::vector<float> m_x;
+    std::vector<float> m_y;
+    std::vector<float> m_z;
+    std::vector<float> m_density;
+    std::vector<float> m_light;
+    std::vector<signed char> m_shade;
+    float m_spacing;
+    Vector3 m_boundsMin;
+    Vector3 m_boundsMax;
+    std::vector<Node> m_nodes;
+
+    float m_threshold;
+    int m_dims[3]; // of the volume being extracted
+    std::vector<Brick> m_plan; // every brick in octree order
+    int m_nextBrick; // of m_plan, the first one not extracted yet
+    bool m_complete; // m_nodes covers every brick of m_plan
+};
+
+#endif // CLOUDPARTICLES_H
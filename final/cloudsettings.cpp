@@ -0,0 +1,280 @@
+#include "cloudsettings.h"
+#include "noisekernel.h"
+#include <QDesktopServices>
+#include <QDir>
+#include <QFile>
+#include <QSettings>
+#include <QStringList>
+#include <QtGlobal>
+
+CloudSettings::CloudSettings()
+    : dimX(50), dimY(25), dimZ(50), octaves(4), cells(4), wind(0),
+      voxelBudget(32768), reducedLayers(true),
+      volumeCache(QDir(QDesktopServices::storageLocation(QDesktopServices::CacheLocation)).filePath("clouds.cvol")),
+      verifyCache(false), cacheBits(0), outOfCore(false),
+      streamFile(QDir(QDesktopServices::storageLocation(QDesktopServices::CacheLocation)).filePath("clouds.cbrk")),
+      windowX(256), windowY(128), windowZ(256), streamBudget(256), engine("billboards"), impostorDistance(400),
+      impostorAngle(5), impostorBudget(32), selfShadowing(true),
+      frameBudget(16.6),
+      occlusionScale(2),
+      godRayQuality("medium"), redrawOnDemand(true), vsync(true)
+{
+}
+
+/**
+  Quality tiers. Everything above medium uses power-of-two grids so the generator can take
+  its shift/mask fast path.
+  */
+bool CloudSettings::applyPreset(const QString &name)
+{
+    if (name == "low")
+    {
+        dimX = 32; dimY = 16; dimZ = 32; octaves = 3; cells = 4;
+    }
+    else if (name == "medium")
+    {
+        dimX = 50; dimY = 25; dimZ = 50; octaves = 4; cells = 4;
+    }
+    else if (name == "high")
+    {
+        dimX = 128; dimY = 64; dimZ = 128; octaves = 4; cells = 4;
+    }
+    else if (name == "ultra")
+    {
+        dimX = 256; dimY = 128; dimZ = 256; octaves = 5; cells = 4;
+    }
+    else
+    {
+        qWarning("Unknown quality preset '%s'", qPrintable(name));
+        return false;
+    }
+    return true;
+}
+
+bool CloudSettings::loadFile(const QString &path)
+{
+    if (!QFile::exists(path))
+    {
+        qWarning("Config file '%s' not found", qPrintable(path));
+        return false;
+    }
+
+    QSettings file(path, QSettings::IniFormat);
+    file.beginGroup("volume");
+    if (file.contains("quality"))
+    {
+        applyPreset(file.value("quality").toString());
+    }
+    dimX = file.value("dimX", dimX).toInt();
+    dimY = file.value("dimY", dimY).toInt();
+    dimZ = file.value("dimZ", dimZ).toInt();
+    octaves = file.value("octaves", octaves).toInt();
+    cells = file.value("cells", cells).toDouble();
+    wind = file.value("wind", wind).toDouble();
+    voxelBudget = file.value("voxelBudget", voxelBudget).toInt();
+    reducedLayers = file.value("reducedLayers", reducedLayers).toBool();
+    volumeCache = file.value("cache", volumeCache).toString();
+    verifyCache = file.value("verifyCache", verifyCache).toBool();
+    cacheBits = file.value("cacheBits", cacheBits).toInt();
+    outOfCore = file.value("outOfCore", outOfCore).toBool();
+    streamFile = file.value("streamFile", streamFile).toString();
+    windowX = file.value("windowX", windowX).toInt();
+    windowY = file.value("windowY", windowY).toInt();
+    windowZ = file.value("windowZ", windowZ).toInt();
+    streamBudget = file.value("streamBudget", streamBudget).toInt();
+    file.endGroup();
+
+    file.beginGroup("render");
+    engine = file.value("engine", engine).toString();
+    impostorDistance = file.value("impostorDistance", impostorDistance).toDouble();
+    impostorAngle = file.value("impostorAngle", impostorAngle).toDouble();
+    impostorBudget = file.value("impostorBudget", impostorBudget).toInt();
+    selfShadowing = file.value("selfShadowing", selfShadowing).toBool();
+    frameBudget = file.value("frameBudget", frameBudget).toDouble();
+    occlusionScale = file.value("occlusionScale", occlusionScale).toInt();
+    godRayQuality = file.value("godRayQuality", godRayQuality).toString();
+    redrawOnDemand = file.value("redraw", redrawOnDemand ? "on-demand" : "always").toString() != "always";
+    vsync = file.value("vsync", vsync).toBool();
+    file.endGroup();
+    return true;
+}
+
+/**
+  Clamps everything into a range the generator and renderer can handle
+  */
+void CloudSettings::sanitize()
+{
+    dimX = qBound(1, dimX, 4096);
+    dimY = qBound(1, dimY, 4096);
+    dimZ = qBound(1, dimZ, 4096);
+    octaves = qBound(1, octaves, (int)NoiseKernel::MAX_OCTAVES);
+    cells = qBound(1., cells, 256.);
+    wind = qBound(0., wind, 16.);
+    voxelBudget = qBound(1024, voxelBudget, 1 << 24);
+    impostorDistance = qMax(0., impostorDistance);
+    impostorAngle = qBound(0.1, impostorAngle, 90.);
+    impostorBudget = qBound(1, impostorBudget, 1024);
+    frameBudget = qBound(0., frameBudget, 1000.);
+    if (volumeCache == "off")
+    {
+        volumeCache.clear();
+    }
+    cacheBits = cacheBits >= 16 ? 16 : (cacheBits >= 8 ? 8 : 0);
+    if (!outOfCore && (qint64)dimX * dimY * dimZ * sizeof(float) > MAX_IN_CORE_BYTES)
+    {
+        qWarning("A %dx%dx%d volume doesn't fit in memory, streaming it from disk", dimX, dimY, dimZ);
+        outOfCore = true;
+    }
+    //never larger than the volume, even one under 8 voxels
+    windowX = qMin(dimX, qMax(8, windowX));
+    windowY = qMin(dimY, qMax(8, windowY));
+    windowZ = qMin(dimZ, qMax(8, windowZ));
+    //room for the window and as much again read ahead
+    int windowMegabytes = (int)((qint64)windowX * windowY * windowZ * sizeof(float) >> 20);
+    streamBudget = qBound(2 * windowMegabytes + 1, streamBudget, 65536);
+    occlusionScale = occlusionScale >= 4 ? 4 : (occlusionScale >= 2 ? 2 : 1);
+    if (engine != "billboards" && engine != "raymarch")
+    {
+        qWarning("Unknown cloud engine '%s'", qPrintable(engine));
+        engine = "billboards";
+    }
+}
+
+CloudSettings CloudSettings::fromArguments(const QStringList &arguments)
+{
+    CloudSettings settings;
+
+    int quality = arguments.indexOf("--quality");
+    if (quality >= 0 && quality + 1 < arguments.size())
+    {
+        settings.applyPreset(arguments[quality + 1]);
+    }
+
+    int config = arguments.indexOf("--config");
+    if (config >= 0 && config + 1 < arguments.size())
+    {
+        settings.loadFile(arguments[config + 1]);
+    }
+
+    for (int i = 1; i + 1 < arguments.size(); i++)
+    {
+        const QString &flag = arguments[i];
+        const QString &value = arguments[i + 1];
+
+        if (flag == "--dims")
+        {
+            QStringList dims = value.split('x');
+            if (dims.size() == 3)
+            {
+                settings.dimX = dims[0].toInt();
+                settings.dimY = dims[1].toInt();
+                settings.dimZ = dims[2].toInt();
+            }
+            else
+            {
+                qWarning("--dims expects XxYxZ, got '%s'", qPrintable(value));
+            }
+        }
+        else if (flag == "--octaves")
+        {
+            settings.octaves = value.toInt();
+        }
+        else if (flag == "--cells")
+        {
+            settings.cells = value.toDouble();
+        }
+        else if (flag == "--wind")
+        {
+            settings.wind = value.toDouble();
+        }
+        else if (flag == "--voxel-budget")
+        {
+            settings.voxelBudget = value.toInt();
+        }
+        else if (flag == "--reduced-layers")
+        {
+            settings.reducedLayers = value != "off";
+        }
+        else if (flag == "--volume-cache")
+        {
+            settings.volumeCache = value;
+        }
+        else if (flag == "--verify-cache")
+        {
+            settings.verifyCache = value != "off";
+        }
+        else if (flag == "--cache-bits")
+        {
+            settings.cacheBits = value.toInt();
+        }
+        else if (flag == "--out-of-core")
+        {
+            settings.outOfCore = value != "off";
+        }
+        else if (flag == "--stream-file")
+        {
+            settings.streamFile = value;
+        }
+        else if (flag == "--window")
+        {
+            QStringList window = value.split('x');
+            if (window.size() == 3)
+            {
+                settings.windowX = window[0].toInt();
+                settings.windowY = window[1].toInt();
+                settings.windowZ = window[2].toInt();
+            }
+            else
+            {
+                qWarning("--window expects XxYxZ, got '%s'", qPrintable(value));
+            }
+        }
+        else if (flag == "--stream-budget")
+        {
+            settings.streamBudget = value.toInt();
+        }
+        else if (flag == "--engine")
+        {
+            settings.engine = value;
+        }
+        else if (flag == "--impostor-distance")
+        {
+            settings.impostorDistance = value.toDouble();
+        }
+        else if (flag == "--impostor-angle")
+        {
+            settings.impostorAngle = value.toDouble();
+        }
+        else if (flag == "--impostor-budget")
+        {
+            settings.impostorBudget = value.toInt();
+        }
+        else if (flag == "--self-shadowing")
+        {
+            settings.selfShadowing = value != "off";
+        }
+        else if (flag == "--frame-budget")
+        {
+            settings.frameBudget = value.toDouble();
+        }
+        else if (flag == "--occlusion-scale")
+        {
+            settings.occlusionScale = value.toInt();
+        }
+        else if (flag == "--god-rays")
+        {
+            settings.godRayQuality = value;
+        }
+        else if (flag == "--redraw")
+        {
+            settings.redrawOnDemand = value != "always";
+        }
+        else if (flag == "--vsync")
+        {
+            settings.vsync = value != "off";
+        }
+    }
+
+    settings.sanitize();
+    return settings;
+}
@@ -0,0 +1,81 @@
+#ifndef CLOUDSETTINGS_H
+#define CLOUDSETTINGS_H
+
+#include <QString>
+#include <QtGlobal>
+
+class QStringList;
+
+/**
+    Size of the cloud volume and the noise that fills it, how the clouds are drawn, how finely
+    the god rays are rendered and when frames are redrawn.
+
+    The defaults are the original 50x25x50 grid with 4 octaves over 4 cells. A quality preset,
+    a config file and individual command line flags are applied on top, in that order:
+
+        final --quality high
+        final --config clouds.ini --octaves 5
+        final --dims 256x128x256 --cells 8
+        final --occlusion-scale 4 --god-rays high
+        final --redraw always --vsync off
+        final --engine raymarch
+        final --impostor-distance 600 --impostor-budget 64
+        final --frame-budget 33.3
+        final --self-shadowing off
+        final --wind 0.2 --voxel-budget 65536
+        final --reduced-layers off
+        final --volume-cache /tmp/clouds.cvol --verify-cache on
+        final --cache-bits 8
+        final --dims 2048x512x2048 --window 256x128x256 --stream-budget 512
+
+    Config files are ini files with the same keys under [volume] (quality, dimX, dimY, dimZ,
+    octaves, cells, wind, voxelBudget, reducedLayers, cache, verifyCache, cacheBits, outOfCore, streamFile,
+    windowX, windowY, windowZ, streamBudget) and [render] (engine, occlusionScale, godRayQuality,
+    redraw, vsync, impostorDistance, impostorAngle, impostorBudget, frameBudget, selfShadowing). A
+    cache path of "off" turns the volume cache off.
+
+    A volume larger than MAX_IN_CORE_BYTES as floats is always streamed from disk, see
+    StreamedVolume, and only a window of it is shown; --out-of-core on streams smaller ones too.
+**/
+struct CloudSettings
+{
+    static const qint64 MAX_IN_CORE_BYTES = 1024LL * 1024 * 1024;
+
+    int dimX;
+    int dimY;
+    int dimZ;
+    int octaves; // number of perlin passes accumulated
+    double cells; // lattice cells across the volume in the first pass
+    double wind; // first pass lattice cells the clouds drift per second, 0 (the default) keeps them still
+    int voxelBudget; // voxels regenerated per frame while the clouds drift
+    bool reducedLayers; // keep the low octaves below the volume's resolution
+    QString volumeCache; // .cvol file the startup volume is mapped from, empty for none
+    bool verifyCache; // check the cached voxels' checksum, which reads them all at startup
+    int cacheBits; // cache the volume as 8 or 16 bit bricks instead of mapped floats, 0 for floats
+    bool outOfCore; // generate the volume into bricks on disk and page in the window shown
+    QString streamFile; // .cbrk file the out of core volume lives in
+    int windowX; // voxels of an out of core volume shown at a time
+    int windowY;
+    int windowZ;
+    int streamBudget; // megabytes of decoded bricks an out of core volume keeps in memory
+    QString engine; // billboards (one particle per voxel) or raymarch (the volume as a 3d texture)
+    double impostorDistance; // billboards farther than this are drawn as cached impostors, 0 for never
+    double impostorAngle; // degrees the view of a cluster may turn before its impostor is redrawn
+    int impostorBudget; // megabytes of impostor textures
+    bool selfShadowing; // shade the particles by the sunlight reaching them, not the angle heuristic
+    double frameBudget; // GPU milliseconds per frame the render scale aims for, 0 for full resolution
+    int occlusionScale; // the god ray passes run at 1/occlusionScale of the window size: 1, 2 or 4
+    QString godRayQuality; // reference (the 100 tap shader), low, medium or high
+    bool redrawOnDemand; // only render when something changed, instead of on every tick
+    bool vsync; // pace buffer swaps to the display refresh
+
+    CloudSettings();
+
+    bool applyPreset(const QString &name);
+    bool loadFile(const QString &path);
+    void sanitize();
+
+    static CloudSettings fromArguments(const QStringList &arguments);
+};
+
+#endif // CLOUDSETTINGS_H
@@ -0,0 +1,131 @@
+#include "cloudvolume.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+
+CloudVolume::CloudVolume()
+    : m_data(0), m_capacity(0), m_strideX(0), m_strideY(0), m_sizeX(0), m_sizeY(0), m_sizeZ(0)
+{
+}
+
+CloudVolume::CloudVolume(int sizeX, int sizeY, int sizeZ)
+    : m_data(0), m_capacity(0), m_strideX(0), m_strideY(0), m_sizeX(0), m_sizeY(0), m_sizeZ(0)
+{
+    resize(sizeX, sizeY, sizeZ);
+}
+
+CloudVolume::CloudVolume(CloudVolume &&other)
+    : m_data(0), m_capacity(0), m_strideX(0), m_strideY(0), m_sizeX(0), m_sizeY(0), m_sizeZ(0)
+{
+    swap(other);
+}
+
+CloudVolume::~CloudVolume()
+{
+    release();
+}
+
+CloudVolume &CloudVolume::operator=(CloudVolume &&other)
+{
+    if (this != &other)
+    {
+        release();
+        swap(other);
+    }
+    return *this;
+}
+
+/**
+  Changes the grid dimensions. The contents are undefined afterwards; the buffer is only
+  reallocated when the new grid does not fit in the current allocation.
+  */
+void CloudVolume::resize(int sizeX, int sizeY, int sizeZ)
+{
+    size_t strideY = rowStride(sizeZ);
+    size_t strideX = strideY * sizeY;
+    size_t needed = strideX * sizeX;
+
+    if (needed > m_capacity)
+    {
+        release();
+
+        // allocate whole cache lines
+        size_t bytes = (needed * sizeof(float) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        void *memory = 0;
+        if (posix_memalign(&memory, ALIGNMENT, bytes) != 0)
+        {
+            throw std::bad_alloc();
+        }
+        m_data = (float *)memory;
+        m_capacity = bytes / sizeof(float);
+    }
+
+    m_sizeX = sizeX;
+    m_sizeY = sizeY;
+    m_sizeZ = sizeZ;
+    m_strideX = strideX;
+    m_strideY = strideY;
+}
+
+/**
+  Sets every voxel (including row padding) to value
+  */
+void CloudVolume::fill(float value)
+{
+    size_t count = m_strideX * m_sizeX;
+    if (value == 0.f)
+    {
+        memset(m_data, 0, count * sizeof(float));
+        return;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        m_data[i] = value;
+    }
+}
+
+/**
+  Frees the buffer and resets the volume to an empty grid
+  */
+void CloudVolume::release()
+{
+    if (m_deleter)
+    {
+        m_deleter();
+        m_deleter = std::function<void()>();
+    }
+    else
+    {
+        free(m_data);
+    }
+    m_data = 0;
+    m_capacity = 0;
+    m_strideX = m_strideY = 0;
+    m_sizeX = m_sizeY = m_sizeZ = 0;
+}
+
+/**
+  Takes over capacity floats at data, ALIGNMENT aligned and laid out as resize() would lay out
+  the grid, which must fit. deleter is called when the volume lets go of them.
+  */
+void CloudVolume::adopt(float *data, size_t capacity, int sizeX, int sizeY, int sizeZ, const std::function<void()> &deleter)
+{
+    release();
+    m_data = data;
+    m_capacity = capacity;
+    m_deleter = deleter;
+    resize(sizeX, sizeY, sizeZ);
+}
+
+void CloudVolume::swap(CloudVolume &other)
+{
+    std::swap(m_data, other.m_data);
+    std::swap(m_capacity, other.m_capacity);
+    std::swap(m_strideX, other.m_strideX);
+    std::swap(m_strideY, other.m_strideY);
+    std::swap(m_sizeX, other.m_sizeX);
+    std::swap(m_sizeY, other.m_sizeY);
+    std::swap(m_sizeZ, other.m_sizeZ);
+    std::swap(m_deleter, other.m_deleter);
+}
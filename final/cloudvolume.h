@@ -0,0 +1,73 @@
+#ifndef CLOUDVOLUME_H
+#define CLOUDVOLUME_H
+
+#include <stddef.h>
+#include <functional>
+
+/**
+    A dense 3d grid of cloud densities stored in a single 64-byte aligned float buffer.
+
+    Voxels are laid out x-major with z contiguous: (x, y, z) lives at
+    x * strideX() + y * strideY() + z. Each z row is padded to a multiple of
+    ROW_ALIGN floats so every row starts on a SIMD friendly boundary.
+
+    The volume owns its buffer and can only be moved, never copied. Calling
+    resize() with a grid that fits in the existing allocation reuses it.
+    adopt() takes over a buffer allocated elsewhere, e.g. a mapped file, along
+    with how to give it back.
+**/
+class CloudVolume
+{
+
+public:
+    static const int ALIGNMENT = 64; // alignment of the buffer in bytes
+    static const int ROW_ALIGN = 8;  // z rows are padded to a multiple of this many floats
+
+    CloudVolume();
+    CloudVolume(int sizeX, int sizeY, int sizeZ);
+    CloudVolume(CloudVolume &&other);
+    ~CloudVolume();
+
+    CloudVolume &operator=(CloudVolume &&other);
+
+    void resize(int sizeX, int sizeY, int sizeZ);
+    void fill(float value);
+    void release();
+    void adopt(float *data, size_t capacity, int sizeX, int sizeY, int sizeZ, const std::function<void()> &deleter);
+    void swap(CloudVolume &other);
+
+    int sizeX() const { return m_sizeX; }
+    int sizeY() const { return m_sizeY; }
+    int sizeZ() const { return m_sizeZ; }
+    size_t strideX() const { return m_strideX; }
+    size_t strideY() const { return m_strideY; }
+    size_t voxelCount() const { return (size_t)m_sizeX * m_sizeY * m_sizeZ; }
+    size_t bytes() const { return m_capacity * sizeof(float); }
+    static size_t rowStride(int sizeZ) { return ((size_t)sizeZ + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN; }
+    bool isEmpty() const { return m_data == 0 || voxelCount() == 0; }
+    bool isAdopted() const { return (bool)m_deleter; }
+
+    float *data() { return m_data; }
+    const float *data() const { return m_data; }
+
+    float *row(int x, int y) { return m_data + x * m_strideX + y * m_strideY; }
+    const float *row(int x, int y) const { return m_data + x * m_strideX + y * m_strideY; }
+
+    float &at(int x, int y, int z) { return row(x, y)[z]; }
+    float at(int x, int y, int z) const { return row(x, y)[z]; }
+
+private:
+    CloudVolume(const CloudVolume &) = delete;
+    CloudVolume &operator=(const CloudVolume &) = delete;
+
+    float *m_data;
+    size_t m_capacity; // allocated floats, may exceed strideX() * sizeX() after shrinking
+    size_t m_strideX;
+    size_t m_strideY;
+    int m_sizeX;
+    int m_sizeY;
+    int m_sizeZ;
+    std::function<void()> m_deleter; // releases an adopted buffer, empty for our own
+};
+
+#endif // CLOUDVOLUME_H
@@ -5,6 +5,8 @@
 
 QT += core gui opengl
 
+QMAKE_CXXFLAGS += -std=c++0x
+
 TARGET = final
 TEMPLATE = app
 
@@ -19,16 +21,68 @@ SOURCES += main.cpp \
     mainwindow.cpp \
     view.cpp \
     camera.cpp \
-    cloudgenerator.cpp
+    cloudgenerator.cpp \
+    cloudvolume.cpp \
+    noisekernel.cpp \
+    threadpool.cpp \
+    cloudsettings.cpp \
+    cloudparticles.cpp \
+    particlerenderer.cpp \
+    particlesorter.cpp \
+    particleculler.cpp \
+    framegraph.cpp \
+    radialblur.cpp \
+    gputimer.cpp \
+    camerapath.cpp \
+    benchmark.cpp \
+    frameprofiler.cpp \
+    volumerenderer.cpp \
+    impostorcache.cpp \
+    resolutionscaler.cpp \
+    lightvolume.cpp \
+    cloudanimator.cpp \
+    layeredvolume.cpp \
+    volumecache.cpp \
+    brickedvolume.cpp \
+    streamedvolume.cpp
 
 HEADERS += mainwindow.h \
     view.h \
     vector.h \
     camera.h \
-    cloudgenerator.h
+    cloudgenerator.h \
+    cloudvolume.h \
+    noisekernel.h \
+    threadpool.h \
+    cloudsettings.h \
+    cloudparticles.h \
+    particlerenderer.h \
+    particlesorter.h \
+    particleculler.h \
+    framegraph.h \
+    radialblur.h \
+    gputimer.h \
+    camerapath.h \
+    benchmark.h \
+    frameprofiler.h \
+    volumerenderer.h \
+    impostorcache.h \
+    resolutionscaler.h \
+    lightvolume.h \
+    cloudanimator.h \
+    layeredvolume.h \
+    volumecache.h \
+    brickedvolume.h \
+    streamedvolume.h
 
 FORMS += mainwindow.ui
 
 OTHER_FILES += \
     ../shaders/lightscatter.frag \
-    ../shaders/lightscatter.vert
+    ../shaders/lightscatter.vert \
+    ../shaders/particles.frag \
+    ../shaders/particles_batched.frag \
+    ../shaders/particles.vert \
+    ../shaders/radialblur.frag \
+    ../shaders/raymarch.frag \
+    ../shaders/raymarch.vert
@@ -0,0 +1,325 @@
+#include "framegraph.h"
+#include "frameprofiler.h"
+
+#include <QGLFramebufferObject>
+
+const char *const FrameGraph::SCREEN = "screen";
+
+FrameGraph::FrameGraph()
+    : m_livePasses(0), m_profiler(0), m_screenWidth(0), m_screenHeight(0)
+{
+}
+
+FrameGraph::~FrameGraph()
+{
+    clear();
+}
+
+/**
+  Deletes every framebuffer object; needs the context current
+  */
+void FrameGraph::clear()
+{
+    for (size_t f = 0; f < m_framebuffers.size(); f++)
+    {
+        delete m_framebuffers[f].object;
+    }
+    m_framebuffers.clear();
+}
+
+/**
+  Starts declaring a new frame for a window of the given size
+  */
+void FrameGraph::reset(int screenWidth, int screenHeight)
+{
+    m_targets.clear();
+    m_targetIndex.clear();
+    m_passes.clear();
+    m_livePasses = 0;
+    m_screenWidth = screenWidth;
+    m_screenHeight = screenHeight;
+}
+
+void FrameGraph::addTarget(const QString &name, const QSize &size, bool depth, const QSize &capacity)
+{
+    Target target;
+    target.name = name;
+    target.size = QSize(qMax(1, size.width()), qMax(1, size.height()));
+    target.capacity = target.size.expandedTo(capacity);
+    target.depth = depth;
+    target.framebuffer = -1;
+    target.firstUse = -1;
+    target.lastUse = -1;
+
+    m_targetIndex[name] = (int)m_targets.size();
+    m_targets.push_back(target);
+}
+
+/**
+  Declares a pass. reads and writes name targets added with addTarget, or SCREEN.
+  */
+void FrameGraph::addPass(const QString &name, const QStringList &reads, const QStringList &writes, const Execute &execute)
+{
+    Pass pass;
+    pass.name = name;
+    pass.reads = reads;
+    pass.writes = writes;
+    pass.execute = execute;
+    pass.live = false;
+    m_passes.push_back(pass);
+}
+
+/**
+  Culls, assigns framebuffer objects to the targets and runs the live passes in order. The
+  viewport is left at the window size.
+  */
+void FrameGraph::execute()
+{
+    cull();
+    releaseStale();
+    assign();
+
+    for (size_t p = 0; p < m_passes.size(); p++)
+    {
+        if (!m_passes[p].live)
+        {
+            continue;
+        }
+
+        if (m_profiler)
+        {
+            m_profiler->begin(m_passes[p].name);
+        }
+        m_passes[p].execute();
+        if (m_profiler)
+        {
+            m_profiler->end();
+        }
+    }
+    glViewport(0, 0, m_screenWidth, m_screenHeight);
+}
+
+/**
+  Marks the passes that contribute to the screen, walking back from the last pass
+  */
+void FrameGraph::cull()
+{
+    std::vector<bool> needed(m_targets.size(), false);
+    m_livePasses = 0;
+
+    for (int p = (int)m_passes.size() - 1; p >= 0; p--)
+    {
+        Pass &pass = m_passes[p];
+        pass.live = false;
+        for (int w = 0; w < pass.writes.size(); w++)
+        {
+            int index = m_targetIndex.value(pass.writes[w], -1);
+            pass.live = pass.live || pass.writes[w] == SCREEN || (index >= 0 && needed[index]);
+        }
+        if (!pass.live)
+        {
+            continue;
+        }
+
+        m_livePasses++;
+        for (int r = 0; r < pass.reads.size(); r++)
+        {
+            int index = m_targetIndex.value(pass.reads[r], -1);
+            if (index < 0)
+            {
+                qWarning("Pass '%s' reads undeclared target '%s'", qPrintable(pass.name), qPrintable(pass.reads[r]));
+                continue;
+            }
+            needed[index] = true;
+        }
+    }
+}
+
+/**
+  Deletes the framebuffer objects whose size class and depth no declared target has any more,
+  e.g. after a resize into another size class
+  */
+void FrameGraph::releaseStale()
+{
+    for (int f = (int)m_framebuffers.size() - 1; f >= 0; f--)
+    {
+        bool wanted = false;
+        for (size_t t = 0; t < m_targets.size() && !wanted; t++)
+        {
+            wanted = sizeClass(m_targets[t].capacity) == m_framebuffers[f].size && m_targets[t].depth == m_framebuffers[f].depth;
+        }
+        if (!wanted)
+        {
+            delete m_framebuffers[f].object;
+            m_framebuffers.erase(m_framebuffers.begin() + f);
+        }
+    }
+}
+
+/**
+  Gives every target used by a live pass a framebuffer object, reusing one whose previous
+  target is no longer used
+  */
+void FrameGraph::assign()
+{
+    for (size_t p = 0; p < m_passes.size(); p++)
+    {
+        if (!m_passes[p].live)
+        {
+            continue;
+        }
+        QStringList used = m_passes[p].reads + m_passes[p].writes;
+        for (int u = 0; u < used.size(); u++)
+        {
+            int index = m_targetIndex.value(used[u], -1);
+            if (index >= 0)
+            {
+                Target &target = m_targets[index];
+                target.firstUse = target.firstUse < 0 ? (int)p : target.firstUse;
+                target.lastUse = (int)p;
+            }
+        }
+    }
+
+    for (size_t f = 0; f < m_framebuffers.size(); f++)
+    {
+        m_framebuffers[f].busyUntil = -1;
+    }
+
+    for (size_t p = 0; p < m_passes.size(); p++)
+    {
+        for (size_t t = 0; t < m_targets.size(); t++)
+        {
+            Target &target = m_targets[t];
+            if (target.firstUse != (int)p)
+            {
+                continue;
+            }
+
+            //prefer an exact match so depth buffers are not taken by targets without depth
+            QSize size = sizeClass(target.capacity);
+            int best = -1;
+            for (size_t f = 0; f < m_framebuffers.size(); f++)
+            {
+                const Framebuffer &framebuffer = m_framebuffers[f];
+                if (framebuffer.busyUntil < (int)p && framebuffer.size == size && (framebuffer.depth || !target.depth)
+                        && (best < 0 || (m_framebuffers[best].depth && !framebuffer.depth)))
+                {
+                    best = (int)f;
+                }
+            }
+            if (best < 0)
+            {
+                best = allocate(size, target.depth);
+            }
+
+            target.framebuffer = best;
+            m_framebuffers[best].busyUntil = target.lastUse;
+        }
+    }
+}
+
+int FrameGraph::allocate(const QSize &size, bool depth)
+{
+    Framebuffer framebuffer;
+    framebuffer.object = new QGLFramebufferObject(size, depth ? QGLFramebufferObject::Depth : QGLFramebufferObject::NoAttachment,
+                                                  GL_TEXTURE_2D, GL_RGB16F_ARB);
+    framebuffer.size = size;
+    framebuffer.depth = depth;
+    framebuffer.busyUntil = -1;
+
+    //targets are stretched over the screen, so filter them
+    glBindTexture(GL_TEXTURE_2D, framebuffer.object->texture());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    m_framebuffers.push_back(framebuffer);
+    return (int)m_framebuffers.size() - 1;
+}
+
+const FrameGraph::Target *FrameGraph::target(const QString &name) const
+{
+    int index = m_targetIndex.value(name, -1);
+    return index >= 0 && m_targets[index].framebuffer >= 0 ? &m_targets[index] : 0;
+}
+
+QSize FrameGraph::sizeClass(const QSize &size)
+{
+    return QSize((size.width() + SIZE_CLASS - 1) / SIZE_CLASS * SIZE_CLASS,
+                 (size.height() + SIZE_CLASS - 1) / SIZE_CLASS * SIZE_CLASS);
+}
+
+/**
+  Renders into the target from now on, through a viewport of its size
+  */
+void FrameGraph::bind(const QString &name) const
+{
+    const Target *target = this->target(name);
+    m_framebuffers[target->framebuffer].object->bind();
+    glViewport(0, 0, target->size.width(), target->size.height());
+    if (m_profiler)
+    {
+        m_profiler->count(FrameProfiler::STATE_CHANGES, 2);
+    }
+}
+
+/**
+  Back to rendering into the window
+  */
+void FrameGraph::release(const QString &name) const
+{
+    const Target *target = this->target(name);
+    m_framebuffers[target->framebuffer].object->release();
+    glViewport(0, 0, m_screenWidth, m_screenHeight);
+    if (m_profiler)
+    {
+        m_profiler->count(FrameProfiler::STATE_CHANGES, 2);
+    }
+}
+
+GLuint FrameGraph::texture(const QString &name) const
+{
+    const Target *target = this->target(name);
+    return target ? m_framebuffers[target->framebuffer].object->texture() : 0;
+}
+
+QSize FrameGraph::size(const QString &name) const
+{
+    const Target *target = this->target(name);
+    return target ? target->size : QSize();
+}
+
+/**
+  The texture coordinates the target's image covers in its framebuffer object
+  */
+Vector2 FrameGraph::extent(const QString &name) const
+{
+    const Target *target = this->target(name);
+    QSize size = m_framebuffers[target->framebuffer].size;
+    return Vector2(target->size.width() / (float) size.width(), target->size.height() / (float) size.height());
+}
+
+/**
+  The largest texture coordinates that filter only texels of the target's image
+  */
+Vector2 FrameGraph::sampleLimit(const QString &name) const
+{
+    const Target *target = this->target(name);
+    QSize size = m_framebuffers[target->framebuffer].size;
+    return Vector2((target->size.width() - 0.5f) / size.width(), (target->size.height() - 0.5f) / size.height());
+}
+
+/**
+  Approximate video memory held, as RGB16F colour and a 32 bit depth buffer
+  */
+qint64 FrameGraph::framebufferBytes() const
+{
+    qint64 bytes = 0;
+    for (size_t f = 0; f < m_framebuffers.size(); f++)
+    {
+        qint64 pixels = (qint64) m_framebuffers[f].size.width() * m_framebuffers[f].size.height();
+        bytes += pixels * (m_framebuffers[f].depth ? 10 : 6);
+    }
+    return bytes;
+}
@@ -0,0 +1,114 @@
+#ifndef FRAMEGRAPH_H
+#define FRAMEGRAPH_H
+
+#include <qgl.h>
+#include <QHash>
+#include <QSize>
+#include <QString>
+#include <QStringList>
+#include <functional>
+#include <vector>
+#include "vector.h"
+
+class FrameProfiler;
+class QGLFramebufferObject;
+
+/**
+    The render passes of one frame, declared with the targets they read and write, and the
+    framebuffer objects behind those targets.
+
+    Every frame the passes and targets are declared again and execute() runs them in order,
+    after culling each pass whose outputs nothing live reads; SCREEN, the window, is the only
+    output that is always live. Targets are transient: a framebuffer object holds a target from
+    its first live use to its last and is free for any later target of the same size class
+    afterwards, so chains of passes ping-pong between two objects instead of copying.
+
+    Framebuffer objects are allocated at the target size rounded up to SIZE_CLASS and rendered
+    to through a viewport of the exact size; they are kept from frame to frame and only
+    recreated when a resize crosses into another size class. A target whose size changes from
+    frame to frame, e.g. with the render scale, can declare the largest size it takes as its
+    capacity; its framebuffer object is allocated for that, so shrinking and growing within it
+    only changes the viewport. A target that needs no depth buffer may also land in one that
+    has one.
+
+    With a profiler set every live pass is timed as a scope of its own name.
+**/
+class FrameGraph
+{
+
+public:
+    static const int SIZE_CLASS = 128; // framebuffer sizes are multiples of this
+    static const char *const SCREEN;
+
+    typedef std::function<void()> Execute;
+
+    FrameGraph();
+    ~FrameGraph();
+
+    void reset(int screenWidth, int screenHeight);
+    void addTarget(const QString &name, const QSize &size, bool depth, const QSize &capacity = QSize());
+    void addPass(const QString &name, const QStringList &reads, const QStringList &writes, const Execute &execute);
+    void execute();
+    void clear();
+    void setProfiler(FrameProfiler *profiler) { m_profiler = profiler; }
+
+    // valid while the passes execute
+    void bind(const QString &target) const;
+    void release(const QString &target) const;
+    GLuint texture(const QString &target) const;
+    QSize size(const QString &target) const;
+    Vector2 extent(const QString &target) const;
+    Vector2 sampleLimit(const QString &target) const;
+
+    int livePasses() const { return m_livePasses; }
+    int culledPasses() const { return (int)m_passes.size() - m_livePasses; }
+    int framebufferCount() const { return (int)m_framebuffers.size(); }
+    qint64 framebufferBytes() const;
+
+private:
+    struct Target
+    {
+        QString name;
+        QSize size;
+        QSize capacity; // at least size
+        bool depth;
+        int framebuffer; // index into m_framebuffers, -1 while unassigned
+        int firstUse; // live pass indices, -1 when unused
+        int lastUse;
+    };
+
+    struct Pass
+    {
+        QString name;
+        QStringList reads;
+        QStringList writes;
+        Execute execute;
+        bool live;
+    };
+
+    struct Framebuffer
+    {
+        QGLFramebufferObject *object;
+        QSize size;
+        bool depth;
+        int busyUntil; // last pass using it this frame
+    };
+
+    void cull();
+    void assign();
+    void releaseStale();
+    int allocate(const QSize &size, bool depth);
+    const Target *target(const QString &name) const;
+    static QSize sizeClass(const QSize &size);
+
+    std::vector<Target> m_targets;
+    QHash<QString, int> m_targetIndex;
+    std::vector<Pass> m_passes;
+    std::vector<Framebuffer> m_framebuffers;
+    int m_livePasses;
+    FrameProfiler *m_profiler;
+    int m_screenWidth;
+    int m_screenHeight;
+};
+
+#endif // FRAMEGRAPH_H
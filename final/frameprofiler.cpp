@@ -0,0 +1,269 @@
+#include "frameprofiler.h"
+#include "gputimer.h"
+
+#include <QFile>
+#include <QTextStream>
+#include <cstring>
+
+FrameProfiler::FrameProfiler()
+    : m_epoch(Clock::now()), m_context(0), m_gpuTiming(true), m_open(-1), m_recording(false)
+{
+    m_frame.number = 0;
+}
+
+FrameProfiler::~FrameProfiler()
+{
+    qDeleteAll(m_timers);
+}
+
+/**
+  GPU times are measured in context, which has to be current for every frame recorded
+  */
+void FrameProfiler::initialize(const QGLContext *context)
+{
+    m_context = context;
+}
+
+/**
+  Turns the timer queries off, e.g. while something else times the frame with its own
+  GL_TIME_ELAPSED query
+  */
+void FrameProfiler::setGpuTiming(bool enabled)
+{
+    m_gpuTiming = enabled;
+}
+
+double FrameProfiler::now() const
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - m_epoch).count();
+}
+
+/**
+  The timer for a scope name, created on first use; 0 when GPU times can't be measured
+  */
+GpuTimer *FrameProfiler::timer(const QString &name)
+{
+    if (!m_gpuTiming || !m_context)
+    {
+        return 0;
+    }
+
+    GpuTimer *timer = m_timers.value(name, 0);
+    if (!timer)
+    {
+        timer = new GpuTimer();
+        timer->initialize(m_context);
+        m_timers[name] = timer;
+    }
+    return timer->isSupported() ? timer : 0;
+}
+
+void FrameProfiler::beginFrame()
+{
+    m_frame.start = now();
+    m_frame.cpuTime = 0;
+    memset(m_frame.counters, 0, sizeof(m_frame.counters));
+    m_frame.scopes.clear();
+    m_timed.clear();
+    m_open = -1;
+    m_recording = true;
+}
+
+/**
+  Queues the frame for its GPU times and resolves the one submitted LATENCY frames ago
+  */
+void FrameProfiler::endFrame()
+{
+    if (!m_recording)
+    {
+        return;
+    }
+    end();
+    m_frame.cpuTime = now() - m_frame.start;
+    m_recording = false;
+
+    m_pending.push_back(m_frame);
+    m_pendingTimed.push_back(m_timed);
+    m_frame.number++;
+
+    while ((int)m_pending.size() >= LATENCY)
+    {
+        resolve(m_pending.front());
+        m_history.push_back(m_pending.front());
+        m_pending.pop_front();
+        m_pendingTimed.pop_front();
+        if ((int)m_history.size() > TRACE_FRAMES)
+        {
+            m_history.pop_front();
+        }
+    }
+}
+
+/**
+  Reads the GPU times of a frame's scopes. Every timer hands out its results in the order the
+  scopes were recorded, so they match up frame by frame.
+  */
+void FrameProfiler::resolve(Frame &frame)
+{
+    const std::vector<bool> &timed = m_pendingTimed.front();
+    for (size_t s = 0; s < frame.scopes.size(); s++)
+    {
+        Scope &scope = frame.scopes[s];
+        GpuTimer *timer = timed[s] ? m_timers.value(scope.name, 0) : 0;
+        if (!timer || !timer->wait(scope.gpuTime))
+        {
+            scope.gpuTime = -1;
+        }
+    }
+}
+
+/**
+  Starts timing a scope, ending the open one
+  */
+void FrameProfiler::begin(const QString &name)
+{
+    if (!m_recording)
+    {
+        return;
+    }
+    end();
+
+    Scope scope;
+    scope.name = name;
+    scope.cpuTime = 0;
+    scope.gpuTime = -1;
+    memset(scope.counters, 0, sizeof(scope.counters));
+
+    GpuTimer *timer = this->timer(name);
+    if (timer)
+    {
+        timer->begin();
+    }
+    m_timed.push_back(timer != 0);
+
+    scope.start = now();
+    m_open = (int)m_frame.scopes.size();
+    m_frame.scopes.push_back(scope);
+}
+
+void FrameProfiler::end()
+{
+    if (m_open < 0)
+    {
+        return;
+    }
+
+    Scope &scope = m_frame.scopes[m_open];
+    scope.cpuTime = now() - scope.start;
+    if (m_timed[m_open])
+    {
+        m_timers.value(scope.name)->end();
+    }
+    m_open = -1;
+}
+
+void FrameProfiler::count(Counter counter, int amount)
+{
+    if (!m_recording)
+    {
+        return;
+    }
+    m_frame.counters[counter] += amount;
+    if (m_open >= 0)
+    {
+        m_frame.scopes[m_open].counters[counter] += amount;
+    }
+}
+
+/**
+  Total GPU time of the frame's scopes, -1 if it wasn't measured
+  */
+double FrameProfiler::gpuTime(const Frame &frame) const
+{
+    double total = -1;
+    for (size_t s = 0; s < frame.scopes.size(); s++)
+    {
+        if (frame.scopes[s].gpuTime >= 0)
+        {
+            total = qMax(total, 0.0) + frame.scopes[s].gpuTime;
+        }
+    }
+    return total;
+}
+
+const char *FrameProfiler::counterName(Counter counter)
+{
+    switch (counter)
+    {
+    case DRAW_CALLS:
+        return "draws";
+    case TEXTURE_BINDS:
+        return "binds";
+    case STATE_CHANGES:
+        return "states";
+    case PARTICLES:
+        return "particles";
+    default:
+        return "";
+    }
+}
+
+static QString quoted(QString value)
+{
+    return "\"" + value.replace('\\', "\\\\").replace('"', "\\\"") + "\"";
+}
+
+/**
+  One complete ("X") trace event; times in milliseconds
+  */
+static QString traceEvent(const QString &name, int thread, double start, double duration, const QString &args)
+{
+    return QString("{ \"name\": %1, \"ph\": \"X\", \"pid\": 1, \"tid\": %2, \"ts\": %3, \"dur\": %4, \"args\": { %5 } }")
+            .arg(quoted(name)).arg(thread).arg(start * 1000, 0, 'f', 1).arg(duration * 1000, 0, 'f', 1).arg(args);
+}
+
+/**
+  Writes the resolved frames kept so far as Chrome trace events, the CPU on thread 1 and the
+  GPU on thread 2
+  */
+bool FrameProfiler::writeTrace(const QString &path) const
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Truncate))
+    {
+        qWarning("Could not write trace '%s'", qPrintable(path));
+        return false;
+    }
+
+    QTextStream out(&file);
+    out << "{ \"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    out << "{ \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": { \"name\": \"CPU\" } },\n";
+    out << "{ \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, \"args\": { \"name\": \"GPU\" } }";
+
+    for (size_t f = 0; f < m_history.size(); f++)
+    {
+        const Frame &frame = m_history[f];
+        out << ",\n" << traceEvent(QString("frame %1").arg(frame.number), 1, frame.start, frame.cpuTime,
+                                   QString("\"gpu_ms\": %1").arg(gpuTime(frame), 0, 'f', 3));
+
+        double gpuStart = frame.start;
+        for (size_t s = 0; s < frame.scopes.size(); s++)
+        {
+            const Scope &scope = frame.scopes[s];
+            QString args;
+            for (int c = 0; c < COUNTERS; c++)
+            {
+                args += QString("%1\"%2\": %3").arg(c ? ", " : "").arg(counterName((Counter)c)).arg(scope.counters[c]);
+            }
+            out << ",\n" << traceEvent(scope.name, 1, scope.start, scope.cpuTime, args);
+
+            if (scope.gpuTime >= 0)
+            {
+                out << ",\n" << traceEvent(scope.name, 2, gpuStart, scope.gpuTime, QString());
+                gpuStart += scope.gpuTime;
+            }
+        }
+    }
+    out << "\n] }\n";
+    return true;
+}
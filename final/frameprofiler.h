@@ -0,0 +1,95 @@
+#ifndef FRAMEPROFILER_H
+#define FRAMEPROFILER_H
+
+#include <QHash>
+#include <QString>
+#include <chrono>
+#include <deque>
+#include <vector>
+
+class GpuTimer;
+class QGLContext;
+
+/**
+    Where the time of each frame goes: CPU and GPU time plus draw call, texture bind, state
+    change and particle counters for every scope between begin() and end(), e.g. the passes of
+    the frame graph.
+
+    Scopes are flat, beginning one ends the open one, since GL_TIME_ELAPSED queries can't nest.
+    Each scope name has its own GpuTimer, so its queries stay in flight for LATENCY frames and
+    a frame is only resolved, and shows up in lastFrame() and the trace, once that many newer
+    frames have been submitted. Without timer queries the GPU times are left at -1.
+
+    The last TRACE_FRAMES resolved frames are kept for writeTrace(), which exports them in the
+    Chrome trace event format (chrome://tracing, Perfetto): the CPU scopes as they ran and the
+    GPU scopes laid end to end from the start of their frame, since elapsed time queries carry
+    no timestamps.
+**/
+class FrameProfiler
+{
+
+public:
+    enum Counter { DRAW_CALLS, TEXTURE_BINDS, STATE_CHANGES, PARTICLES, COUNTERS };
+
+    static const int LATENCY = 3; // frames in flight before their GPU times are read
+    static const int TRACE_FRAMES = 600;
+
+    struct Scope
+    {
+        QString name;
+        double start; // milliseconds since the profiler was created
+        double cpuTime; // milliseconds
+        double gpuTime; // milliseconds, -1 when unknown
+        int counters[COUNTERS];
+    };
+
+    struct Frame
+    {
+        int number;
+        double start;
+        double cpuTime;
+        int counters[COUNTERS]; // the whole frame, including work outside any scope
+        std::vector<Scope> scopes;
+    };
+
+    FrameProfiler();
+    ~FrameProfiler();
+
+    void initialize(const QGLContext *context);
+    void setGpuTiming(bool enabled);
+
+    void beginFrame();
+    void endFrame();
+    void begin(const QString &name);
+    void end();
+    void count(Counter counter, int amount = 1);
+
+    bool hasFrame() const { return !m_history.empty(); }
+    const Frame &lastFrame() const { return m_history.back(); }
+    double gpuTime(const Frame &frame) const;
+
+    bool writeTrace(const QString &path) const;
+
+    static const char *counterName(Counter counter);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    double now() const;
+    GpuTimer *timer(const QString &name);
+    void resolve(Frame &frame);
+
+    Clock::time_point m_epoch;
+    const QGLContext *m_context;
+    bool m_gpuTiming;
+    QHash<QString, GpuTimer *> m_timers; // one ring of queries per scope name
+    Frame m_frame; // being recorded
+    int m_open; // scope of m_frame open, -1 if none
+    bool m_recording;
+    std::vector<bool> m_timed; // per scope of m_frame, whether a query was issued
+    std::deque<Frame> m_pending; // submitted, waiting for their GPU times
+    std::deque<std::vector<bool> > m_pendingTimed;
+    std::deque<Frame> m_history; // resolved, oldest first
+};
+
+#endif // FRAMEPROFILER_H
@@ -0,0 +1,135 @@
+#include "gputimer.h"
+
+#include <cstring>
+
+GpuTimer::GpuTimer()
+    : m_supported(false), m_issued(0), m_collected(0), m_running(false), m_genQueries(0),
+      m_deleteQueries(0), m_beginQuery(0), m_endQuery(0), m_getQueryObjectiv(0), m_getQueryObjectui64v(0)
+{
+    memset(m_queries, 0, sizeof(m_queries));
+}
+
+/**
+  The queries belong to the context passed to initialize(), which has to be current here
+  */
+GpuTimer::~GpuTimer()
+{
+    if (m_supported)
+    {
+        m_deleteQueries(LATENCY, m_queries);
+    }
+}
+
+/**
+  Resolves the query entry points and creates the ring of queries. Must be called with the
+  context current; returns whether GPU times can be measured.
+  */
+bool GpuTimer::initialize(const QGLContext *context)
+{
+    const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+    bool timerQuery = (QGLFormat::openGLVersionFlags() & QGLFormat::OpenGL_Version_3_3)
+            || (extensions && strstr(extensions, "GL_ARB_timer_query"));
+    if (m_supported || !context || !timerQuery)
+    {
+        return m_supported;
+    }
+
+    m_genQueries = (PFNGLGENQUERIESPROC) context->getProcAddress("glGenQueries");
+    m_deleteQueries = (PFNGLDELETEQUERIESPROC) context->getProcAddress("glDeleteQueries");
+    m_beginQuery = (PFNGLBEGINQUERYPROC) context->getProcAddress("glBeginQuery");
+    m_endQuery = (PFNGLENDQUERYPROC) context->getProcAddress("glEndQuery");
+    m_getQueryObjectiv = (PFNGLGETQUERYOBJECTIVPROC) context->getProcAddress("glGetQueryObjectiv");
+    m_getQueryObjectui64v = (PFNGLGETQUERYOBJECTUI64VPROC) context->getProcAddress("glGetQueryObjectui64v");
+    if (!m_genQueries || !m_deleteQueries || !m_beginQuery || !m_endQuery || !m_getQueryObjectiv
+            || !m_getQueryObjectui64v)
+    {
+        return false;
+    }
+
+    m_genQueries(LATENCY, m_queries);
+    m_supported = true;
+    return true;
+}
+
+void GpuTimer::begin()
+{
+    if (!m_supported || m_running)
+    {
+        return;
+    }
+
+    //the next query object is still in flight, its result has to be read before reuse
+    if (m_issued - m_collected == LATENCY)
+    {
+        collect(true);
+    }
+    m_beginQuery(GL_TIME_ELAPSED, m_queries[m_issued % LATENCY]);
+    m_running = true;
+}
+
+void GpuTimer::end()
+{
+    if (!m_running)
+    {
+        return;
+    }
+    m_endQuery(GL_TIME_ELAPSED);
+    m_running = false;
+    m_issued++;
+}
+
+/**
+  Reads the results that have arrived, oldest first. With block set, waits for at least the
+  oldest outstanding one.
+  */
+void GpuTimer::collect(bool block)
+{
+    while (m_collected < m_issued)
+    {
+        GLuint query = m_queries[m_collected % LATENCY];
+        GLint available = 0;
+        m_getQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available && !block)
+        {
+            return;
+        }
+
+        GLuint64 nanoseconds = 0;
+        m_getQueryObjectui64v(query, GL_QUERY_RESULT, &nanoseconds);
+        m_ready.push_back(nanoseconds * 1e-6);
+        m_collected++;
+        block = false;
+    }
+}
+
+/**
+  Hands out the oldest finished measurement, if any, without waiting for the GPU
+  */
+bool GpuTimer::take(double &milliseconds)
+{
+    if (!m_supported)
+    {
+        return false;
+    }
+
+    collect(false);
+    if (m_ready.empty())
+    {
+        return false;
+    }
+    milliseconds = m_ready.front();
+    m_ready.pop_front();
+    return true;
+}
+
+/**
+  Like take(), but waits for the GPU when a measurement is still in flight
+  */
+bool GpuTimer::wait(double &milliseconds)
+{
+    if (m_supported && m_ready.empty())
+    {
+        collect(true);
+    }
+    return take(milliseconds);
+}
@@ -0,0 +1,57 @@
+#ifndef GPUTIMER_H
+#define GPUTIMER_H
+
+#include <qgl.h>
+#include <GL/glext.h>
+#include <deque>
+
+class QGLContext;
+
+/**
+    Measures how long the GPU spends on the commands between begin() and end() with
+    GL_TIME_ELAPSED queries.
+
+    Query results only arrive once the GPU has caught up, so up to LATENCY measurements are kept
+    in flight in a ring of query objects and collected when they are ready; take() hands them
+    out oldest first. Only when the ring is full does begin() wait for the oldest one.
+
+    Needs ARB_timer_query (or GL 3.3); without it isSupported() stays false and nothing is
+    measured.
+**/
+class GpuTimer
+{
+
+public:
+    static const int LATENCY = 4;
+
+    GpuTimer();
+    ~GpuTimer();
+
+    bool initialize(const QGLContext *context);
+    bool isSupported() const { return m_supported; }
+
+    void begin();
+    void end();
+
+    bool take(double &milliseconds);
+    bool wait(double &milliseconds);
+
+private:
+    void collect(bool block);
+
+    bool m_supported;
+    GLuint m_queries[LATENCY];
+    int m_issued; // queries ended so far
+    int m_collected; // queries whose result was read
+    bool m_running;
+    std::deque<double> m_ready; // milliseconds, oldest first
+
+    PFNGLGENQUERIESPROC m_genQueries;
+    PFNGLDELETEQUERIESPROC m_deleteQueries;
+    PFNGLBEGINQUERYPROC m_beginQuery;
+    PFNGLENDQUERYPROC m_endQuery;
+    PFNGLGETQUERYOBJECTIVPROC m_getQueryObjectiv;
+    PFNGLGETQUERYOBJECTUI64VPROC m_getQueryObjectui64v;
+};
+
+#endif // GPUTIMER_H
@@ -0,0 +1,307 @@
+#include "impostorcache.h"
+
+#include <GL/glu.h>
+#include <cstring>
+#include <math.h>
+
+#define DEFAULT_BUDGET (32 * 1024 * 1024) //bytes
+#define DEFAULT_ANGLE 5.0f //degrees
+#define MIN_DISTANCE 1.05f //closest an eye may be to a cluster, in cluster radii
+
+ImpostorCache::ImpostorCache()
+    : m_supported(false), m_budget(DEFAULT_BUDGET), m_bytes(0), m_version(0), m_frame(0), m_renders(0),
+      m_evictions(0), m_framebuffer(0), m_genFramebuffers(0), m_deleteFramebuffers(0), m_bindFramebuffer(0),
+      m_framebufferTexture2D(0), m_blendFuncSeparate(0)
+{
+    this->setAngleThreshold(DEFAULT_ANGLE);
+}
+
+ImpostorCache::~ImpostorCache()
+{
+    this->clear();
+    if (m_framebuffer)
+    {
+        m_deleteFramebuffers(1, &m_framebuffer);
+    }
+}
+
+/**
+  Resolves the framebuffer object entry points. Must be called with the context current;
+  returns whether impostors can be rendered.
+  */
+bool ImpostorCache::initialize(const QGLContext *context)
+{
+    m_supported = false;
+
+    const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+    bool framebuffers = (QGLFormat::openGLVersionFlags() & QGLFormat::OpenGL_Version_3_0)
+            || (extensions && strstr(extensions, "GL_ARB_framebuffer_object"));
+    if (!context || !framebuffers)
+    {
+        return false;
+    }
+
+    m_genFramebuffers = (PFNGLGENFRAMEBUFFERSPROC) context->getProcAddress("glGenFramebuffers");
+    m_deleteFramebuffers = (PFNGLDELETEFRAMEBUFFERSPROC) context->getProcAddress("glDeleteFramebuffers");
+    m_bindFramebuffer = (PFNGLBINDFRAMEBUFFERPROC) context->getProcAddress("glBindFramebuffer");
+    m_framebufferTexture2D = (PFNGLFRAMEBUFFERTEXTURE2DPROC) context->getProcAddress("glFramebufferTexture2D");
+    m_blendFuncSeparate = (PFNGLBLENDFUNCSEPARATEPROC) context->getProcAddress("glBlendFuncSeparate");
+    if (!m_genFramebuffers || !m_deleteFramebuffers || !m_bindFramebuffer || !m_framebufferTexture2D
+            || !m_blendFuncSeparate)
+    {
+        return false;
+    }
+
+    m_genFramebuffers(1, &m_framebuffer);
+    m_supported = true;
+    return true;
+}
+
+/**
+  Most bytes all impostor textures may take together
+  */
+void ImpostorCache::setBudget(qint64 bytes)
+{
+    m_budget = bytes;
+}
+
+/**
+  How far the view direction to a cluster may turn before its impostor is rendered again
+  */
+void ImpostorCache::setAngleThreshold(float degrees)
+{
+    m_cosAngle = cosf(degrees * M_PI / 180.0);
+}
+
+/**
+  Starts a frame: impostors acquired from now on aren't evicted until the next one
+  */
+void ImpostorCache::beginFrame()
+{
+    m_frame++;
+    m_renders = 0;
+}
+
+/**
+  The clusters look different, e.g. after the sun moved; every impostor is rendered again when
+  next acquired, showing the old image until then
+  */
+void ImpostorCache::invalidate()
+{
+    m_version++;
+}
+
+/**
+  Drops every impostor, e.g. when the clusters themselves change
+  */
+void ImpostorCache::clear()
+{
+    for (QHash<int, Impostor>::iterator it = m_impostors.begin(); it != m_impostors.end(); ++it)
+    {
+        this->release(*it);
+    }
+    m_impostors.clear();
+    m_bytes = 0;
+}
+
+void ImpostorCache::release(Impostor &impostor)
+{
+    if (impostor.texture)
+    {
+        glDeleteTextures(1, &impostor.texture);
+        m_bytes -= (qint64)impostor.resolution * impostor.resolution * 4;
+        impostor.texture = 0;
+    }
+}
+
+/**
+  Evicts least recently used impostors not used this frame until bytes more fit in the budget
+  */
+bool ImpostorCache::makeRoom(qint64 bytes)
+{
+    while (m_bytes + bytes > m_budget)
+    {
+        QHash<int, Impostor>::iterator oldest = m_impostors.end();
+        for (QHash<int, Impostor>::iterator it = m_impostors.begin(); it != m_impostors.end(); ++it)
+        {
+            if (it->lastUsed < m_frame && (oldest == m_impostors.end() || it->lastUsed < oldest->lastUsed))
+            {
+                oldest = it;
+            }
+        }
+        if (oldest == m_impostors.end())
+        {
+            return false;
+        }
+        this->release(*oldest);
+        m_impostors.erase(oldest);
+        m_evictions++;
+    }
+    return true;
+}
+
+/**
+  Texture edge for a cluster of the given radius at distance from the eye, so one texel covers
+  about one pixel of a viewport with the given vertical field of view (degrees) and height
+  */
+int ImpostorCache::resolutionFor(float radius, float distance, float fovy, int viewportHeight)
+{
+    float pixels = 2.0f * asinf(qMin(radius / distance, 1.0f)) / (fovy * M_PI / 180.0) * viewportHeight;
+    int resolution = MIN_RESOLUTION;
+    while (resolution < pixels && resolution < MAX_RESOLUTION)
+    {
+        resolution *= 2;
+    }
+    return resolution;
+}
+
+/**
+  The impostor of cluster key, a bounding sphere at centre, up to date for the eye: rendered
+  with render if it is missing or stale and the frame allows it. Returns false when the
+  cluster has to be drawn as particles: the eye is too close, the budget is used up by this
+  frame's impostors or too many were rendered this frame already.
+  */
+bool ImpostorCache::acquire(int key, const Vector3 &centre, float radius, const Vector3 &eye, int resolution,
+                            const Render &render, Impostor &result)
+{
+    Vector3 toCentre = centre - eye;
+    float distance = toCentre.length();
+    if (!m_supported || distance <= radius * MIN_DISTANCE)
+    {
+        return false;
+    }
+    Vector3 direction = toCentre / distance;
+    resolution = qBound((int)MIN_RESOLUTION, resolution, (int)MAX_RESOLUTION);
+
+    QHash<int, Impostor>::iterator found = m_impostors.find(key);
+    if (found != m_impostors.end())
+    {
+        found->lastUsed = m_frame;
+        bool resized = resolution >= found->resolution * 2 || resolution * 2 <= found->resolution;
+        bool stale = resized || found->version != m_version || direction.dot(found->direction) < m_cosAngle;
+        if (stale && m_renders < MAX_RENDERS_PER_FRAME)
+        {
+            if (resized)
+            {
+                this->release(*found);
+                if (!this->makeRoom((qint64)resolution * resolution * 4))
+                {
+                    m_impostors.erase(found);
+                    return false;
+                }
+                found->resolution = resolution;
+            }
+            found->centre = centre;
+            this->render(*found, radius, eye, render);
+        }
+        result = *found;
+        return true;
+    }
+
+    if (m_renders >= MAX_RENDERS_PER_FRAME || !this->makeRoom((qint64)resolution * resolution * 4))
+    {
+        return false;
+    }
+
+    Impostor impostor;
+    impostor.texture = 0;
+    impostor.resolution = resolution;
+    impostor.centre = centre;
+    impostor.lastUsed = m_frame;
+    this->render(impostor, radius, eye, render);
+    m_impostors.insert(key, impostor);
+    result = impostor;
+    return true;
+}
+
+/**
+  Renders the cluster into the impostor's texture, creating it if needed, and restores the
+  framebuffer, viewport, matrices and blending of the caller
+  */
+void ImpostorCache::render(Impostor &impostor, float radius, const Vector3 &eye, const Render &render)
+{
+    int resolution = impostor.resolution;
+    if (!impostor.texture)
+    {
+        glGenTextures(1, &impostor.texture);
+        glBindTexture(GL_TEXTURE_2D, impostor.texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, resolution, resolution, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        m_bytes += (qint64)resolution * resolution * 4;
+    }
+
+    //a square frustum that just contains the bounding sphere
+    Vector3 toCentre = impostor.centre - eye;
+    float distance = toCentre.length();
+    impostor.direction = toCentre / distance;
+    Vector3 worldUp = fabsf(impostor.direction.y) > 0.99f ? Vector3(1, 0, 0) : Vector3(0, 1, 0);
+    Vector3 right = impostor.direction.cross(worldUp).unit();
+    Vector3 up = right.cross(impostor.direction);
+    float halfSize = radius * distance / sqrtf(distance * distance - radius * radius);
+    impostor.right = right * halfSize;
+    impostor.up = up * halfSize;
+    impostor.version = m_version;
+
+    GLint previous = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+    glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_VIEWPORT_BIT);
+
+    m_bindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+    m_framebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, impostor.texture, 0);
+    glViewport(0, 0, resolution, resolution);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    //premultiplied: the colour is blended as usual, the alpha accumulates coverage
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    glDepthMask(GL_FALSE);
+    glEnable(GL_BLEND);
+    m_blendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    gluPerspective(2.0 * asin(radius / distance) * 180.0 / M_PI, 1.0, qMax(distance - radius, 0.1f), distance + radius);
+    gluLookAt(eye.x, eye.y, eye.z, impostor.centre.x, impostor.centre.y, impostor.centre.z, up.x, up.y, up.z);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+
+    render(eye, impostor.direction);
+
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopMatrix();
+
+    m_bindFramebuffer(GL_FRAMEBUFFER, previous);
+    glPopAttrib();
+    m_renders++;
+}
+
+/**
+  The impostor as a quad through its cluster's centre, facing the eye it was rendered from.
+  Expects premultiplied blending (GL_ONE, GL_ONE_MINUS_SRC_ALPHA) and a white colour.
+  */
+void ImpostorCache::draw(const Impostor &impostor) const
+{
+    Vector3 corners[4] = { impostor.centre - impostor.right - impostor.up, impostor.centre + impostor.right - impostor.up,
+                           impostor.centre + impostor.right + impostor.up, impostor.centre - impostor.right + impostor.up };
+
+    glBindTexture(GL_TEXTURE_2D, impostor.texture);
+    glBegin(GL_QUADS);
+    glTexCoord2f(0.0f, 0.0f);
+    glVertex3f(corners[0].x, corners[0].y, corners[0].z);
+    glTexCoord2f(1.0f, 0.0f);
+    glVertex3f(corners[1].x, corners[1].y, corners[1].z);
+    glTexCoord2f(1.0f, 1.0f);
+    glVertex3f(corners[2].x, corners[2].y, corners[2].z);
+    glTexCoord2f(0.0f, 1.0f);
+    glVertex3f(corners[3].x, corners[3].y, corners[3].z);
+    glEnd();
+}
@@ -0,0 +1,99 @@
+#ifndef IMPOSTORCACHE_H
+#define IMPOSTORCACHE_H
+
+#include <qgl.h>
+#include <GL/glext.h>
+#include <QHash>
+#include <functional>
+#include "vector.h"
+
+class QGLContext;
+
+/**
+    Pre-rendered images of distant particle clusters, each drawn as a single textured quad in
+    place of the cluster's billboards.
+
+    An impostor is rendered into a small RGBA texture from the eye's position at the time, looking
+    at the cluster's bounding sphere, with premultiplied alpha so that blending the quad over the
+    scene gives what blending the billboards would have. It is reused until the direction from
+    the eye to the cluster turns by more than the angle threshold, the cluster needs twice the
+    resolution or half of it, or invalidate() says the content changed; regenerating is limited
+    to MAX_RENDERS_PER_FRAME and the stale image is shown meanwhile.
+
+    All impostor textures together stay within the byte budget: making room evicts the least
+    recently used ones not needed this frame, and when that isn't enough acquire() returns false and
+    the cluster is drawn as particles.
+
+    Needs framebuffer objects and glBlendFuncSeparate (GL 3.0, or ARB_framebuffer_object before
+    that); isSupported() stays false otherwise.
+**/
+class ImpostorCache
+{
+
+public:
+    static const int MIN_RESOLUTION = 16;
+    static const int MAX_RESOLUTION = 256;
+    static const int MAX_RENDERS_PER_FRAME = 8;
+
+    struct Impostor
+    {
+        GLuint texture;
+        int resolution;
+        Vector3 centre;
+        Vector3 direction; // from the eye to the centre when it was rendered
+        Vector3 right, up; // the quad's axes, scaled to its half size
+        int version; // invalidate() count it was rendered at
+        int lastUsed; // frame
+    };
+
+    // draws the cluster seen from eye; the projection, target and blending are already set up
+    typedef std::function<void(const Vector3 &eye, const Vector3 &look)> Render;
+
+    ImpostorCache();
+    ~ImpostorCache();
+
+    bool initialize(const QGLContext *context);
+    bool isSupported() const { return m_supported; }
+
+    void setBudget(qint64 bytes);
+    void setAngleThreshold(float degrees);
+
+    void beginFrame();
+    void invalidate();
+    void clear();
+
+    bool acquire(int key, const Vector3 &centre, float radius, const Vector3 &eye, int resolution,
+                 const Render &render, Impostor &result);
+    void draw(const Impostor &impostor) const;
+
+    static int resolutionFor(float radius, float distance, float fovy, int viewportHeight);
+
+    int count() const { return m_impostors.size(); }
+    qint64 bytes() const { return m_bytes; }
+    int rendersThisFrame() const { return m_renders; }
+    int evictions() const { return m_evictions; }
+
+private:
+    bool makeRoom(qint64 bytes);
+    void release(Impostor &impostor);
+    void render(Impostor &impostor, float radius, const Vector3 &eye, const Render &render);
+
+    bool m_supported;
+    QHash<int, Impostor> m_impostors;
+    qint64 m_budget;
+    qint64 m_bytes;
+    float m_cosAngle; // cosine of the angle threshold
+    int m_version;
+    int m_frame;
+    int m_renders; // this frame
+    int m_evictions; // since the cache was created
+    GLuint m_framebuffer;
+
+    PFNGLGENFRAMEBUFFERSPROC m_genFramebuffers;
+    PFNGLDELETEFRAMEBUFFERSPROC m_deleteFramebuffers;
+    PFNGLBINDFRAMEBUFFERPROC m_bindFramebuffer;
+    PFNGLFRAMEBUFFERTEXTURE2DPROC m_framebufferTexture2D;
+    PFNGLBLENDFUNCSEPARATEPROC m_blendFuncSeparate;
+};
+
+#endif // IMPOSTORCACHE_H
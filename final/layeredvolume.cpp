@@ -0,0 +1,300 @@
+#include "layeredvolume.h"
+#include "cloudgenerator.h"
+#include "threadpool.h"
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LAYERS_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+#ifdef LAYERS_X86
+static inline int accumulateSse(float *row, const float *layer, float weight, int count)
+{
+    __m128 w = _mm_set1_ps(weight);
+    int k = 0;
+    for (; k + 4 <= count; k += 4)
+    {
+        _mm_storeu_ps(row + k, _mm_add_ps(_mm_loadu_ps(row + k), _mm_mul_ps(w, _mm_loadu_ps(layer + k))));
+    }
+    return k;
+}
+
+__attribute__((target("avx2")))
+static int accumulateAvx2(float *row, const float *layer, float weight, int count)
+{
+    __m256 w = _mm256_set1_ps(weight);
+    int k = 0;
+    for (; k + 8 <= count; k += 8)
+    {
+        _mm256_storeu_ps(row + k, _mm256_add_ps(_mm256_loadu_ps(row + k), _mm256_mul_ps(w, _mm256_loadu_ps(layer + k))));
+    }
+    return k;
+}
+
+static inline int saturateSse(float *row, int count)
+{
+    __m128 one = _mm_set1_ps(1.0f);
+    int k = 0;
+    for (; k + 4 <= count; k += 4)
+    {
+        _mm_storeu_ps(row + k, _mm_min_ps(_mm_loadu_ps(row + k), one));
+    }
+    return k;
+}
+
+__attribute__((target("avx2")))
+static int saturateAvx2(float *row, int count)
+{
+    __m256 one = _mm256_set1_ps(1.0f);
+    int k = 0;
+    for (; k + 8 <= count; k += 8)
+    {
+        _mm256_storeu_ps(row + k, _mm256_min_ps(_mm256_loadu_ps(row + k), one));
+    }
+    return k;
+}
+#endif
+
+/**
+  row[k] += weight * layer[k], the term the noise kernels add per octave. The vector kernels
+  perform the same float operations in the same order.
+  */
+static void accumulate(float *row, const float *layer, float weight, int count)
+{
+    int k = 0;
+#ifdef LAYERS_X86
+    static const bool wide = NoiseKernel::detectIsa() == NoiseKernel::ISA_AVX2;
+    k = wide ? accumulateAvx2(row, layer, weight, count) : accumulateSse(row, layer, weight, count);
+#endif
+    for (; k < count; k++)
+    {
+        row[k] += weight * layer[k];
+    }
+}
+
+/**
+  row[k] = min(1, row[k])
+  */
+static void saturate(float *row, int count)
+{
+    int k = 0;
+#ifdef LAYERS_X86
+    static const bool wide = NoiseKernel::detectIsa() == NoiseKernel::ISA_AVX2;
+    k = wide ? saturateAvx2(row, count) : saturateSse(row, count);
+#endif
+    for (; k < count; k++)
+    {
+        row[k] = min(row[k], 1.0f);
+    }
+}
+
+LayeredVolume::LayeredVolume(const CloudGenerator &generator)
+    : m_generator(generator), m_reduced(true), m_lastGenerated(0), m_lastUpdateTime(0), m_lastComposeTime(0)
+{
+    m_dims[0] = m_dims[1] = m_dims[2] = 0;
+}
+
+/**
+  Whether the low octaves may be kept below the volume's resolution; takes effect with the next
+  update()
+  */
+void LayeredVolume::setReduced(bool reduced)
+{
+    m_reduced = reduced;
+}
+
+void LayeredVolume::clear()
+{
+    m_layers.clear();
+    m_dims[0] = m_dims[1] = m_dims[2] = 0;
+}
+
+size_t LayeredVolume::bytes() const
+{
+    size_t total = 0;
+    for (size_t q = 0; q < m_layers.size(); q++)
+    {
+        total += m_layers[q].density.bytes();
+    }
+    return total;
+}
+
+/**
+  Maps each of dim voxels onto an axis of samples spread from the first voxel to the last
+  */
+void LayeredVolume::setupAxis(Axis &axis, int dim, int samples)
+{
+    axis.index.resize(dim);
+    axis.frac.resize(dim);
+    for (int n = 0; n < dim; n++)
+    {
+        if (samples == dim)
+        {
+            axis.index[n] = n;
+            axis.frac[n] = 0.0f;
+            continue;
+        }
+        double position = n * (double)(samples - 1) / (dim - 1);
+        int lower = min((int)position, samples - 2);
+        axis.index[n] = lower;
+        axis.frac[n] = (float)(position - lower);
+    }
+}
+
+/**
+  Brings the layers in line with the octaves the generator would use for a dimX x dimY x dimZ
+  volume, regenerating only those whose grid, frequencies or offsets differ from what they
+  hold. Weights don't matter here, compose() applies them. Returns the number of layers
+  regenerated.
+  */
+int LayeredVolume::update(int dimX, int dimY, int dimZ, int numPasses, double numCubes, double phase)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    NoiseOctave octaves[NoiseKernel::MAX_OCTAVES];
+    numPasses = m_generator.setupOctaves(octaves, dimX, dimY, dimZ, numPasses, numCubes, phase);
+    bool resized = dimX != m_dims[0] || dimY != m_dims[1] || dimZ != m_dims[2];
+    m_dims[0] = dimX;
+    m_dims[1] = dimY;
+    m_dims[2] = dimZ;
+    m_layers.resize(numPasses);
+
+    m_lastGenerated = 0;
+    int dims[3] = { dimX, dimY, dimZ };
+    for (int q = 0; q < numPasses; q++)
+    {
+        //lattice cells crossed along each axis of the volume; freqY steps with x, freqX with y
+        const NoiseOctave &octave = octaves[q];
+        double cells[3] = { octave.freqY * (dimX - 1.0), octave.freqX * (dimY - 1.0), octave.freqZ * (dimZ - 1.0) };
+        int samples[3];
+        for (int a = 0; a < 3; a++)
+        {
+            samples[a] = dims[a];
+            if (m_reduced && dims[a] > 2)
+            {
+                samples[a] = max(2, min(dims[a], (int)ceil(cells[a] * SAMPLES_PER_CELL) + 1));
+            }
+        }
+
+        //the layer's own voxels are spaced (dim - 1) / (samples - 1) volume voxels apart
+        NoiseOctave grid = octave;
+        grid.weight = 1;
+        if (samples[0] != dimX)
+        {
+            grid.freqY = (float)(octave.freqY * (dimX - 1.0) / (samples[0] - 1));
+        }
+        if (samples[1] != dimY)
+        {
+            grid.freqX = (float)(octave.freqX * (dimY - 1.0) / (samples[1] - 1));
+        }
+        if (samples[2] != dimZ)
+        {
+            grid.freqZ = (float)(octave.freqZ * (dimZ - 1.0) / (samples[2] - 1));
+        }
+
+        Layer &layer = m_layers[q];
+        bool same = !layer.density.isEmpty() && layer.density.sizeX() == samples[0]
+                && layer.density.sizeY() == samples[1] && layer.density.sizeZ() == samples[2]
+                && layer.octave.freqX == grid.freqX && layer.octave.freqY == grid.freqY
+                && layer.octave.freqZ == grid.freqZ && layer.octave.offsetX == grid.offsetX
+                && layer.octave.offsetY == grid.offsetY;
+        if (!same)
+        {
+            layer.octave = grid;
+            layer.density.resize(samples[0], samples[1], samples[2]);
+            m_generator.calcOctave(layer.density, grid);
+            m_lastGenerated++;
+        }
+        if (!same || resized)
+        {
+            layer.full = samples[0] == dimX && samples[1] == dimY && samples[2] == dimZ;
+            for (int a = 0; a < 3; a++)
+            {
+                setupAxis(layer.axes[a], dims[a], samples[a]);
+            }
+        }
+    }
+
+    m_lastUpdateTime = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    return m_lastGenerated;
+}
+
+/**
+  Adds weight times the layer, interpolated onto the volume's grid, to the z row at (i, j):
+  bilinearly between the four layer rows around it, then linearly along z
+  */
+void LayeredVolume::addLayer(float *row, const Layer &layer, int i, int j, float weight,
+                             std::vector<float> &scratch) const
+{
+    int count = m_dims[2];
+    if (layer.full)
+    {
+        accumulate(row, layer.density.row(i, j), weight, count);
+        return;
+    }
+
+    int i0 = layer.axes[0].index[i], j0 = layer.axes[1].index[j];
+    float ti = layer.axes[0].frac[i], tj = layer.axes[1].frac[j];
+    int i1 = ti > 0 ? i0 + 1 : i0;
+    int j1 = tj > 0 ? j0 + 1 : j0;
+    const float *a = layer.density.row(i0, j0);
+    const float *b = layer.density.row(i0, j1);
+    const float *c = layer.density.row(i1, j0);
+    const float *d = layer.density.row(i1, j1);
+
+    int samples = layer.density.sizeZ();
+    scratch.resize(samples + 1);
+    for (int k = 0; k < samples; k++)
+    {
+        float low = a[k] + tj * (b[k] - a[k]);
+        float high = c[k] + tj * (d[k] - c[k]);
+        scratch[k] = low + ti * (high - low);
+    }
+    //the last voxel reads one past the last sample with a weight of 0
+    scratch[samples] = scratch[samples - 1];
+
+    const int *index = &layer.axes[2].index[0];
+    const float *frac = &layer.axes[2].frac[0];
+    for (int k = 0; k < count; k++)
+    {
+        float lower = scratch[index[k]];
+        row[k] += weight * (lower + frac[k] * (scratch[index[k] + 1] - lower));
+    }
+}
+
+/**
+  Sums the layers into volume, resized to the grid of the last update(), with the generator's
+  current weights; rows are spread over the thread pool
+  */
+void LayeredVolume::compose(CloudVolume &volume)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    volume.resize(m_dims[0], m_dims[1], m_dims[2]);
+    ThreadPool &pool = ThreadPool::global();
+    int dimY = m_dims[1];
+    int dimZ = m_dims[2];
+    int rows = m_dims[0] * dimY;
+    int slab = max(1, rows / (8 * (pool.threadCount() + 1)));
+
+    pool.parallelFor(rows, slab, [&](int begin, int end) {
+        std::vector<float> scratch;
+        for (int r = begin; r < end; r++)
+        {
+            float *row = volume.row(r / dimY, r % dimY);
+            std::fill(row, row + dimZ, 0.0f);
+            for (size_t q = 0; q < m_layers.size(); q++)
+            {
+                this->addLayer(row, m_layers[q], r / dimY, r % dimY, m_generator.weight((int)q), scratch);
+            }
+            saturate(row, dimZ);
+        }
+    });
+
+    m_lastComposeTime = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
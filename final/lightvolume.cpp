@@ -0,0 +1,339 @@
+#include "lightvolume.h"
+#include "cloudvolume.h"
+#include "noisekernel.h"
+#include "threadpool.h"
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LIGHT_X86
+#include <immintrin.h>
+#endif
+
+#define SWEEP_CHUNK 4 //rows of a slice per thread pool task
+#define TRANSPOSE_BLOCK 16 //y per pass over z when copying the volume out z-major
+
+/**
+  One row of a slice: the two rows of the previous slice the rays come from, already offset by
+  the whole voxels of the shift, the fractions left to filter and the row's densities
+  */
+struct SweepRow
+{
+    const float *above; // previous slice, row u + u0, column v0
+    const float *below; // the row after it
+    const float *density;
+    float *out;
+    float fu, fv;
+    float falloff; // of the densities towards the top of the volume
+    float threshold;
+    float scale; // optical depth per unit of faded density
+};
+
+/**
+  Bilinear filter of the previous slice plus the voxel's own depth. The vector kernels below
+  perform the same float operations in the same order.
+  */
+static inline float sweepVoxel(const SweepRow &row, int v)
+{
+    float top = (1.0f - row.fv) * row.above[v] + row.fv * row.above[v + 1];
+    float bottom = (1.0f - row.fv) * row.below[v] + row.fv * row.below[v + 1];
+    float faded = row.density[v] * row.falloff;
+    float own = faded > row.threshold ? faded * row.scale : 0.0f;
+    return (1.0f - row.fu) * top + row.fu * bottom + own;
+}
+
+#ifdef LIGHT_X86
+static inline int sweepSse(const SweepRow &row, int begin, int end)
+{
+    __m128 fu = _mm_set1_ps(row.fu), gu = _mm_set1_ps(1.0f - row.fu);
+    __m128 fv = _mm_set1_ps(row.fv), gv = _mm_set1_ps(1.0f - row.fv);
+    __m128 falloff = _mm_set1_ps(row.falloff), threshold = _mm_set1_ps(row.threshold), scale = _mm_set1_ps(row.scale);
+
+    int v = begin;
+    for (; v + 4 <= end; v += 4)
+    {
+        __m128 top = _mm_add_ps(_mm_mul_ps(gv, _mm_loadu_ps(row.above + v)), _mm_mul_ps(fv, _mm_loadu_ps(row.above + v + 1)));
+        __m128 bottom = _mm_add_ps(_mm_mul_ps(gv, _mm_loadu_ps(row.below + v)), _mm_mul_ps(fv, _mm_loadu_ps(row.below + v + 1)));
+        __m128 faded = _mm_mul_ps(_mm_loadu_ps(row.density + v), falloff);
+        __m128 own = _mm_and_ps(_mm_cmpgt_ps(faded, threshold), _mm_mul_ps(faded, scale));
+        __m128 depth = _mm_add_ps(_mm_add_ps(_mm_mul_ps(gu, top), _mm_mul_ps(fu, bottom)), own);
+        _mm_storeu_ps(row.out + v, depth);
+    }
+    return v;
+}
+
+__attribute__((target("avx2")))
+static int sweepAvx2(const SweepRow &row, int begin, int end)
+{
+    __m256 fu = _mm256_set1_ps(row.fu), gu = _mm256_set1_ps(1.0f - row.fu);
+    __m256 fv = _mm256_set1_ps(row.fv), gv = _mm256_set1_ps(1.0f - row.fv);
+    __m256 falloff = _mm256_set1_ps(row.falloff), threshold = _mm256_set1_ps(row.threshold);
+    __m256 scale = _mm256_set1_ps(row.scale);
+
+    int v = begin;
+    for (; v + 8 <= end; v += 8)
+    {
+        __m256 top = _mm256_add_ps(_mm256_mul_ps(gv, _mm256_loadu_ps(row.above + v)),
+                                   _mm256_mul_ps(fv, _mm256_loadu_ps(row.above + v + 1)));
+        __m256 bottom = _mm256_add_ps(_mm256_mul_ps(gv, _mm256_loadu_ps(row.below + v)),
+                                      _mm256_mul_ps(fv, _mm256_loadu_ps(row.below + v + 1)));
+        __m256 faded = _mm256_mul_ps(_mm256_loadu_ps(row.density + v), falloff);
+        __m256 own = _mm256_and_ps(_mm256_cmp_ps(faded, threshold, _CMP_GT_OQ), _mm256_mul_ps(faded, scale));
+        __m256 depth = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(gu, top), _mm256_mul_ps(fu, bottom)), own);
+        _mm256_storeu_ps(row.out + v, depth);
+    }
+    return v;
+}
+#endif
+
+/**
+  Fills row.out for columns [0, count), widest kernel first and scalar for the tail
+  */
+static void sweepRow(const SweepRow &row, int count, bool wide)
+{
+    int v = 0;
+#ifdef LIGHT_X86
+    if (wide)
+    {
+        v = sweepAvx2(row, v, count);
+    }
+    v = sweepSse(row, v, count);
+#else
+    (void) wide;
+#endif
+    for (; v < count; v++)
+    {
+        row.out[v] = sweepVoxel(row, v);
+    }
+}
+
+LightVolume::LightVolume()
+    : m_sun(0, 1, 0), m_extinction(1), m_threshold(0), m_axis(1), m_uAxis(0), m_vAxis(2), m_reverse(true),
+      m_rowStride(0), m_sliceStride(0), m_firstDirty(1), m_lastSlices(0), m_lastUpdateTime(0)
+{
+    m_dims[0] = m_dims[1] = m_dims[2] = 0;
+}
+
+/**
+  Direction from the clouds towards the sun; any change recomputes the whole volume
+  */
+void LightVolume::setSun(const Vector3 &towardsSun)
+{
+    Vector3 sun = towardsSun.unit();
+    if (sun.x != m_sun.x || sun.y != m_sun.y || sun.z != m_sun.z)
+    {
+        m_sun = sun;
+        this->markDirty();
+    }
+}
+
+/**
+  Optical depth a voxel of density 1 adds over one voxel edge of path
+  */
+void LightVolume::setExtinction(float perVoxel)
+{
+    if (perVoxel != m_extinction)
+    {
+        m_extinction = perVoxel;
+        this->markDirty();
+    }
+}
+
+/**
+  Faded densities at or below threshold don't block light, like the voxels that aren't drawn
+  */
+void LightVolume::setThreshold(float threshold)
+{
+    if (threshold != m_threshold)
+    {
+        m_threshold = threshold;
+        this->markDirty();
+    }
+}
+
+void LightVolume::markDirty()
+{
+    m_firstDirty = 1;
+}
+
+void LightVolume::clear()
+{
+    m_depth.clear();
+    m_dims[0] = m_dims[1] = m_dims[2] = 0;
+    m_firstDirty = 1;
+}
+
+/**
+  Recomputes the dirty slices for volume, at most maxSlices of them if that is above 0; the
+  rest are left for the next calls, which must pass the same volume. Returns whether anything
+  was recomputed.
+  */
+bool LightVolume::update(const CloudVolume &volume, int maxSlices)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    int dims[3] = { volume.sizeX(), volume.sizeY(), volume.sizeZ() };
+    if (dims[0] != m_dims[0] || dims[1] != m_dims[1] || dims[2] != m_dims[2])
+    {
+        m_firstDirty = 1;
+    }
+
+    m_lastSlices = 0;
+    m_lastUpdateTime = 0;
+    if (volume.isEmpty())
+    {
+        this->clear();
+        return false;
+    }
+    if (m_firstDirty > 1 && m_firstDirty > m_dims[m_axis])
+    {
+        return false;
+    }
+
+    if (m_firstDirty <= 1)
+    {
+        //sweep along the axis the light travels the most along, so a slice step shifts by a voxel at most
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+        {
+            axis = fabsf(m_sun.xyz[a]) > fabsf(m_sun.xyz[axis]) ? a : axis;
+        }
+        int uAxis = axis == 0 ? 1 : 0;
+        int vAxis = axis == 2 ? 1 : 2;
+        bool reverse = m_sun.xyz[axis] > 0;
+
+        //the layout changed, so stale depths may sit where the zero border now is
+        bool relayout = axis != m_axis || dims[0] != m_dims[0] || dims[1] != m_dims[1] || dims[2] != m_dims[2];
+        m_axis = axis;
+        m_uAxis = uAxis;
+        m_vAxis = vAxis;
+        m_reverse = reverse;
+        m_dims[0] = dims[0];
+        m_dims[1] = dims[1];
+        m_dims[2] = dims[2];
+        m_rowStride = (dims[m_vAxis] + 2 + 7) / 8 * 8;
+        m_sliceStride = (size_t)(dims[m_uAxis] + 2) * m_rowStride;
+        size_t size = m_sliceStride * (dims[m_axis] + 1);
+        if (relayout || m_depth.size() != size)
+        {
+            m_depth.assign(size, 0.0f);
+        }
+    }
+
+    int last = m_dims[m_axis];
+    if (maxSlices > 0)
+    {
+        last = std::min(last, m_firstDirty + maxSlices - 1);
+    }
+    this->sweep(volume, m_firstDirty, last);
+    m_lastSlices = last - m_firstDirty + 1;
+    m_firstDirty = last + 1;
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    m_lastUpdateTime = elapsed.count();
+    return true;
+}
+
+/**
+  Computes slices first to last, in sweep order, one after the other; the rows of each in
+  parallel
+  */
+void LightVolume::sweep(const CloudVolume &volume, int first, int last)
+{
+    static const bool wide = NoiseKernel::detectIsa() == NoiseKernel::ISA_AVX2;
+
+    int slices = m_dims[m_axis];
+    int rows = m_dims[m_uAxis];
+    int columns = m_dims[m_vAxis];
+    int height = m_dims[1];
+
+    //every ray moves the same way between slices: one step towards the sun
+    float along = fabsf(m_sun.xyz[m_axis]);
+    float shiftU = m_sun.xyz[m_uAxis] / along;
+    float shiftV = m_sun.xyz[m_vAxis] / along;
+    int u0 = std::min((int)floorf(shiftU), 0);
+    int v0 = std::min((int)floorf(shiftV), 0);
+    float fu = shiftU - u0;
+    float fv = shiftV - v0;
+    float scale = m_extinction / along;
+    float threshold = m_threshold;
+
+    //sweeping along z the columns of a slice run along y, across the volume's rows, so the
+    //slices to do are first copied out faded, z-major, a few y at a time
+    if (m_axis == 2)
+    {
+        int low = m_reverse ? slices - last : first - 1;
+        int high = m_reverse ? slices - first + 1 : last;
+        m_transposed.resize((size_t)slices * rows * columns);
+        float *transposed = m_transposed.data();
+        ThreadPool::global().parallelFor(rows, SWEEP_CHUNK, [&](int begin, int end)
+        {
+            for (int x = begin; x < end; x++)
+            {
+                for (int y0 = 0; y0 < columns; y0 += TRANSPOSE_BLOCK)
+                {
+                    int y1 = std::min(y0 + TRANSPOSE_BLOCK, columns);
+                    for (int z = low; z < high; z++)
+                    {
+                        float *out = transposed + ((size_t)z * rows + x) * columns;
+                        for (int y = y0; y < y1; y++)
+                        {
+                            out[y] = volume.at(x, y, z) * (1.0f - y / (float) height);
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    for (int n = first; n <= last; n++)
+    {
+        int s = m_reverse ? slices - n : n - 1;
+        const float *previous = m_depth.data() + (n - 1) * m_sliceStride;
+        float *current = m_depth.data() + n * m_sliceStride;
+
+        ThreadPool::global().parallelFor(rows, SWEEP_CHUNK, [&](int begin, int end)
+        {
+            for (int u = begin; u < end; u++)
+            {
+                SweepRow row;
+                row.above = previous + (u + 1 + u0) * m_rowStride + 1 + v0;
+                row.below = row.above + m_rowStride;
+                row.out = current + (u + 1) * m_rowStride + 1;
+                row.fu = fu;
+                row.fv = fv;
+                row.threshold = threshold;
+                row.scale = scale;
+
+                if (m_axis == 2)
+                {
+                    row.density = m_transposed.data() + ((size_t)s * rows + u) * columns;
+                    row.falloff = 1.0f;
+                }
+                else
+                {
+                    row.density = m_axis == 0 ? volume.row(s, u) : volume.row(u, s);
+                    row.falloff = 1.0f - (m_axis == 0 ? u : s) / (float) height;
+                }
+                sweepRow(row, columns, wide);
+            }
+        });
+    }
+}
+
+size_t LightVolume::index(int x, int y, int z) const
+{
+    int voxel[3] = { x, y, z };
+    int s = voxel[m_axis];
+    int n = m_reverse ? m_dims[m_axis] - s : s + 1;
+    return n * m_sliceStride + (voxel[m_uAxis] + 1) * m_rowStride + voxel[m_vAxis] + 1;
+}
+
+/**
+  Fraction of the sunlight that reaches voxel (x, y, z)
+  */
+float LightVolume::transmittance(int x, int y, int z) const
+{
+    return expf(-m_depth[this->index(x, y, z)]);
+}
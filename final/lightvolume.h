@@ -0,0 +1,72 @@
+#ifndef LIGHTVOLUME_H
+#define LIGHTVOLUME_H
+
+#include <vector>
+#include "vector.h"
+
+class CloudVolume;
+
+/**
+    How much sunlight reaches each voxel of a cloud volume through the cloud between it and the
+    sun, which is treated as a directional light.
+
+    The volume is swept slice by slice along the axis the sun direction is most aligned with,
+    starting from the sun's side. Every voxel continues the ray of its neighbour in the previous
+    slice, one slice step towards the sun: its optical depth is the bilinearly filtered depth at
+    that point plus its own, extinction times the faded density (0 below the threshold, like the
+    voxels that aren't drawn). The offset within a slice is the same for every voxel, so a slice
+    is computed row by row on the global thread pool, each row with the widest SIMD kernel the
+    CPU has. Rows follow the z rows of the cloud volume when sweeping along x or y; along z the
+    densities are first copied out z-major. Rays entering through the sides start unshadowed.
+
+    Optical depth is stored, not transmittance, so the sweep needs no exp(); transmittance()
+    converts. Slices are kept with a border of zero depth so the kernels never test bounds.
+
+    update() only recomputes after the sun direction, the extinction, the threshold or the
+    volume size changes, or after markDirty(); any change recomputes every slice. A slice budget
+    spreads that sweep over several calls, e.g. one per frame.
+**/
+class LightVolume
+{
+
+public:
+    LightVolume();
+
+    void setSun(const Vector3 &towardsSun);
+    void setExtinction(float perVoxel);
+    void setThreshold(float threshold);
+    void markDirty();
+    bool update(const CloudVolume &volume, int maxSlices = 0);
+    void clear();
+
+    bool isEmpty() const { return m_depth.empty(); }
+    bool isUpToDate() const { return !m_depth.empty() && m_firstDirty > m_dims[m_axis]; }
+    float opticalDepth(int x, int y, int z) const { return m_depth[this->index(x, y, z)]; }
+    float transmittance(int x, int y, int z) const;
+
+    int lastSlices() const { return m_lastSlices; } // recomputed by the last update()
+    double lastUpdateTime() const { return m_lastUpdateTime; } // milliseconds
+
+private:
+    size_t index(int x, int y, int z) const;
+    void sweep(const CloudVolume &volume, int first, int last);
+
+    Vector3 m_sun; // unit vector towards the sun
+    float m_extinction;
+    float m_threshold;
+
+    int m_dims[3]; // of the volume last swept
+    int m_axis; // swept along
+    int m_uAxis, m_vAxis; // rows and columns of a slice, v contiguous
+    bool m_reverse; // the sun is on the high side of the sweep axis
+    int m_rowStride; // padded columns per row
+    size_t m_sliceStride; // padded rows per slice times m_rowStride
+    std::vector<float> m_depth; // slice 0 is the unlit one before the volume, then in sweep order
+    std::vector<float> m_transposed; // faded densities z-major, while sweeping along z
+
+    int m_firstDirty; // slice in sweep order, past the last one when clean
+    int m_lastSlices;
+    double m_lastUpdateTime;
+};
+
+#endif // LIGHTVOLUME_H
@@ -1,9 +1,41 @@
 #include <QtGui/QApplication>
 #include "mainwindow.h"
+#include "benchmark.h"
+#include "view.h"
 
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
+
+    // Cold and warm start of the cloud volume, which needs no window at all
+    if (a.arguments().contains("--bench-startup"))
+    {
+        CloudSettings volume = CloudSettings::fromArguments(a.arguments());
+        StartupBenchmark benchmark(volume, BenchmarkSettings::fromArguments(a.arguments()));
+        return benchmark.run() ? 0 : 2;
+    }
+
+    // Generating and paging an out of core volume, which needs no window either
+    if (a.arguments().contains("--bench-stream"))
+    {
+        CloudSettings volume = CloudSettings::fromArguments(a.arguments());
+        StreamBenchmark benchmark(volume, BenchmarkSettings::fromArguments(a.arguments()));
+        return benchmark.run() ? 0 : 2;
+    }
+
+    // Headless frame time measurements: render into a widget that never shows up on screen
+    if (a.arguments().contains("--bench"))
+    {
+        BenchmarkSettings settings = BenchmarkSettings::fromArguments(a.arguments());
+        View view(0);
+        view.setAttribute(Qt::WA_DontShowOnScreen);
+        view.resize(settings.width, settings.height);
+        view.show();
+
+        Benchmark benchmark(&view, settings);
+        return benchmark.run() ? 0 : 2;
+    }
+
     MainWindow w;
 
     bool startFullscreen = false;
@@ -19,4 +51,3 @@ int main(int argc, char *argv[])
 
     return a.exec();
 }
-
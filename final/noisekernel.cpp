@@ -0,0 +1,658 @@
+#include "noisekernel.h"
+#include <math.h>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NOISE_X86
+#include <immintrin.h>
+#endif
+
+const float NoiseKernel::TOLERANCE = 1e-5f;
+
+//our psuedo-random number array used for perlin generation (the upper half is left zeroed)
+static const int PERM[512] = {151,160,137,91,90,15,
+                131,13,201,95,96,53,194,233,7,225,140,36,103,30,69,142,8,99,37,240,21,10,23,
+                190, 6,148,247,120,234,75,0,26,197,62,94,252,219,203,117,35,11,32,57,177,33,
+                88,237,149,56,87,174,20,125,136,171,168, 68,175,74,165,71,134,139,48,27,166,
+                77,146,158,231,83,111,229,122,60,211,133,230,220,105,92,41,55,46,245,40,244,
+                102,143,54, 65,25,63,161, 1,216,80,73,209,76,132,187,208, 89,18,169,200,196,
+                135,130,116,188,159,86,164,100,109,198,173,186, 3,64,52,217,226,250,124,123,
+                5,202,38,147,118,126,255,82,85,212,207,206,59,227,47,16,58,17,182,189,28,42,
+                223,183,170,213,119,248,152, 2,44,154,163, 70,221,153,101,155,167, 43,172,9,
+                129,22,39,253, 19,98,108,110,79,113,224,232,178,185, 112,104,218,246,97,228,
+                251,34,242,193,238,210,144,12,191,179,162,241, 81,51,145,235,249,14,239,107,
+                49,192,214, 31,181,199,106,157,184, 84,204,176,115,121,50,45,127, 4,150,254,
+                138,236,205,93,222,114,67,29,24,72,243,141,128,195,78,66,215,61,156,180};
+
+/**
+  Gradient tables indexed by permutation slot: the old grad(PERM[n], x, y, z) is
+  GRAD.x[n] * x + GRAD.y[n] * y + GRAD.z[n] * z, with every component in {-1, 0, 1}.
+  */
+struct GradientTables
+{
+    float x[512];
+    float y[512];
+    float z[512];
+
+    GradientTables()
+    {
+        for (int n = 0; n < 512; n++)
+        {
+            int h = PERM[n] & 15;
+            float g[3] = { 0.f, 0.f, 0.f };
+
+            // same selection as the old CloudGenerator::grad
+            int uAxis = (h < 8) ? 0 : 1;
+            int vAxis = (h < 4) ? 1 : (h == 12 || h == 14) ? 0 : 2;
+            g[uAxis] = (h & 1) == 0 ? 1.f : -1.f;
+            g[vAxis] = (h & 2) == 0 ? 1.f : -1.f;
+
+            x[n] = g[0];
+            y[n] = g[1];
+            z[n] = g[2];
+        }
+    }
+};
+
+static const GradientTables GRAD;
+
+/**
+  Everything about a noise sample that is constant along a z row
+  */
+struct NoiseRow
+{
+    float x, y;   // offsets within the lattice cell
+    float x1, y1; // offsets minus one
+    float u, v;   // faded offsets
+    int aa, ab, ba, bb; // hash bases of the four corner columns
+    float freqZ;  // lattice cells per voxel along the row
+    float weight; // contribution of this octave to the sum
+    int shift;    // power-of-two grids only: log2 of the voxels per cell,
+    int mask;     // (1 << shift) - 1
+};
+
+// full unrolling of the octave loop for the specialized row functions
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 8
+#define NOISE_UNROLL _Pragma("GCC unroll 16")
+#else
+#define NOISE_UNROLL
+#endif
+
+static inline float fade(float t)
+{
+    return t * t * t * (t * (t * 6.f - 15.f) + 10.f);
+}
+
+static inline float lerp(float t, float a, float b)
+{
+    return std::max(0.f, a + t * (b - a));
+}
+
+static inline float grad(int n, float x, float y, float z)
+{
+    return GRAD.x[n] * x + GRAD.y[n] * y + GRAD.z[n] * z;
+}
+
+static inline void setupRow(NoiseRow &r, float x, float y)
+{
+    float fx = floorf(x);
+    float fy = floorf(y);
+    int X = (int)fx & 255;
+    int Y = (int)fy & 255;
+
+    r.x = x - fx;
+    r.y = y - fy;
+    r.x1 = r.x - 1.f;
+    r.y1 = r.y - 1.f;
+    r.u = fade(r.x);
+    r.v = fade(r.y);
+
+    int A = PERM[X] + Y;
+    int B = PERM[X + 1] + Y;
+    r.aa = PERM[A];
+    r.ab = PERM[A + 1];
+    r.ba = PERM[B];
+    r.bb = PERM[B + 1];
+}
+
+/**
+  Noise at offset z within z cell Z of the row
+  */
+static inline float noiseAt(const NoiseRow &r, int Z, float z)
+{
+    float z1 = z - 1.f;
+    float w = fade(z);
+
+    int AA = r.aa + Z;
+    int AB = r.ab + Z;
+    int BA = r.ba + Z;
+    int BB = r.bb + Z;
+
+    return lerp(w, lerp(r.v, lerp(r.u, grad(AA, r.x, r.y, z), grad(BA, r.x1, r.y, z)),
+                             lerp(r.u, grad(AB, r.x, r.y1, z), grad(BB, r.x1, r.y1, z))),
+                   lerp(r.v, lerp(r.u, grad(AA + 1, r.x, r.y, z1), grad(BA + 1, r.x1, r.y, z1)),
+                             lerp(r.u, grad(AB + 1, r.x, r.y1, z1), grad(BB + 1, r.x1, r.y1, z1))));
+}
+
+/**
+  A frequency of exactly 2^-shift lets cells and offsets come from shifts and masks. The
+  results are identical to the float path because scaling by a power of two is exact.
+  */
+static inline bool powerOfTwoShift(float freq, int &shift)
+{
+    int exponent;
+    if (frexpf(freq, &exponent) != 0.5f || exponent > 1 || exponent < -29)
+    {
+        return false;
+    }
+    shift = 1 - exponent;
+    return true;
+}
+
+static inline bool isPowerOfTwoGrid(const NoiseOctave *octaves, int numOctaves)
+{
+    int shift;
+    for (int q = 0; q < numOctaves; q++)
+    {
+        if (!powerOfTwoShift(octaves[q].freqZ, shift))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline void setupRows(NoiseRow *rows, int i, int j, const NoiseOctave *octaves, int numOctaves)
+{
+    for (int q = 0; q < numOctaves; q++)
+    {
+        //note the x lattice coordinate follows j and the y coordinate follows i
+        setupRow(rows[q], j * octaves[q].freqX + octaves[q].offsetX, i * octaves[q].freqY + octaves[q].offsetY);
+        rows[q].freqZ = octaves[q].freqZ;
+        rows[q].weight = octaves[q].weight;
+        rows[q].shift = 0;
+        powerOfTwoShift(octaves[q].freqZ, rows[q].shift);
+        rows[q].mask = (1 << rows[q].shift) - 1;
+    }
+}
+
+template<bool POW2>
+static inline float octaveAt(const NoiseRow &r, int k)
+{
+    int Z;
+    float z;
+    if (POW2)
+    {
+        Z = (k >> r.shift) & 255;
+        z = (float)(k & r.mask) * r.freqZ;
+    }
+    else
+    {
+        float pz = (float)k * r.freqZ;
+        float fz = floorf(pz);
+        Z = (int)fz & 255;
+        z = pz - fz;
+    }
+    return std::min(1.f, std::max(0.f, noiseAt(r, Z, z))) * r.weight;
+}
+
+template<int OCTAVES, bool POW2>
+static inline void fillScalar(float *row, int begin, int count, const NoiseRow *rows, int numOctaves)
+{
+    for (int k = begin; k < count; k++)
+    {
+        float sum = octaveAt<POW2>(rows[0], k);
+        if (OCTAVES > 0)
+        {
+            NOISE_UNROLL
+            for (int q = 1; q < OCTAVES; q++)
+            {
+                sum += octaveAt<POW2>(rows[q], k);
+            }
+        }
+        else
+        {
+            for (int q = 1; q < numOctaves; q++)
+            {
+                sum += octaveAt<POW2>(rows[q], k);
+            }
+        }
+        row[k] = std::min(1.f, sum);
+    }
+}
+
+/**
+  Row functions are instantiated for OCTAVES = 1..NoiseKernel::SPECIALIZED_OCTAVES, where the
+  octave loop is unrolled, and OCTAVES = 0, which reads the count at runtime. POW2 selects
+  shift/mask cell lookup instead of multiply/floor.
+  */
+template<int OCTAVES, bool POW2>
+static void fillRowScalar(float *row, int count, int i, int j, const NoiseOctave *octaves, int numOctaves)
+{
+    const int n = OCTAVES > 0 ? OCTAVES : numOctaves;
+    NoiseRow rows[NoiseKernel::MAX_OCTAVES];
+    setupRows(rows, i, j, octaves, n);
+    fillScalar<OCTAVES, POW2>(row, 0, count, rows, n);
+}
+
+#ifdef NOISE_X86
+
+/**
+  SSE4.1: eight voxels per iteration as two 4-wide halves. There is no gather, so the
+  per-lane corner hashes are resolved into small gradient arrays first.
+  */
+__attribute__((target("sse4.1")))
+static inline __m128 fadeSse(__m128 t)
+{
+    __m128 inner = _mm_add_ps(_mm_mul_ps(t, _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6.f)), _mm_set1_ps(15.f))),
+                              _mm_set1_ps(10.f));
+    return _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(t, t), t), inner);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128 lerpSse(__m128 t, __m128 a, __m128 b)
+{
+    return _mm_max_ps(_mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a))), _mm_setzero_ps());
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128 gradSse(const float *gx, const float *gy, const float *gz, __m128 x, __m128 y, __m128 z)
+{
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(gx), x), _mm_mul_ps(_mm_load_ps(gy), y)),
+                      _mm_mul_ps(_mm_load_ps(gz), z));
+}
+
+/**
+  One octave's clamped, weighted contribution to voxels k..k+7, written to out[0] and out[1]
+  */
+template<bool POW2>
+__attribute__((target("sse4.1")))
+static inline void octaveSse(const NoiseRow &r, int k, __m128 *out)
+{
+    const __m128 vx = _mm_set1_ps(r.x), vx1 = _mm_set1_ps(r.x1);
+    const __m128 vy = _mm_set1_ps(r.y), vy1 = _mm_set1_ps(r.y1);
+    const __m128 vu = _mm_set1_ps(r.u), vv = _mm_set1_ps(r.v);
+    const __m128 freqZ = _mm_set1_ps(r.freqZ);
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128i mask = _mm_set1_epi32(255);
+    const int bases[4] = { r.aa, r.ba, r.ab, r.bb };
+
+    // corner c of lane l lives at [c][l]; corners are ordered AA, BA, AB, BB, then the +1 row
+    float gx[8][8] __attribute__((aligned(16)));
+    float gy[8][8] __attribute__((aligned(16)));
+    float gz[8][8] __attribute__((aligned(16)));
+    int cell[8] __attribute__((aligned(16)));
+
+    __m128 z[2], w[2], z1[2];
+    for (int h = 0; h < 2; h++)
+    {
+        __m128i index = _mm_add_epi32(_mm_set1_epi32(k + 4 * h), _mm_setr_epi32(0, 1, 2, 3));
+        __m128i Z;
+        if (POW2)
+        {
+            Z = _mm_srl_epi32(index, _mm_cvtsi32_si128(r.shift));
+            z[h] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(index, _mm_set1_epi32(r.mask))), freqZ);
+        }
+        else
+        {
+            __m128 pz = _mm_mul_ps(_mm_cvtepi32_ps(index), freqZ);
+            __m128 fz = _mm_floor_ps(pz);
+            Z = _mm_cvttps_epi32(fz);
+            z[h] = _mm_sub_ps(pz, fz);
+        }
+        _mm_store_si128((__m128i *)(cell + 4 * h), _mm_and_si128(Z, mask));
+        z1[h] = _mm_sub_ps(z[h], one);
+        w[h] = fadeSse(z[h]);
+    }
+
+    for (int l = 0; l < 8; l++)
+    {
+        for (int c = 0; c < 4; c++)
+        {
+            int n = bases[c] + cell[l];
+            gx[c][l] = GRAD.x[n];     gy[c][l] = GRAD.y[n];     gz[c][l] = GRAD.z[n];
+            gx[c + 4][l] = GRAD.x[n + 1]; gy[c + 4][l] = GRAD.y[n + 1]; gz[c + 4][l] = GRAD.z[n + 1];
+        }
+    }
+
+    for (int h = 0; h < 2; h++)
+    {
+        int o = 4 * h;
+        __m128 c000 = gradSse(gx[0] + o, gy[0] + o, gz[0] + o, vx, vy, z[h]);
+        __m128 c100 = gradSse(gx[1] + o, gy[1] + o, gz[1] + o, vx1, vy, z[h]);
+        __m128 c010 = gradSse(gx[2] + o, gy[2] + o, gz[2] + o, vx, vy1, z[h]);
+        __m128 c110 = gradSse(gx[3] + o, gy[3] + o, gz[3] + o, vx1, vy1, z[h]);
+        __m128 c001 = gradSse(gx[4] + o, gy[4] + o, gz[4] + o, vx, vy, z1[h]);
+        __m128 c101 = gradSse(gx[5] + o, gy[5] + o, gz[5] + o, vx1, vy, z1[h]);
+        __m128 c011 = gradSse(gx[6] + o, gy[6] + o, gz[6] + o, vx, vy1, z1[h]);
+        __m128 c111 = gradSse(gx[7] + o, gy[7] + o, gz[7] + o, vx1, vy1, z1[h]);
+
+        __m128 color = lerpSse(w[h], lerpSse(vv, lerpSse(vu, c000, c100), lerpSse(vu, c010, c110)),
+                                     lerpSse(vv, lerpSse(vu, c001, c101), lerpSse(vu, c011, c111)));
+        out[h] = _mm_mul_ps(_mm_min_ps(_mm_max_ps(color, _mm_setzero_ps()), one), _mm_set1_ps(r.weight));
+    }
+}
+
+template<int OCTAVES, bool POW2>
+__attribute__((target("sse4.1")))
+static void fillRowSse41(float *row, int count, int i, int j, const NoiseOctave *octaves, int numOctaves)
+{
+    const int n = OCTAVES > 0 ? OCTAVES : numOctaves;
+    NoiseRow rows[NoiseKernel::MAX_OCTAVES];
+    setupRows(rows, i, j, octaves, n);
+
+    const __m128 one = _mm_set1_ps(1.f);
+
+    int k = 0;
+    for (; k + 8 <= count; k += 8)
+    {
+        __m128 sum[2], color[2];
+        octaveSse<POW2>(rows[0], k, sum);
+        if (OCTAVES > 0)
+        {
+            NOISE_UNROLL
+            for (int q = 1; q < OCTAVES; q++)
+            {
+                octaveSse<POW2>(rows[q], k, color);
+                sum[0] = _mm_add_ps(sum[0], color[0]);
+                sum[1] = _mm_add_ps(sum[1], color[1]);
+            }
+        }
+        else
+        {
+            for (int q = 1; q < n; q++)
+            {
+                octaveSse<POW2>(rows[q], k, color);
+                sum[0] = _mm_add_ps(sum[0], color[0]);
+                sum[1] = _mm_add_ps(sum[1], color[1]);
+            }
+        }
+        _mm_storeu_ps(row + k, _mm_min_ps(sum[0], one));
+        _mm_storeu_ps(row + k + 4, _mm_min_ps(sum[1], one));
+    }
+
+    fillScalar<OCTAVES, POW2>(row, k, count, rows, n);
+}
+
+/**
+  AVX2: eight voxels per iteration, gradients fetched straight from the tables with gathers
+  */
+__attribute__((target("avx2")))
+static inline __m256 fadeAvx2(__m256 t)
+{
+    __m256 inner = _mm256_add_ps(_mm256_mul_ps(t, _mm256_sub_ps(_mm256_mul_ps(t, _mm256_set1_ps(6.f)), _mm256_set1_ps(15.f))),
+                                 _mm256_set1_ps(10.f));
+    return _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(t, t), t), inner);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 lerpAvx2(__m256 t, __m256 a, __m256 b)
+{
+    return _mm256_max_ps(_mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a))), _mm256_setzero_ps());
+}
+
+__attribute__((target("avx2")))
+static inline __m256 gradAvx2(__m256i n, __m256 x, __m256 y, __m256 z)
+{
+    __m256 gx = _mm256_i32gather_ps(GRAD.x, n, 4);
+    __m256 gy = _mm256_i32gather_ps(GRAD.y, n, 4);
+    __m256 gz = _mm256_i32gather_ps(GRAD.z, n, 4);
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(gx, x), _mm256_mul_ps(gy, y)), _mm256_mul_ps(gz, z));
+}
+
+/**
+  One octave's clamped, weighted contribution to the 8 voxels whose indices are in ki / kf
+  */
+template<bool POW2>
+__attribute__((target("avx2")))
+static inline __m256 octaveAvx2(const NoiseRow &r, __m256i ki, __m256 kf)
+{
+    const __m256 vx = _mm256_set1_ps(r.x), vx1 = _mm256_set1_ps(r.x1);
+    const __m256 vy = _mm256_set1_ps(r.y), vy1 = _mm256_set1_ps(r.y1);
+    const __m256 vu = _mm256_set1_ps(r.u), vv = _mm256_set1_ps(r.v);
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256i inc = _mm256_set1_epi32(1);
+
+    __m256i Z;
+    __m256 z;
+    if (POW2)
+    {
+        Z = _mm256_srl_epi32(ki, _mm_cvtsi32_si128(r.shift));
+        z = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(ki, _mm256_set1_epi32(r.mask))), _mm256_set1_ps(r.freqZ));
+    }
+    else
+    {
+        __m256 pz = _mm256_mul_ps(kf, _mm256_set1_ps(r.freqZ));
+        __m256 fz = _mm256_floor_ps(pz);
+        Z = _mm256_cvttps_epi32(fz);
+        z = _mm256_sub_ps(pz, fz);
+    }
+    Z = _mm256_and_si256(Z, _mm256_set1_epi32(255));
+    __m256 z1 = _mm256_sub_ps(z, one);
+    __m256 w = fadeAvx2(z);
+
+    __m256i AA = _mm256_add_epi32(_mm256_set1_epi32(r.aa), Z);
+    __m256i AB = _mm256_add_epi32(_mm256_set1_epi32(r.ab), Z);
+    __m256i BA = _mm256_add_epi32(_mm256_set1_epi32(r.ba), Z);
+    __m256i BB = _mm256_add_epi32(_mm256_set1_epi32(r.bb), Z);
+
+    __m256 color = lerpAvx2(w, lerpAvx2(vv, lerpAvx2(vu, gradAvx2(AA, vx, vy, z), gradAvx2(BA, vx1, vy, z)),
+                                            lerpAvx2(vu, gradAvx2(AB, vx, vy1, z), gradAvx2(BB, vx1, vy1, z))),
+                               lerpAvx2(vv, lerpAvx2(vu, gradAvx2(_mm256_add_epi32(AA, inc), vx, vy, z1),
+                                                         gradAvx2(_mm256_add_epi32(BA, inc), vx1, vy, z1)),
+                                            lerpAvx2(vu, gradAvx2(_mm256_add_epi32(AB, inc), vx, vy1, z1),
+                                                         gradAvx2(_mm256_add_epi32(BB, inc), vx1, vy1, z1))));
+    return _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(color, _mm256_setzero_ps()), one), _mm256_set1_ps(r.weight));
+}
+
+template<int OCTAVES, bool POW2>
+__attribute__((target("avx2")))
+static void fillRowAvx2(float *row, int count, int i, int j, const NoiseOctave *octaves, int numOctaves)
+{
+    const int n = OCTAVES > 0 ? OCTAVES : numOctaves;
+    NoiseRow rows[NoiseKernel::MAX_OCTAVES];
+    setupRows(rows, i, j, octaves, n);
+
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    int k = 0;
+    for (; k + 8 <= count; k += 8)
+    {
+        __m256i ki = _mm256_add_epi32(_mm256_set1_epi32(k), lanes);
+        __m256 kf = _mm256_cvtepi32_ps(ki);
+        __m256 sum = octaveAvx2<POW2>(rows[0], ki, kf);
+        if (OCTAVES > 0)
+        {
+            NOISE_UNROLL
+            for (int q = 1; q < OCTAVES; q++)
+            {
+                sum = _mm256_add_ps(sum, octaveAvx2<POW2>(rows[q], ki, kf));
+            }
+        }
+        else
+        {
+            for (int q = 1; q < n; q++)
+            {
+                sum = _mm256_add_ps(sum, octaveAvx2<POW2>(rows[q], ki, kf));
+            }
+        }
+        _mm256_storeu_ps(row + k, _mm256_min_ps(sum, one));
+    }
+
+    fillScalar<OCTAVES, POW2>(row, k, count, rows, n);
+}
+
+#endif // NOISE_X86
+
+#define NOISE_ROW_FUNCTIONS(function, pow2) \
+    { function<0, pow2>, function<1, pow2>, function<2, pow2>, function<3, pow2>, function<4, pow2>, \
+      function<5, pow2>, function<6, pow2>, function<7, pow2>, function<8, pow2> }
+
+NoiseKernel::NoiseKernel(Isa isa, bool specialize)
+    : m_isa(ISA_SCALAR), m_specialize(specialize)
+{
+    static const RowFunction scalarRows[2][SPECIALIZED_OCTAVES + 1] = {
+        NOISE_ROW_FUNCTIONS(fillRowScalar, false), NOISE_ROW_FUNCTIONS(fillRowScalar, true) };
+    const RowFunction (*rows)[SPECIALIZED_OCTAVES + 1] = scalarRows;
+
+    // never pick a path the cpu can't run, whatever was asked for
+    Isa supported = detectIsa();
+    if (isa > supported)
+    {
+        isa = supported;
+    }
+
+#ifdef NOISE_X86
+    static const RowFunction sseRows[2][SPECIALIZED_OCTAVES + 1] = {
+        NOISE_ROW_FUNCTIONS(fillRowSse41, false), NOISE_ROW_FUNCTIONS(fillRowSse41, true) };
+    static const RowFunction avx2Rows[2][SPECIALIZED_OCTAVES + 1] = {
+        NOISE_ROW_FUNCTIONS(fillRowAvx2, false), NOISE_ROW_FUNCTIONS(fillRowAvx2, true) };
+
+    if (isa == ISA_AVX2)
+    {
+        rows = avx2Rows;
+    }
+    else if (isa == ISA_SSE41)
+    {
+        rows = sseRows;
+    }
+#endif
+    m_isa = isa;
+
+    for (int pow2 = 0; pow2 < 2; pow2++)
+    {
+        for (int n = 0; n <= SPECIALIZED_OCTAVES; n++)
+        {
+            m_rows[pow2][n] = rows[pow2][n];
+        }
+    }
+}
+
+/**
+  Writes min(1, sum over octaves of weight * clamp(noise)) for voxels (i, j, 0..count) into
+  row, evaluating every octave per voxel in a single pass. Octave counts up to
+  SPECIALIZED_OCTAVES and power-of-two z frequencies take the specialized paths unless the
+  kernel was built without them.
+  */
+void NoiseKernel::fillRow(float *row, int count, int i, int j, const NoiseOctave *octaves, int numOctaves) const
+{
+    if (numOctaves <= 0)
+    {
+        std::fill(row, row + count, 0.f);
+        return;
+    }
+    numOctaves = std::min(numOctaves, (int)MAX_OCTAVES);
+
+    if (!m_specialize)
+    {
+        m_rows[0][0](row, count, i, j, octaves, numOctaves);
+        return;
+    }
+
+    int pow2 = isPowerOfTwoGrid(octaves, numOctaves) ? 1 : 0;
+    int unrolled = numOctaves <= SPECIALIZED_OCTAVES ? numOctaves : 0;
+    m_rows[pow2][unrolled](row, count, i, j, octaves, numOctaves);
+}
+
+NoiseKernel::Isa NoiseKernel::detectIsa()
+{
+#ifdef NOISE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return ISA_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return ISA_SSE41;
+    }
+#endif
+    return ISA_SCALAR;
+}
+
+const char *NoiseKernel::isaName(Isa isa)
+{
+    switch (isa)
+    {
+    case ISA_AVX2: return "avx2";
+    case ISA_SSE41: return "sse4.1";
+    default: return "scalar";
+    }
+}
+
+/**
+  Identifies the permutation table, the only seed of the noise, as its FNV-1a hash
+  */
+unsigned NoiseKernel::seed()
+{
+    unsigned hash = 2166136261u;
+    for (int n = 0; n < 256; n++)
+    {
+        hash = (hash ^ (unsigned)PERM[n]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+  Scalar float reference for a single sample (without clamping)
+  */
+float NoiseKernel::noise(float x, float y, float z)
+{
+    NoiseRow r;
+    setupRow(r, x, y);
+    float fz = floorf(z);
+    return noiseAt(r, (int)fz & 255, z - fz);
+}
+
+/**
+  Runs the given path, specialized and generic, against the generic scalar reference over a
+  spread of rows, octave counts and grids and returns the largest absolute difference.
+  Anything above TOLERANCE is a bug.
+  */
+float NoiseKernel::verify(Isa isa)
+{
+    const int count = 67; // deliberately not a multiple of 8 so the tail is covered too
+    const int numOctaves = SPECIALIZED_OCTAVES + 2;
+    float expected[count];
+    float actual[count];
+    float worst = 0.f;
+
+    NoiseKernel reference(ISA_SCALAR, false);
+    NoiseKernel kernels[2] = { NoiseKernel(isa, false), NoiseKernel(isa, true) };
+
+    for (int grid = 0; grid < 2; grid++)
+    {
+        // grid 1 has power-of-two z frequencies, grid 0 does not
+        NoiseOctave octaves[numOctaves];
+        for (int q = 0; q < numOctaves; q++)
+        {
+            octaves[q].freqX = 0.08f * (1 << q);
+            octaves[q].freqY = 0.16f * (1 << q);
+            octaves[q].freqZ = grid ? 1.f / (1 << (numOctaves - q)) : 0.0625f * (1 << q) + 0.01f * q;
+            octaves[q].weight = 1.f / (1 << q);
+            octaves[q].offsetX = 0.37f * q;
+            octaves[q].offsetY = -1.5f * q;
+        }
+
+        for (int n = 1; n <= numOctaves; n++)
+        {
+            for (int j = 0; j < 12; j++)
+            {
+                reference.fillRow(expected, count, j * 3, j * 7, octaves, n);
+
+                for (int s = 0; s < 2; s++)
+                {
+                    kernels[s].fillRow(actual, count, j * 3, j * 7, octaves, n);
+
+                    for (int k = 0; k < count; k++)
+                    {
+                        worst = std::max(worst, fabsf(expected[k] - actual[k]));
+                    }
+                }
+            }
+        }
+    }
+
+    return worst;
+}
@@ -0,0 +1,64 @@
+#ifndef NOISEKERNEL_H
+#define NOISEKERNEL_H
+
+/**
+    Lattice frequencies, offsets and weight of one perlin octave. Voxel (i, j, k) samples the
+    noise at (j * freqX + offsetX, i * freqY + offsetY, k * freqZ), matching the axis order
+    calcIntensity has always used. The offsets are in lattice cells and let the octaves drift.
+**/
+struct NoiseOctave
+{
+    float freqX;
+    float freqY;
+    float freqZ;
+    float weight;
+    float offsetX;
+    float offsetY;
+};
+
+/**
+    Evaluates rows of summed, clamped perlin octaves along z.
+
+    The scalar path is the float reference. The SSE4.1 and AVX2 paths evaluate 8 voxels per
+    iteration with table-driven gradients and perform the same float operations in the same
+    order, so they match the reference to within TOLERANCE (in practice they are bit-identical;
+    the bound leaves room for compilers that contract the scalar path into FMAs). The widest
+    path the CPU supports is picked at runtime.
+
+    Each path is also instantiated per octave count, with the octave loop fully unrolled, and
+    for grids whose z frequencies are powers of two, where cells come from shifts and masks
+    instead of multiply and floor. Those specializations give the same results as the
+    generic code and are picked per call.
+**/
+class NoiseKernel
+{
+
+public:
+    typedef void (*RowFunction)(float *row, int count, int i, int j, const NoiseOctave *octaves, int numOctaves);
+
+    enum Isa { ISA_SCALAR, ISA_SSE41, ISA_AVX2 };
+
+    static const float TOLERANCE;
+    static const int MAX_OCTAVES = 16;
+    static const int SPECIALIZED_OCTAVES = 8; // octave counts with their own unrolled row functions
+
+    explicit NoiseKernel(Isa isa = detectIsa(), bool specialize = true);
+
+    Isa isa() const { return m_isa; }
+    bool isSpecialized() const { return m_specialize; }
+
+    void fillRow(float *row, int count, int i, int j, const NoiseOctave *octaves, int numOctaves) const;
+
+    static Isa detectIsa();
+    static const char *isaName(Isa isa);
+    static float noise(float x, float y, float z);
+    static unsigned seed();
+    static float verify(Isa isa);
+
+private:
+    Isa m_isa;
+    bool m_specialize;
+    RowFunction m_rows[2][SPECIALIZED_OCTAVES + 1]; // [power-of-two grid][octave count, 0 = any]
+};
+
+#endif // NOISEKERNEL_H
@@ -0,0 +1,172 @@
+#include "particleculler.h"
+#include "camera.h"
+#include <algorithm>
+
+#define NEAR_PLANE 0.1f //same as the projection in View::applyPerspectiveCamera
+
+ParticleCuller::ParticleCuller()
+    : m_valid(false), m_impostorDistance(0), m_clusterSize(0), m_visibleBricks(0), m_culledBricks(0),
+      m_culledParticles(0), m_farParticles(0)
+{
+}
+
+/**
+  Nodes farther than distance from the eye become far clusters no larger than clusterSize along
+  any axis (bricks may exceed it); a distance of 0 turns this off
+  */
+void ParticleCuller::setImpostors(float distance, float clusterSize)
+{
+    m_impostorDistance = distance;
+    m_clusterSize = clusterSize;
+    m_valid = false;
+}
+
+/**
+  Forgets the previous visible set, e.g. after the particles were rebuilt
+  */
+void ParticleCuller::invalidate()
+{
+    m_valid = false;
+}
+
+/**
+  Finds the bricks within the camera's view. aspect is the viewport width over its height and
+  margin how far a billboard reaches beyond its particle. Returns whether visible() changed
+  since the last call.
+  */
+bool ParticleCuller::cull(const CloudParticles &particles, const OrbitCamera &camera, float aspect, float margin)
+{
+    Vector3 dir(-Vector3::fromAngles(camera.theta, camera.phi));
+    Vector3 eye(camera.center - dir * camera.zoom);
+    Vector3 right = dir.cross(camera.up).unit();
+    Vector3 up = right.cross(dir);
+
+    float tanY = tanf(camera.fovy * M_PI / 360.0);
+    float tanX = tanY * aspect;
+
+    //each side plane contains the eye and one edge direction of the view pyramid
+    Vector3 edges[4] = { dir + right * tanX, dir - right * tanX, dir + up * tanY, dir - up * tanY };
+    Vector3 along[4] = { up, up, right, right };
+    for (int p = 0; p < 4; p++)
+    {
+        Vector3 normal = edges[p].cross(along[p]).unit();
+        if (normal.dot(dir) < 0)
+        {
+            normal = -normal;
+        }
+        m_planes[p].normal = normal;
+        m_planes[p].offset = -normal.dot(eye);
+    }
+    m_planes[4].normal = dir;
+    m_planes[4].offset = -dir.dot(eye + dir * NEAR_PLANE);
+
+    m_eye = eye;
+    m_ranges.clear();
+    m_far.clear();
+    m_visibleBricks = 0;
+    m_farParticles = 0;
+    const std::vector<CloudParticles::Node> &nodes = particles.nodes();
+    if (!nodes.empty())
+    {
+        visit(nodes, 0, margin);
+    }
+
+    m_culledBricks = (nodes.empty() ? 0 : nodes[0].bricks) - m_visibleBricks;
+
+    bool changed = !m_valid || m_ranges != m_lastRanges || m_far != m_lastFar;
+    if (changed)
+    {
+        m_visible.clear();
+        for (size_t r = 0; r < m_ranges.size(); r += 2)
+        {
+            for (int p = m_ranges[r]; p < m_ranges[r] + m_ranges[r + 1]; p++)
+            {
+                m_visible.push_back(p);
+            }
+        }
+        m_lastRanges.swap(m_ranges);
+        m_lastFar = m_far;
+        m_valid = true;
+    }
+    m_culledParticles = particles.size() - (int)m_visible.size() - m_farParticles;
+    return changed;
+}
+
+/**
+  Lists the particles of a node, merged with the previous range when they touch
+  */
+void ParticleCuller::addRange(const CloudParticles::Node &node)
+{
+    if (!m_ranges.empty() && m_ranges[m_ranges.size() - 2] + m_ranges.back() == node.first)
+    {
+        m_ranges.back() += node.count;
+    }
+    else
+    {
+        m_ranges.push_back(node.first);
+        m_ranges.push_back(node.count);
+    }
+}
+
+/**
+  Collects the visible particle ranges below a node
+  */
+void ParticleCuller::visit(const std::vector<CloudParticles::Node> &nodes, int index, float margin)
+{
+    const CloudParticles::Node &node = nodes[index];
+
+    bool inside = true;
+    for (int p = 0; p < PLANES; p++)
+    {
+        const Vector3 &n = m_planes[p].normal;
+
+        //the corners farthest in front of and behind the plane
+        Vector3 front(n.x > 0 ? node.max.x : node.min.x, n.y > 0 ? node.max.y : node.min.y, n.z > 0 ? node.max.z : node.min.z);
+        Vector3 back(n.x > 0 ? node.min.x : node.max.x, n.y > 0 ? node.min.y : node.max.y, n.z > 0 ? node.min.z : node.max.z);
+
+        if (n.dot(front) + m_planes[p].offset < -margin)
+        {
+            return;
+        }
+        inside = inside && n.dot(back) + m_planes[p].offset >= margin;
+    }
+
+    bool mixed = false;
+    if (m_impostorDistance > 0)
+    {
+        //distances from the eye to the nearest and farthest particle bounds
+        Vector3 nearest = Vector3::max(node.min, Vector3::min(m_eye, node.max));
+        Vector3 farthest(m_eye.x * 2 > node.min.x + node.max.x ? node.min.x : node.max.x,
+                         m_eye.y * 2 > node.min.y + node.max.y ? node.min.y : node.max.y,
+                         m_eye.z * 2 > node.min.z + node.max.z ? node.min.z : node.max.z);
+        Vector3 extent = node.max - node.min;
+
+        if ((nearest - m_eye).length() > m_impostorDistance)
+        {
+            if (node.childCount == 0 || std::max(extent.x, std::max(extent.y, extent.z)) <= m_clusterSize)
+            {
+                m_far.push_back(index);
+                m_visibleBricks += node.bricks;
+                m_farParticles += node.count;
+                return;
+            }
+            mixed = true;
+        }
+        else
+        {
+            mixed = (farthest - m_eye).length() > m_impostorDistance;
+        }
+    }
+
+    if ((inside && !mixed) || node.childCount == 0)
+    {
+        this->addRange(node);
+        m_visibleBricks += node.bricks;
+        return;
+    }
+
+    for (int c = 0; c < node.childCount; c++)
+    {
+        visit(nodes, node.children[c], margin);
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef PARTICLECULLER_H
+#define PARTICLECULLER_H
+
+#include <vector>
+#include "vector.h"
+#include "cloudparticles.h"
+
+struct OrbitCamera;
+
+/**
+    Frustum culling of the particle brick octree built by CloudParticles.
+
+    The frustum is derived from the orbit camera the same way applyPerspectiveCamera sets up the
+    projection. Nodes are tested with their bounds grown by the billboard reach; nodes entirely
+    inside contribute their whole index range without descending further, so a fully visible
+    cloud costs a single test. The visible particles are listed by brick, ready to be sorted.
+
+    With an impostor distance set, nodes whose particles all lie farther than that from the eye
+    are not listed but handed out as clusters instead, the largest nodes that still fit in
+    clusterSize (or single bricks), to be drawn as impostors.
+**/
+class ParticleCuller
+{
+
+public:
+    ParticleCuller();
+
+    bool cull(const CloudParticles &particles, const OrbitCamera &camera, float aspect, float margin);
+    void invalidate();
+    void setImpostors(float distance, float clusterSize);
+
+    const std::vector<int> &visible() const { return m_visible; }
+    const std::vector<int> &farClusters() const { return m_far; } // node indices
+
+    int visibleBricks() const { return m_visibleBricks; }
+    int culledBricks() const { return m_culledBricks; }
+    int visibleParticles() const { return (int)m_visible.size(); }
+    int culledParticles() const { return m_culledParticles; }
+    int farParticles() const { return m_farParticles; } // in the far clusters
+
+private:
+    struct Plane
+    {
+        Vector3 normal; // points into the frustum
+        float offset;
+    };
+
+    enum { PLANES = 5 }; // no far plane, it lies well beyond the sky box
+
+    void visit(const std::vector<CloudParticles::Node> &nodes, int index, float margin);
+    void addRange(const CloudParticles::Node &node);
+
+    Plane m_planes[PLANES];
+    std::vector<int> m_ranges; // first and count of each visible run of particles
+    std::vector<int> m_lastRanges;
+    std::vector<int> m_visible; // particle indices, brick by brick
+    std::vector<int> m_far;
+    std::vector<int> m_lastFar;
+    bool m_valid;
+
+    Vector3 m_eye;
+    float m_impostorDistance; // 0 when every visible particle is listed
+    float m_clusterSize;
+
+    int m_visibleBricks;
+    int m_culledBricks;
+    int m_culledParticles;
+    int m_farParticles;
+};
+
+#endif // PARTICLECULLER_H
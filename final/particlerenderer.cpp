@@ -0,0 +1,266 @@
+#include "particlerenderer.h"
+
+#include <cstring>
+#include <QGLShaderProgram>
+
+#define INSTANCE_FLOATS 5 //x, y, z, size, layer
+
+ParticleRenderer::ParticleRenderer()
+    : m_program(0), m_corners(QGLBuffer::VertexBuffer), m_instances(QGLBuffer::VertexBuffer),
+      m_instanceCount(0), m_supported(false), m_textureArray(0), m_cornerLocation(-1),
+      m_particleLocation(-1), m_layerLocation(-1), m_textureBinds(0), m_drawCalls(0),
+      m_vertexAttribDivisor(0), m_drawArraysInstanced(0), m_arrayProgram(0), m_batchedProgram(0)
+{
+    memset(m_layerTextures, 0, sizeof(m_layerTextures));
+    memset(m_batchStart, 0, sizeof(m_batchStart));
+}
+
+/**
+  Whether the context can sample GL_TEXTURE_2D_ARRAY from a shader
+  */
+bool ParticleRenderer::hasTextureArrays()
+{
+    const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+    return (QGLFormat::openGLVersionFlags() & QGLFormat::OpenGL_Version_3_0)
+            || (extensions && strstr(extensions, "GL_EXT_texture_array"));
+}
+
+/**
+  Resolves the instancing entry points and creates the buffers. Must be called with the
+  context current; returns whether the instanced path can be used. Call setTextures()
+  afterwards to pick between the texture array and the batched program.
+  */
+bool ParticleRenderer::initialize(const QGLContext *context, QGLShaderProgram *arrayProgram, QGLShaderProgram *batchedProgram)
+{
+    m_supported = false;
+    m_arrayProgram = arrayProgram;
+    m_batchedProgram = batchedProgram;
+
+    const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+    bool instancing = (QGLFormat::openGLVersionFlags() & QGLFormat::OpenGL_Version_3_3)
+            || (extensions && strstr(extensions, "GL_ARB_instanced_arrays"));
+    if (!context || !batchedProgram || !instancing)
+    {
+        return false;
+    }
+
+    m_vertexAttribDivisor = (PFNGLVERTEXATTRIBDIVISORARBPROC) context->getProcAddress("glVertexAttribDivisor");
+    if (!m_vertexAttribDivisor)
+    {
+        m_vertexAttribDivisor = (PFNGLVERTEXATTRIBDIVISORARBPROC) context->getProcAddress("glVertexAttribDivisorARB");
+    }
+    m_drawArraysInstanced = (PFNGLDRAWARRAYSINSTANCEDARBPROC) context->getProcAddress("glDrawArraysInstanced");
+    if (!m_drawArraysInstanced)
+    {
+        m_drawArraysInstanced = (PFNGLDRAWARRAYSINSTANCEDARBPROC) context->getProcAddress("glDrawArraysInstancedARB");
+    }
+    if (!m_vertexAttribDivisor || !m_drawArraysInstanced)
+    {
+        return false;
+    }
+
+    //same corners, order and winding as renderTexturedQuad
+    const GLfloat corners[] = { 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f, 0.0f, 1.0f };
+    if (!m_corners.create() || !m_instances.create())
+    {
+        return false;
+    }
+    m_corners.setUsagePattern(QGLBuffer::StaticDraw);
+    m_corners.bind();
+    m_corners.allocate(corners, sizeof(corners));
+    m_corners.release();
+
+    m_instances.setUsagePattern(QGLBuffer::DynamicDraw);
+
+    m_supported = true;
+    return true;
+}
+
+/**
+  Hands over the particle textures. With a texture array (layers as in CloudParticles::shade,
+  then WHITE_LAYER and MODELER_LAYER) it is bound once here and never again; otherwise
+  layerTextures holds one 2d texture per layer and particles are drawn in shade batches.
+  Takes effect on the next upload().
+  */
+void ParticleRenderer::setTextures(GLuint textureArray, const GLuint *layerTextures)
+{
+    if (!m_supported)
+    {
+        return;
+    }
+
+    m_textureArray = (m_arrayProgram && m_arrayProgram->isLinked()) ? textureArray : 0;
+    m_program = m_textureArray ? m_arrayProgram : m_batchedProgram;
+    for (int l = 0; l < LAYERS; l++)
+    {
+        m_layerTextures[l] = layerTextures ? layerTextures[l] : 0;
+    }
+
+    //the per vertex attribute has to live at location 0 on compatibility profiles
+    m_program->bindAttributeLocation("corner", 0);
+    if (!m_program->link())
+    {
+        m_supported = false;
+        return;
+    }
+    m_cornerLocation = m_program->attributeLocation("corner");
+    m_particleLocation = m_program->attributeLocation("particle");
+    m_layerLocation = m_program->attributeLocation("layer");
+
+    m_program->bind();
+    m_program->setUniformValue("textures", (GLint) 0);
+    m_program->release();
+
+    if (m_textureArray)
+    {
+        glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, m_textureArray);
+    }
+}
+
+/**
+  Copies count particles into the instance buffer, in the draw order given by their indices.
+  size is the billboard edge length. Without a texture array the instances are grouped by
+  shade, keeping the draw order within each group.
+  */
+void ParticleRenderer::upload(const CloudParticles &particles, float size, const int *order, int count)
+{
+    if (!m_supported)
+    {
+        return;
+    }
+
+    m_instanceCount = count;
+
+    std::vector<int> batched;
+    if (!m_textureArray)
+    {
+        particles.groupByShade(order, count, batched, m_batchStart);
+        order = batched.data();
+    }
+
+    std::vector<GLfloat> &data = m_staging;
+    data.resize((size_t)m_instanceCount * INSTANCE_FLOATS);
+    const float *x = particles.x();
+    const float *y = particles.y();
+    const float *z = particles.z();
+    const signed char *shade = particles.shade();
+    for (int i = 0; i < m_instanceCount; i++)
+    {
+        int p = order[i];
+        GLfloat *instance = &data[(size_t)i * INSTANCE_FLOATS];
+        instance[0] = x[p];
+        instance[1] = y[p];
+        instance[2] = z[p];
+        instance[3] = size;
+        instance[4] = shade[p];
+    }
+
+    //the order changes whenever the camera moves, so reuse the buffer where possible
+    int bytes = (int)(data.size() * sizeof(GLfloat));
+    m_instances.bind();
+    if (m_instances.size() == bytes && bytes > 0)
+    {
+        m_instances.write(0, &data[0], bytes);
+    }
+    else
+    {
+        m_instances.allocate(data.empty() ? 0 : &data[0], bytes);
+    }
+    m_instances.release();
+}
+
+/**
+  Points the per instance attributes at instance first onwards
+  */
+void ParticleRenderer::setInstanceOffset(int first)
+{
+    int stride = INSTANCE_FLOATS * sizeof(GLfloat);
+    int offset = first * stride;
+
+    m_program->setAttributeBuffer(m_particleLocation, GL_FLOAT, offset, 4, stride);
+    if (m_layerLocation >= 0)
+    {
+        m_program->setAttributeBuffer(m_layerLocation, GL_FLOAT, offset + 4 * sizeof(GLfloat), 1, stride);
+    }
+}
+
+/**
+  Draws the uploaded particles. By default each billboard uses its own shade; passing
+  WHITE_LAYER or MODELER_LAYER draws every billboard with that texture instead.
+  */
+void ParticleRenderer::draw(const Vector3 &look, int layer)
+{
+    m_textureBinds = 0;
+    m_drawCalls = 0;
+
+    if (!m_supported || !m_program || m_instanceCount == 0)
+    {
+        return;
+    }
+
+    m_program->bind();
+    m_program->setUniformValue("look", (GLfloat) look.x, (GLfloat) look.y, (GLfloat) look.z);
+    m_program->setUniformValue("layerOverride", (GLfloat) layer);
+
+    m_corners.bind();
+    m_program->setAttributeBuffer(m_cornerLocation, GL_FLOAT, 0, 2);
+    m_program->enableAttributeArray(m_cornerLocation);
+
+    m_instances.bind();
+    m_program->enableAttributeArray(m_particleLocation);
+    m_vertexAttribDivisor(m_particleLocation, 1);
+    if (m_layerLocation >= 0)
+    {
+        m_program->enableAttributeArray(m_layerLocation);
+        m_vertexAttribDivisor(m_layerLocation, 1);
+    }
+
+    if (m_textureArray || layer != CloudParticles::UNSHADED)
+    {
+        if (!m_textureArray)
+        {
+            glBindTexture(GL_TEXTURE_2D, m_layerTextures[layer]);
+            m_textureBinds++;
+        }
+        setInstanceOffset(0);
+        m_drawArraysInstanced(GL_TRIANGLE_FAN, 0, 4, m_instanceCount);
+        m_drawCalls++;
+    }
+    else
+    {
+        for (int l = 0; l <= CloudParticles::SHADE_LAYERS; l++)
+        {
+            int first = m_batchStart[l];
+            int count = m_batchStart[l + 1] - first;
+            if (count == 0)
+            {
+                continue;
+            }
+
+            //the last batch holds the unshaded particles, drawn untextured
+            glBindTexture(GL_TEXTURE_2D, l < CloudParticles::SHADE_LAYERS ? m_layerTextures[l] : 0);
+            m_textureBinds++;
+            setInstanceOffset(first);
+            m_drawArraysInstanced(GL_TRIANGLE_FAN, 0, 4, count);
+            m_drawCalls++;
+        }
+    }
+
+    //leave the attribute state the way the fixed function code expects it
+    m_vertexAttribDivisor(m_particleLocation, 0);
+    m_program->disableAttributeArray(m_particleLocation);
+    if (m_layerLocation >= 0)
+    {
+        m_vertexAttribDivisor(m_layerLocation, 0);
+        m_program->disableAttributeArray(m_layerLocation);
+    }
+    m_program->disableAttributeArray(m_cornerLocation);
+    QGLBuffer::release(QGLBuffer::VertexBuffer);
+
+    if (!m_textureArray)
+    {
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    m_program->release();
+}
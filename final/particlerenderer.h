@@ -0,0 +1,82 @@
+#ifndef PARTICLERENDERER_H
+#define PARTICLERENDERER_H
+
+#include <qgl.h>
+#include <QGLBuffer>
+#include <GL/glext.h>
+#include <vector>
+#include "vector.h"
+#include "cloudparticles.h"
+
+class QGLContext;
+class QGLShaderProgram;
+
+/**
+    Draws the cloud particles as a camera facing billboard with a single instanced draw call.
+
+    The particles are uploaded once into a vertex buffer (position, billboard size and texture
+    layer per instance) and a four vertex quad is instanced over them. The billboard rotation
+    that used to be handed to glRotatef per particle is computed in particles.vert from the look
+    direction.
+
+    All particle textures live in one texture array (the eight shades, then the white occlusion
+    and the modeler texture), which stays bound, so a pass binds no textures at all. Without
+    texture arrays the instances are grouped by shade and drawn as at most SHADE_LAYERS + 1
+    batches, one bind each.
+
+    Needs ARB_instanced_arrays (or GL 3.3); when it is missing isSupported() stays false and the
+    caller keeps drawing in immediate mode.
+**/
+class ParticleRenderer
+{
+
+public:
+    static const int WHITE_LAYER = CloudParticles::SHADE_LAYERS;
+    static const int MODELER_LAYER = CloudParticles::SHADE_LAYERS + 1;
+    static const int LAYERS = CloudParticles::SHADE_LAYERS + 2;
+
+    ParticleRenderer();
+
+    bool initialize(const QGLContext *context, QGLShaderProgram *arrayProgram, QGLShaderProgram *batchedProgram);
+    bool isSupported() const { return m_supported; }
+    bool usesTextureArray() const { return m_textureArray != 0; }
+
+    static bool hasTextureArrays();
+    void setTextures(GLuint textureArray, const GLuint *layerTextures);
+
+    void upload(const CloudParticles &particles, float size, const int *order, int count);
+    void draw(const Vector3 &look, int layer = CloudParticles::UNSHADED);
+
+    int instanceCount() const { return m_instanceCount; }
+    int textureBinds() const { return m_textureBinds; }
+    int drawCalls() const { return m_drawCalls; }
+
+private:
+    void setInstanceOffset(int first);
+
+    QGLShaderProgram *m_program;
+    QGLBuffer m_corners; // the unit quad, one corner per vertex
+    QGLBuffer m_instances; // x, y, z, size, layer per particle
+    std::vector<GLfloat> m_staging;
+    int m_instanceCount;
+    bool m_supported;
+
+    GLuint m_textureArray; // 0 when drawing in shade batches
+    GLuint m_layerTextures[LAYERS];
+    int m_batchStart[CloudParticles::SHADE_LAYERS + 2]; // instance ranges per shade, unshaded last
+
+    int m_cornerLocation;
+    int m_particleLocation;
+    int m_layerLocation;
+
+    int m_textureBinds; // during the last draw()
+    int m_drawCalls;
+
+    PFNGLVERTEXATTRIBDIVISORARBPROC m_vertexAttribDivisor;
+    PFNGLDRAWARRAYSINSTANCEDARBPROC m_drawArraysInstanced;
+
+    QGLShaderProgram *m_arrayProgram;
+    QGLShaderProgram *m_batchedProgram;
+};
+
+#endif // PARTICLERENDERER_H
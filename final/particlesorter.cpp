@@ -0,0 +1,265 @@
+#include "particlesorter.h"
+#include "cloudparticles.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#define KEY_CHUNK 4096 //particles per task when computing keys
+#define MIN_RADIX_CHUNK 16384 //smallest slice of the array one radix task works on
+
+const float ParticleSorter::KEY_SPACING = 0.25f;
+
+ParticleSorter::ParticleSorter()
+    : m_valid(false), m_lastMethod(SORT_NONE), m_lastSortTime(0)
+{
+}
+
+/**
+  Replaces the particles to sort; they are sorted from scratch on the next sort()
+  */
+void ParticleSorter::setCandidates(const std::vector<int> &candidates)
+{
+    m_order = candidates;
+    m_valid = false;
+}
+
+/**
+  Forgets the previous order, e.g. after the particles were relit
+  */
+void ParticleSorter::invalidate()
+{
+    m_valid = false;
+}
+
+/**
+  Brings order() up to date for a camera at eye looking along look. Returns whether the order
+  changed since the last call.
+  */
+bool ParticleSorter::sort(const CloudParticles &particles, const Vector3 &eye, const Vector3 &look)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    int count = (int)m_order.size();
+    Vector3 dir = look.unit();
+
+    if (m_valid && eye == m_lastEye && dir == m_lastLook)
+    {
+        m_lastMethod = SORT_NONE;
+        m_lastSortTime = 0;
+        return false;
+    }
+
+    bool coherent = m_valid;
+    int keyRange = computeKeys(particles, eye, dir);
+
+    //every particle that steps back sinks past about one key's worth of particles
+    if (coherent)
+    {
+        long long expectedMoves = countDescents() * (count / keyRange + 1);
+        coherent = expectedMoves <= (long long)INSERTION_BUDGET * count;
+    }
+
+    if (coherent && insertionSort(INSERTION_BUDGET))
+    {
+        m_lastMethod = SORT_INSERTION;
+    }
+    else
+    {
+        radixSort();
+        m_lastMethod = SORT_RADIX;
+    }
+
+    m_valid = true;
+    m_lastEye = eye;
+    m_lastLook = dir;
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    m_lastSortTime = elapsed.count();
+    return true;
+}
+
+/**
+  Quantizes the view depth of every particle, in the current order. The key range spans the
+  depths of the particles' bounding box corners, with the farthest depth at key 0. Returns the
+  number of distinct keys in use.
+  */
+int ParticleSorter::computeKeys(const CloudParticles &particles, const Vector3 &eye, const Vector3 &look)
+{
+    Vector3 low = particles.boundsMin();
+    Vector3 high = particles.boundsMax();
+
+    float nearest = 0, farthest = 0;
+    for (int corner = 0; corner < 8; corner++)
+    {
+        Vector3 point(corner & 1 ? high.x : low.x, corner & 2 ? high.y : low.y, corner & 4 ? high.z : low.z);
+        float depth = (point - eye).dot(look);
+        nearest = corner ? std::min(nearest, depth) : depth;
+        farthest = corner ? std::max(farthest, depth) : depth;
+    }
+
+    const float maxKey = (float)((1 << DEPTH_BITS) - 1);
+    float step = std::max((farthest - nearest) / maxKey, particles.spacing() * KEY_SPACING);
+    float scale = step > 0 ? 1.0f / step : 0;
+
+    const float *x = particles.x();
+    const float *y = particles.y();
+    const float *z = particles.z();
+    const int *order = m_order.data();
+    m_sortedKeys.resize(m_order.size());
+    uint16_t *keys = m_sortedKeys.data();
+
+    ThreadPool::global().parallelFor((int)m_order.size(), KEY_CHUNK, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            int p = order[i];
+            float depth = (x[p] - eye.x) * look.x + (y[p] - eye.y) * look.y + (z[p] - eye.z) * look.z;
+            float key = (farthest - depth) * scale;
+            keys[i] = (uint16_t)std::min(std::max(key, 0.0f), maxKey);
+        }
+    });
+
+    return (int)std::min((farthest - nearest) * scale, maxKey) + 1;
+}
+
+/**
+  Number of places where the keys, in the current order, step backwards
+  */
+long long ParticleSorter::countDescents() const
+{
+    std::atomic<long long> descents(0);
+    const uint16_t *keys = m_sortedKeys.data();
+
+    ThreadPool::global().parallelFor((int)m_sortedKeys.size(), KEY_CHUNK, [&](int begin, int end)
+    {
+        long long local = 0;
+        for (int i = std::max(begin, 1); i < end; i++)
+        {
+            local += keys[i] < keys[i - 1];
+        }
+        descents += local;
+    });
+    return descents;
+}
+
+/**
+  Repairs a nearly sorted order in place. Gives up, leaving a valid but unsorted permutation,
+  once more than budget moves per particle were needed.
+  */
+bool ParticleSorter::insertionSort(int budget)
+{
+    int count = (int)m_order.size();
+    long long moves = 0;
+    long long limit = (long long)budget * count;
+
+    uint16_t *keys = m_sortedKeys.data();
+    int *order = m_order.data();
+
+    for (int i = 1; i < count; i++)
+    {
+        uint16_t key = keys[i];
+        int particle = order[i];
+        int j = i;
+        while (j > 0 && keys[j - 1] > key)
+        {
+            keys[j] = keys[j - 1];
+            order[j] = order[j - 1];
+            j--;
+        }
+        keys[j] = key;
+        order[j] = particle;
+
+        moves += i - j;
+        if (moves > limit)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+  Stable LSD radix sort of the current order by key, RADIX_BITS per pass. Each pass builds
+  per slice histograms in parallel, turns them into scatter offsets and scatters in parallel.
+  */
+void ParticleSorter::radixSort()
+{
+    const int buckets = 1 << RADIX_BITS;
+    int count = (int)m_order.size();
+
+    ThreadPool &pool = ThreadPool::global();
+    int slices = std::max(1, std::min(pool.threadCount() + 1, count / MIN_RADIX_CHUNK));
+    int sliceSize = (count + slices - 1) / slices;
+
+    m_scratchOrder.resize(count);
+    m_scratchKeys.resize(count);
+    std::vector<int> offsets((size_t)slices * buckets);
+
+    for (int shift = 0; shift < DEPTH_BITS; shift += RADIX_BITS)
+    {
+        const uint16_t *keys = m_sortedKeys.data();
+        const int *order = m_order.data();
+        uint16_t *outKeys = m_scratchKeys.data();
+        int *outOrder = m_scratchOrder.data();
+        int *offset = offsets.data();
+
+        std::fill(offsets.begin(), offsets.end(), 0);
+        pool.parallelFor(slices, 1, [&](int begin, int end)
+        {
+            for (int s = begin; s < end; s++)
+            {
+                int *histogram = offset + s * buckets;
+                int last = std::min(count, (s + 1) * sliceSize);
+                for (int i = s * sliceSize; i < last; i++)
+                {
+                    histogram[(keys[i] >> shift) & (buckets - 1)]++;
+                }
+            }
+        });
+
+        //bucket major, then slice, keeps the sort stable
+        int sum = 0;
+        for (int b = 0; b < buckets; b++)
+        {
+            for (int s = 0; s < slices; s++)
+            {
+                int histogram = offset[s * buckets + b];
+                offset[s * buckets + b] = sum;
+                sum += histogram;
+            }
+        }
+
+        pool.parallelFor(slices, 1, [&](int begin, int end)
+        {
+            for (int s = begin; s < end; s++)
+            {
+                int *next = offset + s * buckets;
+                int last = std::min(count, (s + 1) * sliceSize);
+                for (int i = s * sliceSize; i < last; i++)
+                {
+                    int position = next[(keys[i] >> shift) & (buckets - 1)]++;
+                    outKeys[position] = keys[i];
+                    outOrder[position] = order[i];
+                }
+            }
+        });
+
+        m_sortedKeys.swap(m_scratchKeys);
+        m_order.swap(m_scratchOrder);
+    }
+}
+
+const char *ParticleSorter::methodName(Method method)
+{
+    switch (method)
+    {
+    case SORT_INSERTION:
+        return "insertion";
+    case SORT_RADIX:
+        return "radix";
+    default:
+        return "none";
+    }
+}
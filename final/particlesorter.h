@@ -0,0 +1,72 @@
+#ifndef PARTICLESORTER_H
+#define PARTICLESORTER_H
+
+#include <stdint.h>
+#include <vector>
+#include "vector.h"
+
+class CloudParticles;
+
+/**
+    Orders cloud particles back to front along the view direction for alpha blending.
+
+    Depths are quantized to DEPTH_BITS wide keys over the depth range of the particles' bounding
+    box, but never finer than KEY_SPACING of the particle spacing: the billboards are far larger
+    than that, so closer particles can blend in either order, and the coarser keys keep small
+    camera moves from reshuffling whole slabs of the lattice.
+
+    A full sort is a parallel LSD radix sort on the global thread pool. Between frames the orbit
+    camera usually moves a little, so the keys are first computed in the previous order and the
+    places where they step backwards are counted. Few of those (zooming alone produces none) and
+    the order is repaired with an insertion sort instead, which gives up and falls back to the
+    radix sort once it has moved more than INSERTION_BUDGET elements per particle. Nothing is
+    sorted while the camera stands still.
+
+    Only the candidate particles handed to setCandidates() are sorted, e.g. those the culler
+    found on screen; changing them starts over with a full sort.
+**/
+class ParticleSorter
+{
+
+public:
+    enum Method { SORT_NONE, SORT_INSERTION, SORT_RADIX };
+
+    static const int DEPTH_BITS = 16;
+    static const int RADIX_BITS = 8;
+    static const int INSERTION_BUDGET = 4;
+    static const float KEY_SPACING; // finest key step as a fraction of the particle spacing
+
+    ParticleSorter();
+
+    void setCandidates(const std::vector<int> &candidates);
+    bool sort(const CloudParticles &particles, const Vector3 &eye, const Vector3 &look);
+    void invalidate();
+
+    const int *order() const { return m_order.data(); }
+    int size() const { return (int)m_order.size(); }
+
+    Method lastMethod() const { return m_lastMethod; }
+    double lastSortTime() const { return m_lastSortTime; }
+
+    static const char *methodName(Method method);
+
+private:
+    int computeKeys(const CloudParticles &particles, const Vector3 &eye, const Vector3 &look);
+    long long countDescents() const;
+    bool insertionSort(int budget);
+    void radixSort();
+
+    std::vector<int> m_order; // candidate particle indices, farthest first once sorted
+    std::vector<int> m_scratchOrder;
+    std::vector<uint16_t> m_sortedKeys; // per entry of m_order, smaller is farther
+    std::vector<uint16_t> m_scratchKeys;
+
+    bool m_valid; // m_order was sorted for m_lastEye and m_lastLook
+    Vector3 m_lastEye;
+    Vector3 m_lastLook;
+
+    Method m_lastMethod;
+    double m_lastSortTime; // milliseconds
+};
+
+#endif // PARTICLESORTER_H
@@ -0,0 +1,197 @@
+#include "radialblur.h"
+
+#include <math.h>
+#include <string.h>
+#include <GL/glu.h>
+#include <QGLFramebufferObject>
+#include <QGLShaderProgram>
+
+/**
+  Taps and passes per preset, from LOW up
+  */
+static const int PRESET_TAPS[] = { 8, 12, 16 };
+static const int PRESET_PASSES[] = { 2, 2, 2 };
+
+RadialBlur::RadialBlur()
+    : m_quality(MEDIUM), m_exposure(0.8f), m_decay(0.95f), m_density(0.9f), m_weight(1.0f)
+{
+    plan();
+}
+
+/**
+  The same parameters lightscatter.frag takes
+  */
+void RadialBlur::setParameters(float exposure, float decay, float density, float weight)
+{
+    m_exposure = exposure;
+    m_decay = decay;
+    m_density = density;
+    m_weight = weight;
+    plan();
+}
+
+void RadialBlur::setQuality(Quality quality)
+{
+    m_quality = quality;
+    plan();
+}
+
+/**
+  Works out the uniforms of every pass for the current quality and parameters
+  */
+void RadialBlur::plan()
+{
+    m_passes.clear();
+    if (m_quality == REFERENCE)
+    {
+        return;
+    }
+
+    int taps = PRESET_TAPS[m_quality - LOW];
+    int passes = PRESET_PASSES[m_quality - LOW];
+
+    //weighted mean distance of the reference taps, relative to the pixel's distance to the light
+    double step = m_density / REFERENCE_SAMPLES;
+    double weight = 1, total = 0, mean = 0;
+    for (int i = 1; i <= REFERENCE_SAMPLES; i++)
+    {
+        total += weight;
+        mean += weight * (1 - i * step);
+        weight *= m_decay;
+    }
+    mean /= total;
+
+    //bisect for the geometric ratio with the same weighted mean
+    double low = 0, high = 1, ratio = 1;
+    for (int iteration = 0; iteration < 50; iteration++)
+    {
+        ratio = (low + high) / 2;
+        double distance = ratio, geometric = 0;
+        weight = 1;
+        for (int i = 1; i <= REFERENCE_SAMPLES; i++)
+        {
+            geometric += weight * distance;
+            distance *= ratio;
+            weight *= m_decay;
+        }
+        if (geometric / total > mean)
+        {
+            high = ratio;
+        }
+        else
+        {
+            low = ratio;
+        }
+    }
+
+    int covered = (int)pow((double) taps, passes);
+    double coveredTotal = (1 - pow((double) m_decay, covered)) / (1 - m_decay);
+
+    int stride = 1;
+    for (int p = 0; p < passes; p++)
+    {
+        Pass pass;
+        pass.taps = taps;
+        pass.firstScale = p == 0 ? (float) ratio : 1.0f;
+        pass.scale = (float) pow(ratio, stride);
+        pass.decay = (float) pow((double) m_decay, stride);
+        pass.gain = p == passes - 1 ? (float)(m_exposure * m_weight * total / coveredTotal) : 1.0f;
+        m_passes.push_back(pass);
+        stride *= taps;
+    }
+}
+
+/**
+  Draws one pass into the bound target, over the whole viewport. The source image covers
+  texture coordinates up to extent (which the light position is relative to as well) and is
+  sampled no further than sampleLimit; the first pass reads the occlusion mask.
+  */
+void RadialBlur::renderPass(QGLShaderProgram *program, int pass, GLuint source, const GLfloat *lightPositionOnScreen,
+                            const GLfloat *extent, const GLfloat *sampleLimit) const
+{
+    const Pass &settings = m_passes[pass];
+
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluOrtho2D(0.f, 1.f, 0.f, 1.f);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    program->bind();
+    program->setUniformValue("source", (GLint) 0);
+    program->setUniformValueArray("lightPositionOnScreen", lightPositionOnScreen, 1, 2);
+    program->setUniformValueArray("extent", sampleLimit, 1, 2);
+    program->setUniformValue("taps", (GLint) settings.taps);
+    program->setUniformValue("firstScale", settings.firstScale);
+    program->setUniformValue("scale", settings.scale);
+    program->setUniformValue("decay", settings.decay);
+    program->setUniformValue("gain", settings.gain);
+    program->setUniformValue("occlusion", (GLint)(pass == 0));
+    glBindTexture(GL_TEXTURE_2D, source);
+
+    glBegin(GL_QUADS);
+    glTexCoord2f(0.0f, 0.0f);
+    glVertex2f(0.0f, 0.0f);
+    glTexCoord2f(extent[0], 0.0f);
+    glVertex2f(1.0f, 0.0f);
+    glTexCoord2f(extent[0], extent[1]);
+    glVertex2f(1.0f, 1.0f);
+    glTexCoord2f(0.0f, extent[1]);
+    glVertex2f(0.0f, 1.0f);
+    glEnd();
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    program->release();
+}
+
+/**
+  Blurs a whole occlusion texture through the passes, alternating between two targets of its
+  size, and returns the texture holding the result (0 for REFERENCE). The viewport must
+  already match the targets.
+  */
+GLuint RadialBlur::render(QGLShaderProgram *program, GLuint occlusion, QGLFramebufferObject *ping,
+                          QGLFramebufferObject *pong, const GLfloat *lightPositionOnScreen) const
+{
+    const GLfloat whole[2] = { 1.0f, 1.0f };
+
+    GLuint source = occlusion;
+    for (size_t p = 0; p < m_passes.size(); p++)
+    {
+        QGLFramebufferObject *target = p % 2 ? pong : ping;
+        target->bind();
+        renderPass(program, (int) p, source, lightPositionOnScreen, whole, whole);
+        target->release();
+        source = target->texture();
+    }
+    return m_passes.empty() ? 0 : source;
+}
+
+const char *RadialBlur::qualityName(Quality quality)
+{
+    switch (quality)
+    {
+    case REFERENCE:
+        return "reference";
+    case LOW:
+        return "low";
+    case MEDIUM:
+        return "medium";
+    case HIGH:
+        return "high";
+    default:
+        return "";
+    }
+}
+
+bool RadialBlur::qualityFromName(const char *name, Quality &quality)
+{
+    for (int q = 0; q < QUALITIES; q++)
+    {
+        if (strcmp(name, qualityName((Quality) q)) == 0)
+        {
+            quality = (Quality) q;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,68 @@
+#ifndef RADIALBLUR_H
+#define RADIALBLUR_H
+
+#include <qgl.h>
+#include <vector>
+
+class QGLFramebufferObject;
+class QGLShaderProgram;
+
+/**
+    God ray scattering as a radial blur built from a few short passes of radialblur.frag,
+    in place of the 100 samples per pixel of lightscatter.frag.
+
+    lightscatter.frag sums REFERENCE_SAMPLES taps spaced evenly between each pixel and the
+    light, each decay times weaker than the last. Here the taps of a pass shrink the distance to
+    the light geometrically instead, and every further pass blurs the previous result with the
+    ratio raised to the number of taps already covered, so passes x taps reads cover
+    taps^passes ray positions. The ratio is fitted so the weighted mean tap position matches
+    the evenly spaced taps, and the last pass rescales to the same total weight.
+
+    REFERENCE keeps using lightscatter.frag; the other presets trade error against taps.
+**/
+class RadialBlur
+{
+
+public:
+    enum Quality { REFERENCE, LOW, MEDIUM, HIGH, QUALITIES };
+
+    static const int MAX_TAPS = 16; // as in radialblur.frag
+    static const int REFERENCE_SAMPLES = 100; // NUM_SAMPLES in lightscatter.frag
+
+    /** Uniforms of one pass **/
+    struct Pass
+    {
+        int taps;
+        float firstScale;
+        float scale;
+        float decay;
+        float gain;
+    };
+
+    RadialBlur();
+
+    void setParameters(float exposure, float decay, float density, float weight);
+    void setQuality(Quality quality);
+    Quality quality() const { return m_quality; }
+    const std::vector<Pass> &passes() const { return m_passes; }
+
+    void renderPass(QGLShaderProgram *program, int pass, GLuint source, const GLfloat *lightPositionOnScreen,
+                    const GLfloat *extent, const GLfloat *sampleLimit) const;
+    GLuint render(QGLShaderProgram *program, GLuint occlusion, QGLFramebufferObject *ping,
+                  QGLFramebufferObject *pong, const GLfloat *lightPositionOnScreen) const;
+
+    static const char *qualityName(Quality quality);
+    static bool qualityFromName(const char *name, Quality &quality);
+
+private:
+    void plan();
+
+    Quality m_quality;
+    float m_exposure;
+    float m_decay;
+    float m_density;
+    float m_weight;
+    std::vector<Pass> m_passes;
+};
+
+#endif // RADIALBLUR_H
@@ -0,0 +1,75 @@
+#include "resolutionscaler.h"
+
+#include <QtGlobal>
+#include <math.h>
+
+const float ResolutionScaler::MIN_SCALE = 0.5f;
+const float ResolutionScaler::MAX_SCALE = 1.0f;
+const float ResolutionScaler::MAX_STEP = 0.125f;
+const float ResolutionScaler::LOW_WATER = 0.75f;
+const float ResolutionScaler::TARGET = 0.9f;
+
+ResolutionScaler::ResolutionScaler()
+    : m_budget(0), m_scale(MAX_SCALE), m_average(-1), m_settle(0)
+{
+}
+
+void ResolutionScaler::setBudget(double milliseconds)
+{
+    m_budget = qMax(0.0, milliseconds);
+    this->reset();
+}
+
+/**
+  Back to full resolution, forgetting the collected times
+  */
+void ResolutionScaler::reset()
+{
+    m_scale = MAX_SCALE;
+    m_times.clear();
+    m_average = -1;
+    m_settle = 0;
+}
+
+void ResolutionScaler::addFrame(double milliseconds)
+{
+    if (m_budget <= 0 || milliseconds <= 0)
+    {
+        return;
+    }
+    if (m_settle > 0)
+    {
+        m_settle--;
+        return;
+    }
+
+    m_times.push_back(milliseconds);
+    if ((int)m_times.size() < WINDOW)
+    {
+        return;
+    }
+
+    double total = 0;
+    for (size_t t = 0; t < m_times.size(); t++)
+    {
+        total += m_times[t];
+    }
+    m_average = total / m_times.size();
+    m_times.pop_front();
+
+    if (m_average <= m_budget && m_average >= m_budget * LOW_WATER)
+    {
+        return;
+    }
+
+    //the area, not the edge, follows the time
+    float wanted = m_scale * sqrtf(m_budget * TARGET / m_average);
+    wanted = qBound(m_scale - MAX_STEP, wanted, m_scale + MAX_STEP);
+    wanted = qBound(MIN_SCALE, floorf(wanted * QUANTIZE + 0.5f) / QUANTIZE, MAX_SCALE);
+    if (wanted != m_scale)
+    {
+        m_scale = wanted;
+        m_times.clear();
+        m_settle = SETTLE_FRAMES;
+    }
+}
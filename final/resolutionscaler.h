@@ -0,0 +1,52 @@
+#ifndef RESOLUTIONSCALER_H
+#define RESOLUTIONSCALER_H
+
+#include <deque>
+
+/**
+    Picks the fraction of the window size the cloud and scatter passes render at, between
+    MIN_SCALE and MAX_SCALE, so the GPU frame time stays within a budget.
+
+    addFrame() takes one GPU frame time per frame. Once WINDOW of them have been collected their
+    average is compared with the budget; above it, or below LOW_WATER of it, the scale moves
+    towards the one whose pixel count would bring the average to TARGET of the budget, assuming
+    the time is proportional to the pixels. Steps are at most MAX_STEP and rounded to
+    1/QUANTIZE, so noise doesn't make the image size creep. Times take a few frames to arrive,
+    so after a change the next SETTLE_FRAMES samples, most of which were rendered at the old
+    scale, are ignored.
+
+    A budget of 0 keeps the full resolution.
+**/
+class ResolutionScaler
+{
+
+public:
+    static const float MIN_SCALE;
+    static const float MAX_SCALE;
+    static const float MAX_STEP;
+    static const float LOW_WATER;
+    static const float TARGET;
+    static const int QUANTIZE = 32;
+    static const int WINDOW = 8;
+    static const int SETTLE_FRAMES = 4; // the profiler's latency and the frame in flight
+
+    ResolutionScaler();
+
+    void setBudget(double milliseconds);
+    double budget() const { return m_budget; }
+
+    void addFrame(double milliseconds);
+    void reset();
+
+    float scale() const { return m_scale; }
+    double averageTime() const { return m_average; } // over the last full window, -1 before one
+
+private:
+    double m_budget;
+    float m_scale;
+    std::deque<double> m_times;
+    double m_average;
+    int m_settle; // samples left to ignore
+};
+
+#endif // RESOLUTIONSCALER_H
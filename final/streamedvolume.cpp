@@ -0,0 +1,556 @@
+#include "streamedvolume.h"
+#include "cloudgenerator.h"
+#include "cloudvolume.h"
+#include "threadpool.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+using namespace std;
+
+/**
+  The first bytes of a .cbrk file, padded to StreamedVolume::PAGE on disk
+  */
+struct StreamHeader
+{
+    char magic[4]; // "CBRK"
+    quint32 format;
+    quint32 generator;
+    quint32 seed;
+    qint32 dims[3];
+    qint32 octaves;
+    double cells;
+    quint32 weights;
+    quint32 bits;
+    float threshold; // the bricks were quantized for
+    quint32 codeBricks; // quantized bricks, whose codes follow the header page in table order
+    quint64 tableOffset; // bytes from the start of the file
+    quint64 tableBytes;
+    quint32 tableChecksum;
+    quint32 headerChecksum; // of every byte before it
+};
+
+static double millisecondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+static quint32 headerChecksum(const StreamHeader &header)
+{
+    return VolumeCache::checksum(&header, offsetof(StreamHeader, headerChecksum));
+}
+
+StreamedVolume::StreamedVolume()
+    : m_bits(8), m_threshold(0), m_budget(256 * 1024 * 1024), m_fileBytes(0), m_capacity(0), m_resident(0),
+      m_newest(-1), m_oldest(-1), m_hits(0), m_misses(0), m_evictions(0), m_prefetched(0), m_lastBuildTime(0),
+      m_lastReadTime(0), m_lastReadAheadTime(0)
+{
+    m_dims[0] = m_dims[1] = m_dims[2] = 0;
+    m_bricks[0] = m_bricks[1] = m_bricks[2] = 0;
+}
+
+StreamedVolume::~StreamedVolume()
+{
+    this->close();
+}
+
+/**
+  The .cbrk file the volume is built into and paged from
+  */
+void StreamedVolume::setPath(const QString &path)
+{
+    m_path = path;
+}
+
+/**
+  Bits per quantized voxel, 8 or 16, and the density a voxel needs to be drawn, see
+  BrickedVolume::encode()
+  */
+void StreamedVolume::setCompression(int bits, float threshold)
+{
+    m_bits = bits == 16 ? 16 : 8;
+    m_threshold = threshold;
+}
+
+/**
+  Most bytes the decoded bricks may take; takes effect at the next open()
+  */
+void StreamedVolume::setBudget(qint64 bytes)
+{
+    m_budget = bytes;
+}
+
+/**
+  Opens the volume for key, building the file first if it holds another one or none
+  */
+bool StreamedVolume::fetch(const VolumeCache::Key &key, const CloudGenerator &generator)
+{
+    return this->open(key) || (this->build(key, generator) && this->open(key));
+}
+
+/**
+  Opens the file if it holds the volume for key, quantized as setCompression() asks for, and
+  reads its brick table. Nothing else is read until it is asked for.
+  */
+bool StreamedVolume::open(const VolumeCache::Key &key)
+{
+    this->close();
+    int bricks[3];
+    for (int a = 0; a < 3; a++)
+    {
+        bricks[a] = (key.dims[a] + BrickedVolume::BRICK_SIZE - 1) / BrickedVolume::BRICK_SIZE;
+    }
+    size_t count = (size_t)bricks[0] * bricks[1] * bricks[2];
+    quint64 brickBytes = BrickedVolume::BRICK_VOXELS * (m_bits / 8);
+
+    m_file.setFileName(m_path);
+    StreamHeader header;
+    bool matches = !m_path.isEmpty() && m_file.open(QIODevice::ReadOnly)
+            && m_file.read((char *)&header, sizeof(header)) == (qint64)sizeof(header)
+            && memcmp(header.magic, "CBRK", 4) == 0 && header.format == FORMAT_VERSION
+            && header.headerChecksum == headerChecksum(header) && header.generator == key.generator
+            && header.seed == key.seed && header.dims[0] == key.dims[0] && header.dims[1] == key.dims[1]
+            && header.dims[2] == key.dims[2] && header.octaves == key.octaves && header.cells == key.cells
+            && header.weights == key.weights && header.bits == (quint32)m_bits && header.threshold == m_threshold
+            && header.tableOffset == PAGE + header.codeBricks * brickBytes && header.tableBytes == count * sizeof(Entry)
+            && m_file.size() >= (qint64)(header.tableOffset + header.tableBytes);
+    if (matches)
+    {
+        m_table.resize(count);
+        matches = m_file.seek(header.tableOffset)
+                && m_file.read((char *)&m_table[0], header.tableBytes) == (qint64)header.tableBytes
+                && VolumeCache::checksum(&m_table[0], header.tableBytes) == header.tableChecksum;
+        for (size_t b = 0; matches && b < count; b++)
+        {
+            matches = m_table[b].codes == NO_CODES || m_table[b].codes < header.codeBricks;
+        }
+    }
+    if (!matches)
+    {
+        this->close();
+        return false;
+    }
+
+    for (int a = 0; a < 3; a++)
+    {
+        m_dims[a] = key.dims[a];
+        m_bricks[a] = bricks[a];
+    }
+    m_fileBytes = m_file.size();
+
+    //slots are only touched once taken, but never reallocated
+    qint64 budgeted = m_budget / (BrickedVolume::BRICK_VOXELS * sizeof(float));
+    m_capacity = (int)max((qint64)1, min(budgeted, (qint64)header.codeBricks));
+    m_voxels.reserve((size_t)m_capacity * BrickedVolume::BRICK_VOXELS);
+    m_slots.assign(count, -1);
+    m_owners.assign(m_capacity, -1);
+    m_newer.assign(m_capacity, -1);
+    m_older.assign(m_capacity, -1);
+    return true;
+}
+
+/**
+  Generates the volume for key one slab at a time and writes it to the file, replacing what
+  was there. The volume is closed.
+  */
+bool StreamedVolume::build(const VolumeCache::Key &key, const CloudGenerator &generator)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    this->close();
+    if (m_path.isEmpty())
+    {
+        return false;
+    }
+
+    int bricks[3];
+    for (int a = 0; a < 3; a++)
+    {
+        bricks[a] = (key.dims[a] + BrickedVolume::BRICK_SIZE - 1) / BrickedVolume::BRICK_SIZE;
+    }
+    size_t slabBricks = (size_t)bricks[1] * bricks[2];
+    size_t brickBytes = BrickedVolume::BRICK_VOXELS * (m_bits / 8);
+    std::vector<Entry> table(slabBricks * bricks[0]);
+
+    QDir().mkpath(QFileInfo(m_path).absolutePath());
+    QString temporary = VolumeCache::temporaryPath(m_path);
+    QFile file(temporary);
+    std::vector<char> page(PAGE, 0);
+    bool written = file.open(QIODevice::WriteOnly | QIODevice::Truncate) && file.write(&page[0], PAGE) == PAGE;
+
+    //generate, quantize and write out one slab of bricks while the next one waits
+    CloudVolume slab;
+    BrickedVolume encoded;
+    quint64 stored = 0; // quantized bricks written
+    for (int bx = 0; bx < bricks[0] && written; bx++)
+    {
+        int x0 = bx * BrickedVolume::BRICK_SIZE;
+        slab.resize(min((int)BrickedVolume::BRICK_SIZE, key.dims[0] - x0), key.dims[1], key.dims[2]);
+        generator.calcSlab(slab, x0, key.dims[0], key.octaves, key.cells);
+        encoded.encode(slab, m_threshold, m_bits);
+
+        const std::vector<BrickedVolume::Brick> &slabTable = encoded.table();
+        for (size_t b = 0; b < slabBricks; b++)
+        {
+            Entry &entry = table[bx * slabBricks + b];
+            entry.base = slabTable[b].base;
+            entry.step = slabTable[b].step;
+            entry.codes = slabTable[b].kind == BrickedVolume::QUANTIZED
+                    ? (quint32)(stored + slabTable[b].offset / brickBytes) : NO_CODES;
+        }
+        const std::vector<unsigned char> &codes = encoded.codes();
+        written = codes.empty() || file.write((const char *)&codes[0], codes.size()) == (qint64)codes.size();
+        stored += codes.size() / brickBytes;
+    }
+
+    StreamHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "CBRK", 4);
+    header.format = FORMAT_VERSION;
+    header.generator = key.generator;
+    header.seed = key.seed;
+    header.dims[0] = key.dims[0];
+    header.dims[1] = key.dims[1];
+    header.dims[2] = key.dims[2];
+    header.octaves = key.octaves;
+    header.cells = key.cells;
+    header.weights = key.weights;
+    header.bits = m_bits;
+    header.threshold = m_threshold;
+    header.codeBricks = (quint32)stored;
+    header.tableOffset = PAGE + stored * brickBytes;
+    header.tableBytes = table.size() * sizeof(Entry);
+    header.tableChecksum = VolumeCache::checksum(&table[0], header.tableBytes);
+    header.headerChecksum = headerChecksum(header);
+
+    written = written && stored < NO_CODES
+            && file.write((const char *)&table[0], header.tableBytes) == (qint64)header.tableBytes
+            && file.seek(0) && file.write((const char *)&header, sizeof(header)) == (qint64)sizeof(header);
+    file.close();
+    if (!written)
+    {
+        qWarning("Could not write the streamed volume '%s'", qPrintable(temporary));
+        QFile::remove(temporary);
+        return false;
+    }
+
+    if (!VolumeCache::replace(temporary, m_path))
+    {
+        return false;
+    }
+    m_lastBuildTime = millisecondsSince(start);
+    return true;
+}
+
+/**
+  Closes the file and frees the table and every slot
+  */
+void StreamedVolume::close()
+{
+    m_file.close();
+    std::vector<Entry>().swap(m_table);
+    std::vector<float>().swap(m_voxels);
+    std::vector<int>().swap(m_slots);
+    std::vector<int>().swap(m_owners);
+    std::vector<int>().swap(m_newer);
+    std::vector<int>().swap(m_older);
+    std::vector<unsigned char>().swap(m_staging);
+    m_dims[0] = m_dims[1] = m_dims[2] = 0;
+    m_bricks[0] = m_bricks[1] = m_bricks[2] = 0;
+    m_fileBytes = 0;
+    m_capacity = 0;
+    m_resident = 0;
+    m_newest = m_oldest = -1;
+    m_hits = m_misses = m_evictions = m_prefetched = 0;
+}
+
+qint64 StreamedVolume::bytes() const
+{
+    return (qint64)(m_table.size() * sizeof(Entry) + m_voxels.size() * sizeof(float) + m_staging.capacity()
+                    + (m_slots.size() + m_owners.size() + m_newer.size() + m_older.size()) * sizeof(int));
+}
+
+void StreamedVolume::unlink(int slot)
+{
+    (m_newer[slot] >= 0 ? m_older[m_newer[slot]] : m_newest) = m_older[slot];
+    (m_older[slot] >= 0 ? m_newer[m_older[slot]] : m_oldest) = m_newer[slot];
+}
+
+/**
+  Makes the slot, which must be taken, the most recently used one
+  */
+void StreamedVolume::touch(int slot)
+{
+    if (slot == m_newest)
+    {
+        return;
+    }
+    if (m_newer[slot] >= 0 || m_older[slot] >= 0 || slot == m_oldest)
+    {
+        this->unlink(slot);
+    }
+    m_newer[slot] = -1;
+    m_older[slot] = m_newest;
+    (m_newest >= 0 ? m_newer[m_newest] : m_oldest) = slot;
+    m_newest = slot;
+}
+
+/**
+  Makes the count bricks resident and the most recently used, no more than capacity() of them.
+  The missing ones take free slots or those of the least recently used bricks, and are read
+  in file order, a run of consecutive ones at a time, and decoded on the thread pool.
+  */
+void StreamedVolume::load(const int *bricks, int count)
+{
+    std::vector<int> missing;
+    for (int i = 0; i < count; i++)
+    {
+        int brick = bricks[i];
+        if (m_table[brick].codes == NO_CODES)
+        {
+            continue;
+        }
+        if (m_slots[brick] >= 0)
+        {
+            this->touch(m_slots[brick]);
+        }
+        else
+        {
+            missing.push_back(brick);
+        }
+    }
+    if (missing.empty())
+    {
+        return;
+    }
+    sort(missing.begin(), missing.end(), [this](int a, int b) { return m_table[a].codes < m_table[b].codes; });
+
+    for (size_t i = 0; i < missing.size(); i++)
+    {
+        int slot;
+        if (m_resident < m_capacity)
+        {
+            slot = m_resident++;
+            m_voxels.resize((size_t)m_resident * BrickedVolume::BRICK_VOXELS);
+        }
+        else
+        {
+            slot = m_oldest;
+            this->unlink(slot);
+            m_newer[slot] = m_older[slot] = -1;
+            m_slots[m_owners[slot]] = -1;
+            m_evictions++;
+        }
+        m_slots[missing[i]] = slot;
+        m_owners[slot] = missing[i];
+        this->touch(slot);
+    }
+
+    size_t brickBytes = BrickedVolume::BRICK_VOXELS * (m_bits / 8);
+    m_staging.resize(missing.size() * brickBytes);
+    for (size_t i = 0; i < missing.size(); )
+    {
+        size_t run = 1;
+        while (i + run < missing.size() && m_table[missing[i + run]].codes == m_table[missing[i]].codes + run)
+        {
+            run++;
+        }
+        qint64 bytes = run * brickBytes;
+        if (!m_file.seek(PAGE + (qint64)m_table[missing[i]].codes * brickBytes)
+                || m_file.read((char *)&m_staging[i * brickBytes], bytes) != bytes)
+        {
+            qWarning("Could not read bricks from the streamed volume '%s'", qPrintable(m_path));
+            memset(&m_staging[i * brickBytes], 0, bytes);
+        }
+        i += run;
+    }
+
+    ThreadPool &pool = ThreadPool::global();
+    int grain = max(1, (int)missing.size() / (8 * (pool.threadCount() + 1)));
+    pool.parallelFor((int)missing.size(), grain, [&](int begin, int end) {
+        for (int i = begin; i < end; i++)
+        {
+            const Entry &entry = m_table[missing[i]];
+            BrickedVolume::Brick brick = { entry.base, entry.step, 0, BrickedVolume::QUANTIZED };
+            BrickedVolume::expand(brick, &m_staging[i * brickBytes], m_bits,
+                                  &m_voxels[(size_t)m_slots[missing[i]] * BrickedVolume::BRICK_VOXELS]);
+        }
+    });
+}
+
+/**
+  Density at a voxel of the grid, 0 outside it, paging its brick in if needed
+  */
+float StreamedVolume::sample(int x, int y, int z)
+{
+    if (x < 0 || y < 0 || z < 0 || x >= m_dims[0] || y >= m_dims[1] || z >= m_dims[2])
+    {
+        return 0;
+    }
+    int brick = (int)this->brickIndex(x / BrickedVolume::BRICK_SIZE, y / BrickedVolume::BRICK_SIZE,
+                                      z / BrickedVolume::BRICK_SIZE);
+    const Entry &entry = m_table[brick];
+    if (entry.codes == NO_CODES)
+    {
+        return entry.base;
+    }
+    m_slots[brick] >= 0 ? m_hits++ : m_misses++;
+    this->load(&brick, 1);
+    int mask = BrickedVolume::BRICK_SIZE - 1;
+    return this->voxels(brick)[(((x & mask) << BrickedVolume::BRICK_SHIFT) + (y & mask)) * BrickedVolume::BRICK_SIZE + (z & mask)];
+}
+
+/**
+  Copies the box of the grid with its low corner at (x0, y0, z0) and the window's size into
+  the window, which is already sized; voxels outside the grid are 0. The bricks are paged in
+  and copied a capacity() at a time, so any budget works, but one smaller than the box reads
+  every brick again the next time.
+  */
+void StreamedVolume::read(CloudVolume &window, int x0, int y0, int z0)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    int low[3] = { x0, y0, z0 };
+    int size[3] = { window.sizeX(), window.sizeY(), window.sizeZ() };
+    int first[3], last[3]; // voxels of the grid in the window, inclusive
+    bool inside = true;
+    for (int a = 0; a < 3; a++)
+    {
+        first[a] = max(low[a], 0);
+        last[a] = min(low[a] + size[a], m_dims[a]) - 1;
+        inside = inside && first[a] == low[a] && last[a] == low[a] + size[a] - 1;
+    }
+    if (!inside)
+    {
+        window.fill(0);
+    }
+    if (last[0] < first[0] || last[1] < first[1] || last[2] < first[2])
+    {
+        return;
+    }
+
+    int shift = BrickedVolume::BRICK_SHIFT;
+    std::vector<int> bricks;
+    for (int bx = first[0] >> shift; bx <= last[0] >> shift; bx++)
+    {
+        for (int by = first[1] >> shift; by <= last[1] >> shift; by++)
+        {
+            for (int bz = first[2] >> shift; bz <= last[2] >> shift; bz++)
+            {
+                bricks.push_back((int)this->brickIndex(bx, by, bz));
+            }
+        }
+    }
+
+    ThreadPool &pool = ThreadPool::global();
+    for (size_t begin = 0; begin < bricks.size(); begin += m_capacity)
+    {
+        int count = (int)min(bricks.size() - begin, (size_t)m_capacity);
+        const int *chunk = &bricks[begin];
+        for (int i = 0; i < count; i++)
+        {
+            if (m_table[chunk[i]].codes != NO_CODES)
+            {
+                m_slots[chunk[i]] >= 0 ? m_hits++ : m_misses++;
+            }
+        }
+        this->load(chunk, count);
+
+        //bricks cover disjoint voxels of the window
+        int grain = max(1, count / (8 * (pool.threadCount() + 1)));
+        pool.parallelFor(count, grain, [&](int begin, int end) {
+            for (int i = begin; i < end; i++)
+            {
+                int brick = chunk[i];
+                int b[3] = { brick / (m_bricks[1] * m_bricks[2]), brick / m_bricks[2] % m_bricks[1], brick % m_bricks[2] };
+                int from[3], to[3];
+                for (int a = 0; a < 3; a++)
+                {
+                    from[a] = max(b[a] << shift, first[a]);
+                    to[a] = min((b[a] + 1) << shift, last[a] + 1);
+                }
+                const Entry &entry = m_table[brick];
+                const float *voxels = entry.codes == NO_CODES ? 0 : this->voxels(brick);
+                int mask = BrickedVolume::BRICK_SIZE - 1;
+                for (int x = from[0]; x < to[0]; x++)
+                {
+                    for (int y = from[1]; y < to[1]; y++)
+                    {
+                        float *row = window.row(x - x0, y - y0) + (from[2] - z0);
+                        if (!voxels)
+                        {
+                            std::fill(row, row + (to[2] - from[2]), entry.base);
+                            continue;
+                        }
+                        const float *decoded = voxels + ((((x & mask) << shift) + (y & mask)) << shift) + (from[2] & mask);
+                        std::copy(decoded, decoded + (to[2] - from[2]), row);
+                    }
+                }
+            }
+        });
+    }
+    m_lastReadTime = millisecondsSince(start);
+}
+
+/**
+  Pages in up to maxBricks bricks of the box from low to high (exclusive, in voxels) moved
+  reach voxels along direction, slices nearest to the box first, so a read() of the box once it
+  has moved that way finds them resident. At most a quarter of the slots are filled per call,
+  which keeps what was read last in memory. Returns the number of bricks paged in.
+  */
+int StreamedVolume::readAhead(const int *low, const int *high, const Vector3 &direction, int reach, int maxBricks)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    float length = direction.length();
+    if (!this->isOpen() || length == 0 || reach <= 0)
+    {
+        return 0;
+    }
+    float along[3] = { direction.x / length, direction.y / length, direction.z / length };
+    int shift = BrickedVolume::BRICK_SHIFT;
+    int first[3], last[3]; // bricks of the moved box
+    for (int a = 0; a < 3; a++)
+    {
+        int moved = (int)lrintf(along[a] * reach);
+        first[a] = max(low[a] + moved, 0) >> shift;
+        last[a] = (min(high[a] + moved, m_dims[a]) - 1) >> shift;
+        if (last[a] < first[a] || low[a] + moved >= m_dims[a])
+        {
+            return 0;
+        }
+    }
+
+    //slices across the axis closest to the direction, walked away from the box
+    int axis = fabsf(along[0]) >= fabsf(along[1]) && fabsf(along[0]) >= fabsf(along[2]) ? 0 : (fabsf(along[1]) >= fabsf(along[2]) ? 1 : 2);
+    int u = (axis + 1) % 3, v = (axis + 2) % 3;
+    int slices = last[axis] - first[axis] + 1;
+    maxBricks = min(maxBricks, max(1, m_capacity / 4));
+
+    std::vector<int> missing;
+    for (int s = 0; s < slices && (int)missing.size() < maxBricks; s++)
+    {
+        int b[3];
+        b[axis] = along[axis] >= 0 ? first[axis] + s : last[axis] - s;
+        for (b[u] = first[u]; b[u] <= last[u] && (int)missing.size() < maxBricks; b[u]++)
+        {
+            for (b[v] = first[v]; b[v] <= last[v] && (int)missing.size() < maxBricks; b[v]++)
+            {
+                int brick = (int)this->brickIndex(b[0], b[1], b[2]);
+                if (m_table[brick].codes != NO_CODES && m_slots[brick] < 0)
+                {
+                    missing.push_back(brick);
+                }
+            }
+        }
+    }
+    if (!missing.empty())
+    {
+        this->load(&missing[0], (int)missing.size());
+    }
+    m_prefetched += missing.size();
+    m_lastReadAheadTime = millisecondsSince(start);
+    return (int)missing.size();
+}
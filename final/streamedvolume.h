@@ -0,0 +1,120 @@
+#ifndef STREAMEDVOLUME_H
+#define STREAMEDVOLUME_H
+
+#include <QFile>
+#include <QString>
+#include <QtGlobal>
+#include <vector>
+#include "brickedvolume.h"
+#include "vector.h"
+#include "volumecache.h"
+
+class CloudGenerator;
+class CloudVolume;
+
+/**
+    A cloud volume too large to hold in memory, kept on disk as BrickedVolume bricks and paged
+    in on demand.
+
+    build() generates the grid one slab of BRICK_SIZE x planes at a time, each slab on the
+    thread pool, quantizes it into bricks and appends their codes to the file, so memory only
+    ever holds a slab. The file is a PAGE sized header, the codes of the quantized bricks, and
+    a table of every brick at the end; open() checks the header against the key like the
+    volume cache does and keeps the table, which is small, in memory.
+
+    Quantized bricks are decoded into a fixed number of slots, set by the byte budget, and the
+    least recently used brick gives up its slot when another one is needed. Constant bricks
+    never take a slot. read() copies a box of the grid into a dense volume, paging in what it
+    misses in batches that are read in file order and decoded on the thread pool.
+    readAhead() pages in the bricks of a box moved along a direction, e.g. where the camera
+    looks, before they are asked for. Memory use stays at the table plus the budget, however
+    large the grid.
+
+    Not thread safe: one thread uses it, the paging spreads its own work over the pool.
+**/
+class StreamedVolume
+{
+
+public:
+    static const quint32 FORMAT_VERSION = 1;
+    static const int PAGE = 4096; // bytes before the codes
+    static const quint32 NO_CODES = 0xffffffffu;
+
+    struct Entry
+    {
+        float base;
+        float step; // 0 for constant bricks
+        quint32 codes; // index of the brick's codes in the file, NO_CODES for constant bricks
+    };
+
+    StreamedVolume();
+    ~StreamedVolume();
+
+    void setPath(const QString &path);
+    void setCompression(int bits, float threshold);
+    void setBudget(qint64 bytes);
+
+    bool fetch(const VolumeCache::Key &key, const CloudGenerator &generator);
+    bool open(const VolumeCache::Key &key);
+    bool build(const VolumeCache::Key &key, const CloudGenerator &generator);
+    void close();
+
+    float sample(int x, int y, int z);
+    void read(CloudVolume &window, int x0, int y0, int z0);
+    int readAhead(const int *low, const int *high, const Vector3 &direction, int reach, int maxBricks);
+
+    bool isOpen() const { return m_file.isOpen(); }
+    const QString &path() const { return m_path; }
+    int sizeX() const { return m_dims[0]; }
+    int sizeY() const { return m_dims[1]; }
+    int sizeZ() const { return m_dims[2]; }
+    int brickCount() const { return (int)m_table.size(); }
+    int capacity() const { return m_capacity; } // bricks that fit in the budget
+    int residentBricks() const { return m_resident; }
+    qint64 bytes() const; // in memory: the table, the slots and their bookkeeping
+    qint64 fileBytes() const { return m_fileBytes; }
+    qint64 hits() const { return m_hits; }
+    qint64 misses() const { return m_misses; }
+    qint64 evictions() const { return m_evictions; }
+    qint64 prefetched() const { return m_prefetched; }
+    double lastBuildTime() const { return m_lastBuildTime; } // milliseconds
+    double lastReadTime() const { return m_lastReadTime; } // milliseconds
+    double lastReadAheadTime() const { return m_lastReadAheadTime; } // milliseconds
+
+private:
+    size_t brickIndex(int bx, int by, int bz) const { return ((size_t)bx * m_bricks[1] + by) * m_bricks[2] + bz; }
+    void load(const int *bricks, int count);
+    void touch(int slot);
+    void unlink(int slot);
+    const float *voxels(int brick) const { return &m_voxels[(size_t)m_slots[brick] * BrickedVolume::BRICK_VOXELS]; }
+
+    QString m_path;
+    QFile m_file; // open while the volume is
+    int m_bits;
+    float m_threshold;
+    qint64 m_budget;
+
+    int m_dims[3];
+    int m_bricks[3];
+    std::vector<Entry> m_table; // x-major like the voxels
+    qint64 m_fileBytes;
+
+    int m_capacity;
+    int m_resident;
+    std::vector<float> m_voxels; // m_capacity slots of BRICK_VOXELS, grown as they are taken
+    std::vector<int> m_slots; // per brick, -1 unless resident
+    std::vector<int> m_owners; // per slot, the brick in it
+    std::vector<int> m_newer, m_older; // per slot, the least recently used list
+    int m_newest, m_oldest; // slots, -1 when none is taken
+    std::vector<unsigned char> m_staging; // codes read for a batch
+
+    qint64 m_hits;
+    qint64 m_misses;
+    qint64 m_evictions;
+    qint64 m_prefetched;
+    double m_lastBuildTime;
+    double m_lastReadTime;
+    double m_lastReadAheadTime;
+};
+
+#endif // STREAMEDVOLUME_H
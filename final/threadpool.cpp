@@ -0,0 +1,187 @@
+#include "threadpool.h"
+#include <algorithm>
+
+struct ThreadPool::Job
+{
+    const std::function<void(int, int)> *body;
+    std::atomic<int> remaining;
+    std::mutex mutex;
+    std::condition_variable done;
+};
+
+/**
+  Starts threads workers, or one per hardware thread (minus the caller) when threads is 0
+  */
+ThreadPool::ThreadPool(int threads)
+    : m_pending(0), m_stop(false)
+{
+    if (threads <= 0)
+    {
+        threads = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+    }
+
+    for (int i = 0; i <= threads; i++)
+    {
+        m_queues.push_back(new Queue());
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        m_threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+
+    for (size_t i = 0; i < m_threads.size(); i++)
+    {
+        m_threads[i].join();
+    }
+    for (size_t i = 0; i < m_queues.size(); i++)
+    {
+        delete m_queues[i];
+    }
+}
+
+/**
+  The process wide pool shared by everything that generates cloud data
+  */
+ThreadPool &ThreadPool::global()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+/**
+  Calls body(begin, end) over [0, count) in chunks of at most grain items and returns once
+  every chunk has finished. Chunks may run in any order on any thread, so body must only
+  touch state that belongs to its own range.
+  */
+void ThreadPool::parallelFor(int count, int grain, const std::function<void(int, int)> &body)
+{
+    if (count <= 0)
+    {
+        return;
+    }
+    grain = std::max(1, grain);
+
+    int chunks = (count + grain - 1) / grain;
+    if (chunks == 1 || m_threads.empty())
+    {
+        body(0, count);
+        return;
+    }
+
+    Job job;
+    job.body = &body;
+    job.remaining = chunks;
+
+    // counted before they are published, so a worker taking one never drives the count below 0
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending += chunks;
+    }
+
+    // deal contiguous runs of chunks to each queue so neighbouring slabs stay on one core
+    int queues = (int)m_queues.size();
+    for (int q = 0; q < queues; q++)
+    {
+        int first = (int)((long long)chunks * q / queues);
+        int last = (int)((long long)chunks * (q + 1) / queues);
+
+        std::lock_guard<std::mutex> lock(m_queues[q]->mutex);
+        for (int c = first; c < last; c++)
+        {
+            Task task = { &job, c * grain, std::min(count, (c + 1) * grain) };
+            m_queues[q]->tasks.push_back(task);
+        }
+    }
+    m_wake.notify_all();
+
+    // help out from the caller's queue until there is nothing left to take
+    int self = queues - 1;
+    Task task;
+    while (job.remaining > 0 && takeTask(self, task))
+    {
+        runTask(task);
+    }
+
+    std::unique_lock<std::mutex> lock(job.mutex);
+    while (job.remaining > 0)
+    {
+        job.done.wait(lock);
+    }
+}
+
+void ThreadPool::workerLoop(int index)
+{
+    for (;;)
+    {
+        Task task;
+        if (takeTask(index, task))
+        {
+            runTask(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_stop && m_pending == 0)
+        {
+            m_wake.wait(lock);
+        }
+        if (m_stop && m_pending == 0)
+        {
+            return;
+        }
+    }
+}
+
+/**
+  Pops from the front of our own queue, otherwise steals from the back of another one
+  */
+bool ThreadPool::takeTask(int index, Task &task)
+{
+    int queues = (int)m_queues.size();
+    for (int i = 0; i < queues; i++)
+    {
+        Queue *queue = m_queues[(index + i) % queues];
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        if (queue->tasks.empty())
+        {
+            continue;
+        }
+
+        if (i == 0)
+        {
+            task = queue->tasks.front();
+            queue->tasks.pop_front();
+        }
+        else
+        {
+            task = queue->tasks.back();
+            queue->tasks.pop_back();
+        }
+        m_pending--;
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::runTask(const Task &task)
+{
+    Job *job = task.job;
+    (*job->body)(task.begin, task.end);
+
+    // count down under the lock: the job lives on the caller's stack and disappears as soon
+    // as the caller sees zero, so nothing may touch it after the lock is released
+    std::lock_guard<std::mutex> lock(job->mutex);
+    if (--job->remaining == 0)
+    {
+        job->done.notify_all();
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+    A persistent pool of worker threads with per-worker task queues and work stealing.
+
+    parallelFor() splits a range into chunks, deals contiguous runs of chunks to each queue and
+    blocks until all of them ran. Idle workers (and the calling thread, which helps out) take
+    from the front of their own queue and steal from the back of the others.
+**/
+class ThreadPool
+{
+
+public:
+    explicit ThreadPool(int threads = 0);
+    ~ThreadPool();
+
+    int threadCount() const { return (int)m_threads.size(); }
+
+    void parallelFor(int count, int grain, const std::function<void(int, int)> &body);
+
+    static ThreadPool &global();
+
+private:
+    struct Job;
+    struct Task
+    {
+        Job *job;
+        int begin;
+        int end;
+    };
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    void workerLoop(int index);
+    bool takeTask(int index, Task &task);
+    void runTask(const Task &task);
+
+    std::vector<std::thread> m_threads;
+    std::vector<Queue *> m_queues; // one per worker plus a shared one for callers
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::atomic<int> m_pending; // tasks sitting in queues
+    bool m_stop;
+};
+
+#endif // THREADPOOL_H
@@ -6,21 +6,32 @@
 #include <QApplication>
 #include <QKeyEvent>
 #include <QList>
+#include <QStringList>
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include <GL/glext.h>
 #include <QGLShader>
 #include <iostream>
 #include <numeric>
+#include <algorithm>
 
-#define dimX 50
-#define dimY 25
-#define dimZ 50
+#define REFERENCE_DIM 50. //grid width the container size was tuned for
+#define BILLBOARD_REACH 1.42f //farthest billboard corner from its particle, in billboard edges
+#define LIGHT_EXTINCTION 0.02f //optical depth per world unit of cloud at density 1
+#define IMPOSTOR_CLUSTER 200.f //largest far cluster drawn as one impostor, in world units
 #define EXTENT 500.
 #define SUN_RADIUS 35
 #define SUNX -EXTENT+(2*SUN_RADIUS)
 #define SUNY (2*EXTENT)/3
 #define SUNZ -EXTENT+(2*SUN_RADIUS)
+#define ACTIVE_INTERVAL (1000 / 60) //milliseconds between ticks while frames change
+#define MAX_IDLE_INTERVAL 250 //slowest tick once nothing changes
+#define MAX_DRIFT_INTERVAL 50 //slowest tick while the clouds drift, so a refresh still finishes
+#define LIGHT_SLICES_PER_TICK 8 //light volume slices swept per tick after the clouds drift
+#define EXTRACT_VOXELS_PER_TICK (1 << 18) //voxels scanned for particles per tick after the clouds drift
+#define UPLOAD_VOXELS_PER_FRAME (1 << 20) //voxels staged into the ray marched texture per frame after a drift
+#define PAN_FRACTION 16 //the arrow keys pan an out of core window by this fraction of its width
+#define READ_AHEAD_BRICKS 256 //most bricks of an out of core volume paged in ahead per tick
 
 using namespace std;
 class QGLShaderProgram;
@@ -40,32 +51,260 @@ View::View(QWidget *parent) : QGLWidget(parent), m_font("Verdana", 8, 4)
     // The game loop is implemented using a timer
     connect(&timer, SIGNAL(timeout()), this, SLOT(tick()));
 
+    m_dirty = true;
+    m_presentedImage = 0;
+    m_framesRendered = 0;
+    m_framesPresented = 0;
+    m_loadCpu = 0;
+    m_loadFrames = 0;
+    m_cpuLoad = 0;
+    m_frameRate = 0;
+
     //initialize settings for our program
+    m_settings = CloudSettings::fromArguments(QApplication::arguments());
+
+    //pace the frames to the display, except when benchmarking how fast they render
+    QGLFormat format = this->format();
+    format.setSwapInterval(m_settings.vsync && !QApplication::arguments().contains("--bench") ? 1 : 0);
+    this->setFormat(format);
+    RadialBlur::Quality quality;
+    if (RadialBlur::qualityFromName(qPrintable(m_settings.godRayQuality), quality))
+    {
+        m_radialBlur.setQuality(quality);
+    }
+    else
+    {
+        qWarning("Unknown god ray quality '%s'", qPrintable(m_settings.godRayQuality));
+    }
+    m_sunPosition = Vector3(SUNX, SUNY, SUNZ);
+    //where the particle shading and the god ray direction have always placed the light (the
+    //SUN macros expand unparenthesised, so this is a little behind the drawn sun)
+    m_sunLight = -Vector3(-SUNX, -SUNY, -SUNZ);
+    m_sunMoved = false;
+    m_lightVolume.setThreshold(PARTICLE_THRESHOLD);
     this->setSquareSize(100);
     m_godRaysEnabled = true;
     m_godModeEnabled = false;
     m_modelerModeEnabled = false;
+    m_prevTime = 0;
+    m_prevFps = 0;
     m_cloudgen = new CloudGenerator();
-    m_clouds = m_cloudgen->calcIntensity(dimX, dimY, dimZ);
+    m_layers = new LayeredVolume(*m_cloudgen);
+    m_layers->setReduced(m_settings.reducedLayers);
+
+    //map the volume of the last start with these parameters, or generate it and keep it for the
+    //next one; after a mapped start the layers are only generated by the first tweak
+    QTime startup;
+    startup.start();
+    m_stream = 0;
+    if (m_settings.outOfCore)
+    {
+        //only a window of the volume is held, paged in from bricks generated to disk once
+        VolumeCache::Key key = VolumeCache::keyFor(m_settings, *m_cloudgen);
+        m_stream = new StreamedVolume();
+        m_stream->setPath(m_settings.streamFile);
+        m_stream->setCompression(m_settings.cacheBits > 0 ? m_settings.cacheBits : 8, PARTICLE_THRESHOLD);
+        m_stream->setBudget((qint64)m_settings.streamBudget * 1024 * 1024);
+        qDebug("Streaming the %dx%dx%d volume from '%s', generated there first if it isn't yet",
+               m_settings.dimX, m_settings.dimY, m_settings.dimZ, qPrintable(m_settings.streamFile));
+        if (m_stream->fetch(key, *m_cloudgen))
+        {
+            m_clouds.resize(m_settings.windowX, m_settings.windowY, m_settings.windowZ);
+            m_windowOrigin[0] = (m_settings.dimX - m_settings.windowX) / 2;
+            m_windowOrigin[1] = (m_settings.dimY - m_settings.windowY) / 2;
+            m_windowOrigin[2] = (m_settings.dimZ - m_settings.windowZ) / 2;
+            m_stream->read(m_clouds, m_windowOrigin[0], m_windowOrigin[1], m_windowOrigin[2]);
+        }
+        else
+        {
+            //without the bricks on disk only a volume the size of the window fits in memory
+            qWarning("Could not open or generate the %dx%dx%d volume in '%s', showing a %dx%dx%d one in memory instead",
+                     m_settings.dimX, m_settings.dimY, m_settings.dimZ, qPrintable(m_settings.streamFile),
+                     m_settings.windowX, m_settings.windowY, m_settings.windowZ);
+            delete m_stream;
+            m_stream = 0;
+            m_settings.outOfCore = false;
+            m_settings.dimX = m_settings.windowX;
+            m_settings.dimY = m_settings.windowY;
+            m_settings.dimZ = m_settings.windowZ;
+        }
+    }
+    if (!m_stream)
+    {
+        m_volumeCache.setPath(m_settings.volumeCache);
+        m_volumeCache.setVerify(m_settings.verifyCache);
+        m_volumeCache.setCompression(m_settings.cacheBits, PARTICLE_THRESHOLD);
+        m_volumeCache.fetch(VolumeCache::keyFor(m_settings, *m_cloudgen), m_clouds, [this](CloudVolume &volume) {
+            m_layers->update(m_settings.dimX, m_settings.dimY, m_settings.dimZ, m_settings.octaves, m_settings.cells);
+            m_layers->compose(volume);
+        });
+    }
+    m_startupTime = startup.elapsed();
+    m_animator = new CloudAnimator(*m_cloudgen);
+    m_animator->setVolume(m_settings.dimX, m_settings.dimY, m_settings.dimZ, m_settings.octaves, m_settings.cells);
+    m_animator->setWind(m_stream ? 0 : m_settings.wind); //an out of core volume stays as it was generated
+    m_animator->setVoxelBudget(m_settings.voxelBudget);
+    if (m_animator->isRunning())
+    {
+        qDebug("Clouds drift at %g cells/s, a full refresh takes %d frames of %d voxels", m_settings.wind,
+               m_animator->framesPerRefresh(), m_settings.voxelBudget);
+    }
+    m_drifted = false;
+    m_extracting = false;
+    m_particlesDirty = true;
+    m_volumeDirty = true;
+    m_rayMarching = m_settings.engine == "raymarch";
+    m_resolutionScaler.setBudget(m_settings.frameBudget);
+    m_scaledFrame = -1;
+
+    //--record-path flight.txt saves the camera of every tick, to be replayed by --bench-path
+    QStringList arguments = QApplication::arguments();
+    int record = arguments.indexOf("--record-path");
+    if (record >= 0 && record + 1 < arguments.size())
+    {
+        m_recordFile = arguments[record + 1];
+    }
+
+    //--trace frames.json keeps the last frames' pass timings for chrome://tracing
+    m_showTimings = false;
+    int trace = arguments.indexOf("--trace");
+    if (trace >= 0 && trace + 1 < arguments.size())
+    {
+        m_traceFile = arguments[trace + 1];
+    }
 }
 
 View::~View()
 {
+    if (!m_recordFile.isEmpty())
+    {
+        m_recordedPath.save(m_recordFile);
+    }
+    if (!m_traceFile.isEmpty())
+    {
+        m_profiler.writeTrace(m_traceFile);
+    }
     gluDeleteQuadric(m_quadric);
+    delete(m_animator);
+    delete(m_stream);
+    delete(m_layers);
     delete(m_cloudgen);
-    delete m_framebufferObjects["fbo_0"];
-    delete m_framebufferObjects["fbo_1"];
-    delete m_framebufferObjects["fbo_2"];
-    delete m_framebufferObjects["fbo_3"];
 }
 
 /**
-  A mutator for the square size (container size). The distribution of our cloud depends on this.
+  Moves the sun to a new world position. The lighting of the clouds is recomputed once, before
+  the next frame, rather than every frame.
+  */
+void View::setSunPosition(const Vector3 &position)
+{
+    //the shading light keeps its offset from the drawn sun
+    m_sunLight += position - m_sunPosition;
+    m_sunPosition = position;
+    m_sunMoved = true;
+    this->invalidate();
+}
+
+void View::setCamera(const OrbitCamera &camera)
+{
+    m_camera = camera;
+    this->invalidate();
+}
+
+/**
+  Marks the frame as changed, so the next tick renders it again, and makes the ticks fast
+  again if they had slowed down
+  */
+void View::invalidate()
+{
+    m_dirty = true;
+    if (timer.isActive() && timer.interval() != ACTIVE_INTERVAL)
+    {
+        timer.start(ACTIVE_INTERVAL);
+    }
+}
+
+/**
+  Redraw only changed frames, or every tick as before
+  */
+void View::setRedrawOnDemand(bool onDemand)
+{
+    m_settings.redrawOnDemand = onDemand;
+    this->invalidate();
+}
+
+/**
+  Sets the same toggles as the G, B and M keys at once
+  */
+void View::setFeatures(bool godRays, bool godMode, bool modelerMode)
+{
+    m_godRaysEnabled = godRays;
+    m_godModeEnabled = godMode;
+    m_modelerModeEnabled = modelerMode;
+    this->invalidate();
+}
+
+/**
+  Draws the clouds by ray-marching the volume instead of as billboards, where the driver allows
+  it, like the E key
+  */
+void View::setRayMarching(bool rayMarching)
+{
+    m_rayMarching = rayMarching;
+    this->invalidate();
+}
+
+/**
+  A mutator for the square size (container size). The distribution of our cloud depends on this,
+  scaled so that finer grids cover the same extent as the original 50 wide one.
   */
 void View::setSquareSize(float squareSize)
 {
     m_squareSize = squareSize;
-    m_squareDistribution = m_squareSize / 5.0;
+    int width = m_settings.outOfCore ? m_settings.windowX : m_settings.dimX;
+    m_squareDistribution = m_squareSize / 5.0 * (REFERENCE_DIM / width);
+    m_lightVolume.setExtinction(LIGHT_EXTINCTION * m_squareDistribution);
+    m_particlesDirty = true;
+    this->invalidate();
+}
+
+/**
+  Brings the clouds in line with the octave count and weights after they were tweaked. Only
+  the octave layers that changed are generated again before the layers are summed. Drifting
+  clouds are composed at the animator's current phase, which regenerates every layer, and the
+  refresh under way starts over with the new noise.
+  */
+void View::retuneNoise()
+{
+    double phase = m_animator->isRunning() ? m_animator->phase() : 0;
+    m_layers->update(m_settings.dimX, m_settings.dimY, m_settings.dimZ, m_settings.octaves, m_settings.cells, phase);
+    m_layers->compose(m_clouds);
+    if (m_animator->isRunning())
+    {
+        m_animator->setVolume(m_settings.dimX, m_settings.dimY, m_settings.dimZ, m_settings.octaves, m_settings.cells);
+    }
+    m_particlesDirty = true;
+    m_volumeDirty = true;
+    m_lightVolume.markDirty();
+}
+
+/**
+  Moves the window of an out of core volume by (dx, dz) voxels, staying inside the volume, and
+  pages in what it shows now. Bricks read ahead while the camera looked that way are hits.
+  */
+void View::panWindow(int dx, int dz)
+{
+    int x = qBound(0, m_windowOrigin[0] + dx, m_stream->sizeX() - m_clouds.sizeX());
+    int z = qBound(0, m_windowOrigin[2] + dz, m_stream->sizeZ() - m_clouds.sizeZ());
+    if (x == m_windowOrigin[0] && z == m_windowOrigin[2])
+    {
+        return;
+    }
+    m_windowOrigin[0] = x;
+    m_windowOrigin[2] = z;
+    m_stream->read(m_clouds, m_windowOrigin[0], m_windowOrigin[1], m_windowOrigin[2]);
+    m_particlesDirty = true;
+    m_volumeDirty = true;
+    m_lightVolume.markDirty();
 }
 
 void View::initializeGL()
@@ -77,7 +316,9 @@ void View::initializeGL()
     // Start a timer that will try to get 60 frames per second (the actual
     // frame rate depends on the operating system and other running programs)
     m_clock.start();
-    timer.start(1000 / 60);
+    timer.start(ACTIVE_INTERVAL);
+    m_loadClock.start();
+    m_loadCpu = std::clock();
 
     // Center the mouse, which is explained more in mouseMoveEvent() below.
     // This needs to be done here because the mouse may be initially outside
@@ -118,19 +359,55 @@ void View::initializeGL()
     initializeResources();
     m_quadric = gluNewQuadric();
 
+    m_profiler.initialize(context());
+    m_frameGraph.setProfiler(&m_profiler);
+
     QCursor::setPos(mapToGlobal(QPoint(width() / 2, height() / 2)));
 
-    //loads the textures used for the cloud particles
-    m_textureIDwhite = this->loadTexture("../textures/particle_cloud.png");
-    m_textureIDModeler = this->loadTexture("../textures/particle_cloud_gradient.png");
-    m_textureID1 = this->loadTexture("../textures/particle_cloud1.png");
-    m_textureID2 = this->loadTexture("../textures/particle_cloud2.png");
-    m_textureID3 = this->loadTexture("../textures/particle_cloud3.png");
-    m_textureID4 = this->loadTexture("../textures/particle_cloud4.png");
-    m_textureID5 = this->loadTexture("../textures/particle_cloud5.png");
-    m_textureID6 = this->loadTexture("../textures/particle_cloud6.png");
-    m_textureID7 = this->loadTexture("../textures/particle_cloud7.png");
-    m_textureID8 = this->loadTexture("../textures/particle_cloud8.png");
+    //loads the textures used for the cloud particles, in the layer order ParticleRenderer uses
+    QStringList particleTextures;
+    for (int i = 1; i <= CloudParticles::SHADE_LAYERS; i++)
+    {
+        particleTextures.append(QString("../textures/particle_cloud%1.png").arg(i));
+    }
+    particleTextures.append("../textures/particle_cloud.png");
+    particleTextures.append("../textures/particle_cloud_gradient.png");
+
+    //draw the clouds with one instanced call per pass where the driver allows it
+    bool instanced = m_particleRenderer.initialize(context(), m_shaderPrograms["particles"],
+                                                   m_shaderPrograms["particles_batched"]);
+    if (!instanced)
+    {
+        qWarning("Instanced particles unavailable, drawing clouds in immediate mode");
+    }
+
+    m_particleTextureArray = 0;
+    if (instanced && ParticleRenderer::hasTextureArrays())
+    {
+        m_particleTextureArray = this->loadTextureArray(particleTextures);
+    }
+    for (int l = 0; l < ParticleRenderer::LAYERS; l++)
+    {
+        m_particleTextures[l] = m_particleTextureArray ? 0 : this->loadTexture(particleTextures[l]);
+    }
+    m_particleRenderer.setTextures(m_particleTextureArray, m_particleTextures);
+
+    //the ray-marched clouds take their colours from the same textures
+    if (!m_volumeRenderer.initialize(context(), m_shaderPrograms["raymarch"]))
+    {
+        qWarning("Float 3d textures unavailable, the ray-marching engine is disabled");
+    }
+    m_volumeRenderer.setTextures(particleTextures);
+
+    //distant clusters are drawn from cached images, rendered by a particle renderer of their own
+    if (instanced && m_impostors.initialize(context()))
+    {
+        m_impostorRenderer.initialize(context(), m_shaderPrograms["particles"], m_shaderPrograms["particles_batched"]);
+        m_impostorRenderer.setTextures(m_particleTextureArray, m_particleTextures);
+        m_impostors.setBudget((qint64)m_settings.impostorBudget * 1024 * 1024);
+        m_impostors.setAngleThreshold(m_settings.impostorAngle);
+        m_particleCuller.setImpostors(m_settings.impostorDistance, IMPOSTOR_CLUSTER);
+    }
 
     glEnable(GL_ALPHA_TEST);
 
@@ -144,6 +421,10 @@ void View::createShaderPrograms()
 {
       const QGLContext *ctx = context();
       m_shaderPrograms["lightscatter"] = this->newFragShaderProgram(ctx, "../shaders/lightscatter.frag");
+      m_shaderPrograms["radialblur"] = this->newFragShaderProgram(ctx, "../shaders/radialblur.frag");
+      m_shaderPrograms["particles"] = this->newShaderProgram(ctx, "../shaders/particles.vert", "../shaders/particles.frag");
+      m_shaderPrograms["particles_batched"] = this->newShaderProgram(ctx, "../shaders/particles.vert", "../shaders/particles_batched.frag");
+      m_shaderPrograms["raymarch"] = this->newShaderProgram(ctx, "../shaders/raymarch.vert", "../shaders/raymarch.frag");
 }
 
 void View::initializeResources()
@@ -151,7 +432,6 @@ void View::initializeResources()
     m_skybox = loadSkybox();
     loadCubeMap();
     createShaderPrograms();
-    createFramebufferObjects(width(), height());
 }
 
 /**
@@ -265,29 +545,36 @@ void View::applyPerspectiveCamera(float width, float height)
     glLoadIdentity();
 }
 
-void View::createFramebufferObjects(int width, int height)
+/**
+  Size of the god ray targets for a window of the given size
+  */
+QSize View::occlusionSize(int width, int height) const
+{
+    int scale = m_settings.occlusionScale;
+    return QSize(qMax(1, (width + scale - 1) / scale), qMax(1, (height + scale - 1) / scale));
+}
+
+/**
+  Whether the camera looks towards the sun, the only case in which god rays show
+  */
+bool View::sunInView() const
 {
-    // Allocate the main framebuffer object for rendering the scene to
-    // This needs a depth attachment
-    m_framebufferObjects["fbo_0"] = new QGLFramebufferObject(width, height, QGLFramebufferObject::Depth,
-                                                             GL_TEXTURE_2D, GL_RGB16F_ARB);
-    m_framebufferObjects["fbo_0"]->format().setSamples(16);
-    // Allocate the secondary framebuffer obejcts for rendering textures to (post process effects)
-    // These do not require depth attachments
-    m_framebufferObjects["fbo_1"] = new QGLFramebufferObject(width, height, QGLFramebufferObject::NoAttachment,
-                                                             GL_TEXTURE_2D, GL_RGB16F_ARB);
+    Vector3 dir(-Vector3::fromAngles(m_camera.theta, m_camera.phi));
+
+    Vector3 lightVector(-m_sunLight);
+    lightVector.normalize();
 
-    m_framebufferObjects["fbo_2"] = new QGLFramebufferObject(width, height, QGLFramebufferObject::NoAttachment,
-                                                             GL_TEXTURE_2D, GL_RGB16F_ARB);
-    m_framebufferObjects["fbo_3"] = new QGLFramebufferObject(width, height, QGLFramebufferObject::NoAttachment,
-                                                             GL_TEXTURE_2D, GL_RGB16F_ARB);
+    return lightVector.dot(dir) < 0;
 }
 
 /**
-  renderLightScatter: does pre-processing prior to passing our scene to the shader for god rays
+  renderLightScatter: does pre-processing prior to passing our scene to the shader for god rays.
+  Adds the passes that blur the occlusion target into rays of the given size, and at most
+  capacity, to the frame graph and returns the name of the target holding the rays. Needs the
+  perspective camera applied.
   */
 
-void View::renderLightScatter(int width, int height)
+QString View::renderLightScatter(const QSize &size, const QSize &capacity)
 {
     float exposure = 0.8; //brightness of the rays compared to the rest of the scene
     float decay = 0.95; //determines the fall-off of the rays from the light source
@@ -296,15 +583,15 @@ void View::renderLightScatter(int width, int height)
 
     Vector3 dir(-Vector3::fromAngles(m_camera.theta, m_camera.phi));
 
-    Vector3 lightVector(-SUNX, -SUNY,-SUNZ);
+    Vector3 lightVector(-m_sunLight);
     lightVector.normalize();
 
     float dotLightLook = lightVector.dot(dir);
 
     double lightPositionInWorld[4];
-    lightPositionInWorld[0] = SUNX;
-    lightPositionInWorld[1] = SUNY;
-    lightPositionInWorld[2] = SUNZ;
+    lightPositionInWorld[0] = m_sunPosition.x;
+    lightPositionInWorld[1] = m_sunPosition.y;
+    lightPositionInWorld[2] = m_sunPosition.z;
     lightPositionInWorld[3] = 1.;
 
     double modelView[16];
@@ -347,27 +634,64 @@ void View::renderLightScatter(int width, int height)
     lightPositionOnScreen[0] = (1 + result[0] * rhw) * viewPort[2] / 2 + viewPort[0];
     lightPositionOnScreen[1] = (1 - result[1] * rhw) * viewPort[3] / 2 + viewPort[1];
 
-    lightPositionOnScreen[0] = lightPositionOnScreen[0]/((double)this->width());
-    lightPositionOnScreen[1] = 1-(lightPositionOnScreen[1]/((double)this->height()));
+    lightPositionOnScreen[0] = lightPositionOnScreen[0]/viewPort[2];
+    lightPositionOnScreen[1] = 1-(lightPositionOnScreen[1]/viewPort[3]);
 
 
-    m_framebufferObjects["fbo_1"]->bind();
-    m_shaderPrograms["lightscatter"]->bind();
+    Vector2 light(lightPositionOnScreen[0], lightPositionOnScreen[1]);
 
-    glBindTexture(GL_TEXTURE_2D, m_framebufferObjects["fbo_2"]->texture());
+    // every pass blurs the previous target into a new one, the frame graph ping-pongs them
+    m_radialBlur.setParameters(exposure, decay, density, weight);
+    bool reference = m_radialBlur.quality() == RadialBlur::REFERENCE;
+    int passes = reference ? 1 : (int) m_radialBlur.passes().size();
 
-    m_shaderPrograms["lightscatter"]->setUniformValue("exposure", exposure);
-    m_shaderPrograms["lightscatter"]->setUniformValue("decay", decay);
-    m_shaderPrograms["lightscatter"]->setUniformValue("density", density);
-    m_shaderPrograms["lightscatter"]->setUniformValue("weight", weight);
-    m_shaderPrograms["lightscatter"]->setUniformValue("dotLightLook", dotLightLook);
-    m_shaderPrograms["lightscatter"]->setUniformValueArray("lightPositionOnScreen", lightPositionOnScreen, 1, 2);
-    applyOrthogonalCamera(width, height);
+    QString source = "occlusion";
+    for (int p = 0; p < passes; p++)
+    {
+        QString rays = QString("rays_%1").arg(p);
+        m_frameGraph.addTarget(rays, size, false, capacity);
+        m_frameGraph.addPass(QString("scatter %1").arg(p), QStringList(source), QStringList(rays), [=]()
+        {
+            // the light position is relative to the part of the texture the source covers
+            Vector2 extent = m_frameGraph.extent(source);
+            Vector2 limit = m_frameGraph.sampleLimit(source);
+            Vector2 lightInTexture = light * extent;
 
-    renderTexturedQuad(width , height);
-    m_shaderPrograms["lightscatter"]->release();
-    glBindTexture(GL_TEXTURE_2D, 0);
-    m_framebufferObjects["fbo_1"]->release();
+            m_frameGraph.bind(rays);
+            if (!reference)
+            {
+                m_radialBlur.renderPass(m_shaderPrograms["radialblur"], p, m_frameGraph.texture(source),
+                                        lightInTexture.xy, extent.xy, limit.xy);
+                m_profiler.count(FrameProfiler::DRAW_CALLS);
+                m_profiler.count(FrameProfiler::TEXTURE_BINDS);
+                m_profiler.count(FrameProfiler::STATE_CHANGES);
+                m_frameGraph.release(rays);
+                return;
+            }
+
+            m_shaderPrograms["lightscatter"]->bind();
+
+            glBindTexture(GL_TEXTURE_2D, m_frameGraph.texture(source));
+            m_profiler.count(FrameProfiler::TEXTURE_BINDS);
+            m_profiler.count(FrameProfiler::STATE_CHANGES);
+
+            m_shaderPrograms["lightscatter"]->setUniformValue("exposure", exposure);
+            m_shaderPrograms["lightscatter"]->setUniformValue("decay", decay);
+            m_shaderPrograms["lightscatter"]->setUniformValue("density", density);
+            m_shaderPrograms["lightscatter"]->setUniformValue("weight", weight);
+            m_shaderPrograms["lightscatter"]->setUniformValue("dotLightLook", dotLightLook);
+            m_shaderPrograms["lightscatter"]->setUniformValueArray("lightPositionOnScreen", lightInTexture.xy, 1, 2);
+            m_shaderPrograms["lightscatter"]->setUniformValueArray("extent", limit.xy, 1, 2);
+            applyOrthogonalCamera(size.width(), size.height());
+
+            renderTexturedQuad(size.width(), size.height(), extent.x, extent.y);
+            m_shaderPrograms["lightscatter"]->release();
+            glBindTexture(GL_TEXTURE_2D, 0);
+            m_frameGraph.release(rays);
+        });
+        source = rays;
+    }
+    return source;
 }
 
 void View::renderBlackBox()
@@ -410,143 +734,382 @@ void View::renderBlackBox()
     glVertex3f( extent, -extent,  extent);
     glVertex3f( extent, -extent, -extent);
     glEnd();
+    m_profiler.count(FrameProfiler::DRAW_CALLS);
 }
 
 void View::paintGL()
 {
+    //nothing changed since the last frame, e.g. the window was just uncovered: show it again
+    if (!m_dirty && m_settings.redrawOnDemand && m_presentedSize == QSize(this->width(), this->height()))
+    {
+        this->presentCachedImage();
+        return;
+    }
+    m_dirty = false;
+
+    this->updateRenderScale();
+    m_profiler.beginFrame();
+    m_impostors.beginFrame();
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     int width = this->width();
     int height = this->height();
+    float scale = m_resolutionScaler.scale();
+    m_renderSize = QSize(qMax(1, qRound(width * scale)), qMax(1, qRound(height * scale)));
 
     int time = m_clock.elapsed();
     m_fps = 1000.f / (time - m_prevTime);
     m_prevTime = time;
+    m_textureBinds = 0;
+    m_sortTime = 0;
+    m_sortMethod = ParticleSorter::SORT_NONE;
+
+    // Every target and pass is declared each frame; the frame graph skips the passes nothing
+    // on screen depends on and shares framebuffer objects between targets that don't overlap.
+    // The offscreen targets render at the scaled size inside objects big enough for the full
+    // one, so the render scale can change without reallocating, and the composites upscale them
+    QSize occlusionSize = this->occlusionSize(m_renderSize.width(), m_renderSize.height());
+    QSize occlusionCapacity = this->occlusionSize(width, height);
+    m_frameGraph.reset(width, height);
+    m_frameGraph.addTarget("occlusion", occlusionSize, true, occlusionCapacity);
+    m_frameGraph.addTarget("scene", m_renderSize, true, QSize(width, height));
+
+    m_frameGraph.addPass("occlusion", QStringList(), QStringList("occlusion"), [=]()
+    {
+        m_frameGraph.bind("occlusion");
+        this->renderOcclusion(width, height);
+        m_frameGraph.release("occlusion");
+    });
 
-    if(this->m_godRaysEnabled || this->m_godModeEnabled)
+    // the clouds are blended over the skybox in the same target
+    m_frameGraph.addPass("skybox", QStringList(), QStringList("scene"), [=]()
     {
-        m_framebufferObjects["fbo_0"]->bind();
-        applyPerspectiveCamera(width, height);
+        m_frameGraph.bind("scene");
+        this->renderSkybox(width, height);
+        m_frameGraph.release("scene");
+    });
 
-        glEnable(GL_DEPTH_TEST);
-        glClear(GL_DEPTH_BUFFER_BIT);
+    m_frameGraph.addPass("clouds", QStringList("scene"), QStringList("scene"), [=]()
+    {
+        m_frameGraph.bind("scene");
+        this->renderSceneClouds(width, height);
+        m_frameGraph.release("scene");
+    });
+
+    // render the scene if not in god mode
+    if(!m_godModeEnabled)
+    {
+        m_frameGraph.addPass("composite scene", QStringList("scene"), QStringList(FrameGraph::SCREEN), [=]()
+        {
+            Vector2 extent = m_frameGraph.extent("scene");
+            applyOrthogonalCamera(width, height);
+            glBindTexture(GL_TEXTURE_2D, m_frameGraph.texture("scene"));
+            m_profiler.count(FrameProfiler::TEXTURE_BINDS);
+            renderTexturedQuad(width, height, extent.x, extent.y);
+            glBindTexture(GL_TEXTURE_2D, 0);
+        });
+    }
 
-        this->renderBlackBox();
+    // facing away from the sun there are no rays, so none of the god ray passes run
+    if((m_godRaysEnabled || m_godModeEnabled) && this->sunInView())
+    {
+        applyPerspectiveCamera(width, height);
+        QString rays = this->renderLightScatter(occlusionSize, occlusionCapacity);
 
-        glEnable(GL_CULL_FACE);
+        // Enable alpha blending and render the texture from the GPU to the screen, bilinearly
+        // upsampled from the reduced size
+        m_frameGraph.addPass("composite rays", QStringList(rays), QStringList(FrameGraph::SCREEN), [=]()
+        {
+            Vector2 extent = m_frameGraph.extent(rays);
+            applyOrthogonalCamera(width, height);
+            glBindTexture(GL_TEXTURE_2D, m_frameGraph.texture(rays));
+            m_profiler.count(FrameProfiler::TEXTURE_BINDS);
 
+            //blend if we're using god rays
+            if(!m_godModeEnabled)
+            {
+                setCapability(GL_BLEND, true);
+                glBlendFunc(GL_ONE, GL_ONE);
+                m_profiler.count(FrameProfiler::STATE_CHANGES);
+            }
 
-        //draws the sun for god rays
-        glMatrixMode(GL_MODELVIEW);
-        glPushMatrix();
-        glTranslatef(SUNX, SUNY, SUNZ);
-        glColor4f(0.0f, 0.0f, 0.0f, 0.f);
-        gluSphere(m_quadric, SUN_RADIUS, 20, 20);
-        glPopMatrix();
+            renderTexturedQuad(width, height, extent.x, extent.y);
 
-        glDisable(GL_CULL_FACE);
+            if(!m_godModeEnabled)
+            {
+                setCapability(GL_BLEND, false);
+            }
 
-        glEnable(GL_CULL_FACE);
+            glBindTexture(GL_TEXTURE_2D, 0);
+        });
+    }
 
-        this->renderClouds(true);
+    m_frameGraph.execute();
 
-        glDisable(GL_CULL_FACE);
+    m_profiler.begin("text");
+    paintText();
 
-        glDepthMask(GL_TRUE);
-        glDisable(GL_BLEND);
-        glDisable(GL_DEPTH_TEST);
+    if (m_settings.redrawOnDemand)
+    {
+        m_profiler.begin("cache");
+        this->cacheFinalImage();
+    }
+    m_profiler.endFrame();
+    m_framesRendered++;
+}
 
-        m_framebufferObjects["fbo_0"]->release();
+/**
+  Copies the finished frame out of the back buffer for presentCachedImage()
+  */
+void View::cacheFinalImage()
+{
+    int width = this->width();
+    int height = this->height();
 
-        // Copy the rendered scene into framebuffer 1
-        m_framebufferObjects["fbo_0"]->blitFramebuffer(m_framebufferObjects["fbo_1"],
-                                                       QRect(0, 0, width, height), m_framebufferObjects["fbo_0"],
-                                                       QRect(0, 0, width, height), GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    if (!m_presentedImage)
+    {
+        glGenTextures(1, &m_presentedImage);
+    }
+    glBindTexture(GL_TEXTURE_2D, m_presentedImage);
+    if (m_presentedSize != QSize(width, height))
+    {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        m_presentedSize = QSize(width, height);
     }
 
-    //START RENDERING REAL SKYBOX
-    if(!this->m_godModeEnabled)
+    glReadBuffer(GL_BACK);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    m_profiler.count(FrameProfiler::TEXTURE_BINDS);
+}
+
+/**
+  Shows the last rendered frame again with a single textured quad
+  */
+void View::presentCachedImage()
+{
+    int width = this->width();
+    int height = this->height();
+
+    glViewport(0, 0, width, height);
+    applyOrthogonalCamera(width, height);
+    glColor3f(1.f, 1.f, 1.f);
+    glBindTexture(GL_TEXTURE_2D, m_presentedImage);
+    renderTexturedQuad(width, height);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    m_framesPresented++;
+}
+
+/**
+  glEnable or glDisable, counted as a state change
+  */
+void View::setCapability(GLenum capability, bool enabled)
+{
+    if (enabled)
     {
-        // Render the scene to a framebuffer
-        m_framebufferObjects["fbo_0"]->bind();
-        applyPerspectiveCamera(width, height);
+        glEnable(capability);
+    }
+    else
+    {
+        glDisable(capability);
+    }
+    m_profiler.count(FrameProfiler::STATE_CHANGES);
+}
 
-        glEnable(GL_DEPTH_TEST);
-        glClear(GL_DEPTH_BUFFER_BIT);
+/**
+  The god ray occlusion mask: a light grey box, the black sun and the clouds in white
+  */
+void View::renderOcclusion(int width, int height)
+{
+    applyPerspectiveCamera(width, height);
 
-        // Enable cube maps and draw the skybox
-        glEnable(GL_TEXTURE_CUBE_MAP);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, m_cubeMap);
-        glCallList(m_skybox); //renders the skybox
+    setCapability(GL_DEPTH_TEST, true);
+    glClear(GL_DEPTH_BUFFER_BIT);
 
-        glBindTexture(GL_TEXTURE_CUBE_MAP,0);
-        glDisable(GL_TEXTURE_CUBE_MAP);
+    this->renderBlackBox();
 
-        // Enable culling (back) faces for rendering the dragon
-        glEnable(GL_CULL_FACE);
+    setCapability(GL_CULL_FACE, true);
 
-        this->renderClouds(false);
+    //draws the sun for god rays
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glTranslatef(m_sunPosition.x, m_sunPosition.y, m_sunPosition.z);
+    glColor4f(0.0f, 0.0f, 0.0f, 0.f);
+    gluSphere(m_quadric, SUN_RADIUS, 20, 20);
+    glPopMatrix();
+    m_profiler.count(FrameProfiler::DRAW_CALLS);
 
-        glDisable(GL_CULL_FACE);
+    this->renderClouds(true);
 
-        glDepthMask(GL_TRUE);
-        glDisable(GL_BLEND);
-        glDisable(GL_DEPTH_TEST);
+    setCapability(GL_CULL_FACE, false);
 
-        m_framebufferObjects["fbo_0"]->release();
-    }
+    glDepthMask(GL_TRUE);
+    m_profiler.count(FrameProfiler::STATE_CHANGES);
+    setCapability(GL_BLEND, false);
+    setCapability(GL_DEPTH_TEST, false);
+}
 
-    //END REAL SKYBOX
+/**
+  The sky box, which also fills the depth buffer of the scene target
+  */
+void View::renderSkybox(int width, int height)
+{
+    applyPerspectiveCamera(width, height);
 
-    // Copy the rendered scene into framebuffer 1
-    m_framebufferObjects["fbo_0"]->blitFramebuffer(m_framebufferObjects["fbo_3"],
-                                                   QRect(0, 0, width, height), m_framebufferObjects["fbo_0"],
-                                                   QRect(0, 0, width, height), GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    setCapability(GL_DEPTH_TEST, true);
+    glClear(GL_DEPTH_BUFFER_BIT);
 
-    // render the scene if not in god mode
-    if(!m_godModeEnabled)
+    // Enable cube maps and draw the skybox
+    setCapability(GL_TEXTURE_CUBE_MAP, true);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, m_cubeMap);
+    m_profiler.count(FrameProfiler::TEXTURE_BINDS);
+    glCallList(m_skybox); //renders the skybox
+    m_profiler.count(FrameProfiler::DRAW_CALLS);
+
+    glBindTexture(GL_TEXTURE_CUBE_MAP,0);
+    setCapability(GL_TEXTURE_CUBE_MAP, false);
+    setCapability(GL_DEPTH_TEST, false);
+}
+
+/**
+  The shaded clouds, blended over the sky box
+  */
+void View::renderSceneClouds(int width, int height)
+{
+    applyPerspectiveCamera(width, height);
+
+    setCapability(GL_DEPTH_TEST, true);
+
+    // Enable culling (back) faces for rendering the dragon
+    setCapability(GL_CULL_FACE, true);
+
+    this->renderClouds(false);
+
+    setCapability(GL_CULL_FACE, false);
+
+    glDepthMask(GL_TRUE);
+    m_profiler.count(FrameProfiler::STATE_CHANGES);
+    setCapability(GL_BLEND, false);
+    setCapability(GL_DEPTH_TEST, false);
+}
+
+/**
+  World position of voxel (0, 0, 0) of the cloud volume
+  */
+Vector3 View::cloudOrigin() const
+{
+    //start point is determined by our sky box size
+    return Vector3(-EXTENT, -EXTENT+(2*SUN_RADIUS), -EXTENT);
+}
+
+/**
+  Extracts the visible particles from the cloud volume. Only needs to run again when the volume,
+  the threshold or the particle spacing changes.
+  */
+void View::buildParticles()
+{
+    m_particles.build(m_clouds, this->cloudOrigin(), m_squareDistribution, PARTICLE_THRESHOLD);
+    this->relightParticles();
+    m_particlesDirty = false;
+    m_sunMoved = false;
+    m_particleCuller.invalidate();
+    m_impostors.invalidate();
+    m_farFallback.clear();
+
+    //a drift still settling is caught up with all at once
+    if (m_drifted)
     {
-        applyOrthogonalCamera(width, height);
-        glBindTexture(GL_TEXTURE_2D, m_framebufferObjects["fbo_3"]->texture());
-        renderTexturedQuad(width, height);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        m_drifted = false;
+        m_extracting = false;
+        m_nextParticles.clear();
+        m_volumeDirty = true;
     }
+}
 
-    // check if the user specified that god rays should be calculated on the gpu
-    if(m_godRaysEnabled || m_godModeEnabled)
+/**
+  Recomputes the particles' lighting for the current sun, from the light volume when self
+  shadowing, which only sweeps the volume again where it is out of date
+  */
+void View::relightParticles()
+{
+    if (!m_settings.selfShadowing)
     {
-        // copy what's in FBO 1 to FBO 2 for renderLightScatter shader stuff
-        applyOrthogonalCamera(width, height);
-        m_framebufferObjects["fbo_2"]->bind();
-        glBindTexture(GL_TEXTURE_2D, m_framebufferObjects["fbo_1"]->texture());
-        renderTexturedQuad(width, height);
-        glBindTexture(GL_TEXTURE_2D, 0);
-        m_framebufferObjects["fbo_2"]->release();
+        m_particles.relight(m_sunLight);
+        return;
+    }
 
-        // Enable alpha blending and render the texture from the GPU to the screen
-        applyPerspectiveCamera(width, height);
-        this->renderLightScatter(width, height);
-        applyOrthogonalCamera(width, height);
-        glBindTexture(GL_TEXTURE_2D, m_framebufferObjects["fbo_1"]->texture());
+    this->updateLightVolume(0);
+    m_particles.relight(m_lightVolume);
+}
 
-        //blend if we're using god rays
-        if(!m_godModeEnabled)
-        {
-            glEnable(GL_BLEND);
-            glBlendFunc(GL_ONE, GL_ONE);
-        }
+/**
+  Sweeps the light volume for the current sun where it is out of date, at most maxSlices slices
+  if that is above 0
+  */
+void View::updateLightVolume(int maxSlices)
+{
+    Vector3 centre = this->cloudOrigin()
+            + Vector3(m_clouds.sizeX() - 1, m_clouds.sizeY() - 1, m_clouds.sizeZ() - 1) * (m_squareDistribution * 0.5f);
+    m_lightVolume.setSun(m_sunLight - centre);
+    m_lightVolume.update(m_clouds, maxSlices);
+}
 
-        renderTexturedQuad(width, height);
+/**
+  Catches up with a volume the animator swapped in, a little per tick while the old particles
+  stay on screen: with self shadowing the light volume is swept LIGHT_SLICES_PER_TICK slices at
+  a time, then EXTRACT_VOXELS_PER_TICK voxels are scanned for particles into m_nextParticles,
+  which replace the drawn ones once complete. Ray marching stages the volume while drawing.
+  */
+void View::settleDrift()
+{
+    //a full rebuild is already due, or the volume is staged as it is drawn
+    if (m_particlesDirty || this->isRayMarching())
+    {
+        this->invalidate();
+        return;
+    }
 
-        if(!m_godModeEnabled)
+    if (m_settings.selfShadowing)
+    {
+        this->updateLightVolume(LIGHT_SLICES_PER_TICK);
+        if (!m_lightVolume.isUpToDate())
         {
-            glDisable(GL_BLEND);
+            return;
         }
-
-        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    if (!m_extracting)
+    {
+        m_nextParticles.start(m_clouds, this->cloudOrigin(), m_squareDistribution, PARTICLE_THRESHOLD);
+        m_extracting = true;
+    }
+    if (!m_nextParticles.extract(m_clouds, EXTRACT_VOXELS_PER_TICK))
+    {
+        return;
     }
 
-    paintText();
+    m_particles.swap(m_nextParticles);
+    m_nextParticles.clear();
+    m_extracting = false;
+    m_drifted = false;
+    m_volumeDirty = true;
+    m_particleCuller.invalidate();
+    m_farFallback.clear();
+    m_sunMoved = true; //the new particles are lit and uploaded on the next frame
+    this->invalidate();
+}
+
+/**
+  Hands the current particles, back to front, to whichever path draws them
+  */
+void View::uploadParticles()
+{
+    m_particleRenderer.upload(m_particles, m_squareSize, m_particleSorter.order(), m_particleSorter.size());
+    if (!m_particleRenderer.isSupported())
+    {
+        m_particles.groupByShade(m_particleSorter.order(), m_particleSorter.size(), m_shadeOrder, m_shadeBatches);
+    }
 }
 
 /**
@@ -555,132 +1118,293 @@ void View::paintGL()
 
 void View::renderClouds(bool renderGreyMode) {
 
-    //start point is determined by our sky box size
-    Vector3 startPoint(-EXTENT, -EXTENT+(2*SUN_RADIUS), -EXTENT);
-
-    // calculate the angle and axis about which the squares should be rotated to match
-    // the camera's rotation for billboarding
     Vector3 dir(-Vector3::fromAngles(m_camera.theta, m_camera.phi));
-    Vector3 faceNormal = Vector3(0,0,-1);
-    Vector3 axis = dir.cross(faceNormal);
-    axis.normalize();
-    double angle = acos(dir.dot(faceNormal) / dir.length() / faceNormal.length());
+
+    glTexEnvf(GL_TEXTURE_2D,GL_TEXTURE_ENV_MODE,GL_MODULATE);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_BLEND_SRC);
+    glDepthMask(GL_FALSE);
+    setCapability(GL_BLEND, true);
+    glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    m_profiler.count(FrameProfiler::STATE_CHANGES, 4);
+
+    //the volume engine needs no particles at all
+    if (this->isRayMarching())
+    {
+        this->renderCloudsVolume(renderGreyMode, dir);
+        return;
+    }
+
+    bool upload = false;
+    if (m_particlesDirty)
+    {
+        this->buildParticles();
+        upload = true;
+    }
+    else if (m_sunMoved)
+    {
+        //only the lighting changes when the sun moves
+        this->relightParticles();
+        m_impostors.invalidate();
+        m_sunMoved = false;
+        upload = true;
+    }
 
     //if we're rending the grey occlusion mode, use white cloud particles
+    int layer = CloudParticles::UNSHADED;
     if (renderGreyMode)
     {
-        glBindTexture(GL_TEXTURE_2D, m_textureIDwhite);
+        layer = ParticleRenderer::WHITE_LAYER;
     // use white gradient particle if we're in modeler mode
     } else if(m_modelerModeEnabled)
     {
-        glBindTexture(GL_TEXTURE_2D, m_textureIDModeler);
+        layer = ParticleRenderer::MODELER_LAYER;
     }
 
-    glTexEnvf(GL_TEXTURE_2D,GL_TEXTURE_ENV_MODE,GL_MODULATE);
-    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_BLEND_SRC);
-    glDepthMask(GL_FALSE);
-    glEnable(GL_BLEND);
-    glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    m_num_squares = 0;
+    //only the bricks in view are sorted and drawn, the far ones mostly as impostors behind them
+    float aspect = height() > 0 ? width() / (float) height() : 1.0f;
+    Vector3 eye(m_camera.center - dir * m_camera.zoom);
+    bool culled = m_particleCuller.cull(m_particles, m_camera, aspect, m_squareSize * BILLBOARD_REACH);
+    if (this->renderImpostors(eye, layer) || culled)
+    {
+        const std::vector<CloudParticles::Node> &nodes = m_particles.nodes();
+        m_candidates = m_particleCuller.visible();
+        for (unsigned i = 0; i < m_farFallback.size(); i++)
+        {
+            const CloudParticles::Node &node = nodes[m_farFallback[i]];
+            for (int p = node.first; p < node.first + node.count; p++)
+            {
+                m_candidates.push_back(p);
+            }
+        }
+        m_particleSorter.setCandidates(m_candidates);
+    }
 
-    //light vector indicates direction in which the suns rays are going
-    Vector3 lightVector(-SUNX, -SUNY, -SUNZ);
-    lightVector.normalize();
+    //blending needs the particles back to front
+    if (m_particleSorter.sort(m_particles, eye, dir))
+    {
+        m_sortTime += m_particleSorter.lastSortTime();
+        m_sortMethod = m_particleSorter.lastMethod();
+        upload = true;
+    }
+
+    if (upload)
+    {
+        this->uploadParticles();
+    }
 
-    double particleSunAngle;
+    if (!m_particleRenderer.isSupported())
+    {
+        this->renderCloudsImmediate(renderGreyMode, dir);
+        return;
+    }
+
+    m_particleRenderer.draw(dir, layer);
+    m_num_squares = m_particleRenderer.instanceCount();
+    m_textureBinds += m_particleRenderer.textureBinds();
+
+    //the renderer binds its program and buffers itself
+    m_profiler.count(FrameProfiler::DRAW_CALLS, m_particleRenderer.drawCalls());
+    m_profiler.count(FrameProfiler::TEXTURE_BINDS, m_particleRenderer.textureBinds());
+    m_profiler.count(FrameProfiler::STATE_CHANGES, 2);
+    m_profiler.count(FrameProfiler::PARTICLES, m_num_squares);
+}
+
+/**
+  Draws the far clusters from their impostors, farthest first, rendering missing and stale ones
+  on the way. Clusters the cache can't take this frame are left in m_farFallback to be drawn as
+  particles; returns whether that list changed.
+  */
+bool View::renderImpostors(const Vector3 &eye, int layer)
+{
+    const std::vector<CloudParticles::Node> &nodes = m_particles.nodes();
+    const std::vector<int> &far = m_particleCuller.farClusters();
+    std::vector<int> fallback;
 
-    //populate the cloud lattice
-    for (int i=0; i < dimX; i++)
+    std::vector<std::pair<float, int> > clusters;
+    for (unsigned i = 0; i < far.size(); i++)
     {
-        for (int j=0; j < dimY; j++)
+        const CloudParticles::Node &node = nodes[far[i]];
+        clusters.push_back(std::make_pair(-((node.min + node.max) * 0.5f - eye).length(), far[i]));
+    }
+    std::sort(clusters.begin(), clusters.end());
+
+    //shaded, grey and modeler images of a cluster are cached separately
+    int slot = layer == ParticleRenderer::WHITE_LAYER ? 1 : (layer == ParticleRenderer::MODELER_LAYER ? 2 : 0);
+    std::vector<ImpostorCache::Impostor> impostors;
+    for (unsigned i = 0; i < clusters.size(); i++)
+    {
+        const CloudParticles::Node &node = nodes[clusters[i].second];
+        Vector3 centre = (node.min + node.max) * 0.5f;
+        float radius = (node.max - node.min).length() * 0.5f + m_squareSize * BILLBOARD_REACH;
+        int resolution = ImpostorCache::resolutionFor(radius, -clusters[i].first, m_camera.fovy, m_renderSize.height());
+
+        //the cluster's particles alone, back to front as seen from the impostor's eye
+        ImpostorCache::Render render = [this, &node, layer](const Vector3 &from, const Vector3 &look)
         {
-            for (int k=0; k < dimZ; k++)
+            std::vector<int> range(node.count);
+            for (int p = 0; p < node.count; p++)
             {
-                //intensity is the value given in the corresponding perlin 3d array, also incorporating vertical fall-off
-                float intensity = m_clouds[i][j][k]*(1.0 - (j/((float) dimY)));
-                //threshold for rendering a particle
-                if (intensity > 0.1)
-                {
-                    //use various particle colors depending on intensity and lighting scheme
-                    if (!(renderGreyMode || m_modelerModeEnabled))
-                    {
-                        //vector from the sun to the current particle
-                        Vector3 toParticle(startPoint.x+(m_squareDistribution*i)-SUNX, startPoint.y+(m_squareDistribution*j)-SUNY, startPoint.z+(m_squareDistribution*k)-SUNZ);
-                        toParticle.normalize();
-
-                        //cos of the angle from sun to particle, mapping to range [0,1]
-                        particleSunAngle = ((lightVector.dot(toParticle))/2.)+0.5;
-
-                        //factor is greater when particles are in more direct view of the sun
-                        double factor = ((1.8-(particleSunAngle))*m_clouds[i][j][k]);
-
-                        if (factor >= 0.0 && factor <= 0.125)
-                        {
-                            glBindTexture(GL_TEXTURE_2D, m_textureID8);
-                        }
-                        else if (factor > 0.125 && factor <= 0.18)
-                        {
-                            glBindTexture(GL_TEXTURE_2D, m_textureID7);
-                        }
-                        else if (factor > 0.18 && factor <= 0.25)
-                        {
-                            glBindTexture(GL_TEXTURE_2D, m_textureID6);
-                        }
-                        else if (factor > 0.25 && factor <= 0.31)
-                        {
-                            glBindTexture(GL_TEXTURE_2D, m_textureID5);
-                        }
-                        else if (factor > 0.31 && factor <= 0.4)
-                        {
-                            glBindTexture(GL_TEXTURE_2D, m_textureID4);
-                        }
-                        else if (factor > 0.4 && factor <= 0.5)
-                        {
-                            glBindTexture(GL_TEXTURE_2D, m_textureID3);
-                        }
-                        else if (factor > 0.5 && factor <= 0.6)
-                        {
-                            glBindTexture(GL_TEXTURE_2D, m_textureID2);
-                        }
-                        else if (factor > 0.6 && factor <= 1.0)
-                        {
-                            glBindTexture(GL_TEXTURE_2D, m_textureID1);
-                        }
-                    }
-
-                    m_num_squares++;
-                    glMatrixMode(GL_MODELVIEW);
-                    glPushMatrix();
-                    glTranslatef(startPoint.x+(m_squareDistribution*i), startPoint.y+(m_squareDistribution*j), startPoint.z+(m_squareDistribution*k));
-                    glRotatef((-angle/M_PI)*180, axis.x, axis.y, axis.z);
-                    glColor4f(1.0f, 1.0f, 1.0f, 0.1f);
-                    renderTexturedQuad(m_squareSize, m_squareSize);
-
-                    if (!renderGreyMode && !m_modelerModeEnabled)
-                    {
-                        glBindTexture(GL_TEXTURE_2D, 0);
-                    }
-                    glPopMatrix();
-                }
+                range[p] = node.first + p;
             }
+            m_impostorSorter.setCandidates(range);
+            m_impostorSorter.sort(m_particles, from, look);
+            m_impostorRenderer.upload(m_particles, m_squareSize, m_impostorSorter.order(), m_impostorSorter.size());
+            m_impostorRenderer.draw(look, layer);
+            m_profiler.count(FrameProfiler::DRAW_CALLS, m_impostorRenderer.drawCalls());
+            m_profiler.count(FrameProfiler::PARTICLES, m_impostorRenderer.instanceCount());
+        };
+
+        ImpostorCache::Impostor impostor;
+        if (m_impostors.acquire(clusters[i].second * 3 + slot, centre, radius, eye, resolution, render, impostor))
+        {
+            impostors.push_back(impostor);
+        }
+        else
+        {
+            fallback.push_back(clusters[i].second);
         }
     }
 
-    if (renderGreyMode || m_modelerModeEnabled)
+    //the impostors hold premultiplied colour
+    if (!impostors.empty())
     {
+        glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+        glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+        for (unsigned i = 0; i < impostors.size(); i++)
+        {
+            m_impostors.draw(impostors[i]);
+        }
         glBindTexture(GL_TEXTURE_2D, 0);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        m_textureBinds += (int)impostors.size();
+        m_profiler.count(FrameProfiler::DRAW_CALLS, (int)impostors.size());
+        m_profiler.count(FrameProfiler::TEXTURE_BINDS, (int)impostors.size());
+        m_profiler.count(FrameProfiler::STATE_CHANGES, 2);
     }
+
+    std::sort(fallback.begin(), fallback.end());
+    bool changed = fallback != m_farFallback;
+    m_farFallback.swap(fallback);
+    return changed;
+}
+
+/**
+  Ray-marches the cloud volume, uploading it first if it changed, or after a drift staging it
+  UPLOAD_VOXELS_PER_FRAME voxels per frame while the old one is drawn
+  */
+void View::renderCloudsVolume(bool renderGreyMode, const Vector3 &dir)
+{
+    if (m_volumeDirty)
+    {
+        m_volumeRenderer.upload(m_clouds, PARTICLE_THRESHOLD);
+        m_volumeDirty = false;
+        if (m_drifted)
+        {
+            m_drifted = false;
+            m_particlesDirty = true;
+        }
+    }
+    else if (m_drifted && m_volumeRenderer.stage(m_clouds, PARTICLE_THRESHOLD, UPLOAD_VOXELS_PER_FRAME))
+    {
+        m_drifted = false;
+        m_particlesDirty = true;
+    }
+
+    m_volumeRenderer.setPlacement(this->cloudOrigin(), m_squareDistribution, m_squareSize);
+    m_volumeRenderer.setSun(m_sunLight, m_sunPosition, SUN_RADIUS);
+
+    //the same textures the billboards would use, averaged
+    VolumeRenderer::Mode mode = VolumeRenderer::SHADED;
+    if (renderGreyMode)
+    {
+        mode = VolumeRenderer::OCCLUSION;
+    } else if (m_modelerModeEnabled)
+    {
+        mode = VolumeRenderer::MODELER;
+    }
+
+    Vector3 eye(m_camera.center - dir * m_camera.zoom);
+    m_volumeRenderer.draw(eye, mode);
+    m_num_squares = 0;
+
+    //one box, both 3d textures and the state the renderer saves and restores
+    m_profiler.count(FrameProfiler::DRAW_CALLS);
+    m_profiler.count(FrameProfiler::TEXTURE_BINDS, 2);
+    m_profiler.count(FrameProfiler::STATE_CHANGES, 8);
+}
+
+/**
+  Fallback for drivers without instancing: one textured quad per particle
+  */
+void View::renderCloudsImmediate(bool renderGreyMode, const Vector3 &dir)
+{
+    // calculate the angle and axis about which the squares should be rotated to match
+    // the camera's rotation for billboarding
+    Vector3 faceNormal = Vector3(0,0,-1);
+    Vector3 axis = dir.cross(faceNormal);
+    axis.normalize();
+    double angle = acos(dir.dot(faceNormal) / dir.length() / faceNormal.length());
+
+    const float *px = m_particles.x();
+    const float *py = m_particles.y();
+    const float *pz = m_particles.z();
+
+    m_num_squares = 0;
+
+    //draws the particles sequence[begin, end) as billboards
+    auto drawQuads = [&](const int *sequence, int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            int p = sequence[i];
+
+            m_num_squares++;
+            glMatrixMode(GL_MODELVIEW);
+            glPushMatrix();
+            glTranslatef(px[p], py[p], pz[p]);
+            glRotatef((-angle/M_PI)*180, axis.x, axis.y, axis.z);
+            glColor4f(1.0f, 1.0f, 1.0f, 0.1f);
+            renderTexturedQuad(m_squareSize, m_squareSize);
+            glPopMatrix();
+        }
+    };
+
+    //the grey occlusion and modeler modes use one texture for every particle, so they keep the
+    //back to front order in a single batch
+    if (renderGreyMode || m_modelerModeEnabled)
+    {
+        int layer = renderGreyMode ? ParticleRenderer::WHITE_LAYER : ParticleRenderer::MODELER_LAYER;
+        glBindTexture(GL_TEXTURE_2D, m_particleTextures[layer]);
+        m_textureBinds++;
+        m_profiler.count(FrameProfiler::TEXTURE_BINDS);
+        drawQuads(m_particleSorter.order(), 0, m_particleSorter.size());
+    }
+    else
+    {
+        //one batch per shade texture, the unshaded particles last and untextured
+        for (int l = 0; l <= CloudParticles::SHADE_LAYERS; l++)
+        {
+            if (m_shadeBatches[l] == m_shadeBatches[l + 1])
+            {
+                continue;
+            }
+            glBindTexture(GL_TEXTURE_2D, l < CloudParticles::SHADE_LAYERS ? m_particleTextures[l] : 0);
+            m_textureBinds++;
+            m_profiler.count(FrameProfiler::TEXTURE_BINDS);
+            drawQuads(m_shadeOrder.data(), m_shadeBatches[l], m_shadeBatches[l + 1]);
+        }
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    m_profiler.count(FrameProfiler::PARTICLES, m_num_squares);
 }
 
 
 void View::resizeGL(int w, int h)
 {
+    // the frame graph resizes its targets when the next frame declares them
     glViewport(0, 0, w, h);
-    delete m_framebufferObjects["fbo_0"];
-    delete m_framebufferObjects["fbo_1"];
-    delete m_framebufferObjects["fbo_2"];
-    delete m_framebufferObjects["fbo_3"];
-    createFramebufferObjects(w, h);
+    this->invalidate();
 }
 
 GLuint View::loadTexture(const QString &path)
@@ -713,19 +1437,66 @@ GLuint View::loadTexture(const QString &path)
     return id; /* return something meaningful */
 }
 
-void View::renderTexturedQuad(int width, int height)
+/**
+  Loads equally sized images into the layers of one GL_TEXTURE_2D_ARRAY, in order. Images that
+  differ in size from the first are scaled to match.
+  */
+GLuint View::loadTextureArray(const QStringList &paths)
+{
+    if (paths.isEmpty())
+    {
+        return 0;
+    }
+
+    QImage first(paths[0]);
+    if (first.isNull())
+    {
+        return 0;
+    }
+    int width = first.width();
+    int height = first.height();
+
+    GLuint id = 0;
+    glGenTextures(1, &id);
+    glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, id);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY_EXT, 0, GL_RGBA, width, height, paths.size(), 0, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+
+    for (int layer = 0; layer < paths.size(); layer++)
+    {
+        // same byte order loadTexture uploads
+        QImage image = QImage(paths[layer]).convertToFormat(QImage::Format_ARGB32);
+        if (image.width() != width || image.height() != height)
+        {
+            image = image.scaled(width, height, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        }
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY_EXT, 0, 0, 0, layer, width, height, 1, GL_BGRA, GL_UNSIGNED_BYTE, image.bits());
+    }
+
+    glTexParameteri(GL_TEXTURE_2D_ARRAY_EXT, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY_EXT, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, 0);
+
+    return id;
+}
+
+/**
+  Draws a width x height quad textured with the texture coordinates up to (s, t)
+  */
+void View::renderTexturedQuad(int width, int height, float s, float t)
 {
     // Draw the  quad
     glBegin(GL_QUADS);
     glTexCoord2f(0.0f, 0.0f);
     glVertex2f(0.0f, 0.0f);
-    glTexCoord2f(1.0f, 0.0f);
+    glTexCoord2f(s, 0.0f);
     glVertex2f(width, 0.0f);
-    glTexCoord2f(1.0f, 1.0f);
+    glTexCoord2f(s, t);
     glVertex2f(width, height);
-    glTexCoord2f(0.0f, 1.0f);
+    glTexCoord2f(0.0f, t);
     glVertex2f(0.0f, height);
     glEnd();
+    m_profiler.count(FrameProfiler::DRAW_CALLS);
 }
 
 void View::mousePressEvent(QMouseEvent *event)
@@ -739,6 +1510,7 @@ void View::wheelEvent(QWheelEvent *event)
     if (event->orientation() == Qt::Vertical)
     {
         m_camera.mouseWheel(event->delta());
+        this->invalidate();
     }
 }
 
@@ -759,6 +1531,7 @@ void View::mouseMoveEvent(QMouseEvent *event)
     if (event->buttons() & Qt::LeftButton || event->buttons() & Qt::RightButton)
     {
         m_camera.mouseMove(pos - m_prevMousePos);
+        this->invalidate();
     }
 
     m_prevMousePos = pos;
@@ -777,10 +1550,82 @@ void View::tick()
     // Get the number of seconds since the last tick (variable update rate)
     float seconds = m_clock.restart() * 0.001f;
 
-    // TODO: Implement the demo update here
+    // Drift the clouds; the volume changes only when a whole refresh is done, and the next
+    // refresh waits until what is drawn from it has caught up
+    if (m_animator->isRunning())
+    {
+        m_animator->advance(seconds);
+        if (!m_drifted && m_animator->step(m_clouds))
+        {
+            m_drifted = true;
+            m_extracting = false;
+            m_lightVolume.markDirty();
+        }
+        if (m_drifted)
+        {
+            this->settleDrift();
+        }
+    }
+    // Page in the bricks of an out of core volume the next pans along the view will show
+    if (m_stream)
+    {
+        Vector3 dir(-Vector3::fromAngles(m_camera.theta, m_camera.phi));
+        int high[3] = { m_windowOrigin[0] + m_clouds.sizeX(), m_windowOrigin[1] + m_clouds.sizeY(),
+                        m_windowOrigin[2] + m_clouds.sizeZ() };
+        m_stream->readAhead(m_windowOrigin, high, Vector3(dir.x, 0, dir.z), m_clouds.sizeX() / 4, READ_AHEAD_BRICKS);
+    }
+    if (!m_recordFile.isEmpty())
+    {
+        m_recordedPath.record(m_camera);
+    }
+    this->measureLoad();
+
+    // Render the frame right away if anything changed; otherwise tick less and less often
+    // until the next change (recording keeps the ticks regular, drifting clouds and the light
+    // sweep after a drift need them often enough to get through)
+    int maxInterval = m_drifted ? ACTIVE_INTERVAL : (m_animator->isRunning() ? MAX_DRIFT_INTERVAL : MAX_IDLE_INTERVAL);
+    if (m_dirty || !m_settings.redrawOnDemand)
+    {
+        m_dirty = true;
+        updateGL();
+    }
+    else if (m_recordFile.isEmpty() && timer.interval() != maxInterval)
+    {
+        timer.setInterval(qMin(timer.interval() * 2, maxInterval));
+    }
+}
 
-    // Flag this view for repainting (Qt will call paintGL() soon after)
-    update();
+/**
+  Process CPU time (all threads) and rendered frames per second of wall time, over roughly the
+  last second
+  */
+void View::measureLoad()
+{
+    int elapsed = m_loadClock.elapsed();
+    if (elapsed < 1000)
+    {
+        return;
+    }
+
+    std::clock_t cpu = std::clock();
+    m_cpuLoad = 100.0 * (cpu - m_loadCpu) / CLOCKS_PER_SEC / (elapsed * 0.001);
+    m_frameRate = (m_framesRendered - m_loadFrames) / (elapsed * 0.001);
+    m_loadCpu = cpu;
+    m_loadFrames = m_framesRendered;
+    m_loadClock.restart();
+}
+
+/**
+  Hands the GPU time of the newest frame the profiler resolved to the resolution scaler
+  */
+void View::updateRenderScale()
+{
+    if (!m_profiler.hasFrame() || m_profiler.lastFrame().number == m_scaledFrame)
+    {
+        return;
+    }
+    m_scaledFrame = m_profiler.lastFrame().number;
+    m_resolutionScaler.addFrame(m_profiler.gpuTime(m_profiler.lastFrame()));
 }
 
 void View::keyPressEvent(QKeyEvent *event)
@@ -812,6 +1657,68 @@ void View::keyPressEvent(QKeyEvent *event)
        m_modelerModeEnabled = !m_modelerModeEnabled;
        m_godRaysEnabled = false;
     }
+
+    if (event->key() == Qt::Key_E)
+    {
+        m_rayMarching = !m_rayMarching;
+    }
+
+    if (event->key() == Qt::Key_O)
+    {
+        //cycle the god ray resolution through full, half and quarter size
+        m_settings.occlusionScale = m_settings.occlusionScale == 4 ? 1 : m_settings.occlusionScale * 2;
+    }
+
+    if (event->key() == Qt::Key_R)
+    {
+        //cycle the god ray blur from the reference shader through the multi pass presets
+        m_radialBlur.setQuality((RadialBlur::Quality)((m_radialBlur.quality() + 1) % RadialBlur::QUALITIES));
+    }
+
+    if (event->key() == Qt::Key_P)
+    {
+        m_showTimings = !m_showTimings;
+    }
+
+    //tweaking the noise of an out of core volume would mean generating all of it again
+    if (!m_stream && (event->key() == Qt::Key_BracketLeft || event->key() == Qt::Key_BracketRight))
+    {
+        //weaken or strengthen the finest octave, only the sum has to be redone
+        int finest = m_settings.octaves - 1;
+        float factor = event->key() == Qt::Key_BracketRight ? 1.25f : 0.8f;
+        m_cloudgen->setWeight(finest, m_cloudgen->weight(finest) * factor);
+        this->retuneNoise();
+    }
+
+    if (!m_stream && (event->key() == Qt::Key_Minus || event->key() == Qt::Key_Equal || event->key() == Qt::Key_Plus))
+    {
+        //dropping an octave drops its layer, adding one generates only that layer
+        int octaves = m_settings.octaves + (event->key() == Qt::Key_Minus ? -1 : 1);
+        if (octaves >= 1 && octaves <= NoiseKernel::MAX_OCTAVES)
+        {
+            m_settings.octaves = octaves;
+            this->retuneNoise();
+        }
+    }
+
+    if (m_stream && (event->key() == Qt::Key_Up || event->key() == Qt::Key_Down || event->key() == Qt::Key_Left
+                     || event->key() == Qt::Key_Right))
+    {
+        //up and down travel along the view direction, left and right across it
+        Vector3 dir(-Vector3::fromAngles(m_camera.theta, m_camera.phi));
+        Vector3 forward = Vector3(dir.x, 0, dir.z).unit();
+        Vector3 step = event->key() == Qt::Key_Up ? forward : (event->key() == Qt::Key_Down ? -forward
+                : Vector3(-forward.z, 0, forward.x) * (event->key() == Qt::Key_Right ? 1.0f : -1.0f));
+        step *= (float)max(1, m_clouds.sizeX() / PAN_FRACTION);
+        this->panWindow(qRound(step.x), qRound(step.z));
+    }
+
+    if (event->key() == Qt::Key_T && !m_traceFile.isEmpty())
+    {
+        m_profiler.writeTrace(m_traceFile);
+    }
+
+    this->invalidate();
 }
 
 /**
@@ -837,6 +1744,16 @@ QGLShaderProgram* View::newFragShaderProgram(const QGLContext *context, QString
     return program;
 }
 
+/**
+  Draws one line of the overlay and counts it as a draw call
+  */
+void View::paintLine(int x, int y, const QString &text)
+{
+    // QGLWidget's renderText takes xy coordinates, a string, and a font
+    renderText(x, y, text, m_font);
+    m_profiler.count(FrameProfiler::DRAW_CALLS);
+}
+
 void View::paintText()
 {
     glColor3f(1.f, 1.f, 1.f);
@@ -848,10 +1765,92 @@ void View::paintText()
        m_prevFps += m_fps * 0.05f;
     }
 
-    // QGLWidget's renderText takes xy coordinates, a string, and a font
-    renderText(10, 20, "G: Toggle God Rays", m_font);
-    renderText(10, 35, "B: Toggle God Ray Pass", m_font);
-    renderText(10, 50, "M: Toggle Modeler Mode", m_font);
-    renderText(10, 65, "Q/W: Increase/Decrease Container Size", m_font);
+    this->paintLine(10, 20, "G: Toggle God Rays");
+    this->paintLine(10, 35, "B: Toggle God Ray Pass");
+    this->paintLine(10, 50, QString("M/E: Toggle Modeler Mode / Cloud Engine (%1)")
+               .arg(this->isRayMarching() ? "ray marching" : "billboards"));
+    this->paintLine(10, 65, QString("Q/W: Increase/Decrease Container Size, -/+: Octaves (%1), [/]: Finest Octave Weight (%2)")
+               .arg(m_settings.octaves).arg(m_cloudgen->weight(m_settings.octaves - 1), 0, 'g', 3));
+    this->paintLine(10, 80, QString("O/R: Cycle God Ray Resolution (1/%1) / Quality (%2)").arg(m_settings.occlusionScale)
+               .arg(RadialBlur::qualityName(m_radialBlur.quality())));
+    this->paintLine(10, 95, m_traceFile.isEmpty() ? QString("P: Toggle Pass Timings")
+               : QString("P/T: Toggle Pass Timings / Write Trace (%1)").arg(m_traceFile));
+    if (this->isRayMarching())
+    {
+        this->paintLine(10, 110, QString("Volume: %1 of %2 bricks occupied, %3 MB of 3d textures")
+                   .arg(m_volumeRenderer.occupiedBricks()).arg(m_volumeRenderer.brickCount())
+                   .arg(m_volumeRenderer.textureBytes() / (1024. * 1024.), 0, 'f', 1));
+    }
+    else
+    {
+        this->paintLine(10, 110, QString("Particles: %1, texture binds per frame: %2").arg(m_num_squares).arg(m_textureBinds));
+    }
+    this->paintLine(10, 125, QString("Sort: %1 ms (%2), last light sweep: %3 ms (%4 slices)").arg(m_sortTime, 0, 'f', 2)
+               .arg(ParticleSorter::methodName(m_sortMethod)).arg(m_lightVolume.lastUpdateTime(), 0, 'f', 2)
+               .arg(m_lightVolume.lastSlices()));
+    this->paintLine(10, 140, QString("Bricks visible/culled: %1/%2, particles visible/culled/far: %3/%4/%5, impostors %6 (%7 MB)")
+               .arg(m_particleCuller.visibleBricks()).arg(m_particleCuller.culledBricks())
+               .arg(m_particleCuller.visibleParticles()).arg(m_particleCuller.culledParticles())
+               .arg(m_particleCuller.farParticles()).arg(m_impostors.count())
+               .arg(m_impostors.bytes() / (1024. * 1024.), 0, 'f', 1));
+    this->paintLine(10, 155, QString("Frame graph: %1 passes, %2 culled, %3 targets (%4 MB), render scale %5%")
+               .arg(m_frameGraph.livePasses()).arg(m_frameGraph.culledPasses()).arg(m_frameGraph.framebufferCount())
+               .arg(m_frameGraph.framebufferBytes() / (1024. * 1024.), 0, 'f', 1)
+               .arg(m_resolutionScaler.scale() * 100, 0, 'f', 0));
+    this->paintLine(10, 170, QString("Redraw %1: %2 frames/s, %3 re-presented, CPU %4% of a core")
+               .arg(m_settings.redrawOnDemand ? "on demand" : "every tick").arg(m_frameRate, 0, 'f', 1)
+               .arg(m_framesPresented).arg(m_cpuLoad, 0, 'f', 1));
+    QString noise = QString("Noise layers: %1 MB, last tweak %2 ms (%3 regenerated), volume %4 in %5 ms")
+            .arg(m_layers->bytes() / (1024. * 1024.), 0, 'f', 1)
+            .arg(m_layers->lastUpdateTime() + m_layers->lastComposeTime(), 0, 'f', 1).arg(m_layers->lastGenerated())
+            .arg(!m_volumeCache.lastHit() ? "generated" : (m_volumeCache.bits() > 0 ? "decoded" : "mapped"))
+            .arg(m_startupTime);
+    if (m_animator->isRunning())
+    {
+        noise += QString(", wind %1 cells/s, refresh %2% done, %3 frames each (last %4), step %5 ms")
+                .arg(m_settings.wind).arg(m_animator->progress() * 100, 0, 'f', 0)
+                .arg(m_animator->framesPerRefresh()).arg(m_animator->lastRefreshFrames())
+                .arg(m_animator->lastStepTime(), 0, 'f', 2);
+    }
+    if (m_stream)
+    {
+        noise = QString("Out of core %1x%2x%3 (%4 MB on disk), window at %5,%6; bricks %7/%8 paged in (%9 MB), "
+                        "%10 missed, %11 read ahead, last read %12 ms; arrows pan")
+                .arg(m_stream->sizeX()).arg(m_stream->sizeY()).arg(m_stream->sizeZ())
+                .arg(m_stream->fileBytes() / (1024 * 1024)).arg(m_windowOrigin[0]).arg(m_windowOrigin[2])
+                .arg(m_stream->residentBricks()).arg(m_stream->capacity())
+                .arg(m_stream->bytes() / (1024. * 1024.), 0, 'f', 1).arg(m_stream->misses())
+                .arg(m_stream->prefetched()).arg(m_stream->lastReadTime(), 0, 'f', 1);
+    }
+    this->paintLine(10, 185, noise);
+
+    if (m_showTimings && m_profiler.hasFrame())
+    {
+        this->paintTimings(10, 210);
+    }
+}
+
+/**
+  Lists the CPU and GPU time and the counters of every pass of the last frame whose GPU times
+  are in, a few frames behind the one on screen
+  */
+void View::paintTimings(int x, int y)
+{
+    const FrameProfiler::Frame &frame = m_profiler.lastFrame();
+    double gpu = m_profiler.gpuTime(frame);
+
+    this->paintLine(x, y, QString("Frame %1: %2 fps, CPU %3 ms, GPU %4").arg(frame.number).arg(m_prevFps, 0, 'f', 1)
+               .arg(frame.cpuTime, 0, 'f', 2).arg(gpu >= 0 ? QString("%1 ms").arg(gpu, 0, 'f', 2) : QString("n/a")));
+    for (size_t s = 0; s < frame.scopes.size(); s++)
+    {
+        const FrameProfiler::Scope &scope = frame.scopes[s];
+        QString line = QString("%1: CPU %2 ms, GPU %3").arg(scope.name).arg(scope.cpuTime, 0, 'f', 2)
+                .arg(scope.gpuTime >= 0 ? QString("%1 ms").arg(scope.gpuTime, 0, 'f', 2) : QString("n/a"));
+        for (int c = 0; c < FrameProfiler::COUNTERS; c++)
+        {
+            line += QString(", %1 %2").arg(scope.counters[c]).arg(FrameProfiler::counterName((FrameProfiler::Counter)c));
+        }
+        this->paintLine(x + 10, y + 15 * (int)(s + 1), line);
+    }
 }
 
@@ -9,10 +9,30 @@
 #include <QTimer>
 #include <QGLShaderProgram>
 #include <QGLShader>
+#include <ctime>
+#include <vector>
 
 #include "camera.h"
+#include "camerapath.h"
 #include "vector.h"
+#include "cloudanimator.h"
 #include "cloudgenerator.h"
+#include "layeredvolume.h"
+#include "cloudparticles.h"
+#include "framegraph.h"
+#include "impostorcache.h"
+#include "lightvolume.h"
+#include "frameprofiler.h"
+#include "particlerenderer.h"
+#include "particleculler.h"
+#include "particlesorter.h"
+#include "radialblur.h"
+#include "resolutionscaler.h"
+#include "streamedvolume.h"
+#include "volumecache.h"
+#include "volumerenderer.h"
+#include "cloudsettings.h"
+#include "cloudvolume.h"
 
 class QGLShaderProgram;
 class QGLFramebufferObject;
@@ -25,6 +45,22 @@ public:
     View(QWidget *parent);
     ~View();
 
+    void setSunPosition(const Vector3 &position);
+    Vector3 sunPosition() const { return m_sunPosition; }
+
+    const OrbitCamera &camera() const { return m_camera; }
+    void setCamera(const OrbitCamera &camera);
+    void setFeatures(bool godRays, bool godMode, bool modelerMode);
+    void setRayMarching(bool rayMarching);
+    bool isRayMarching() const { return m_rayMarching && m_volumeRenderer.isSupported(); }
+    const CloudSettings &settings() const { return m_settings; }
+    FrameProfiler &profiler() { return m_profiler; }
+
+    void invalidate();
+    void setRedrawOnDemand(bool onDemand);
+    int framesRendered() const { return m_framesRendered; }
+    int framesPresented() const { return m_framesPresented; }
+
 private:
     QTime m_clock;
     QTimer timer;
@@ -38,12 +74,19 @@ private:
     void loadCubeMap();
     void applyOrthogonalCamera(float width, float height);
     void applyPerspectiveCamera(float width, float height);
-    void createFramebufferObjects(int width, int height);
-    void renderTexturedQuad(int width, int height);
+    QSize occlusionSize(int width, int height) const;
+    void renderTexturedQuad(int width, int height, float s = 1.0f, float t = 1.0f);
 
     void paintText();
+    void paintLine(int x, int y, const QString &text);
+    void cacheFinalImage();
+    void presentCachedImage();
+    void measureLoad();
+    void updateRenderScale();
+    void paintTimings(int x, int y);
 
     GLuint loadTexture(const QString &path);
+    GLuint loadTextureArray(const QStringList &paths);
     void mousePressEvent(QMouseEvent *event);
     void mouseMoveEvent(QMouseEvent *event);
     void mouseReleaseEvent(QMouseEvent *event);
@@ -54,43 +97,104 @@ private:
     void createShaderPrograms();
     QGLShaderProgram* newShaderProgram(const QGLContext *context, QString vertShader, QString fragShader);
     QGLShaderProgram* newFragShaderProgram(const QGLContext *context, QString fragShader);
-    void renderLightScatter(int width, int height);
+    bool sunInView() const;
+    QString renderLightScatter(const QSize &size, const QSize &capacity);
+    void renderOcclusion(int width, int height);
+    void renderSkybox(int width, int height);
+    void renderSceneClouds(int width, int height);
+    void setCapability(GLenum capability, bool enabled);
 
     void renderBlackBox();
+    void buildParticles();
+    void uploadParticles();
+    void relightParticles();
+    void updateLightVolume(int maxSlices);
+    void settleDrift();
     void renderClouds(bool blackModeEnabled);
+    void renderCloudsImmediate(bool blackModeEnabled, const Vector3 &dir);
+    void renderCloudsVolume(bool blackModeEnabled, const Vector3 &dir);
+    bool renderImpostors(const Vector3 &eye, int layer);
+    Vector3 cloudOrigin() const;
     void setSquareSize(float squareSize);
+    void retuneNoise();
+    void panWindow(int dx, int dz);
 
     int m_prevTime;
-    double*** m_clouds;
+    CloudSettings m_settings;
+    CloudVolume m_clouds;
+    CloudParticles m_particles; // voxels of m_clouds above the threshold
+    CloudParticles m_nextParticles; // extracted a few bricks per tick after a drift, then swapped in
+    bool m_extracting; // m_nextParticles has been started for the current m_clouds
+    bool m_particlesDirty; // set whenever m_clouds or the particle spacing changes
+    LightVolume m_lightVolume; // sunlight reaching each voxel of m_clouds, when self shadowing
+    ParticleRenderer m_particleRenderer;
+    ParticleCuller m_particleCuller;
+    ParticleSorter m_particleSorter;
+    ImpostorCache m_impostors; // images of the clusters the culler found far away
+    ParticleRenderer m_impostorRenderer; // draws one cluster at a time into its impostor
+    ParticleSorter m_impostorSorter;
+    std::vector<int> m_farFallback; // far clusters drawn as particles, the cache couldn't hold them
+    std::vector<int> m_candidates; // visible particles and those of m_farFallback
+    VolumeRenderer m_volumeRenderer; // ray-marches m_clouds instead of drawing the particles
+    bool m_volumeDirty; // m_clouds changed since it was last uploaded to the volume renderer
+    bool m_rayMarching; // draw the clouds with m_volumeRenderer where it is supported
+    double m_sortTime; // milliseconds spent sorting particles this frame
+    ParticleSorter::Method m_sortMethod;
+    Vector3 m_sunPosition; // where the sun is drawn
+    Vector3 m_sunLight; // where the particle shading places the light
+    bool m_sunMoved; // the particles need relighting
     int m_num_squares;
-    GLuint m_textureID1;
-    GLuint m_textureID2;
-    GLuint m_textureID3;
-    GLuint m_textureID4;
-    GLuint m_textureID5;
-    GLuint m_textureID6;
-    GLuint m_textureID7;
-    GLuint m_textureID8;
-    GLuint m_textureIDwhite;
-    GLuint m_textureIDModeler;
+    GLuint m_particleTextureArray; // every particle texture as one array, 0 if unsupported
+    GLuint m_particleTextures[ParticleRenderer::LAYERS]; // the same textures one by one, when there is no array
+    std::vector<int> m_shadeOrder; // particles grouped by shade for the immediate mode path
+    int m_shadeBatches[CloudParticles::SHADE_LAYERS + 2];
+    int m_textureBinds; // particle texture binds in the last frame
     float m_squareSize;
     float m_squareDistribution;
+    RadialBlur m_radialBlur; // multi pass god rays, unless set to the reference shader
     bool m_godRaysEnabled; // allows the user to toggle between using the god rays or not in the scene
     bool m_godModeEnabled; // allows the user to view JUST the god rays given by the shader
     bool m_modelerModeEnabled; // allows the user to view the particles without our beautiful textures
     float m_prevFps, m_fps;
     Vector2 m_prevMousePos;
     OrbitCamera m_camera;
+    QString m_recordFile; // where the camera path is saved on exit, empty unless recording
+    CameraPath m_recordedPath; // one camera per tick while recording
 
     GLuint m_skybox;
     GLuint m_cubeMap;
 
     // Resources
     QHash<QString, QGLShaderProgram *> m_shaderPrograms; // hash map of all shader programs
-    QHash<QString, QGLFramebufferObject *> m_framebufferObjects; // hash map of all framebuffer objects
+    FrameGraph m_frameGraph; // the passes of each frame and the framebuffer objects behind them
+    FrameProfiler m_profiler; // times and counts per pass
+    ResolutionScaler m_resolutionScaler; // render scale of the cloud and scatter passes
+    int m_scaledFrame; // last profiler frame handed to m_resolutionScaler
+    QSize m_renderSize; // of the scene target this frame, the window size scaled
+    bool m_showTimings; // list the per pass timings below the statistics
+    QString m_traceFile; // where T and exiting write the recent frames as a Chrome trace, empty if off
+
+    // Redrawing on demand
+    bool m_dirty; // something on screen changed since the last rendered frame
+    GLuint m_presentedImage; // copy of the last rendered frame, shown again while nothing changes
+    QSize m_presentedSize;
+    int m_framesRendered; // through the whole pipeline
+    int m_framesPresented; // from m_presentedImage
+    QTime m_loadClock; // wall time since the load was last measured
+    std::clock_t m_loadCpu; // process CPU time at that point
+    int m_loadFrames;
+    double m_cpuLoad; // percent of one core over the last second
+    double m_frameRate; // frames rendered per second over the last second
     QFont m_font; // font for rendering text
 
     CloudGenerator* m_cloudgen;
+    LayeredVolume* m_layers; // the octaves of m_clouds apart, so a tweak recomputes only what it changes
+    VolumeCache m_volumeCache; // the startup m_clouds on disk
+    int m_startupTime; // milliseconds the startup m_clouds took to map or generate
+    CloudAnimator* m_animator; // regenerates m_clouds a few rows per tick as the wind moves it
+    bool m_drifted; // the animator swapped m_clouds and what is drawn from it hasn't caught up
+    StreamedVolume* m_stream; // the whole volume on disk when it is out of core, m_clouds a window of it; 0 otherwise
+    int m_windowOrigin[3]; // voxel of the out of core volume at m_clouds' low corner
     GLUquadric* m_quadric;
 
     int time;
@@ -0,0 +1,376 @@
+#include "volumecache.h"
+#include "brickedvolume.h"
+#include "cloudgenerator.h"
+#include "cloudsettings.h"
+#include "cloudvolume.h"
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <chrono>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define REDUCED_LAYERS 1 //header flag
+
+using namespace std;
+
+/**
+  The first bytes of a .cvol file, padded to VolumeCache::PAGE on disk
+  */
+struct CacheHeader
+{
+    char magic[4]; // "CVOL"
+    quint32 format;
+    quint32 generator;
+    quint32 seed;
+    qint32 dims[3];
+    qint32 octaves;
+    double cells;
+    quint32 weights;
+    quint32 flags;
+    quint32 bits; // of a bricked payload, 0 for floats
+    float threshold; // the bricks were quantized for
+    quint64 tableBytes; // of a bricked payload, the brick table before the codes
+    quint64 strideY; // floats
+    quint64 strideX;
+    quint64 payloadOffset; // bytes from the start of the file
+    quint64 payloadBytes;
+    quint32 payloadChecksum;
+    quint32 headerChecksum; // of every byte before it
+};
+
+static double millisecondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+static quint32 headerChecksum(const CacheHeader &header)
+{
+    return VolumeCache::checksum(&header, offsetof(CacheHeader, headerChecksum));
+}
+
+bool VolumeCache::Key::operator==(const Key &other) const
+{
+    return dims[0] == other.dims[0] && dims[1] == other.dims[1] && dims[2] == other.dims[2]
+            && octaves == other.octaves && cells == other.cells && generator == other.generator
+            && seed == other.seed && weights == other.weights && reducedLayers == other.reducedLayers;
+}
+
+VolumeCache::VolumeCache()
+    : m_verify(false), m_bits(0), m_threshold(0), m_lastHit(false), m_lastOpenTime(0), m_lastSaveTime(0), m_lastBytes(0)
+{
+}
+
+/**
+  The .cvol file to use, empty to turn the cache off
+  */
+void VolumeCache::setPath(const QString &path)
+{
+    m_path = path;
+}
+
+/**
+  Whether open() checks the payload's checksum, which reads the whole file
+  */
+void VolumeCache::setVerify(bool verify)
+{
+    m_verify = verify;
+}
+
+/**
+  Stores the voxels as BrickedVolume bricks of 8 or 16 bits quantized for threshold, or as
+  floats with 0 bits
+  */
+void VolumeCache::setCompression(int bits, float threshold)
+{
+    m_bits = bits;
+    m_threshold = threshold;
+}
+
+/**
+  The parameters the startup volume is generated from, at phase 0 with the generator's
+  current weights
+  */
+VolumeCache::Key VolumeCache::keyFor(const CloudSettings &settings, const CloudGenerator &generator)
+{
+    Key key;
+    key.dims[0] = settings.dimX;
+    key.dims[1] = settings.dimY;
+    key.dims[2] = settings.dimZ;
+    key.octaves = settings.octaves;
+    key.cells = settings.cells;
+    key.generator = CloudGenerator::VERSION;
+    key.seed = NoiseKernel::seed();
+    float weights[NoiseKernel::MAX_OCTAVES];
+    for (int q = 0; q < NoiseKernel::MAX_OCTAVES; q++)
+    {
+        weights[q] = generator.weight(q);
+    }
+    key.weights = checksum(weights, sizeof(weights));
+    key.reducedLayers = settings.reducedLayers;
+    return key;
+}
+
+/**
+  A file next to path only this process writes, to be renamed over path once complete
+  */
+QString VolumeCache::temporaryPath(const QString &path)
+{
+    return path + QString(".%1.tmp").arg(QCoreApplication::applicationPid());
+}
+
+/**
+  Moves the complete file temporary over path, or removes it if that fails. Returns whether
+  path now holds it.
+  */
+bool VolumeCache::replace(const QString &temporary, const QString &path)
+{
+#ifdef Q_OS_UNIX
+    //rename() swaps the file in atomically, readers find either the old one or the new one
+    bool replaced = ::rename(QFile::encodeName(temporary).constData(), QFile::encodeName(path).constData()) == 0;
+#else
+    //QFile::rename won't replace an existing file
+    QFile::remove(path);
+    bool replaced = QFile::rename(temporary, path);
+#endif
+    if (!replaced)
+    {
+        QFile::remove(temporary);
+    }
+    return replaced;
+}
+
+/**
+  FNV-1a over 32-bit words, then the trailing bytes
+  */
+quint32 VolumeCache::checksum(const void *data, size_t bytes)
+{
+    const unsigned char *bytePointer = (const unsigned char *)data;
+    quint32 hash = 2166136261u;
+    size_t words = bytes / 4;
+    for (size_t w = 0; w < words; w++)
+    {
+        quint32 word;
+        memcpy(&word, bytePointer + w * 4, 4);
+        hash = (hash ^ word) * 16777619u;
+    }
+    for (size_t b = words * 4; b < bytes; b++)
+    {
+        hash = (hash ^ bytePointer[b]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+  Fills volume from the cache file if it holds the volume for key, stored the way
+  setCompression() asks for. Returns whether it did; on a miss the volume is left as it was.
+  */
+bool VolumeCache::open(const Key &key, CloudVolume &volume)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    m_lastHit = false;
+
+    QFile file(m_path);
+    CacheHeader header;
+    bool matches = !m_path.isEmpty() && file.open(QIODevice::ReadOnly)
+            && file.read((char *)&header, sizeof(header)) == (qint64)sizeof(header)
+            && memcmp(header.magic, "CVOL", 4) == 0 && header.format == FORMAT_VERSION
+            && header.headerChecksum == headerChecksum(header) && header.generator == key.generator
+            && header.seed == key.seed && header.dims[0] == key.dims[0] && header.dims[1] == key.dims[1]
+            && header.dims[2] == key.dims[2] && header.octaves == key.octaves && header.cells == key.cells
+            && header.weights == key.weights && (header.flags & REDUCED_LAYERS) == (key.reducedLayers ? REDUCED_LAYERS : 0u)
+            && header.bits == (quint32)m_bits && (m_bits == 0 || header.threshold == m_threshold)
+            && header.payloadOffset % PAGE == 0 && header.payloadBytes > 0
+            && file.size() >= (qint64)(header.payloadOffset + header.payloadBytes);
+    if (matches)
+    {
+        m_lastHit = m_bits == 0 ? this->mapDense(file, header, volume) : this->readBricked(file, header, volume);
+    }
+    if (m_lastHit)
+    {
+        m_lastBytes = header.payloadBytes;
+    }
+    m_lastOpenTime = millisecondsSince(start);
+    return m_lastHit;
+}
+
+/**
+  Maps a float payload, laid out as the volume lays it out, and hands it to the volume
+  */
+bool VolumeCache::mapDense(QFile &file, const CacheHeader &header, CloudVolume &volume)
+{
+    //the strides a volume of the header's grid has
+    size_t strideY = CloudVolume::rowStride(header.dims[2]);
+    size_t strideX = strideY * header.dims[1];
+    quint64 payloadBytes = (quint64)strideX * header.dims[0] * sizeof(float);
+    if (header.strideY != strideY || header.strideX != strideX || header.payloadBytes != payloadBytes)
+    {
+        return false;
+    }
+
+#ifdef Q_OS_UNIX
+    //private and writable: the volume may change later, the file must not
+    size_t mapped = header.payloadOffset + payloadBytes;
+    void *base = mmap(0, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE, file.handle(), 0);
+    file.close();
+    if (base == MAP_FAILED)
+    {
+        return false;
+    }
+    float *data = (float *)((char *)base + header.payloadOffset);
+    if (m_verify && checksum(data, payloadBytes) != header.payloadChecksum)
+    {
+        munmap(base, mapped);
+        return false;
+    }
+    volume.adopt(data, payloadBytes / sizeof(float), header.dims[0], header.dims[1], header.dims[2], [base, mapped] {
+        munmap(base, mapped);
+    });
+#else
+    CloudVolume loaded(header.dims[0], header.dims[1], header.dims[2]);
+    if (!file.seek(header.payloadOffset) || file.read((char *)loaded.data(), payloadBytes) != (qint64)payloadBytes
+            || (m_verify && checksum(loaded.data(), payloadBytes) != header.payloadChecksum))
+    {
+        return false;
+    }
+    volume = std::move(loaded);
+#endif
+    return true;
+}
+
+/**
+  Reads a bricked payload, the brick table and then the codes, and decodes it into the
+  volume. It is small enough that the checksum is always checked.
+  */
+bool VolumeCache::readBricked(QFile &file, const CacheHeader &header, CloudVolume &volume)
+{
+    if (header.tableBytes % sizeof(BrickedVolume::Brick) != 0 || header.tableBytes > header.payloadBytes)
+    {
+        return false;
+    }
+    std::vector<BrickedVolume::Brick> table(header.tableBytes / sizeof(BrickedVolume::Brick));
+    std::vector<unsigned char> codes(header.payloadBytes - header.tableBytes);
+    if (!file.seek(header.payloadOffset) || file.read((char *)&table[0], header.tableBytes) != (qint64)header.tableBytes
+            || (!codes.empty() && file.read((char *)&codes[0], codes.size()) != (qint64)codes.size()))
+    {
+        return false;
+    }
+    quint32 sum = checksum(&table[0], header.tableBytes);
+    if (!codes.empty())
+    {
+        sum ^= checksum(&codes[0], codes.size());
+    }
+    BrickedVolume bricks;
+    if (sum != header.payloadChecksum
+            || !bricks.assign(header.dims[0], header.dims[1], header.dims[2], header.bits, table, codes))
+    {
+        return false;
+    }
+    bricks.decode(volume);
+    return true;
+}
+
+/**
+  Writes volume as the cache for key. Returns false, leaving any previous cache in place, if it
+  couldn't be written.
+  */
+bool VolumeCache::save(const Key &key, const CloudVolume &volume)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if (m_path.isEmpty() || volume.isEmpty())
+    {
+        return false;
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "CVOL", 4);
+    header.format = FORMAT_VERSION;
+    header.generator = key.generator;
+    header.seed = key.seed;
+    header.dims[0] = volume.sizeX();
+    header.dims[1] = volume.sizeY();
+    header.dims[2] = volume.sizeZ();
+    header.octaves = key.octaves;
+    header.cells = key.cells;
+    header.weights = key.weights;
+    header.flags = key.reducedLayers ? REDUCED_LAYERS : 0;
+    header.bits = m_bits;
+    header.threshold = m_threshold;
+    header.strideY = volume.strideY();
+    header.strideX = volume.strideX();
+    header.payloadOffset = PAGE;
+
+    //the payload in up to two pieces
+    BrickedVolume bricks;
+    const char *pieces[2] = { (const char *)volume.data(), 0 };
+    quint64 sizes[2] = { (quint64)volume.strideX() * volume.sizeX() * sizeof(float), 0 };
+    if (m_bits == 0)
+    {
+        header.payloadChecksum = checksum(pieces[0], sizes[0]);
+    }
+    else
+    {
+        bricks.encode(volume, m_threshold, m_bits);
+        pieces[0] = (const char *)&bricks.table()[0];
+        sizes[0] = bricks.table().size() * sizeof(BrickedVolume::Brick);
+        pieces[1] = bricks.codes().empty() ? 0 : (const char *)&bricks.codes()[0];
+        sizes[1] = bricks.codes().size();
+        header.tableBytes = sizes[0];
+        header.payloadChecksum = checksum(pieces[0], sizes[0]) ^ (sizes[1] > 0 ? checksum(pieces[1], sizes[1]) : 0);
+    }
+    header.payloadBytes = sizes[0] + sizes[1];
+    header.headerChecksum = headerChecksum(header);
+
+    std::vector<char> page(PAGE, 0);
+    memcpy(&page[0], &header, sizeof(header));
+
+    QDir().mkpath(QFileInfo(m_path).absolutePath());
+    QString temporary = temporaryPath(m_path);
+    QFile file(temporary);
+    bool written = file.open(QIODevice::WriteOnly | QIODevice::Truncate)
+            && file.write(&page[0], PAGE) == PAGE
+            && file.write(pieces[0], sizes[0]) == (qint64)sizes[0]
+            && (sizes[1] == 0 || file.write(pieces[1], sizes[1]) == (qint64)sizes[1]);
+    file.close();
+    if (!written)
+    {
+        qWarning("Could not write the volume cache '%s'", qPrintable(temporary));
+        QFile::remove(temporary);
+        return false;
+    }
+
+    if (!replace(temporary, m_path))
+    {
+        return false;
+    }
+    m_lastSaveTime = millisecondsSince(start);
+    m_lastBytes = header.payloadBytes;
+    return true;
+}
+
+/**
+  Opens the cache for key into volume, or generates the volume and writes it back when the
+  cache misses. Returns whether the cache hit.
+  */
+bool VolumeCache::fetch(const Key &key, CloudVolume &volume, const Generate &generate)
+{
+    if (this->open(key, volume))
+    {
+        return true;
+    }
+    generate(volume);
+    this->save(key, volume);
+    return false;
+}
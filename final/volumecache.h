@@ -0,0 +1,94 @@
+#ifndef VOLUMECACHE_H
+#define VOLUMECACHE_H
+
+#include <QString>
+#include <QtGlobal>
+#include <functional>
+
+class CloudGenerator;
+class CloudVolume;
+class QFile;
+struct CacheHeader;
+struct CloudSettings;
+
+/**
+    Keeps the generated cloud volume in a .cvol file so later starts with the same parameters map
+    it instead of generating it again.
+
+    The file is a PAGE sized header followed by the payload, in native byte order. The header
+    records the format and generator versions, the noise seed, the grid, octaves, cells, octave
+    weights and layer reduction, how the payload is stored, its size and checksum, and a
+    checksum of itself.
+
+    By default the payload is the voxels exactly as CloudVolume lays them out, padded rows
+    included. On Unix open() maps it copy-on-write and hands the mapping to the volume, so
+    nothing is read until it's touched and later changes to the volume never reach the file;
+    elsewhere the payload is read in. With setCompression() it is a BrickedVolume instead, the
+    brick table followed by the codes, a fraction of the size, which open() reads and decodes.
+
+    Any mismatch, a truncated file or a bad header checksum is a miss. The payload checksum
+    is only checked with setVerify(true), since that reads every page. save() writes a temporary
+    file of its own next to the cache and renames it over, so a crash or a second instance
+    never leaves a half written cache behind. On Unix the rename replaces the old file in one
+    step; elsewhere the old file is removed first, so a reader may briefly find no cache.
+**/
+class VolumeCache
+{
+
+public:
+    static const quint32 FORMAT_VERSION = 2;
+    static const int PAGE = 4096; // bytes of header, the payload starts page aligned after it
+
+    struct Key
+    {
+        qint32 dims[3];
+        qint32 octaves;
+        double cells;
+        quint32 generator; // CloudGenerator::VERSION
+        quint32 seed; // NoiseKernel::seed()
+        quint32 weights; // hash of the octave weights
+        bool reducedLayers;
+
+        bool operator==(const Key &other) const;
+    };
+
+    // fills the volume when the cache misses
+    typedef std::function<void(CloudVolume &volume)> Generate;
+
+    VolumeCache();
+
+    void setPath(const QString &path);
+    QString path() const { return m_path; }
+    void setVerify(bool verify);
+    void setCompression(int bits, float threshold);
+    int bits() const { return m_bits; }
+
+    bool open(const Key &key, CloudVolume &volume);
+    bool save(const Key &key, const CloudVolume &volume);
+    bool fetch(const Key &key, CloudVolume &volume, const Generate &generate);
+
+    bool lastHit() const { return m_lastHit; }
+    double lastOpenTime() const { return m_lastOpenTime; } // milliseconds, hit or miss
+    double lastSaveTime() const { return m_lastSaveTime; } // milliseconds
+    quint64 lastBytes() const { return m_lastBytes; } // payload last opened or saved
+
+    static Key keyFor(const CloudSettings &settings, const CloudGenerator &generator);
+    static quint32 checksum(const void *data, size_t bytes);
+    static QString temporaryPath(const QString &path);
+    static bool replace(const QString &temporary, const QString &path);
+
+private:
+    bool mapDense(QFile &file, const CacheHeader &header, CloudVolume &volume);
+    bool readBricked(QFile &file, const CacheHeader &header, CloudVolume &volume);
+
+    QString m_path; // empty when caching is off
+    bool m_verify;
+    int m_bits; // per voxel of a bricked payload, 0 for floats
+    float m_threshold;
+    bool m_lastHit;
+    double m_lastOpenTime;
+    double m_lastSaveTime;
+    quint64 m_lastBytes;
+};
+
+#endif // VOLUMECACHE_H
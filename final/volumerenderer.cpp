@@ -0,0 +1,413 @@
+#include "volumerenderer.h"
+#include "cloudvolume.h"
+#include "threadpool.h"
+
+#include <QGLShaderProgram>
+#include <QImage>
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <math.h>
+
+#define DEFAULT_STEP 0.5f //voxels per sample, the trilinear reconstruction's Nyquist rate
+#define PARTICLE_ALPHA 0.1f //the alpha every billboard is drawn with
+#define WHITE_SLOT (CloudParticles::SHADE_LAYERS + 1)
+#define MODELER_SLOT (CloudParticles::SHADE_LAYERS + 2)
+
+VolumeRenderer::VolumeRenderer()
+    : m_program(0), m_supported(false), m_density(0), m_occupancy(0), m_occupiedBricks(0), m_threshold(0),
+      m_staged(0), m_stagedBricks(-1), m_spacing(1), m_billboardSize(0), m_stepSize(DEFAULT_STEP), m_sunRadius(0),
+      m_activeTexture(0), m_texImage3D(0), m_texSubImage3D(0)
+{
+    memset(m_dims, 0, sizeof(m_dims));
+    memset(m_bricks, 0, sizeof(m_bricks));
+
+    //untextured white until setTextures() is called
+    for (int s = 0; s <= MODELER_SLOT; s++)
+    {
+        m_shades[s][0] = m_shades[s][1] = m_shades[s][2] = 1.0f;
+        m_shades[s][3] = -logf(1.0f - PARTICLE_ALPHA);
+    }
+}
+
+VolumeRenderer::~VolumeRenderer()
+{
+    if (m_density)
+    {
+        glDeleteTextures(1, &m_density);
+    }
+    if (m_occupancy)
+    {
+        glDeleteTextures(1, &m_occupancy);
+    }
+    if (m_staged)
+    {
+        glDeleteTextures(1, &m_staged);
+    }
+}
+
+/**
+  Checks for float textures and resolves the entry points. Must be called with the context
+  current; returns whether the volume can be ray-marched.
+  */
+bool VolumeRenderer::initialize(const QGLContext *context, QGLShaderProgram *program)
+{
+    m_supported = false;
+    m_program = program;
+
+    const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+    bool floats = (QGLFormat::openGLVersionFlags() & QGLFormat::OpenGL_Version_3_0)
+            || (extensions && strstr(extensions, "GL_ARB_texture_float") && strstr(extensions, "GL_ARB_texture_rg"));
+    if (!context || !program || !program->isLinked() || !floats)
+    {
+        return false;
+    }
+
+    m_activeTexture = (PFNGLACTIVETEXTUREPROC) context->getProcAddress("glActiveTexture");
+    m_texImage3D = (PFNGLTEXIMAGE3DPROC) context->getProcAddress("glTexImage3D");
+    m_texSubImage3D = (PFNGLTEXSUBIMAGE3DPROC) context->getProcAddress("glTexSubImage3D");
+    if (!m_activeTexture || !m_texImage3D)
+    {
+        return false;
+    }
+
+    m_program->bind();
+    m_program->setUniformValue("density", (GLint) 1);
+    m_program->setUniformValue("occupancy", (GLint) 2);
+    m_program->release();
+
+    m_supported = true;
+    return true;
+}
+
+/**
+  Averages the particle textures (the eight shades, then the white occlusion and the modeler
+  texture) into the colour of a sample and the extinction of one billboard layer
+  */
+void VolumeRenderer::setTextures(const QStringList &paths)
+{
+    const int shadeSlots[] = { 0, 1, 2, 3, 4, 5, 6, 7, WHITE_SLOT, MODELER_SLOT };
+    for (int p = 0; p < paths.size() && p < (int)(sizeof(shadeSlots) / sizeof(shadeSlots[0])); p++)
+    {
+        QImage image = QImage(paths[p]).convertToFormat(QImage::Format_ARGB32);
+        if (image.isNull())
+        {
+            qWarning("Could not average particle texture '%s'", qPrintable(paths[p]));
+            continue;
+        }
+
+        //colour weighted by coverage, since that is what blending leaves of each texel
+        double red = 0, green = 0, blue = 0, alpha = 0;
+        for (int y = 0; y < image.height(); y++)
+        {
+            const QRgb *line = (const QRgb *) image.constScanLine(y);
+            for (int x = 0; x < image.width(); x++)
+            {
+                double a = qAlpha(line[x]) / 255.0;
+                red += qRed(line[x]) / 255.0 * a;
+                green += qGreen(line[x]) / 255.0 * a;
+                blue += qBlue(line[x]) / 255.0 * a;
+                alpha += a;
+            }
+        }
+
+        GLfloat *shade = m_shades[shadeSlots[p]];
+        double texels = qMax(1, image.width() * image.height());
+        shade[0] = alpha > 0 ? red / alpha : 1.0f;
+        shade[1] = alpha > 0 ? green / alpha : 1.0f;
+        shade[2] = alpha > 0 ? blue / alpha : 1.0f;
+        shade[3] = -logf(1.0f - PARTICLE_ALPHA * (float)(alpha / texels));
+    }
+}
+
+/**
+  Copies the volume into the density texture and rebuilds the occupancy texture. threshold is
+  the faded density a voxel needs to be drawn, as for CloudParticles::build(). Drops a staged
+  volume that isn't complete yet.
+  */
+void VolumeRenderer::upload(const CloudVolume &volume, float threshold)
+{
+    if (!m_supported)
+    {
+        return;
+    }
+
+    //the staged texture has to match the one drawn
+    m_stagedBricks = -1;
+    if (m_staged && (volume.sizeX() != m_dims[0] || volume.sizeY() != m_dims[1] || volume.sizeZ() != m_dims[2]))
+    {
+        glDeleteTextures(1, &m_staged);
+        m_staged = 0;
+    }
+    m_threshold = threshold;
+    m_dims[0] = volume.sizeX();
+    m_dims[1] = volume.sizeY();
+    m_dims[2] = volume.sizeZ();
+    for (int axis = 0; axis < 3; axis++)
+    {
+        m_bricks[axis] = (m_dims[axis] + BRICK_SIZE - 1) / BRICK_SIZE;
+    }
+    m_ranges.resize((size_t)brickCount() * 2);
+    std::vector<int> occupied(m_bricks[0] * m_bricks[1], 0);
+    this->buildOccupancy(volume, 0, m_bricks[0], m_ranges.data(), occupied.data());
+    m_occupiedBricks = std::accumulate(occupied.begin(), occupied.end(), 0);
+
+    if (!m_density)
+    {
+        glGenTextures(1, &m_density);
+        glGenTextures(1, &m_occupancy);
+    }
+
+    //z is contiguous in the volume, so it becomes the texture's width; the padded rows are
+    //skipped by the unpack state instead of being repacked
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint) volume.strideY());
+    glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, (GLint) (volume.strideX() / volume.strideY()));
+    glBindTexture(GL_TEXTURE_3D, m_density);
+    m_texImage3D(GL_TEXTURE_3D, 0, GL_R16F, m_dims[2], m_dims[1], m_dims[0], 0, GL_RED, GL_FLOAT, volume.data());
+    this->setTextureState(GL_LINEAR);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+
+    this->uploadOccupancy();
+}
+
+/**
+  Uploads the next x slabs of volume, at most maxVoxels of them but at least one brick thick,
+  into the staged density texture, with their part of the occupancy. Once every slab is in,
+  the staged texture and occupancy replace the ones drawn and true is returned; the same,
+  unchanged volume must be passed until then. A volume of another size, or a driver without
+  glTexSubImage3D, is simply uploaded.
+  */
+bool VolumeRenderer::stage(const CloudVolume &volume, float threshold, int maxVoxels)
+{
+    if (!m_supported)
+    {
+        return true;
+    }
+    if (!m_density || !m_texSubImage3D || threshold != m_threshold || volume.sizeX() != m_dims[0]
+            || volume.sizeY() != m_dims[1] || volume.sizeZ() != m_dims[2])
+    {
+        this->upload(volume, threshold);
+        return true;
+    }
+
+    if (m_stagedBricks < 0)
+    {
+        if (!m_staged)
+        {
+            glGenTextures(1, &m_staged);
+            glBindTexture(GL_TEXTURE_3D, m_staged);
+            m_texImage3D(GL_TEXTURE_3D, 0, GL_R16F, m_dims[2], m_dims[1], m_dims[0], 0, GL_RED, GL_FLOAT, 0);
+            this->setTextureState(GL_LINEAR);
+        }
+        m_stagedRanges.resize((size_t)brickCount() * 2);
+        m_stagedOccupied.assign(m_bricks[0] * m_bricks[1], 0);
+        m_stagedBricks = 0;
+    }
+
+    int slab = BRICK_SIZE * m_dims[1] * m_dims[2];
+    int first = m_stagedBricks;
+    int last = std::min(m_bricks[0], first + std::max(1, maxVoxels / slab));
+    this->buildOccupancy(volume, first, last, m_stagedRanges.data(), m_stagedOccupied.data());
+
+    int x0 = first * BRICK_SIZE, x1 = std::min(last * BRICK_SIZE, m_dims[0]);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint) volume.strideY());
+    glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, (GLint) (volume.strideX() / volume.strideY()));
+    glBindTexture(GL_TEXTURE_3D, m_staged);
+    m_texSubImage3D(GL_TEXTURE_3D, 0, 0, 0, x0, m_dims[2], m_dims[1], x1 - x0, GL_RED, GL_FLOAT, volume.row(x0, 0));
+    glBindTexture(GL_TEXTURE_3D, 0);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+
+    m_stagedBricks = last;
+    if (last < m_bricks[0])
+    {
+        return false;
+    }
+
+    std::swap(m_density, m_staged);
+    m_ranges.swap(m_stagedRanges);
+    m_occupiedBricks = std::accumulate(m_stagedOccupied.begin(), m_stagedOccupied.end(), 0);
+    m_stagedBricks = -1;
+    this->uploadOccupancy();
+    return true;
+}
+
+/**
+  Filtering and clamping of the 3d texture bound
+  */
+void VolumeRenderer::setTextureState(GLint filter)
+{
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+}
+
+void VolumeRenderer::uploadOccupancy()
+{
+    glBindTexture(GL_TEXTURE_3D, m_occupancy);
+    m_texImage3D(GL_TEXTURE_3D, 0, GL_RG16F, m_bricks[2], m_bricks[1], m_bricks[0], 0, GL_RG, GL_FLOAT, m_ranges.data());
+    this->setTextureState(GL_NEAREST);
+    glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+/**
+  Minimum and maximum faded density of the bricks [firstX, lastX) along x into ranges, over
+  each brick grown by one voxel on every side so the range also bounds the filtered samples
+  near its faces, and how many reach the threshold into occupied, per row of bricks. One row
+  of bricks per task.
+  */
+void VolumeRenderer::buildOccupancy(const CloudVolume &volume, int firstX, int lastX, float *ranges, int *occupied)
+{
+    int rows = m_bricks[1];
+    ThreadPool::global().parallelFor((lastX - firstX) * rows, 1, [&](int begin, int end)
+    {
+        for (int r = firstX * rows + begin; r < firstX * rows + end; r++)
+        {
+            int bx = r / m_bricks[1];
+            int by = r % m_bricks[1];
+            int x0 = std::max(bx * BRICK_SIZE - 1, 0), x1 = std::min((bx + 1) * BRICK_SIZE + 1, m_dims[0]);
+            int y0 = std::max(by * BRICK_SIZE - 1, 0), y1 = std::min((by + 1) * BRICK_SIZE + 1, m_dims[1]);
+
+            occupied[r] = 0;
+            for (int bz = 0; bz < m_bricks[2]; bz++)
+            {
+                int z0 = std::max(bz * BRICK_SIZE - 1, 0), z1 = std::min((bz + 1) * BRICK_SIZE + 1, m_dims[2]);
+                float low = HUGE_VALF, high = -HUGE_VALF;
+                for (int i = x0; i < x1; i++)
+                {
+                    for (int j = y0; j < y1; j++)
+                    {
+                        //same vertical fall-off as the particle threshold
+                        float falloff = 1.0 - (j / ((float) m_dims[1]));
+                        const float *row = volume.row(i, j);
+                        for (int k = z0; k < z1; k++)
+                        {
+                            float faded = row[k] * falloff;
+                            low = std::min(low, faded);
+                            high = std::max(high, faded);
+                        }
+                    }
+                }
+
+                float *range = &ranges[((size_t)r * m_bricks[2] + bz) * 2];
+                range[0] = low;
+                range[1] = high;
+                occupied[r] += high > m_threshold;
+            }
+        }
+    });
+}
+
+/**
+  Voxel (i, j, k) sits at origin + spacing * (i, j, k), as for the particles; billboardSize is
+  the edge of the billboards the march imitates
+  */
+void VolumeRenderer::setPlacement(const Vector3 &origin, float spacing, float billboardSize)
+{
+    m_origin = origin;
+    m_spacing = spacing;
+    m_billboardSize = billboardSize;
+}
+
+/**
+  light is where the shading places the sun, position and radius the sphere drawn for it, which
+  hides the clouds behind it in the occlusion pass
+  */
+void VolumeRenderer::setSun(const Vector3 &light, const Vector3 &position, float radius)
+{
+    m_light = light;
+    m_sunPosition = position;
+    m_sunRadius = radius;
+}
+
+qint64 VolumeRenderer::textureBytes() const
+{
+    //two bytes per density, twice once staged, four per brick range
+    qint64 density = (qint64)m_dims[0] * m_dims[1] * m_dims[2] * 2;
+    return density * (m_staged ? 2 : 1) + (qint64)brickCount() * 4;
+}
+
+/**
+  The back faces of the volume's box, wound counter-clockwise seen from outside
+  */
+void VolumeRenderer::renderBox()
+{
+    Vector3 low = m_origin - Vector3(0.5f, 0.5f, 0.5f) * m_spacing;
+    Vector3 high = low + Vector3(m_dims[0], m_dims[1], m_dims[2]) * m_spacing;
+
+    glBegin(GL_QUADS);
+    glVertex3f(low.x, low.y, low.z); glVertex3f(low.x, low.y, high.z); glVertex3f(low.x, high.y, high.z); glVertex3f(low.x, high.y, low.z);
+    glVertex3f(high.x, low.y, low.z); glVertex3f(high.x, high.y, low.z); glVertex3f(high.x, high.y, high.z); glVertex3f(high.x, low.y, high.z);
+    glVertex3f(low.x, low.y, low.z); glVertex3f(high.x, low.y, low.z); glVertex3f(high.x, low.y, high.z); glVertex3f(low.x, low.y, high.z);
+    glVertex3f(low.x, high.y, low.z); glVertex3f(low.x, high.y, high.z); glVertex3f(high.x, high.y, high.z); glVertex3f(high.x, high.y, low.z);
+    glVertex3f(low.x, low.y, low.z); glVertex3f(low.x, high.y, low.z); glVertex3f(high.x, high.y, low.z); glVertex3f(high.x, low.y, low.z);
+    glVertex3f(low.x, low.y, high.z); glVertex3f(high.x, low.y, high.z); glVertex3f(high.x, high.y, high.z); glVertex3f(low.x, high.y, high.z);
+    glEnd();
+}
+
+/**
+  Blends the clouds seen from eye over the current target. Each fragment of the box's back faces
+  marches one ray, so the box is drawn without depth test: it reaches half a voxel past the
+  particle positions and may poke through the sky box. Restores the state it changes.
+  */
+void VolumeRenderer::draw(const Vector3 &eye, Mode mode)
+{
+    if (!m_supported || !m_density || m_billboardSize <= 0)
+    {
+        return;
+    }
+
+    glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_POLYGON_BIT);
+    glDisable(GL_DEPTH_TEST);
+    glDepthMask(GL_FALSE);
+    glDisable(GL_ALPHA_TEST);
+    glEnable(GL_CULL_FACE);
+    glCullFace(GL_FRONT);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+    m_activeTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_3D, m_density);
+    m_activeTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_3D, m_occupancy);
+    m_activeTexture(GL_TEXTURE0);
+
+    Vector3 lightVector = -m_light;
+    lightVector.normalize();
+    Vector3 sunCentre = (m_sunPosition - m_origin) / m_spacing + Vector3(0.5f, 0.5f, 0.5f);
+    float overlap = (m_billboardSize / m_spacing) * (m_billboardSize / m_spacing);
+    int flat = mode == OCCLUSION ? WHITE_SLOT : MODELER_SLOT;
+
+    m_program->bind();
+    m_program->setUniformValue("dims", (GLfloat) m_dims[0], (GLfloat) m_dims[1], (GLfloat) m_dims[2]);
+    m_program->setUniformValue("bricks", (GLfloat) m_bricks[0], (GLfloat) m_bricks[1], (GLfloat) m_bricks[2]);
+    m_program->setUniformValue("brickSize", (GLfloat) BRICK_SIZE);
+    m_program->setUniformValue("origin", m_origin.x, m_origin.y, m_origin.z);
+    m_program->setUniformValue("spacing", m_spacing);
+    m_program->setUniformValue("eye", eye.x, eye.y, eye.z);
+    m_program->setUniformValue("threshold", m_threshold);
+    m_program->setUniformValue("overlap", overlap);
+    m_program->setUniformValue("stepSize", m_stepSize);
+    m_program->setUniformValue("sun", m_light.x, m_light.y, m_light.z);
+    m_program->setUniformValue("lightVector", lightVector.x, lightVector.y, lightVector.z);
+    m_program->setUniformValueArray("shades", &m_shades[0][0], CloudParticles::SHADE_LAYERS + 1, 4);
+    m_program->setUniformValueArray("flatShade", m_shades[flat], 1, 4);
+    m_program->setUniformValue("flatMode", (GLfloat) (mode != SHADED));
+    m_program->setUniformValue("sunSphere", sunCentre.x, sunCentre.y, sunCentre.z, m_sunRadius / m_spacing);
+    m_program->setUniformValue("clipSun", (GLfloat) (mode == OCCLUSION));
+
+    this->renderBox();
+    m_program->release();
+
+    m_activeTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_3D, 0);
+    m_activeTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_3D, 0);
+    m_activeTexture(GL_TEXTURE0);
+    glPopAttrib();
+}
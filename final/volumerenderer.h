@@ -0,0 +1,100 @@
+#ifndef VOLUMERENDERER_H
+#define VOLUMERENDERER_H
+
+#include <qgl.h>
+#include <GL/glext.h>
+#include <QStringList>
+#include <vector>
+#include "vector.h"
+#include "cloudparticles.h"
+
+class CloudVolume;
+class QGLContext;
+class QGLShaderProgram;
+
+/**
+    Draws the clouds by ray-marching the density volume in raymarch.frag instead of drawing one
+    billboard per particle.
+
+    upload() copies the volume into a 16 bit float 3d texture and builds a coarse occupancy
+    texture next to it, the minimum and maximum faded density of each BRICK_SIZE^3 brick
+    (including the neighbouring voxels trilinear filtering reaches). The shader jumps over bricks
+    that can't reach the threshold, takes longer steps through bricks that are cloud throughout
+    and stops a ray once it is practically opaque. stage() does the same for a volume of the
+    same size a few slabs per call, into a second density texture that is swapped in once
+    complete, so a changed volume never stalls a frame on one large upload.
+
+    The march reproduces what the billboards look like: a voxel is cloud where its faded density
+    exceeds the particle threshold, it takes the average colour of the shade texture its lighting
+    factor picks, and its opacity is that of the billboards stacked over its footprint, each
+    drawn with 0.1 alpha. The colours and opacities come from the particle textures, in
+    ParticleRenderer's layer order, via setTextures().
+
+    Needs float textures and a linked program (GL 3.0, or ARB_texture_float and ARB_texture_rg
+    before that), which Mesa's llvmpipe has; isSupported() stays false otherwise.
+**/
+class VolumeRenderer
+{
+
+public:
+    enum Mode { SHADED, OCCLUSION, MODELER };
+
+    static const int BRICK_SIZE = CloudParticles::BRICK_SIZE;
+
+    VolumeRenderer();
+    ~VolumeRenderer();
+
+    bool initialize(const QGLContext *context, QGLShaderProgram *program);
+    bool isSupported() const { return m_supported; }
+
+    void setTextures(const QStringList &paths);
+    void upload(const CloudVolume &volume, float threshold);
+    bool stage(const CloudVolume &volume, float threshold, int maxVoxels);
+    void setPlacement(const Vector3 &origin, float spacing, float billboardSize);
+    void setSun(const Vector3 &light, const Vector3 &position, float radius);
+    void setStepSize(float voxels) { m_stepSize = voxels; }
+
+    void draw(const Vector3 &eye, Mode mode);
+
+    int brickCount() const { return m_bricks[0] * m_bricks[1] * m_bricks[2]; }
+    int occupiedBricks() const { return m_occupiedBricks; }
+    qint64 textureBytes() const;
+
+private:
+    void setTextureState(GLint filter);
+    void buildOccupancy(const CloudVolume &volume, int firstX, int lastX, float *ranges, int *occupied);
+    void uploadOccupancy();
+    void renderBox();
+
+    QGLShaderProgram *m_program;
+    bool m_supported;
+
+    GLuint m_density; // raw densities, one texel per voxel
+    GLuint m_occupancy; // min and max faded density, one texel per brick
+    int m_dims[3]; // voxels along x, y and z
+    int m_bricks[3];
+    std::vector<float> m_ranges; // min, max per brick, x-major like the volume
+    int m_occupiedBricks; // bricks that reach the threshold
+    float m_threshold;
+    GLuint m_staged; // density texture stage() fills, 0 until it is first needed
+    int m_stagedBricks; // x bricks of m_staged filled, -1 when not staging
+    std::vector<float> m_stagedRanges;
+    std::vector<int> m_stagedOccupied; // per row of bricks
+
+    Vector3 m_origin;
+    float m_spacing;
+    float m_billboardSize;
+    float m_stepSize; // in voxels
+    Vector3 m_light;
+    Vector3 m_sunPosition;
+    float m_sunRadius;
+
+    // colour and extinction per shade texture, the unshaded particles and the two flat textures
+    GLfloat m_shades[CloudParticles::SHADE_LAYERS + 3][4];
+
+    PFNGLACTIVETEXTUREPROC m_activeTexture;
+    PFNGLTEXIMAGE3DPROC m_texImage3D;
+    PFNGLTEXSUBIMAGE3DPROC m_texSubImage3D;
+};
+
+#endif // VOLUMERENDERER_H
@@ -5,6 +5,7 @@ uniform float weight;
 uniform vec2 lightPositionOnScreen;
 uniform float dotLightLook;
 uniform sampler2D firstPass;
+uniform vec2 extent; // largest texture coordinate inside the mask
 const int NUM_SAMPLES = 100;
 
 void main() {
@@ -20,7 +21,7 @@ void main() {
 
         for(int i = 0; i < NUM_SAMPLES ; i++) {
             textCoo -= deltaTextCoord;
-            vec4 sample = texture2D(firstPass, textCoo );
+            vec4 sample = texture2D(firstPass, min(textCoo, extent));
 
             if (sample.x > 0.992) {
                 sample.x = 1.0;
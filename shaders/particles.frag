@@ -0,0 +1,19 @@
+#extension GL_EXT_texture_array : enable
+
+uniform sampler2DArray textures; // the eight shades, then the white and modeler textures
+uniform float layerOverride; // draws every particle with this layer when not negative
+
+varying float particleLayer;
+
+void main() {
+    float layer = layerOverride >= 0.0 ? layerOverride : particleLayer;
+
+    // particles outside every shade band are drawn untextured
+    vec4 texel = vec4(1.0);
+    if (layer >= 0.0) {
+        texel = texture2DArray(textures, vec3(gl_TexCoord[0].st, layer));
+    }
+
+    // modulated with the 0.1 alpha every particle is drawn with
+    gl_FragColor = texel * vec4(1.0, 1.0, 1.0, 0.1);
+}
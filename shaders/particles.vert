@@ -0,0 +1,28 @@
+// Instanced cloud billboards: one quad corner per vertex, one particle per instance
+attribute vec2 corner;
+attribute vec4 particle; // world position, billboard size
+attribute float layer; // texture layer, -1 for untextured
+
+uniform vec3 look; // camera look direction
+
+varying float particleLayer;
+
+void main() {
+    // rotate the quad (facing -z) by -acos(look . -z) about look x -z, the same rotation the
+    // immediate mode path passes to glRotatef
+    vec3 dir = normalize(look);
+    vec3 faceNormal = vec3(0.0, 0.0, -1.0);
+    vec3 axis = cross(dir, faceNormal);
+    float cosAngle = dot(dir, faceNormal);
+    float sinAngle = length(axis);
+
+    vec3 offset = vec3(corner * particle.w, 0.0);
+    if (sinAngle > 0.0001) {
+        axis /= sinAngle;
+        offset = offset * cosAngle - cross(axis, offset) * sinAngle + axis * dot(axis, offset) * (1.0 - cosAngle);
+    }
+
+    particleLayer = layer;
+    gl_TexCoord[0] = vec4(corner, 0.0, 1.0);
+    gl_Position = gl_ModelViewProjectionMatrix * vec4(particle.xyz + offset, 1.0);
+}
@@ -0,0 +1,18 @@
+// Fallback for drivers without texture arrays: the texture is bound once per shade batch
+uniform sampler2D textures;
+uniform float layerOverride; // draws every particle textured when not negative
+
+varying float particleLayer;
+
+void main() {
+    float layer = layerOverride >= 0.0 ? layerOverride : particleLayer;
+
+    // particles outside every shade band are drawn untextured
+    vec4 texel = vec4(1.0);
+    if (layer >= 0.0) {
+        texel = texture2D(textures, gl_TexCoord[0].st);
+    }
+
+    // modulated with the 0.1 alpha every particle is drawn with
+    gl_FragColor = texel * vec4(1.0, 1.0, 1.0, 0.1);
+}
@@ -0,0 +1,41 @@
+uniform sampler2D source;
+uniform vec2 lightPositionOnScreen;
+uniform int taps; // at most MAX_TAPS
+uniform float firstScale; // distance of the first tap from the light, relative to the pixel's
+uniform float scale; // each tap is this much closer to the light than the one before
+uniform float decay; // and weighs this much less
+uniform float gain;
+uniform bool occlusion; // sampling the occlusion mask rather than an earlier pass
+uniform vec2 extent; // largest texture coordinate inside the source image
+const int MAX_TAPS = 16;
+
+/**
+  One pass of an iterated radial blur towards the light. Taps sit at geometrically shrinking
+  distances from the light, so blurring the result again with the scale raised to the number
+  of taps lands on the taps in between: a few passes of a few taps add up to the long ray sum
+  of lightscatter.frag.
+  */
+void main() {
+    vec2 offset = gl_TexCoord[0].st - lightPositionOnScreen;
+    float distance = firstScale;
+    float tapWeight = 1.0;
+    vec4 sum = vec4(0.0);
+
+    for (int i = 0; i < MAX_TAPS; i++) {
+        if (i >= taps) {
+            break;
+        }
+
+        vec4 sample = texture2D(source, min(lightPositionOnScreen + offset * distance, extent));
+        if (occlusion) {
+            //same per channel threshold as lightscatter.frag, without the branches
+            sample = (vec4(1.0) - sample) * step(sample, vec4(0.992));
+        }
+
+        sum += sample * tapWeight;
+        distance *= scale;
+        tapWeight *= decay;
+    }
+
+    gl_FragColor = sum * gain;
+}
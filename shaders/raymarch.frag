@@ -0,0 +1,123 @@
+// Ray-marches the cloud density volume, front to back, from the eye to the back face of its box.
+// Positions are in voxel units: voxel (i, j, k) is centred on (i, j, k) + 0.5 and the box spans
+// [0, dims]; the textures store x-major volumes, so they are addressed with .zyx.
+#define MAX_STEPS 1024
+#define OPAQUE 0.99 // rays stop once they are this opaque
+#define SOFTNESS 0.02 // half width of the threshold edge in density
+
+uniform sampler3D density; // raw density per voxel
+uniform sampler3D occupancy; // min and max faded density per brick, including the voxels filtering reaches
+uniform vec3 dims; // voxels along x, y and z
+uniform vec3 bricks; // bricks along x, y and z
+uniform float brickSize; // voxels per brick edge
+
+uniform vec3 origin; // world position of voxel (0, 0, 0)
+uniform float spacing; // world distance between voxels
+uniform vec3 eye; // world position of the camera
+uniform float threshold; // faded density above which a voxel is part of the cloud
+uniform float overlap; // billboards stacked over each voxel's footprint
+uniform float stepSize; // in voxels
+
+uniform vec3 sun; // world position of the shading light
+uniform vec3 lightVector; // direction of the sun's rays
+uniform vec4 shades[9]; // colour and extinction per shade texture, unshaded last
+uniform vec4 flatShade; // used for every sample instead when flatMode is set
+uniform float flatMode;
+uniform vec4 sunSphere; // voxel space centre and radius, rays end there when clipSun is set
+uniform float clipSun;
+
+varying vec3 worldPosition;
+
+// the band CloudParticles::shadeLayer picks for a lighting factor, 8 when it is outside all of them
+int shadeLayer(float factor) {
+    if (factor < 0.0 || factor > 1.0) return 8;
+    if (factor <= 0.125) return 7;
+    if (factor <= 0.18) return 6;
+    if (factor <= 0.25) return 5;
+    if (factor <= 0.31) return 4;
+    if (factor <= 0.4) return 3;
+    if (factor <= 0.5) return 2;
+    if (factor <= 0.6) return 1;
+    return 0;
+}
+
+vec4 shade(vec3 voxel, float raw) {
+    if (flatMode > 0.5) return flatShade;
+
+    // the lighting factor of CloudParticles::relight
+    vec3 toVoxel = normalize(origin + (voxel - 0.5) * spacing - sun);
+    float factor = (1.8 - (dot(lightVector, toVoxel) * 0.5 + 0.5)) * raw;
+    return shades[shadeLayer(factor)];
+}
+
+// distances along the ray to where it enters and leaves [low, high]
+vec2 intersectBox(vec3 start, vec3 inverse, vec3 low, vec3 high) {
+    vec3 t0 = (low - start) * inverse;
+    vec3 t1 = (high - start) * inverse;
+    vec3 near = min(t0, t1);
+    vec3 far = max(t0, t1);
+    return vec2(max(max(near.x, near.y), near.z), min(min(far.x, far.y), far.z));
+}
+
+void main() {
+    vec3 start = (eye - origin) / spacing + 0.5;
+    vec3 direction = normalize(worldPosition - eye);
+    // avoid infinities for rays parallel to an axis
+    vec3 safe = vec3(abs(direction.x) < 1e-6 ? 1e-6 : direction.x,
+                     abs(direction.y) < 1e-6 ? 1e-6 : direction.y,
+                     abs(direction.z) < 1e-6 ? 1e-6 : direction.z);
+    vec3 inverse = 1.0 / safe;
+
+    vec2 span = intersectBox(start, inverse, vec3(0.0), dims);
+    float t = max(span.x, 0.0);
+    float end = span.y;
+
+    // the sun sphere is opaque in the occlusion pass
+    if (clipSun > 0.5) {
+        vec3 toCentre = sunSphere.xyz - start;
+        float along = dot(toCentre, direction);
+        float miss = dot(toCentre, toCentre) - along * along;
+        float radius2 = sunSphere.w * sunSphere.w;
+        if (miss < radius2) {
+            float hit = along - sqrt(radius2 - miss);
+            if (hit > 0.0) end = min(end, hit);
+        }
+    }
+
+    // jitter the first sample per pixel, which trades banding for fine noise
+    t += stepSize * fract(sin(dot(gl_FragCoord.xy, vec2(12.9898, 78.233))) * 43758.5453);
+
+    vec3 color = vec3(0.0);
+    float transmittance = 1.0;
+    for (int i = 0; i < MAX_STEPS; i++) {
+        if (t >= end || transmittance < 1.0 - OPAQUE) break;
+
+        vec3 voxel = start + direction * t;
+        vec3 brick = floor(voxel / brickSize);
+        vec2 range = texture3D(occupancy, ((brick + 0.5) / bricks).zyx).rg;
+
+        // nothing in the brick reaches the threshold: jump to where the ray leaves it
+        if (range.y <= threshold - SOFTNESS) {
+            vec2 cell = intersectBox(start, inverse, brick * brickSize, (brick + 1.0) * brickSize);
+            t = max(cell.y, t) + 0.001;
+            continue;
+        }
+
+        float raw = texture3D(density, (voxel / dims).zyx).r;
+        float faded = raw * (1.0 - (voxel.y - 0.5) / dims.y);
+        float coverage = smoothstep(threshold - SOFTNESS, threshold + SOFTNESS, faded);
+
+        // everything in the brick is cloud, so the coverage can't change within a longer step
+        float dt = range.x > threshold + SOFTNESS ? stepSize * 2.0 : stepSize;
+        if (coverage > 0.0) {
+            vec4 particle = shade(voxel, raw);
+            float alpha = 1.0 - exp(-particle.a * overlap * coverage * dt);
+            color += transmittance * alpha * particle.rgb;
+            transmittance *= 1.0 - alpha;
+        }
+        t += dt;
+    }
+
+    // premultiplied, blended with GL_ONE, GL_ONE_MINUS_SRC_ALPHA
+    gl_FragColor = vec4(color, 1.0 - transmittance);
+}
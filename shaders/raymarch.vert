@@ -0,0 +1,7 @@
+// The back faces of the cloud volume's box; every fragment marches the ray from the eye to it
+varying vec3 worldPosition;
+
+void main() {
+    worldPosition = gl_Vertex.xyz;
+    gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+}